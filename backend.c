@@ -0,0 +1,355 @@
+/**
+ * Source implementation of the backend
+ * registry, the file backend and the
+ * in-memory buffer backend.
+ *
+ * @author Matt Stetter
+ * @file backend.c
+ */
+
+#include "backend.h"
+#include "control.h"
+#include "cpy.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Most named memory buffers
+#define MEM_MAX 16
+
+// A named memory buffer
+typedef struct mem_buf {
+  char name[64];	// Name after "mem:"
+  char *data;		// The buffer
+  size_t len;		// Bytes held
+  size_t cap;		// Size of the buffer
+} mem_buf_t;
+
+// Backends registered by other modules
+static const backend_ops_t *registered[BACKEND_MAX];
+static unsigned int num_registered = 0;
+
+// Named memory buffers
+static mem_buf_t mem_bufs[MEM_MAX];
+static unsigned int num_mem = 0;
+
+/**
+ * Capabilities of a file of the
+ * given type.
+ *
+ * @param mode st_mode of the file
+ * @return BE_* capabilities
+ */
+static int file_caps(mode_t mode) {
+  if (S_ISREG(mode)) return BE_PREAD | BE_PWRITE | BE_FD | BE_SPLICE | BE_CLONE | BE_ZERO | BE_MAP;
+  if (S_ISBLK(mode)) return BE_PREAD | BE_PWRITE | BE_FD | BE_ZERO | BE_MAP;
+  if (S_ISFIFO(mode) || S_ISSOCK(mode)) return BE_FD | BE_SPLICE;
+  return BE_FD;
+}
+
+/**
+ * Open a file, block device, pipe or
+ * socket with the device helpers.
+ *
+ * @param b endpoint being opened
+ * @param path path of the file
+ * @param mode BE_READ or BE_WRITE
+ * @param direct non-zero to request O_DIRECT
+ * @return 0 if successful, errno otherwise
+ */
+static int file_open(backend_t *b, const char *path, int mode, int direct) {
+  int fd = mode == BE_READ ? dev_open_src(path, direct, &b->info) :
+    dev_open_dst(path, direct, &b->info);
+  if (fd == -1) return errno;
+  return backend_adopt(b, path, fd, mode);
+}
+
+/**
+ * Read from a file at an offset, or at
+ * the file position for offset -1.
+ *
+ * @param b the open endpoint
+ * @param iov spans to read into
+ * @param iovcnt number of spans
+ * @param off offset to read at
+ * @return bytes read, -1 on failure
+ */
+static ssize_t file_readv(backend_t *b, const struct iovec *iov, int iovcnt, off_t off) {
+  return off < 0 ? readv(b->fd, iov, iovcnt) : preadv(b->fd, iov, iovcnt, off);
+}
+
+/**
+ * Write to a file at an offset, or at
+ * the file position for offset -1.
+ *
+ * @param b the open endpoint
+ * @param iov spans to write
+ * @param iovcnt number of spans
+ * @param off offset to write at
+ * @return bytes written, -1 on failure
+ */
+static ssize_t file_writev(backend_t *b, const struct iovec *iov, int iovcnt, off_t off) {
+  return off < 0 ? writev(b->fd, iov, iovcnt) : pwritev(b->fd, iov, iovcnt, off);
+}
+
+/**
+ * Sync a file's data.
+ *
+ * @param b the open endpoint
+ * @return 0 if successful, errno otherwise
+ */
+static int file_sync(backend_t *b) {
+  return control_sync(b->fd);
+}
+
+/**
+ * Close a file. What was written stays
+ * even if the copy failed, as it always
+ * has for plain files.
+ *
+ * @param b the open endpoint
+ * @param abort unused
+ * @return 0 if successful, errno otherwise
+ */
+static int file_close(backend_t *b, int abort) {
+  (void)abort;
+  return close(b->fd) == 0 ? 0 : errno;
+}
+
+// The file backend, serving every
+// path no other backend claims
+static const backend_ops_t file_ops = {
+  "file", "", BE_FD, file_open, file_readv, file_writev, file_sync, file_close
+};
+
+/**
+ * Look up a named memory buffer.
+ *
+ * @param name name of the buffer
+ * @return the buffer, NULL if there is none
+ */
+static mem_buf_t *mem_find(const char *name) {
+  for (unsigned int i = 0; i < num_mem; i++) {
+    if (strcmp(mem_bufs[i].name, name) == 0) return &mem_bufs[i];
+  }
+  return NULL;
+}
+
+/**
+ * Open a named memory buffer. Writing
+ * to one empties it first.
+ *
+ * @param b endpoint being opened
+ * @param path "mem:" and the name of the buffer
+ * @param mode BE_READ or BE_WRITE
+ * @param direct unused
+ * @return 0 if successful, ENOENT if there is no such buffer
+ */
+static int mem_open(backend_t *b, const char *path, int mode, int direct) {
+  (void)direct;
+  mem_buf_t *m = mem_find(path + strlen("mem:"));
+  if (m == NULL) return ENOENT;
+  if (mode == BE_WRITE) m->len = 0;
+  b->info.size = mode == BE_READ ? (off_t)m->len : -1;
+  b->priv = m;
+  return 0;
+}
+
+/**
+ * Copy out of a memory buffer.
+ *
+ * @param b the open endpoint
+ * @param iov spans to read into
+ * @param iovcnt number of spans
+ * @param off offset to read at
+ * @return bytes read
+ */
+static ssize_t mem_readv(backend_t *b, const struct iovec *iov, int iovcnt, off_t off) {
+  mem_buf_t *m = (mem_buf_t *)b->priv;
+  size_t at = (size_t)off;
+  ssize_t done = 0;
+  for (int i = 0; i < iovcnt && at < m->len; i++) {
+    size_t n = m->len - at < iov[i].iov_len ? m->len - at : iov[i].iov_len;
+    memcpy(iov[i].iov_base, m->data + at, n);
+    at += n;
+    done += n;
+  }
+  return done;
+}
+
+/**
+ * Copy into a memory buffer, failing
+ * with ENOSPC past its size.
+ *
+ * @param b the open endpoint
+ * @param iov spans to write
+ * @param iovcnt number of spans
+ * @param off offset to write at
+ * @return bytes written, -1 on failure
+ */
+static ssize_t mem_writev(backend_t *b, const struct iovec *iov, int iovcnt, off_t off) {
+  mem_buf_t *m = (mem_buf_t *)b->priv;
+  size_t at = (size_t)off;
+  ssize_t done = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    if (at + iov[i].iov_len > m->cap) {
+      errno = ENOSPC;
+      return done > 0 ? done : -1;
+    }
+    memcpy(m->data + at, iov[i].iov_base, iov[i].iov_len);
+    at += iov[i].iov_len;
+    done += iov[i].iov_len;
+  }
+  if (at > m->len) m->len = at;
+  return done;
+}
+
+/**
+ * Close a memory buffer.
+ *
+ * @param b the open endpoint
+ * @param abort unused
+ * @return 0
+ */
+static int mem_close(backend_t *b, int abort) {
+  (void)b;
+  (void)abort;
+  return 0;
+}
+
+// The in-memory buffer backend
+static const backend_ops_t mem_ops = {
+  "mem", "mem:", BE_PREAD | BE_PWRITE, mem_open, mem_readv, mem_writev, NULL, mem_close
+};
+
+// Add a backend to the registry.
+int backend_register(const backend_ops_t *ops) {
+  if (num_registered == BACKEND_MAX) return ENOSPC;
+  registered[num_registered++] = ops;
+  return 0;
+}
+
+// Match the registered backends newest
+// first, then the built-in ones.
+const backend_ops_t *backend_find(const char *path) {
+  for (unsigned int i = num_registered; i > 0; i--) {
+    const char *prefix = registered[i - 1]->prefix;
+    if (strncmp(path, prefix, strlen(prefix)) == 0) return registered[i - 1];
+  }
+  if (strncmp(path, mem_ops.prefix, strlen(mem_ops.prefix)) == 0) return &mem_ops;
+  return &file_ops;
+}
+
+// Work out a path's capabilities. A
+// destination that does not exist yet
+// will be a regular file.
+int backend_path_caps(const char *path, int mode) {
+  const backend_ops_t *ops = backend_find(path);
+  if (ops != &file_ops) return ops->caps;
+
+  struct stat st;
+  if (stat(path, &st) != 0) return mode == BE_WRITE ? file_caps(S_IFREG) : 0;
+  return file_caps(st.st_mode);
+}
+
+// Add a named memory buffer.
+int backend_mem_add(const char *name, char *data, size_t len, size_t cap) {
+  mem_buf_t *m = mem_find(name);
+  if (m == NULL) {
+    if (num_mem == MEM_MAX) return ENOSPC;
+    m = &mem_bufs[num_mem++];
+  }
+  snprintf(m->name, sizeof(m->name), "%s", name);
+  m->data = data;
+  m->len = len;
+  m->cap = cap;
+  return 0;
+}
+
+// Report a memory buffer's length.
+off_t backend_mem_len(const char *name) {
+  mem_buf_t *m = mem_find(name);
+  return m == NULL ? -1 : (off_t)m->len;
+}
+
+// Open an endpoint, starting from the
+// capabilities the backend advertises.
+int backend_open(backend_t *b, const char *path, int mode, int direct) {
+  memset(b, 0, sizeof(*b));
+  b->ops = backend_find(path);
+  b->path = path;
+  b->mode = mode;
+  b->caps = b->ops->caps;
+  b->fd = -1;
+  b->info.size = -1;
+  b->info.lbs = 512;
+  b->info.pbs = 512;
+
+  if ((mode == BE_READ && b->ops->readv == NULL) || (mode == BE_WRITE && b->ops->writev == NULL)) {
+    return EOPNOTSUPP;
+  }
+  int err = b->ops->open(b, path, mode, direct);
+  if (err != 0) return err;
+
+  log("Opened %s with the %s backend\n", path, b->ops->name);
+  return 0;
+}
+
+// Wrap an open descriptor.
+int backend_adopt(backend_t *b, const char *path, int fd, int mode) {
+  struct stat st;
+  if (fstat(fd, &st) != 0) return errno;
+
+  b->ops = &file_ops;
+  b->path = path;
+  b->mode = mode;
+  b->caps = file_caps(st.st_mode);
+  b->fd = fd;
+  b->pos = 0;
+  b->priv = NULL;
+  return dev_probe(fd, &b->info);
+}
+
+// Read with the backend, tracking the
+// position for backends that have none.
+ssize_t backend_read(backend_t *b, void *buf, size_t len, off_t off) {
+  struct iovec iov = { buf, len };
+  int track = off < 0 && !(b->caps & BE_FD);
+  ssize_t n;
+  do {
+    n = b->ops->readv(b, &iov, 1, track ? b->pos : off);
+  } while (n == -1 && errno == EINTR);
+  if (track && n > 0) b->pos += n;
+  return n;
+}
+
+// Write all of a buffer with the backend.
+int backend_write(backend_t *b, const void *buf, size_t len, off_t off) {
+  int track = off < 0 && !(b->caps & BE_FD);
+  size_t done = 0;
+  while (done < len) {
+    struct iovec iov = { (char *)buf + done, len - done };
+    off_t at = track ? b->pos : off < 0 ? -1 : off + (off_t)done;
+    ssize_t n = b->ops->writev(b, &iov, 1, at);
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) return n == 0 ? ENOSPC : errno;
+    done += n;
+    if (track) b->pos += n;
+  }
+  return 0;
+}
+
+// Sync with the backend, if it can.
+int backend_sync(backend_t *b) {
+  return b->ops->sync == NULL ? 0 : b->ops->sync(b);
+}
+
+// Close with the backend.
+int backend_close(backend_t *b, int abort) {
+  int err = b->ops->close(b, abort);
+  b->fd = -1;
+  return err;
+}
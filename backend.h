@@ -0,0 +1,195 @@
+/**
+ * Backends the producer reads the source
+ * from and the consumer writes the
+ * destination to. Each backend is a table
+ * of operations chosen by the prefix of
+ * the path, so files, block devices,
+ * pipes and sockets (the file backend),
+ * in-memory buffers ("mem:") and backends
+ * registered by other modules all go
+ * through the same block ring. A backend
+ * advertises BE_* capabilities, which
+ * the engine selector uses to keep the
+ * engines that need a file descriptor
+ * away from endpoints that have none.
+ *
+ * @author Matt Stetter
+ * @file backend.h
+ */
+
+#include "device.h"
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifndef BACKEND_H_
+#define BACKEND_H_
+
+// Capabilities of an endpoint
+#define BE_PREAD 0x01	// Reads at any offset
+#define BE_PWRITE 0x02	// Writes at any offset
+#define BE_FD 0x04	// Has a file descriptor the kernel engines can use
+#define BE_SPLICE 0x08	// The descriptor works with splice and sendfile
+#define BE_CLONE 0x10	// Regular file for FICLONE and copy_file_range
+#define BE_ZERO 0x20	// Ranges can be zeroed without writing zeros
+#define BE_MAP 0x40	// The descriptor can be mapped with mmap
+
+// Directions an endpoint is opened in
+#define BE_READ 0	// Source of a copy
+#define BE_WRITE 1	// Destination of a copy
+
+// Most backends that can be registered
+#define BACKEND_MAX 8
+
+typedef struct backend backend_t;
+
+// Operations of a backend. Offsets of
+// -1 read or write at the current
+// position, which is all an endpoint
+// without BE_PREAD or BE_PWRITE takes.
+typedef struct backend_ops {
+  const char *name;	// Name used in messages
+  const char *prefix;	// Path prefix the backend serves
+  int caps;		// BE_* capabilities of its endpoints
+  int (*open)(backend_t *b, const char *path, int mode, int direct);
+  ssize_t (*readv)(backend_t *b, const struct iovec *iov, int iovcnt, off_t off);
+  ssize_t (*writev)(backend_t *b, const struct iovec *iov, int iovcnt, off_t off);
+  int (*sync)(backend_t *b);
+  int (*close)(backend_t *b, int abort);
+} backend_ops_t;
+
+// An open endpoint
+struct backend {
+  const backend_ops_t *ops; // Operations of the backend
+  const char *path;	// Path the endpoint was opened with
+  int mode;		// BE_READ or BE_WRITE
+  int caps;		// BE_* capabilities of this endpoint
+  int fd;		// File descriptor, -1 if the backend has none
+  dev_info_t info;	// Type and alignment, with the size hint (-1 if unknown)
+  off_t pos;		// Position of reads and writes at offset -1
+  void *priv;		// State of the backend
+};
+
+/**
+ * Register a backend for the paths
+ * starting with its prefix. Backends
+ * registered later are matched first.
+ *
+ * @param ops operations of the backend, kept by reference
+ * @return 0 if successful, ENOSPC if BACKEND_MAX are registered
+ */
+int backend_register(const backend_ops_t *ops);
+
+/**
+ * Find the backend serving a path,
+ * the file backend if no prefix matches.
+ *
+ * @param path path of the endpoint
+ * @return operations of the backend
+ */
+const backend_ops_t *backend_find(const char *path);
+
+/**
+ * Capabilities a path would be opened
+ * with. The file backend looks at what
+ * the path is without opening it.
+ *
+ * @param path path of the endpoint
+ * @param mode BE_READ or BE_WRITE
+ * @return BE_* capabilities
+ */
+int backend_path_caps(const char *path, int mode);
+
+/**
+ * Make a named memory buffer available
+ * as "mem:NAME". Reads return the first
+ * len bytes, writes fill the buffer up to
+ * cap bytes and set its length.
+ *
+ * @param name name of the buffer
+ * @param data the buffer
+ * @param len bytes of data held
+ * @param cap size of the buffer
+ * @return 0 if successful, errno otherwise
+ */
+int backend_mem_add(const char *name, char *data, size_t len, size_t cap);
+
+/**
+ * Length of a named memory buffer, which
+ * a copy into it sets.
+ *
+ * @param name name of the buffer
+ * @return bytes held, -1 if there is no such buffer
+ */
+off_t backend_mem_len(const char *name);
+
+/**
+ * Open an endpoint with the backend
+ * serving its path.
+ *
+ * @param b struct to fill in
+ * @param path path of the endpoint
+ * @param mode BE_READ or BE_WRITE
+ * @param direct non-zero to request O_DIRECT
+ * @return 0 if successful, errno otherwise
+ */
+int backend_open(backend_t *b, const char *path, int mode, int direct);
+
+/**
+ * Wrap a descriptor that is already open
+ * in the file backend, for endpoints that
+ * need opening in a special way.
+ *
+ * @param b struct to fill in
+ * @param path path the descriptor was opened with
+ * @param fd the open descriptor, owned by the endpoint from now on
+ * @param mode BE_READ or BE_WRITE
+ * @return 0 if successful, errno otherwise
+ */
+int backend_adopt(backend_t *b, const char *path, int fd, int mode);
+
+/**
+ * Read into a buffer, retrying reads
+ * interrupted by signals.
+ *
+ * @param b the open endpoint
+ * @param buf buffer to read into
+ * @param len most bytes to read
+ * @param off offset to read at, -1 for the current position
+ * @return bytes read, 0 at the end, -1 on failure with errno set
+ */
+ssize_t backend_read(backend_t *b, void *buf, size_t len, off_t off);
+
+/**
+ * Write a whole buffer, retrying short
+ * and interrupted writes.
+ *
+ * @param b the open endpoint
+ * @param buf bytes to write
+ * @param len number of bytes to write
+ * @param off offset to write at, -1 for the current position
+ * @return 0 if successful, errno otherwise
+ */
+int backend_write(backend_t *b, const void *buf, size_t len, off_t off);
+
+/**
+ * Make what was written so far durable.
+ *
+ * @param b the open endpoint
+ * @return 0 if successful, errno otherwise
+ */
+int backend_sync(backend_t *b);
+
+/**
+ * Close an endpoint. A destination closed
+ * with abort set is being given up on,
+ * which lets a backend throw away what it
+ * has staged instead of publishing it.
+ *
+ * @param b the open endpoint
+ * @param abort non-zero if the copy failed
+ * @return 0 if successful, errno otherwise
+ */
+int backend_close(backend_t *b, int abort);
+
+#endif
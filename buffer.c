@@ -9,9 +9,10 @@
  */
 
 #include "buffer.h"
+#include "cgroup.h"
 #include "cpy.h"
 
-#include <assert.h>
+#include <errno.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -20,24 +21,39 @@
 // heap memory for the internal buffer,
 // initializing the mutex, and initializing
 // all the internal variables.
-int buffer_init(buffer_t *b) {
-
-  // Allocate enough memory for the shared
-  // inner buffer
-  b->buf = (block_t *)calloc(NUM_BLOCKS, sizeof(block_t));
-  assert(b->buf);
+int buffer_init(buffer_t *b, unsigned int num_blocks, size_t block_size) {
+  if (block_size == 0) block_size = BLOCK_SIZE;
+  if (block_size % BLOCK_ALIGN != 0) return EINVAL;
+  if (num_blocks == 0) num_blocks = cgroup_buffers(NUM_BLOCKS, block_size, 2);
+
+  b->num_blocks = num_blocks;
+  b->block_size = block_size;
+
+  // Allocate the block descriptors and
+  // one aligned slab holding the data
+  // of every block, so each block can
+  // be used directly for O_DIRECT I/O
+  b->buf = (block_t *)calloc(num_blocks, sizeof(block_t));
+  if (b->buf == NULL) return ENOMEM;
+  if (posix_memalign((void **)&b->slab, BLOCK_ALIGN, (size_t)num_blocks * block_size) != 0) {
+    free(b->buf);
+    return ENOMEM;
+  }
 
   log("Successfully allocated memory for the internal buffer\n");
 
   // Initialize all the mutexes in each block
-  for (int i = 0; i < NUM_BLOCKS; i++) {
+  // and point each block at its slice of
+  // the slab
+  for (unsigned int i = 0; i < num_blocks; i++) {
     pthread_mutex_init(&b->buf[i].mutex, NULL);
+    b->buf[i].blk = b->slab + (size_t)i * block_size;
   }
 
   log("Successfully initialized mutexes for each block in the buffer\n");
 
   // Initialize the two semaphores in the buffer
-  sem_init(&b->empty_spaces, 0, BUFFER_SIZE);
+  sem_init(&b->empty_spaces, 0, num_blocks);
   sem_init(&b->full_spaces, 0, 0);
 
   log("Successfully initialized the semaphores for the buffer\n");
@@ -53,13 +69,14 @@ int buffer_destroy(buffer_t *b) {
   if (b == NULL) return 1;
 
   // Destroy each mutex in the buffer
-  for (int i = 0; i < NUM_BLOCKS; i++) {
+  for (unsigned int i = 0; i < b->num_blocks; i++) {
     pthread_mutex_destroy(&b->buf[i].mutex);
   }
 
   log("Main thread destroyed the mutexes in the buffer\n");
 
   // Free the buffer memory
+  free(b->slab);
   free(b->buf);
 
   log("Main thread freed the memory used for the buffer\n");
@@ -11,21 +11,34 @@
 
 #include <pthread.h>
 #include <semaphore.h>
+#include <sys/types.h>
 
 #ifndef BUFFER_H_
 #define BUFFER_H_
 
+// Flags describing the contents
+// of a block handed from the
+// producer to the consumer.
+#define BLK_EOF 0x1	// Last block of the copy, carries no data
+#define BLK_ERROR 0x2	// Producer failed, the copy must be aborted
+#define BLK_ZERO 0x4	// len bytes at off read as zeros, blk is unused
+#define BLK_SYNC 0x8	// Sync everything written so far, carries no data
+
 // Struct used to represent each block
 // of the buffer. This splits the
 // full buffer into a series of blocks
 // of a constant size. The buffer size
 // should be a mulitple of the block size.
 // The block contains the data stored in
-// the block and a mutex used for
+// the block, where the data belongs in
+// the file, and a mutex used for
 // reading and writing the block.
 typedef struct block {
   pthread_mutex_t mutex; // Mutex used for reading and writing to a block
-  char blk[BLOCK_SIZE];	 // Buffer block containing the buffered characters
+  off_t off;		 // Offset of the data in the source file
+  size_t len;		 // Number of valid bytes in blk
+  int flags;		 // BLK_* flags for this block
+  char *blk;		 // Aligned buffer block containing the data
 } block_t;
 
 // Buffer struct used for passing
@@ -33,12 +46,15 @@ typedef struct block {
 // consumer threads.
 typedef struct buffer {
   sem_t empty_spaces;   // Semaphore with value equal to the
-                        // number of empty spaces in the buffer
+                        // number of empty blocks in the buffer
   
   sem_t full_spaces;    // Semaphore with value equal to the
-                        // number of full spaces in the buffer
+                        // number of full blocks in the buffer
   
-  block_t *buf;		// Pointer to heap allocated buffer
+  block_t *buf;		// Pointer to heap allocated blocks
+  char *slab;		// Aligned memory backing every block
+  unsigned int num_blocks; // Number of blocks in the buffer
+  size_t block_size;	// Capacity of each block in bytes
 } buffer_t;
 
 /**
@@ -46,9 +62,12 @@ typedef struct buffer {
  * heap-allocated empty buffer.
  *
  * @param b buffer_t struct
+ * @param num_blocks number of blocks, 0 for NUM_BLOCKS
+ * @param block_size bytes per block (multiple of
+ * 	  BLOCK_ALIGN), 0 for BLOCK_SIZE
  * @return 0 if successful, errno otherwise
  */
-int buffer_init(buffer_t *b);
+int buffer_init(buffer_t *b, unsigned int num_blocks, size_t block_size);
 
 /**
  * Destroy the buffer and free
@@ -0,0 +1,196 @@
+/**
+ * Source implementation of the
+ * source file cache.
+ *
+ * @author Matt Stetter
+ * @file cache.c
+ */
+
+#include "cache.h"
+#include "cpy.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Copy the identifying fields.
+void cache_key(cache_key_t *key, const struct stat *st) {
+  memset(key, 0, sizeof(*key));
+  key->dev = st->st_dev;
+  key->ino = st->st_ino;
+  key->mtime = st->st_mtim;
+  key->size = st->st_size;
+}
+
+// Order keys field by field.
+int cache_key_cmp(const cache_key_t *a, const cache_key_t *b) {
+  if (a->dev != b->dev) return a->dev < b->dev ? -1 : 1;
+  if (a->ino != b->ino) return a->ino < b->ino ? -1 : 1;
+  if (a->mtime.tv_sec != b->mtime.tv_sec) return a->mtime.tv_sec < b->mtime.tv_sec ? -1 : 1;
+  if (a->mtime.tv_nsec != b->mtime.tv_nsec) return a->mtime.tv_nsec < b->mtime.tv_nsec ? -1 : 1;
+  if (a->size != b->size) return a->size < b->size ? -1 : 1;
+  return 0;
+}
+
+// Set up an empty cache.
+void cache_init(cache_t *c, size_t cap) {
+  pthread_mutex_init(&c->lock, NULL);
+  c->cap = cap;
+  c->used = 0;
+  c->head = NULL;
+  c->tail = NULL;
+}
+
+// Free every entry.
+void cache_destroy(cache_t *c) {
+  cache_entry_t *e = c->head;
+  while (e != NULL) {
+    cache_entry_t *next = e->next;
+    free(e->data);
+    free(e);
+    e = next;
+  }
+  pthread_mutex_destroy(&c->lock);
+}
+
+/**
+ * Take an entry out of the
+ * recency list.
+ *
+ * @param c the cache (locked)
+ * @param e the entry
+ */
+static void unlink_entry(cache_t *c, cache_entry_t *e) {
+  if (e->prev) e->prev->next = e->next;
+  else c->head = e->next;
+  if (e->next) e->next->prev = e->prev;
+  else c->tail = e->prev;
+  e->prev = e->next = NULL;
+}
+
+/**
+ * Put an entry at the most recently
+ * used end of the list.
+ *
+ * @param c the cache (locked)
+ * @param e the entry
+ */
+static void push_front(cache_t *c, cache_entry_t *e) {
+  e->prev = NULL;
+  e->next = c->head;
+  if (c->head) c->head->prev = e;
+  else c->tail = e;
+  c->head = e;
+}
+
+/**
+ * Unlink and free an entry.
+ *
+ * @param c the cache (locked)
+ * @param e the entry, not pinned
+ */
+static void drop_entry(cache_t *c, cache_entry_t *e) {
+  unlink_entry(c, e);
+  c->used -= (size_t)e->key.size;
+  free(e->data);
+  free(e);
+}
+
+/**
+ * Find the entry holding a key.
+ *
+ * @param c the cache (locked)
+ * @param key version of the file
+ * @return the entry, NULL if there is none
+ */
+static cache_entry_t *find_entry(cache_t *c, const cache_key_t *key) {
+  for (cache_entry_t *e = c->head; e != NULL; e = e->next) {
+    if (cache_key_cmp(&e->key, key) == 0) return e;
+  }
+  return NULL;
+}
+
+// Pin and promote a complete entry.
+cache_entry_t *cache_get(cache_t *c, const cache_key_t *key) {
+  pthread_mutex_lock(&c->lock);
+  cache_entry_t *e = find_entry(c, key);
+  if (e != NULL && e->complete) {
+    e->pins++;
+    unlink_entry(c, e);
+    push_front(c, e);
+  } else {
+    e = NULL;
+  }
+  pthread_mutex_unlock(&c->lock);
+  return e;
+}
+
+/**
+ * Allocate an empty pinned entry and
+ * put it at the front of the list.
+ *
+ * @param c the cache (locked)
+ * @param key version of the file
+ * @return the entry, NULL if out of memory
+ */
+static cache_entry_t *new_entry(cache_t *c, const cache_key_t *key) {
+  cache_entry_t *e = (cache_entry_t *)calloc(1, sizeof(cache_entry_t));
+  if (e == NULL) return NULL;
+  if ((e->data = (char *)malloc((size_t)key->size)) == NULL) {
+    free(e);
+    return NULL;
+  }
+  e->key = *key;
+  e->pins = 1;
+  c->used += (size_t)key->size;
+  push_front(c, e);
+  return e;
+}
+
+// Evict unpinned entries from the
+// tail until the file fits.
+cache_entry_t *cache_fill(cache_t *c, const cache_key_t *key) {
+  size_t size = (size_t)key->size;
+  if (key->size <= 0 || size > c->cap) return NULL;
+
+  pthread_mutex_lock(&c->lock);
+  cache_entry_t *e = NULL;
+  if (find_entry(c, key) == NULL) {
+    cache_entry_t *victim = c->tail;
+    while (c->used + size > c->cap && victim != NULL) {
+      cache_entry_t *prev = victim->prev;
+      if (victim->pins == 0) {
+        log("Cache evicted %lld bytes\n", (long long)victim->key.size);
+        drop_entry(c, victim);
+      }
+      victim = prev;
+    }
+    if (c->used + size <= c->cap) e = new_entry(c, key);
+  }
+  pthread_mutex_unlock(&c->lock);
+  return e;
+}
+
+// Copy the piece in, ignoring
+// anything past the expected size.
+void cache_append(cache_entry_t *e, const char *data, size_t len) {
+  size_t room = (size_t)e->key.size - e->len;
+  if (len > room) len = room;
+  memcpy(e->data + e->len, data, len);
+  e->len += len;
+}
+
+// Keep a whole file, drop a partial one.
+void cache_done(cache_t *c, cache_entry_t *e, int ok) {
+  pthread_mutex_lock(&c->lock);
+  e->pins--;
+  if (ok && e->len == (size_t)e->key.size) e->complete = 1;
+  else drop_entry(c, e);
+  pthread_mutex_unlock(&c->lock);
+}
+
+// Drop a pin.
+void cache_put(cache_t *c, cache_entry_t *e) {
+  pthread_mutex_lock(&c->lock);
+  e->pins--;
+  pthread_mutex_unlock(&c->lock);
+}
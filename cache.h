@@ -0,0 +1,138 @@
+/**
+ * In-memory cache of whole source files
+ * for the shared pipeline, so a source
+ * copied to many destinations is read
+ * from its device once. Entries are
+ * keyed by device, inode, modification
+ * time and size, so a source that
+ * changed is never served stale. The
+ * cache holds at most a fixed number
+ * of bytes and evicts the least
+ * recently used entries that are not
+ * being copied from.
+ *
+ * @author Matt Stetter
+ * @file cache.h
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifndef CACHE_H_
+#define CACHE_H_
+
+// Identity of a version of a source
+typedef struct cache_key {
+  dev_t dev;		// Device holding the file
+  ino_t ino;		// Inode of the file
+  struct timespec mtime; // Last modification time
+  off_t size;		// Size of the file
+} cache_key_t;
+
+// One cached file
+typedef struct cache_entry {
+  cache_key_t key;	// Version of the file held
+  char *data;		// Contents of the file
+  size_t len;		// Bytes filled in so far
+  int complete;		// Non-zero once the whole file is held
+  unsigned int pins;	// Jobs filling or copying from the entry
+  struct cache_entry *prev; // More recently used entry
+  struct cache_entry *next; // Less recently used entry
+} cache_entry_t;
+
+// The cache
+typedef struct cache {
+  pthread_mutex_t lock;	// Protects everything below
+  size_t cap;		// Most bytes held at once
+  size_t used;		// Bytes held by the entries
+  cache_entry_t *head;	// Most recently used entry
+  cache_entry_t *tail;	// Least recently used entry
+} cache_t;
+
+/**
+ * Fill in the key of a file.
+ *
+ * @param key key to fill in
+ * @param st status of the file
+ */
+void cache_key(cache_key_t *key, const struct stat *st);
+
+/**
+ * Compare two keys.
+ *
+ * @param a first key
+ * @param b second key
+ * @return negative, 0 or positive like strcmp
+ */
+int cache_key_cmp(const cache_key_t *a, const cache_key_t *b);
+
+/**
+ * Initialize an empty cache.
+ *
+ * @param c cache to initialize
+ * @param cap most bytes held at once
+ */
+void cache_init(cache_t *c, size_t cap);
+
+/**
+ * Free every entry of a cache.
+ *
+ * @param c the cache
+ */
+void cache_destroy(cache_t *c);
+
+/**
+ * Look up a complete entry and pin
+ * it so it is not evicted while it is
+ * copied from.
+ *
+ * @param c the cache
+ * @param key version of the file
+ * @return the pinned entry, NULL on a miss
+ */
+cache_entry_t *cache_get(cache_t *c, const cache_key_t *key);
+
+/**
+ * Make room for a file and return an
+ * empty entry to fill it into, pinned
+ * until cache_done.
+ *
+ * @param c the cache
+ * @param key version of the file
+ * @return the pinned entry, NULL if the file does not fit or is already held
+ */
+cache_entry_t *cache_fill(cache_t *c, const cache_key_t *key);
+
+/**
+ * Append the next piece of the file
+ * to an entry being filled. Only the
+ * thread filling the entry may call it.
+ *
+ * @param e entry returned by cache_fill
+ * @param data piece of the file
+ * @param len length of the piece
+ */
+void cache_append(cache_entry_t *e, const char *data, size_t len);
+
+/**
+ * Finish filling an entry. The entry
+ * is kept if it holds the whole file
+ * and dropped otherwise.
+ *
+ * @param c the cache
+ * @param e entry returned by cache_fill
+ * @param ok non-zero if the file was read without errors
+ */
+void cache_done(cache_t *c, cache_entry_t *e, int ok);
+
+/**
+ * Unpin an entry returned by cache_get.
+ *
+ * @param c the cache
+ * @param e the entry
+ */
+void cache_put(cache_t *c, cache_entry_t *e);
+
+#endif
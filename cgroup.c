@@ -0,0 +1,271 @@
+/**
+ * Source implementation of the
+ * cgroup limits.
+ *
+ * @author Matt Stetter
+ * @file cgroup.c
+ */
+
+#include "cgroup.h"
+#include "cpy.h"
+
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Memory limits from here up mean
+// no limit (v1 reports one just
+// short of 2^63)
+#define CGROUP_UNLIMITED (1ULL << 62)
+
+// Limits of the cgroup cpy runs in
+cgroup_t cgroup;
+
+/**
+ * Read the first line of a file in
+ * a cgroup directory.
+ *
+ * @param dir the directory
+ * @param file name of the file
+ * @param buf returned line without its newline
+ * @param len size of buf
+ * @return 0 if successful, 1 otherwise
+ */
+static int read_line(const char *dir, const char *file, char *buf, size_t len) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", dir, file);
+  FILE *f = fopen(path, "r");
+  if (f == NULL) return 1;
+  int err = fgets(buf, (int)len, f) == NULL;
+  fclose(f);
+  buf[strcspn(buf, "\n")] = '\0';
+  return err;
+}
+
+/**
+ * Check that a path is a directory.
+ *
+ * @param path the path
+ * @return non-zero if it is a directory, 0 otherwise
+ */
+static int is_dir(const char *path) {
+  struct stat st;
+  return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/**
+ * Find the path of the calling process
+ * in a hierarchy of /proc/self/cgroup.
+ *
+ * @param ctrl controller to look for, "" for the v2 hierarchy
+ * @param ctrls returned controllers mounted with it, as listed
+ * @param path returned path of the group in the hierarchy
+ * @return 0 if successful, 1 if the hierarchy is not listed
+ */
+static int find_group(const char *ctrl, char ctrls[NAME_MAX], char path[PATH_MAX]) {
+  FILE *f = fopen("/proc/self/cgroup", "r");
+  if (f == NULL) return 1;
+
+  // Each line is ID:CONTROLLERS:PATH, and
+  // the v2 hierarchy has no controllers
+  char line[PATH_MAX + NAME_MAX];
+  int found = 0;
+  while (!found && fgets(line, sizeof(line), f) != NULL) {
+    line[strcspn(line, "\n")] = '\0';
+    char *list = strchr(line, ':');
+    char *group = list ? strchr(list + 1, ':') : NULL;
+    if (group == NULL) continue;
+    *group++ = '\0';
+    list++;
+    if (ctrl[0] == '\0') found = list[0] == '\0';
+    else {
+      size_t n = strlen(ctrl);
+      for (char *c = list; !found && (c = strstr(c, ctrl)) != NULL; c += n) {
+        found = (c == list || c[-1] == ',') && (c[n] == '\0' || c[n] == ',');
+      }
+    }
+    if (found) {
+      snprintf(ctrls, NAME_MAX, "%s", list);
+      snprintf(path, PATH_MAX, "%s", group);
+    }
+  }
+  fclose(f);
+  return !found;
+}
+
+/**
+ * Find the v2 group of the calling
+ * process under the usual mount or
+ * the one hybrid systems use.
+ *
+ * @param dir returned directory of the group
+ * @param len size of dir
+ * @param root returned length of the mount point in dir
+ * @return 0 if successful, 1 if there is no v2 hierarchy
+ */
+static int find_v2(char *dir, size_t len, size_t *root) {
+  char ctrls[NAME_MAX], path[PATH_MAX];
+  if (find_group("", ctrls, path) != 0) return 1;
+
+  static const char *const mounts[] = { "/sys/fs/cgroup", "/sys/fs/cgroup/unified" };
+  for (size_t i = 0; i < sizeof(mounts) / sizeof(mounts[0]); i++) {
+    char probe[PATH_MAX];
+    snprintf(probe, sizeof(probe), "%s/cgroup.controllers", mounts[i]);
+    if (access(probe, F_OK) != 0) continue;
+    snprintf(dir, len, "%s%s", mounts[i], strcmp(path, "/") == 0 ? "" : path);
+    *root = strlen(mounts[i]);
+    if (is_dir(dir)) return 0;
+  }
+  return 1;
+}
+
+// Find the v2 group.
+int cgroup_dir(char *dir, size_t len) {
+  size_t root;
+  return find_v2(dir, len, &root);
+}
+
+/**
+ * Tighten the cpu quota with the
+ * limit of one group.
+ *
+ * @param dir the group's directory
+ * @param version hierarchy of the group
+ */
+static void read_cpu(const char *dir, int version) {
+  char line[64];
+  long long quota, period;
+  if (version == 2) {
+    if (read_line(dir, "cpu.max", line, sizeof(line)) != 0) return;
+    if (sscanf(line, "%lld %lld", &quota, &period) != 2) return;
+  } else {
+    if (read_line(dir, "cpu.cfs_quota_us", line, sizeof(line)) != 0) return;
+    quota = strtoll(line, NULL, 10);
+    if (read_line(dir, "cpu.cfs_period_us", line, sizeof(line)) != 0) return;
+    period = strtoll(line, NULL, 10);
+  }
+  if (quota <= 0 || period <= 0) return;
+  double cpus = (double)quota / period;
+  if (cgroup.quota == 0 || cpus < cgroup.quota) cgroup.quota = cpus;
+  cgroup.version = version;
+}
+
+/**
+ * Tighten the memory limit with the
+ * limit of one group.
+ *
+ * @param dir the group's directory
+ * @param version hierarchy of the group
+ */
+static void read_memory(const char *dir, int version) {
+  char line[64];
+  if (read_line(dir, version == 2 ? "memory.max" : "memory.limit_in_bytes", line, sizeof(line)) != 0) {
+    return;
+  }
+  char *end;
+  unsigned long long limit = strtoull(line, &end, 10);
+  if (end == line || limit == 0 || limit >= CGROUP_UNLIMITED) return;
+  if (cgroup.memory == 0 || limit < cgroup.memory) cgroup.memory = limit;
+  cgroup.version = version;
+}
+
+/**
+ * Read the limits of a group and each
+ * of its ancestors up to the root of
+ * the hierarchy.
+ *
+ * @param dir the group's directory, cut down in place
+ * @param root length of the hierarchy's mount point in dir
+ * @param read reader of the limits of one group
+ * @param version hierarchy of the group
+ */
+static void walk(char *dir, size_t root, void (*read)(const char *, int), int version) {
+  for (;;) {
+    read(dir, version);
+    char *slash = strrchr(dir, '/');
+    if (slash == NULL || (size_t)(slash - dir) < root) break;
+    *slash = '\0';
+  }
+}
+
+/**
+ * Read the limits of a controller in
+ * its v1 hierarchy. A group that is
+ * not visible, as inside a cgroup
+ * namespace, is read at the mount.
+ *
+ * @param ctrl the controller
+ * @param read reader of the limits of one group
+ */
+static void walk_v1(const char *ctrl, void (*read)(const char *, int)) {
+  char ctrls[NAME_MAX], path[PATH_MAX];
+  if (find_group(ctrl, ctrls, path) != 0) return;
+
+  char mount[PATH_MAX], dir[2 * PATH_MAX];
+  snprintf(mount, sizeof(mount), "/sys/fs/cgroup/%s", ctrls);
+  if (!is_dir(mount)) snprintf(mount, sizeof(mount), "/sys/fs/cgroup/%s", ctrl);
+  if (!is_dir(mount)) return;
+  snprintf(dir, sizeof(dir), "%s%s", mount, strcmp(path, "/") == 0 ? "" : path);
+  if (!is_dir(dir)) snprintf(dir, sizeof(dir), "%s", mount);
+  walk(dir, strlen(mount), read, 1);
+}
+
+// Read the v2 limits, falling back
+// to v1 for each limit v2 does not
+// have, then size the budget.
+void cgroup_detect(void) {
+  memset(&cgroup, 0, sizeof(cgroup));
+
+  char dir[PATH_MAX];
+  size_t root;
+  if (find_v2(dir, sizeof(dir), &root) == 0) {
+    char up[PATH_MAX];
+    snprintf(up, sizeof(up), "%s", dir);
+    walk(up, root, &read_cpu, 2);
+    snprintf(up, sizeof(up), "%s", dir);
+    walk(up, root, &read_memory, 2);
+  }
+  if (cgroup.quota == 0) walk_v1("cpu", &read_cpu);
+  if (cgroup.memory == 0) walk_v1("memory", &read_memory);
+
+  cpu_set_t set;
+  long online = sysconf(_SC_NPROCESSORS_ONLN);
+  cgroup.cpus = sched_getaffinity(0, sizeof(set), &set) == 0 ? (unsigned int)CPU_COUNT(&set) :
+                online > 0 ? (unsigned int)online : 1;
+  unsigned int quota = (unsigned int)(cgroup.quota + 0.999);
+  if (cgroup.quota > 0 && quota < cgroup.cpus) cgroup.cpus = quota > 0 ? quota : 1;
+  cgroup.budget = (size_t)(cgroup.memory / CGROUP_MEMORY_SHARE);
+
+  log("Cgroup v%d: %u CPUs, quota %.2f, memory %llu, budget %zu\n", cgroup.version, cgroup.cpus,
+      cgroup.quota, cgroup.memory, cgroup.budget);
+}
+
+// Cap a pool at the CPUs the
+// quota allows.
+unsigned int cgroup_threads(unsigned int def) {
+  if (cgroup.quota == 0 || def <= cgroup.cpus) return def;
+  cgroup.threads = cgroup.cpus;
+  return cgroup.cpus;
+}
+
+// Fit a ring in half the budget,
+// leaving the rest for the cache.
+unsigned int cgroup_buffers(unsigned int def, size_t size, unsigned int least) {
+  if (cgroup.budget == 0 || size == 0) return def;
+  size_t fit = cgroup.budget / 2 / size;
+  if (fit >= def) return def;
+  cgroup.buffers = fit > least ? (unsigned int)fit : least;
+  cgroup.buffer_size = size;
+  return cgroup.buffers;
+}
+
+// Fit the cache in the other half.
+size_t cgroup_cache(size_t def) {
+  if (cgroup.budget == 0 || def <= cgroup.budget / 2) return def;
+  cgroup.cache = cgroup.budget / 2;
+  return cgroup.cache;
+}
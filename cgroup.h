@@ -0,0 +1,97 @@
+/**
+ * Limits of the cgroup cpy runs in.
+ * The cpu quota and memory limit are
+ * read once at startup from cpu.max and
+ * memory.max on cgroup v2, or from
+ * cpu.cfs_quota_us and
+ * memory.limit_in_bytes on v1, taking
+ * the tightest limit of the group and
+ * its ancestors. Default thread counts,
+ * ring depths and the cache are then
+ * sized to fit them, so a copy in a
+ * container is neither throttled for
+ * running more threads than its quota
+ * nor killed for allocating more than
+ * its limit. Sizes given on the command
+ * line are left as they are.
+ *
+ * @author Matt Stetter
+ * @file cgroup.h
+ */
+
+#include <stddef.h>
+
+#ifndef CGROUP_H_
+#define CGROUP_H_
+
+// Share of the memory limit the copy's
+// buffers and cache may take, leaving
+// the rest for the page cache its
+// reads and writes go through
+#define CGROUP_MEMORY_SHARE 4
+
+// Limits found and what was sized
+// from them
+typedef struct cgroup {
+  int version;		// 2 or 1 for the hierarchy limits were read from, 0 if none
+  unsigned int cpus;	// CPUs the copy may keep busy, from its affinity and quota
+  double quota;		// CPUs worth of time the quota allows, 0 if unlimited
+  unsigned long long memory; // Memory limit in bytes, 0 if unlimited
+  size_t budget;	// Bytes of buffers and cache the copy may take, 0 if unlimited
+  unsigned int threads;	// Threads a pool was sized to, 0 if none was
+  unsigned int buffers;	// Buffers a ring or pool was sized to, 0 if none was
+  size_t buffer_size;	// Size of each of those buffers
+  size_t cache;		// Bytes the cache was sized to, 0 if it was not
+} cgroup_t;
+
+// Limits of the cgroup cpy runs in
+extern cgroup_t cgroup;
+
+/**
+ * Find the cgroup v2 directory of
+ * the calling process.
+ *
+ * @param dir returned directory under the v2 mount
+ * @param len size of dir
+ * @return 0 if successful, 1 if there is no v2 hierarchy
+ */
+int cgroup_dir(char *dir, size_t len);
+
+/**
+ * Read the limits of the cgroup and
+ * the CPUs the process may run on.
+ * Called once before the options
+ * are parsed.
+ */
+void cgroup_detect(void);
+
+/**
+ * Size a thread pool to the CPUs
+ * the quota allows.
+ *
+ * @param def threads the pool has without a limit
+ * @return def, or fewer under a cpu quota, at least 1
+ */
+unsigned int cgroup_threads(unsigned int def);
+
+/**
+ * Size a ring or pool of buffers to
+ * the memory budget.
+ *
+ * @param def buffers the ring has without a limit
+ * @param size bytes in each buffer
+ * @param least fewest buffers the ring works with
+ * @return def, or as many as fit the budget but no fewer than least
+ */
+unsigned int cgroup_buffers(unsigned int def, size_t size, unsigned int least);
+
+/**
+ * Size the pipeline's source cache
+ * to half the memory budget.
+ *
+ * @param def bytes the cache has without a limit
+ * @return def, or half the budget if that is less
+ */
+size_t cgroup_cache(size_t def);
+
+#endif
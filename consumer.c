@@ -8,14 +8,20 @@
  * @file consumer.c
  */
 
+#include "backend.h"
 #include "buffer.h"
 #include "consumer.h"
 #include "cpy.h"
+#include "device.h"
+#include "stats.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 // Control struct used for
@@ -23,168 +29,353 @@
 // portion of the buffered
 // file copy.
 typedef struct consumer {
-  char *out_file;	// Name of the file to write to
+  options_t *opts;	// Options naming the file to write to
   pthread_t *thread;	// Consumer's thread of execution
   buffer_t *buf;	// Buffer to read from
-  unsigned int read;	// Index to read from the shared buffer at
+  unsigned int read;	// Index of the block to read next
+  backend_t sink;	// The open destination
+  int opened;		// Non-zero once the destination is open
+  int status;		// 0 if the copy succeeded, errno otherwise
+  int seekable;		// Non-zero to write with pwrite at block offsets
+  int zero_detect;	// Non-zero to look for runs of zeros in data blocks
+  off_t zero_off;	// Start of the pending run of zeros
+  off_t zero_len;	// Length of the pending run of zeros
+  off_t end;		// End of the data written so far
+  off_t map_size;	// Size of a mapped destination, 0 to use write()
+  char *map;		// Window of the mapped destination, NULL if none
+  off_t map_off;	// Offset of the window in the file
+  size_t map_len;	// Length of the window
 } consumer_t;
 
+// Zero-filled block used to write out
+// runs of zeros that are too short to
+// be punched or zeroed by the device
+static char zero_block[BLOCK_SIZE] __attribute__((aligned(BLOCK_ALIGN)));
+
 /**
- * Main thread target for the
- * consumer thread to execute.
- * Reads from the shared buffer
- * into the output file until
- * an EOF character is read.
+ * Hand the current window of a mapped
+ * destination back. Writeback of its
+ * pages is started without waiting, and
+ * they are dropped from the mapping so
+ * the copy does not hold on to them.
  *
- * @param args consumer_t struct pointer
- * @return NULL
+ * @param c the consumer_t struct
  */
-void *cons_target(void *args) {
-  
-  // Cast parameter to consumer_t struct
-  consumer_t *c = (consumer_t *)args;
+static void map_retire(consumer_t *c) {
+  if (c->map == NULL) return;
+  msync(c->map, c->map_len, MS_ASYNC);
+  madvise(c->map, c->map_len, MADV_DONTNEED);
+  munmap(c->map, c->map_len);
+  c->map = NULL;
+  log("Consumer retired the window at %lld\n", (long long)c->map_off);
+}
 
-  // Try to open the output file to write to
-  int fd;
-  if ((fd = open(c->out_file, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) {
-    fprintf(stderr, "Consumer could not open/create target file %s for writing\n", c->out_file);
-    return NULL;
+/**
+ * Map the window of a mapped destination
+ * holding an offset, retiring the last
+ * one. Windows are MAP_WINDOW aligned,
+ * and a source that grew past the size
+ * the file was given extends the file.
+ *
+ * @param c the consumer_t struct
+ * @param off offset the window must hold
+ * @param end end of the data about to be copied
+ * @return 0 if successful, errno otherwise
+ */
+static int map_window(consumer_t *c, off_t off, off_t end) {
+  map_retire(c);
+  if (end > c->map_size) {
+    if (ftruncate(c->sink.fd, end) != 0) return errno;
+    c->map_size = end;
   }
 
-  log("Consumer successfully opened file %s\n", c->out_file);
+  c->map_off = off - off % MAP_WINDOW;
+  c->map_len = c->map_size - c->map_off < MAP_WINDOW ? (size_t)(c->map_size - c->map_off) : MAP_WINDOW;
+  void *map = mmap(NULL, c->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, c->sink.fd, c->map_off);
+  if (map == MAP_FAILED) return errno;
+  c->map = (char *)map;
+  return 0;
+}
 
-  unsigned int cur_block = 0;
-  pthread_mutex_t *cur_mutex = &c->buf->buf[0].mutex;
+/**
+ * Copy a range of data into a mapped
+ * destination, moving the window along
+ * as the range crosses into the next.
+ *
+ * @param c the consumer_t struct
+ * @param data bytes to copy
+ * @param off offset of the data in the file
+ * @param len number of bytes to copy
+ * @return 0 if successful, errno otherwise
+ */
+static int map_data(consumer_t *c, const char *data, off_t off, size_t len) {
+  off_t end = off + (off_t)len;
+  int err;
+  while (off < end) {
+    if (c->map == NULL || off < c->map_off || off >= c->map_off + (off_t)c->map_len) {
+      if ((err = map_window(c, off, end)) != 0) return err;
+    }
+    size_t at = (size_t)(off - c->map_off);
+    size_t n = (size_t)(end - off) < c->map_len - at ? (size_t)(end - off) : c->map_len - at;
+    memcpy(c->map + at, data, n);
+    data += n;
+    off += n;
+  }
 
-  // Wait until there is at least one
-  // character available in the shared
-  // buffer.
-  sem_wait(&c->buf->full_spaces);
-  pthread_mutex_lock(cur_mutex);
+  if (end > c->end) c->end = end;
+  atomic_fetch_add(&stats.bytes_written, len);
+  return 0;
+}
 
-  log("Consumer got the mutex lock on block %u\n", cur_block);
+/**
+ * Write a range of data to the output
+ * file, retrying short writes. O_DIRECT
+ * is dropped for the rest of the copy
+ * if the range is not sector aligned,
+ * which happens for the tail of a
+ * regular file. Seekable
+ * files are written with pwrite at the
+ * data's offset, so blocks may arrive
+ * in any order and skipped runs of zeros
+ * leave no trace in the file position.
+ *
+ * @param c the consumer_t struct
+ * @param data bytes to write
+ * @param off offset of the data in the file
+ * @param len number of bytes to write
+ * @return 0 if successful, errno otherwise
+ */
+static int write_data(consumer_t *c, const char *data, off_t off, size_t len) {
+  if (c->map_size != 0) return map_data(c, data, off, len);
+  if (c->sink.info.direct && (len % c->sink.info.lbs != 0 || off % c->sink.info.lbs != 0)) {
+    fcntl(c->sink.fd, F_SETFL, fcntl(c->sink.fd, F_GETFL) & ~O_DIRECT);
+    c->sink.info.direct = 0;
+    log("Consumer dropped O_DIRECT for unaligned write at %lld\n", (long long)off);
+  }
 
-  // Get the first character from the buffer
-  char ch = c->buf->buf[0].blk[0];
+  int err;
+  if ((err = backend_write(&c->sink, data, len, c->seekable ? off : -1)) != 0) return err;
 
-  // Increment the index for reading from the buffer
-  c->read = (c->read + 1) % BUFFER_SIZE;
-  
-  sem_post(&c->buf->empty_spaces);
+  if (off + (off_t)len > c->end) c->end = off + len;
+  atomic_fetch_add(&stats.bytes_written, len);
 
-  if (sem_trywait(&c->buf->full_spaces) == -1) {
-    pthread_mutex_unlock(cur_mutex);
-    log("Consumer ran out of buffer space to read\n");
-    sem_wait(&c->buf->full_spaces);
-    pthread_mutex_lock(cur_mutex);
-  }
+  log("Consumer wrote %zu bytes to file %s\n", len, c->opts->dst);
 
-  //log("Consumer received character: %c\n", ch);
+  return 0;
+}
 
-  // Initialize temporary buffer for writing
-  // to the file
-  char temp_buf[CONS_BUFFER_SIZE];
-  int buf_index = 0;
-  ssize_t nbytes;
-  unsigned int end_of_block = c->read - (c->read % BLOCK_SIZE) + BLOCK_SIZE;
-  
-  // Increment the block number and mutex if
-  // the consumer reads to a new block
-  if (c->read == end_of_block) {
-    pthread_mutex_unlock(cur_mutex);
-    cur_block = (cur_block + 1) % NUM_BLOCKS;
-    cur_mutex = &c->buf->buf[cur_block].mutex;
-    end_of_block = (end_of_block + BLOCK_SIZE) % BUFFER_SIZE;
-    log("Consumer reached end of block, new end of block is %u\n", end_of_block);
-    pthread_mutex_lock(cur_mutex);
+/**
+ * Finish the pending run of zeros. Runs
+ * at least as long as the zero threshold
+ * are punched out or zeroed by the device,
+ * shorter runs and runs the destination
+ * cannot zero are written as zero pages.
+ *
+ * @param c the consumer_t struct
+ * @return 0 if successful, errno otherwise
+ */
+static int flush_zeros(consumer_t *c) {
+  off_t off = c->zero_off;
+  off_t len = c->zero_len;
+  if (len == 0) return 0;
+  c->zero_len = 0;
+
+  if ((size_t)len >= c->opts->zero_threshold && (c->sink.caps & BE_ZERO) &&
+      dev_zero_range(c->sink.fd, &c->sink.info, off, len, c->opts->discard) == 0) {
+    if (off + len > c->end) c->end = off + len;
+    atomic_fetch_add(&stats.bytes_zeroed, len);
+    log("Consumer zeroed %lld bytes at offset %lld\n", (long long)len, (long long)off);
+    return 0;
   }
 
-  // Keep reading bytes until a null
-  // byte is read, which terminates
-  // the file copy
-  while (ch != '\0') {
-
-    // Flush the buffer to the output
-    // file if it is full
-    if (buf_index >= CONS_BUFFER_SIZE) {
-      nbytes = write(fd, temp_buf, buf_index);
-
-      // If not all the bytes in the buffer
-      // could be written to the file,
-      // print an error message and return
-      if (nbytes != buf_index) {
-        fprintf(stderr, "Could not write all %d bytes to file %s\n", buf_index, c->out_file);
-	return NULL;
-      }
-      buf_index = 0;
+  int err;
+  while (len > 0) {
+    size_t n = len < (off_t)sizeof(zero_block) ? (size_t)len : sizeof(zero_block);
+    if ((err = write_data(c, zero_block, off, n)) != 0) return err;
+    off += n;
+    len -= n;
+  }
+  return 0;
+}
 
-      log("Consumer wrote %ld bytes to file %s\n", nbytes, c->out_file);
-    }
+/**
+ * Extend the pending run of zeros, or
+ * start a new one if the range does not
+ * follow on from it. Destinations that
+ * cannot be seeked get the zeros
+ * written straight away.
+ *
+ * @param c the consumer_t struct
+ * @param off start of the zero range
+ * @param len length of the zero range
+ * @return 0 if successful, errno otherwise
+ */
+static int add_zeros(consumer_t *c, off_t off, off_t len) {
+  int err;
+  if (c->zero_len != 0 && c->zero_off + c->zero_len != off) {
+    if ((err = flush_zeros(c)) != 0) return err;
+  }
+  if (c->zero_len == 0) c->zero_off = off;
+  c->zero_len += len;
 
-    
-    // Write this character to the
-    // temporary buffer
-    temp_buf[buf_index++] = ch;
+  return c->seekable ? 0 : flush_zeros(c);
+}
 
-    // Read the character and increment
-    // the read index of the buffer
-    ch = c->buf->buf[cur_block].blk[c->read % BLOCK_SIZE];
+/**
+ * Write a whole block to the output
+ * file. When zero detection is on the block is scanned
+ * in ZERO_GRAIN pieces, data is written
+ * and runs of zeros are collected so
+ * flush_zeros can skip them. BLK_ZERO
+ * blocks from holes in the source join
+ * the run of zeros without a scan.
+ *
+ * @param c the consumer_t struct
+ * @param blk block to write
+ * @return 0 if successful, errno otherwise
+ */
+static int write_block(consumer_t *c, block_t *blk) {
+  int err;
+  if (blk->flags & BLK_ZERO) return add_zeros(c, blk->off, blk->len);
 
-    // Increment the index for reading from the buffer
-    c->read = (c->read + 1) % BUFFER_SIZE;
-    
-    // Increment the semaphore containing the number
-    // of empty positions in the buffer
-    sem_post(&c->buf->empty_spaces);
+  if (!c->zero_detect) {
+    if ((err = flush_zeros(c)) != 0) return err;
+    return write_data(c, blk->blk, blk->off, blk->len);
+  }
 
-    // Determine if there are any spaces left to read,
-    // and if not, release the lock and wait until
-    // there are spaces and finally reacquire the lock
-    if (sem_trywait(&c->buf->full_spaces) == -1) {
-      pthread_mutex_unlock(cur_mutex);
-      log("Consumer ran out of buffer space to read\n");
-      if (ch == '\0') break;
-      sem_wait(&c->buf->full_spaces);
-      pthread_mutex_lock(cur_mutex);
-    }
+  // Walk the block, writing out each run
+  // of data as soon as a zero piece ends it
+  size_t start = 0;
+  for (size_t pos = 0; pos < blk->len; pos += ZERO_GRAIN) {
+    size_t n = blk->len - pos < ZERO_GRAIN ? blk->len - pos : ZERO_GRAIN;
+    if (!dev_is_zero(blk->blk + pos, n)) continue;
 
-    // Increment the block and mutex being used
-    // to read from
-    if (c->read == end_of_block) {
-      pthread_mutex_unlock(cur_mutex);
-      cur_block = (cur_block + 1) % NUM_BLOCKS;
-      cur_mutex = &c->buf->buf[cur_block].mutex;
-      end_of_block = (end_of_block + BLOCK_SIZE) % BUFFER_SIZE;
-      log("Consumer reached end of block, new end of block is %u\n", end_of_block);
-      pthread_mutex_lock(cur_mutex);
+    if (pos > start) {
+      if ((err = flush_zeros(c)) != 0) return err;
+      if ((err = write_data(c, blk->blk + start, blk->off + start, pos - start)) != 0) return err;
     }
 
-    
-    //log("Consumer received character: %c\n", ch);
+    if ((err = add_zeros(c, blk->off + pos, n)) != 0) return err;
+    start = pos + n;
+  }
+
+  if (start < blk->len) {
+    if ((err = flush_zeros(c)) != 0) return err;
+    return write_data(c, blk->blk + start, blk->off + start, blk->len - start);
   }
 
-  // Release the mutex lock
-  pthread_mutex_unlock(cur_mutex);
+  return 0;
+}
 
-  // If the buffer still has characters in it,
-  // flush them out to the output file
-  if (buf_index != 0) {
-    nbytes = write(fd, temp_buf, buf_index);
-    if (nbytes != buf_index) {
-      fprintf(stderr, "Could not write all %d bytes to file %s\n", buf_index, c->out_file);
-      return NULL;
+/**
+ * Finish the copy once the end of
+ * file block arrives by flushing the
+ * last run of zeros and, for regular
+ * files, setting the final file size
+ * in case the file ends in a hole.
+ *
+ * @param c the consumer_t struct
+ * @return 0 if successful, errno otherwise
+ */
+static int finish_copy(consumer_t *c) {
+  int err;
+  if ((err = flush_zeros(c)) != 0) return err;
+  map_retire(c);
+  if (c->sink.info.is_reg && ftruncate(c->sink.fd, c->end) != 0) return errno;
+  return 0;
+}
+
+/**
+ * Main thread target for the
+ * consumer thread to execute.
+ * Reads blocks from the shared buffer
+ * into the output file until
+ * a block marked BLK_EOF is read.
+ *
+ * @param args consumer_t struct pointer
+ * @return NULL
+ */
+void *cons_target(void *args) {
+  
+  // Cast parameter to consumer_t struct
+  consumer_t *c = (consumer_t *)args;
+  char *out_file = c->opts->dst;
+
+  // Try to open the output file to write to.
+  // If this fails the buffer still has to be
+  // drained so the producer can finish.
+  // Mapped destinations are opened sized
+  // and reserved, then handed to the file
+  // backend
+  if (c->map_size == 0) {
+    c->status = backend_open(&c->sink, out_file, BE_WRITE, c->opts->direct);
+  } else {
+    dev_info_t info;
+    int fd = dev_open_map(out_file, c->map_size, &info);
+    c->status = fd == -1 ? errno : backend_adopt(&c->sink, out_file, fd, BE_WRITE);
+  }
+  if (c->status != 0) {
+    fprintf(stderr, "Consumer could not open/create target file %s for writing\n", out_file);
+  } else {
+    log("Consumer successfully opened file %s\n", out_file);
+    c->opened = 1;
+
+    // Zero runs are always skipped on block
+    // devices, and on regular files only
+    // when a sparse copy was asked for
+    c->seekable = (c->sink.caps & BE_PWRITE) != 0;
+    c->zero_detect = c->sink.info.is_blk || (c->sink.info.is_reg && c->opts->sparse);
+  }
+
+  // Keep reading blocks until the
+  // producer sends the end of file block
+  int flags = 0;
+  while (!(flags & BLK_EOF)) {
+
+    // Wait until there is at least one
+    // full block in the shared buffer
+    sem_wait(&c->buf->full_spaces);
+    block_t *blk = &c->buf->buf[c->read];
+    pthread_mutex_lock(&blk->mutex);
+
+    log("Consumer got the mutex lock on block %u\n", c->read);
+
+    flags = blk->flags;
+    if (flags & BLK_ERROR) {
+      if (c->status == 0) c->status = EIO;
+    } else if (c->status == 0 && blk->len > 0) {
+      if ((c->status = write_block(c, blk)) != 0) {
+        fprintf(stderr, "Could not write %zu bytes to file %s at offset %lld\n",
+                blk->len, out_file, (long long)blk->off);
+      }
+    }
+    if (c->status == 0 && c->opened && (flags & BLK_SYNC)) {
+      map_retire(c);
+      if ((c->status = flush_zeros(c)) == 0) c->status = backend_sync(&c->sink);
+      if (c->status != 0) fprintf(stderr, "Could not sync file %s\n", out_file);
+    }
+    if (c->status == 0 && (flags & BLK_EOF) && !(flags & BLK_ERROR)) {
+      if ((c->status = finish_copy(c)) != 0) {
+        fprintf(stderr, "Could not finish writing file %s\n", out_file);
+      }
     }
 
-    log("Consumer wrote %ld bytes to file %s\n", nbytes, c->out_file);
+    // Release the block and increment the
+    // index for reading from the buffer
+    pthread_mutex_unlock(&blk->mutex);
+    c->read = (c->read + 1) % c->buf->num_blocks;
+    sem_post(&c->buf->empty_spaces);
   }
 
   // Try to close the output file
-  if (close(fd) != 0) {
-    fprintf(stderr, "Consumer could not close target file %s\n", c->out_file);
-    return NULL;
+  map_retire(c);
+  int err;
+  if (c->opened && (err = backend_close(&c->sink, c->status != 0)) != 0) {
+    fprintf(stderr, "Consumer could not close target file %s\n", out_file);
+    if (c->status == 0) c->status = err;
   }
 
-  log("Consumer closed file %s\n", c->out_file);
+  log("Consumer closed file %s\n", out_file);
 
   return NULL;
 }
@@ -193,8 +384,8 @@ void *cons_target(void *args) {
 // to begin the process of reading
 // from the shared buffer and writing
 // the data to an output file.
-consumer_t *consumer_init(char *file_name, buffer_t *buf) {
-  if (file_name == NULL) return NULL;
+consumer_t *consumer_init(options_t *o, buffer_t *buf, off_t map_size) {
+  if (o == NULL || o->dst == NULL) return NULL;
 
   // Allocate enough heap memory for the
   // consumer struct
@@ -208,11 +399,22 @@ consumer_t *consumer_init(char *file_name, buffer_t *buf) {
 
   log("Successfully allocated memory for the consumer struct\n");
 
-  // Set the output file name and the
+  // Set the options and the
   // shared buffer in the consumer struct
-  c->out_file = file_name;
+  c->opts = o;
   c->buf = buf;
   c->read = 0;
+  c->opened = 0;
+  c->status = 0;
+  c->seekable = 0;
+  c->zero_detect = 0;
+  c->zero_off = 0;
+  c->zero_len = 0;
+  c->end = 0;
+  c->map_size = map_size;
+  c->map = NULL;
+  c->map_off = 0;
+  c->map_len = 0;
 
   // Try to initialize the main thread
   // and return 1 if it fails
@@ -239,11 +441,13 @@ consumer_t *consumer_init(char *file_name, buffer_t *buf) {
 // Function to join on the main
 // thread of the consumer.
 int consumer_join(consumer_t *c) {
+  if (c == NULL) return 1;
 
   log("Main thread joining on consumer thread\n");
 
   // Join on the internal thread
   pthread_join(*c->thread, NULL);
+  int status = c->status;
 
   // Free the memory used for the thread
   free(c->thread);
@@ -253,5 +457,5 @@ int consumer_join(consumer_t *c) {
 
   log("Main thread freed consumer memory\n");
 
-  return 0;
+  return status;
 }
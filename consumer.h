@@ -10,12 +10,11 @@
  */
 
 #include "buffer.h"
+#include "options.h"
 
 #ifndef CONSUMER_H_
 #define CONSUMER_H_
 
-#define CONS_BUFFER_SIZE 64
-
 // Main struct of this consumer
 // implementation. Contains a pthread
 // and the information needed to save
@@ -30,11 +29,13 @@ typedef struct consumer consumer_t;
  * This function will begin the 
  * process of asynchronously copying the file.
  *
- * @param file_name the name of the file to write to
+ * @param o options naming the file to write to
  * @param buf the buffer to read from
- * @return 0 if successful, errno otherwise
+ * @param map_size final size of a regular destination to write
+ * 	  through a shared mapping instead of write(), 0 for write()
+ * @return pointer to struct if successful, NULL otherwise
  */
-consumer_t *consumer_init(char *file_name, buffer_t *buf);
+consumer_t *consumer_init(options_t *o, buffer_t *buf, off_t map_size);
 
 /**
  * Joins on the specified
@@ -0,0 +1,119 @@
+/**
+ * Source implementation of pause,
+ * resume and cancel.
+ *
+ * Parked threads sleep on the state
+ * word itself with a futex, so a resume
+ * or cancel only has to change the word
+ * and wake them, both of which are
+ * async-signal-safe.
+ *
+ * @author Matt Stetter
+ * @file control.c
+ */
+
+#include "control.h"
+#include "cpy.h"
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// CONTROL_* state of the copy
+static _Atomic uint32_t state = CONTROL_RUNNING;
+
+/**
+ * Wake every thread parked on
+ * the state word.
+ */
+static void wake_all(void) {
+  syscall(SYS_futex, (uint32_t *)&state, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+}
+
+// Move from running to paused.
+void control_pause(void) {
+  uint32_t cur = CONTROL_RUNNING;
+  atomic_compare_exchange_strong(&state, &cur, CONTROL_PAUSED);
+}
+
+// Move from paused to running and
+// wake the parked threads.
+void control_resume(void) {
+  uint32_t cur = CONTROL_PAUSED;
+  if (atomic_compare_exchange_strong(&state, &cur, CONTROL_RUNNING)) wake_all();
+}
+
+// Cancel for good and wake the
+// parked threads.
+void control_cancel(void) {
+  atomic_store(&state, CONTROL_CANCELLED);
+  wake_all();
+}
+
+// Read the state word.
+int control_state(void) {
+  return (int)atomic_load(&state);
+}
+
+// Sleep on the state word while
+// it says paused.
+int control_checkpoint(void) {
+  uint32_t cur;
+  while ((cur = atomic_load(&state)) == CONTROL_PAUSED) {
+    syscall(SYS_futex, (uint32_t *)&state, FUTEX_WAIT_PRIVATE, CONTROL_PAUSED, NULL, NULL, 0);
+  }
+  return cur == CONTROL_CANCELLED ? ECANCELED : 0;
+}
+
+// Sync the data of the destination,
+// ignoring destinations without any.
+int control_sync(int fd) {
+  if (fdatasync(fd) == 0 || errno == EINVAL || errno == EROFS) return 0;
+  return errno;
+}
+
+// Drop the pages of the buffer.
+void control_release(void *mem, size_t len) {
+  if (madvise(mem, len, MADV_DONTNEED) == 0) {
+    log("Released %zu bytes of idle buffers\n", len);
+  }
+}
+
+/**
+ * Signal handler of the cpy program.
+ * Cancelling restores the default
+ * action so a second signal kills
+ * a copy stuck in a system call.
+ *
+ * @param sig the signal
+ */
+static void on_signal(int sig) {
+  switch (sig) {
+  case SIGUSR1: control_pause(); break;
+  case SIGUSR2: control_resume(); break;
+  default:
+    control_cancel();
+    signal(sig, SIG_DFL);
+    break;
+  }
+}
+
+// Install on_signal for the pause,
+// resume and cancel signals.
+void control_signals(void) {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, NULL);
+  sigaction(SIGUSR2, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+}
@@ -0,0 +1,94 @@
+/**
+ * Pause, resume and cancel of a
+ * running copy. The calls only change
+ * a shared state word and are safe to
+ * make from a signal handler. Every
+ * engine checks the state at chunk
+ * boundaries: a pause lets what was
+ * already read be written and synced,
+ * releases the buffer memory and parks
+ * the readers until the copy resumes
+ * from the same offset; a cancel
+ * writes and syncs what was already
+ * read and ends the copy.
+ *
+ * @author Matt Stetter
+ * @file control.h
+ */
+
+#include <stddef.h>
+
+#ifndef CONTROL_H_
+#define CONTROL_H_
+
+// States of the running copy
+#define CONTROL_RUNNING 0	// Copying
+#define CONTROL_PAUSED 1	// Readers park at the next chunk boundary
+#define CONTROL_CANCELLED 2	// Readers stop at the next chunk boundary
+
+/**
+ * Ask the copy to pause. Has no
+ * effect on a cancelled copy.
+ */
+void control_pause(void);
+
+/**
+ * Resume a paused copy.
+ */
+void control_resume(void);
+
+/**
+ * Cancel the copy, waking it
+ * if it is paused.
+ */
+void control_cancel(void);
+
+/**
+ * Get the state of the copy.
+ *
+ * @return CONTROL_* state
+ */
+int control_state(void);
+
+/**
+ * Sleep while the copy is paused.
+ * Called by readers at chunk
+ * boundaries once the data read so
+ * far is written out.
+ *
+ * @return 0 to carry on, ECANCELED if the copy was cancelled
+ */
+int control_checkpoint(void);
+
+/**
+ * Flush the data written to a
+ * destination to stable storage.
+ * Destinations that cannot be
+ * synced, such as pipes, succeed.
+ *
+ * @param fd the destination
+ * @return 0 if successful, errno otherwise
+ */
+int control_sync(int fd);
+
+/**
+ * Give the pages of an idle buffer
+ * back to the kernel. The memory
+ * stays mapped and reads as zeros
+ * when it is next touched.
+ *
+ * @param mem start of the buffer, page aligned
+ * @param len length of the buffer
+ */
+void control_release(void *mem, size_t len);
+
+/**
+ * Install the signal handlers of the
+ * cpy program: SIGUSR1 pauses, SIGUSR2
+ * resumes, and SIGINT or SIGTERM
+ * cancels. A second SIGINT or SIGTERM
+ * kills the program as usual.
+ */
+void control_signals(void);
+
+#endif
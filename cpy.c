@@ -7,42 +7,49 @@
  * @file cpy.c
  */
 
-#include "buffer.h"
-#include "consumer.h"
-#include "producer.h"
+#include "cgroup.h"
+#include "control.h"
+#include "deadline.h"
+#include "engine.h"
+#include "fetch.h"
+#include "options.h"
+#include "psi.h"
+#include "s3.h"
+#include "stats.h"
+
+#include <stdio.h>
 
 /**
  * Main entry point for the cpy program.
  * Gets command line input to begin
  * the file transfer.
  * 
- * @param argc must be equal to 3
- * @param argv source file: argv[1]
- * 	  destination file: argv[2]
+ * @param argc must include a source and destination
+ * @param argv [OPTIONS] source file or device,
+ * 	  then destination file or device
  * @return 0 if successful, 1 otherwise
  */
 int main(int argc, char *argv[]) {
-  if (argc != 3) return 1;
-
-  // Initialize the shared buffer
-  buffer_t buf;
-  buffer_init(&buf);
-
-  // Start the producer thread
-  producer_t *prod;
-  prod = producer_init(argv[1], &buf);
-
-  // Start the consumer thread
-  consumer_t *cons;
-  cons = consumer_init(argv[2], &buf);
-
-  // Join on producer and consumer
-  producer_join(prod);
-  consumer_join(cons);
-
-  // Free the buffer memory and destroy
-  // the mutex and semaphores
-  buffer_destroy(&buf);
-
-  return 0;
+  options_t opts;
+  cgroup_detect();
+  if (options_parse(&opts, argc, argv) != 0) return 1;
+  if (s3_register(&opts) != 0) return 1;
+  if (fetch_register(&opts) != 0) return 1;
+
+  stats_start();
+  control_signals();
+  psi_start(opts.pressure);
+
+  int status = engine_run(&opts) != 0;
+  psi_stop();
+  deadline_finish(stderr, opts.verbose);
+  if (control_state() == CONTROL_CANCELLED) {
+    fprintf(stderr, "Copy cancelled, %llu bytes written and synced\n",
+            atomic_load(&stats.bytes_written));
+  }
+
+  if (opts.stats) stats_print(stderr);
+  stats_destroy();
+
+  return status;
 }
@@ -13,7 +13,7 @@
 // Change to non-zero value
 // to enable debug messages
 // to standard error.
-// Warning: This will log every character
+// Warning: This will log every block
 // that is transmitted.
 #define ENABLE_LOGGER 0
 
@@ -29,11 +29,117 @@
 
 // The number of bytes that can be stored
 // in the buffer.
-#define BUFFER_SIZE 2048
+#define BUFFER_SIZE (NUM_BLOCKS * BLOCK_SIZE)
 
 // Constants used for the size and number
 // of individual blocks in the buffer.
+// BLOCK_SIZE must be a multiple of
+// BLOCK_ALIGN so that every block can
+// be handed to O_DIRECT reads and writes.
 #define NUM_BLOCKS 64
-#define BLOCK_SIZE 32
+#define BLOCK_SIZE 65536
+
+// Alignment of the memory backing the
+// buffer blocks. This covers the largest
+// logical sector size in common use.
+#define BLOCK_ALIGN 4096
+
+// Granularity at which the consumer looks
+// for runs of zero bytes, and the default
+// length a run must reach before it is
+// punched out or zeroed by the device
+// instead of being written. Shorter runs
+// are written so tiny holes do not
+// fragment the destination's extents.
+#define ZERO_GRAIN 4096
+#define ZERO_THRESHOLD (64 * 1024)
+
+// Default largest distance the producer
+// keeps readahead in flight ahead of
+// its read cursor. The window starts
+// at one buffer block and adapts to
+// how fast the consumer drains.
+#define READAHEAD_MAX (8 * 1024 * 1024)
+
+// Default number and size of the large
+// buffers used by the double-buffered
+// engine.
+#define DBUF_COUNT 2
+#define DBUF_SIZE (4 * 1024 * 1024)
+
+// Regular files up to this size are
+// copied by a single thread with one
+// read and one write, since starting
+// threads costs more than the copy.
+#define SMALL_FILE (256 * 1024)
+
+// Chunks in the memory pool shared by
+// every file of a multi-file copy, and
+// the default number of reader and
+// writer threads pulling from it
+#define POOL_CHUNKS 256
+#define PIPELINE_THREADS 4
+
+// Default memory the pipeline keeps
+// for sources that several of its
+// jobs copy
+#define CACHE_SIZE (256 * 1024 * 1024)
+
+// Small files each pipeline writer
+// creates, writes and closes with a
+// single io_uring_enter
+#define URING_BATCH 32
+
+// Ring of each stream copied by the
+// event loops
+#define EVENT_BUFFER (64 * 1024)
+
+// Span of a destination the mmap
+// engine keeps mapped at a time
+#define MAP_WINDOW (32 * 1024 * 1024)
+
+// Size of the first parts of an S3
+// multipart upload (the store's least
+// is 5M) and how many are uploaded
+// at once
+#define S3_PART_SIZE (8 * 1024 * 1024)
+#define S3_UPLOADS 4
+
+// Size of the ranges an http:// source
+// is fetched in and how many are
+// fetched at once
+#define HTTP_CHUNK (4 * 1024 * 1024)
+#define HTTP_CONNS 4
+
+// Size of the leaves hashed in a
+// SRC.merkle sidecar, and the least
+// a stripe read from a replica holds
+#define REPLICA_LEAF (1024 * 1024)
+
+// Bytes in each unit of an erasure-coded
+// stripe, most shards in a stripe, and
+// stripes the shard writers may lag the
+// encoder by. The header before each
+// shard's units keeps them aligned
+// for O_DIRECT.
+#define EC_UNIT (64 * 1024)
+#define EC_MAX 32
+#define EC_DEPTH 8
+#define EC_HEADER 4096
+
+// Files sorted together when files are
+// started in inode or extent order, so
+// the first files start without waiting
+// for a huge tree to be mapped
+#define ORDER_WINDOW 1024
+
+// Smallest copy worth sharing extents
+// with another, how much of a file each
+// FIDEDUPERANGE call covers (btrfs takes
+// at most 16M) and how many copies one
+// call shares a file's extents with
+#define DEDUPE_MIN 4096
+#define DEDUPE_STEP (16 * 1024 * 1024)
+#define DEDUPE_BATCH 32
 
 #endif
@@ -0,0 +1,279 @@
+/**
+ * Source implementation of the
+ * double- and triple-buffered engine.
+ *
+ * Each buffer has a state word that
+ * is either DBUF_EMPTY (owned by the
+ * reader) or DBUF_FULL (owned by the
+ * writer). A thread that finds the next
+ * buffer in the wrong state sets the
+ * DBUF_WAITING bit and sleeps on the
+ * word with a futex. The thread handing
+ * a buffer over swaps the state and only
+ * makes the wake system call if the
+ * waiting bit was set, so a copy where
+ * neither side stalls makes no
+ * synchronization system calls at all.
+ *
+ * @author Matt Stetter
+ * @file dbuf.c
+ */
+
+#include "buffer.h"
+#include "control.h"
+#include "cpy.h"
+#include "dbuf.h"
+#include "deadline.h"
+#include "device.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// States of a buffer
+#define DBUF_EMPTY 0u	// Owned by the reader
+#define DBUF_FULL 1u	// Owned by the writer
+#define DBUF_WAITING 2u	// Bit set while the other side sleeps on the state
+
+// Shared state of one copy
+typedef struct dbuf {
+  options_t *opts;		// Options naming the source and destination
+  unsigned int count;		// Number of buffers in use
+  size_t size;			// Capacity of each buffer
+  char *slab;			// Aligned memory backing every buffer
+  _Atomic uint32_t state[DBUF_MAX]; // DBUF_* state of each buffer
+  size_t len[DBUF_MAX];		// Valid bytes in each full buffer
+  int flags[DBUF_MAX];		// BLK_* flags of each full buffer
+  int status;			// 0 if reading succeeded, errno otherwise
+} dbuf_t;
+
+/**
+ * Sleep until a buffer reaches the
+ * wanted state.
+ *
+ * @param state state word of the buffer
+ * @param want DBUF_EMPTY or DBUF_FULL
+ */
+static void dbuf_wait(_Atomic uint32_t *state, uint32_t want) {
+  uint32_t cur;
+  while (((cur = atomic_load(state)) & ~DBUF_WAITING) != want) {
+
+    // Announce the sleep, then only sleep
+    // if nobody handed the buffer over
+    // between the load and the futex call
+    if (!(cur & DBUF_WAITING) &&
+        !atomic_compare_exchange_weak(state, &cur, cur | DBUF_WAITING)) {
+      continue;
+    }
+    syscall(SYS_futex, (uint32_t *)state, FUTEX_WAIT_PRIVATE,
+            cur | DBUF_WAITING, NULL, NULL, 0);
+  }
+}
+
+/**
+ * Hand a buffer over to the other
+ * thread, waking it if it is asleep
+ * on the buffer.
+ *
+ * @param state state word of the buffer
+ * @param to DBUF_EMPTY or DBUF_FULL
+ */
+static void dbuf_post(_Atomic uint32_t *state, uint32_t to) {
+  if (atomic_exchange(state, to) & DBUF_WAITING) {
+    syscall(SYS_futex, (uint32_t *)state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  }
+}
+
+/**
+ * Thread target for the reader. Fills
+ * each buffer completely before handing
+ * it over so the writer issues large
+ * writes, and marks the last buffer
+ * with BLK_EOF.
+ *
+ * @param args dbuf_t struct pointer
+ * @return NULL
+ */
+static void *dbuf_reader(void *args) {
+  dbuf_t *d = (dbuf_t *)args;
+  char *in_file = d->opts->src;
+
+  int fd;
+  dev_info_t info = { 0 };
+  if ((fd = dev_open_src(in_file, d->opts->direct, &info)) == -1) {
+    d->status = errno;
+    fprintf(stderr, "Reader could not open file: %s\n", in_file);
+  } else if (!info.direct) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+
+  off_t remaining = info.is_blk ? info.size : -1;
+  off_t off = 0;
+  int flags = 0;
+  for (unsigned int i = 0; !(flags & BLK_EOF); i = (i + 1) % d->count) {
+    dbuf_wait(&d->state[i], DBUF_EMPTY);
+    deadline_pace();
+
+    // At a pause or cancel the writer gets
+    // an empty BLK_SYNC buffer to sync what
+    // it wrote, and once every buffer is
+    // back a pause releases their memory
+    if (d->status == 0 && control_state() != CONTROL_RUNNING) {
+      d->len[i] = 0;
+      d->flags[i] = BLK_SYNC;
+      dbuf_post(&d->state[i], DBUF_FULL);
+      for (unsigned int j = 0; j < d->count; j++) dbuf_wait(&d->state[j], DBUF_EMPTY);
+
+      if (control_state() == CONTROL_PAUSED) {
+        control_release(d->slab, d->count * d->size);
+        if (d->opts->verbose) fprintf(stderr, "cpy: paused at offset %lld\n", (long long)off);
+      }
+      d->status = control_checkpoint();
+      continue;
+    }
+
+    char *data = d->slab + (size_t)i * d->size;
+    size_t len = 0;
+
+    while (d->status == 0 && len < d->size && remaining != 0) {
+      size_t want = d->size - len;
+      if (remaining > 0 && (off_t)want > remaining) want = (size_t)remaining;
+      ssize_t status = read(fd, data + len, want);
+      if (status == -1 && errno == EINTR) continue;
+      if (status == -1 || (status == 0 && remaining > 0)) {
+        d->status = status == -1 ? errno : EIO;
+        fprintf(stderr, "Reader could not read file %s\n", in_file);
+        break;
+      }
+      if (status == 0) {
+        remaining = 0;
+        break;
+      }
+      len += status;
+      if (remaining > 0) remaining -= status;
+    }
+    atomic_fetch_add(&stats.bytes_read, len);
+    off += len;
+
+    if (d->status != 0) flags = BLK_EOF | BLK_ERROR;
+    else if (remaining == 0) flags = BLK_EOF;
+    d->len[i] = len;
+    d->flags[i] = flags;
+    dbuf_post(&d->state[i], DBUF_FULL);
+  }
+
+  if (fd != -1 && close(fd) != 0) {
+    fprintf(stderr, "Reader could not close file: %s\n", in_file);
+  }
+
+  return NULL;
+}
+
+/**
+ * Write the buffers handed over by
+ * the reader until the last one. After
+ * a write error the buffers are still
+ * handed back so the reader can finish.
+ *
+ * @param d the dbuf_t struct
+ * @return 0 if successful, errno otherwise
+ */
+static int dbuf_writer(dbuf_t *d) {
+  char *out_file = d->opts->dst;
+
+  int fd;
+  int err = 0;
+  dev_info_t info = { 0 };
+  if ((fd = dev_open_dst(out_file, d->opts->direct, &info)) == -1) {
+    err = errno;
+    fprintf(stderr, "Writer could not open/create target file %s for writing\n", out_file);
+  }
+
+  int flags = 0;
+  for (unsigned int i = 0; !(flags & BLK_EOF); i = (i + 1) % d->count) {
+    dbuf_wait(&d->state[i], DBUF_FULL);
+    char *data = d->slab + (size_t)i * d->size;
+    size_t len = d->len[i];
+    flags = d->flags[i];
+
+    // The tail of a regular file is
+    // not sector aligned
+    if (info.direct && len % info.lbs != 0) {
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+      info.direct = 0;
+    }
+
+    size_t done = 0;
+    while (err == 0 && done < len) {
+      ssize_t nbytes = write(fd, data + done, len - done);
+      if (nbytes == -1 && errno == EINTR) continue;
+      if (nbytes <= 0) {
+        err = nbytes == 0 ? ENOSPC : errno;
+        fprintf(stderr, "Could not write %zu bytes to file %s\n", len - done, out_file);
+        break;
+      }
+      done += nbytes;
+    }
+    atomic_fetch_add(&stats.bytes_written, done);
+    if (err == 0 && fd != -1 && (flags & BLK_SYNC) && (err = control_sync(fd)) != 0) {
+      fprintf(stderr, "Could not sync file %s\n", out_file);
+    }
+
+    dbuf_post(&d->state[i], DBUF_EMPTY);
+  }
+
+  if (fd != -1 && close(fd) != 0) {
+    fprintf(stderr, "Writer could not close target file %s\n", out_file);
+    if (err == 0) err = errno;
+  }
+
+  return err;
+}
+
+// Run a copy with a reader thread
+// and the calling thread as writer.
+int dbuf_copy(options_t *o) {
+  dbuf_t *d = (dbuf_t *)calloc(1, sizeof(dbuf_t));
+  if (d == NULL) return ENOMEM;
+
+  d->opts = o;
+  d->count = o->buffers ? o->buffers : DBUF_COUNT;
+  if (d->count < DBUF_MIN) d->count = DBUF_MIN;
+  if (d->count > DBUF_MAX) d->count = DBUF_MAX;
+  d->size = o->block_size ? o->block_size : DBUF_SIZE;
+  for (unsigned int i = 0; i < DBUF_MAX; i++) {
+    atomic_init(&d->state[i], DBUF_EMPTY);
+  }
+
+  if (posix_memalign((void **)&d->slab, BLOCK_ALIGN, d->count * d->size) != 0) {
+    free(d);
+    return ENOMEM;
+  }
+
+  log("Double buffering with %u buffers of %zu bytes\n", d->count, d->size);
+
+  pthread_t reader;
+  if (pthread_create(&reader, NULL, &dbuf_reader, d) != 0) {
+    fprintf(stderr, "Failed to start the reader thread\n");
+    free(d->slab);
+    free(d);
+    return EAGAIN;
+  }
+
+  int err = dbuf_writer(d);
+  pthread_join(reader, NULL);
+  if (err == 0) err = d->status;
+
+  free(d->slab);
+  free(d);
+
+  return err;
+}
@@ -0,0 +1,36 @@
+/**
+ * Double- and triple-buffered copy
+ * engine. A reader thread and a writer
+ * thread pass a small number of large
+ * buffers back and forth, with one
+ * futex handoff per buffer instead of
+ * the per-block mutexes and semaphores
+ * of the shared ring buffer.
+ *
+ * @author Matt Stetter
+ * @file dbuf.h
+ */
+
+#include "options.h"
+
+#ifndef DBUF_H_
+#define DBUF_H_
+
+// Limits on the number of buffers
+// the engine alternates between
+#define DBUF_MIN 2
+#define DBUF_MAX 3
+
+/**
+ * Copy the source to the destination
+ * named in the options. A reader thread
+ * is started to fill the buffers and
+ * the calling thread writes them out.
+ * Returns once the copy has finished.
+ *
+ * @param o options naming the source and destination
+ * @return 0 if successful, errno otherwise
+ */
+int dbuf_copy(options_t *o);
+
+#endif
@@ -0,0 +1,236 @@
+/**
+ * Source implementation of
+ * deadline pacing.
+ *
+ * The pace aims to finish at a target
+ * ahead of the deadline, leaving the
+ * DEADLINE_MARGIN share of the time as
+ * slack. Readers pace themselves with
+ * a virtual clock: every chunk pushes
+ * the earliest start of the next one
+ * out by its size over the needed
+ * rate, and a reader that finds the
+ * clock ahead of real time sleeps the
+ * difference. A copy that falls behind
+ * gets no credit for it, the needed
+ * rate simply rises, and past the
+ * target it runs flat out.
+ *
+ * @author Matt Stetter
+ * @file deadline.c
+ */
+
+#include "cpy.h"
+#include "deadline.h"
+#include "stats.h"
+
+#include <ctype.h>
+#include <linux/ioprio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Pacing state shared by every reader
+static struct {
+  atomic_int active;		// Non-zero once a deadline is set, read without the lock
+  pthread_mutex_t lock;		// Protects everything below
+  double start;			// Time the copy started
+  double end;			// The deadline
+  double target;		// Time the pace aims to finish by
+  unsigned long long total;	// Bytes to read, 0 if unknown
+  double next;			// Earliest start of the next chunk
+  unsigned long long last;	// Bytes read when next was set
+  double slept;			// Wall time some reader spent sleeping
+  double sleep_end;		// End of the latest sleep
+  double share;			// Needed rate over the reachable rate
+  int warned;			// Non-zero once the deadline was at risk
+} pace = { .lock = PTHREAD_MUTEX_INITIALIZER, .share = 1 };
+
+// I/O priority level last set on
+// this thread, -1 if never set
+static _Thread_local int cur_prio = -1;
+
+/**
+ * Read a clock in seconds.
+ *
+ * @param clock CLOCK_* clock to read
+ * @return the time in seconds
+ */
+static double clock_secs(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Parse a duration, a time of day or
+// an epoch time into a monotonic time.
+int deadline_parse(const char *str, struct timespec *at) {
+  double real = clock_secs(CLOCK_REALTIME);
+  double wait;
+  char *end;
+
+  if (str[0] == '@') {
+    long long epoch = strtoll(str + 1, &end, 10);
+    if (end == str + 1 || *end != '\0') return 1;
+    wait = epoch - real;
+  } else if (strchr(str, ':') != NULL) {
+    int h, m, s = 0, n = 0;
+    if (sscanf(str, "%d:%d%n:%d%n", &h, &m, &n, &s, &n) < 2 || str[n] != '\0' ||
+        h < 0 || h > 23 || m < 0 || m > 59 || s < 0 || s > 59) {
+      return 1;
+    }
+    time_t now = (time_t)real;
+    struct tm tm;
+    localtime_r(&now, &tm);
+    tm.tm_hour = h;
+    tm.tm_min = m;
+    tm.tm_sec = s;
+    tm.tm_isdst = -1;
+    wait = (double)mktime(&tm) - real;
+    if (wait <= 0) wait += 24 * 60 * 60;
+  } else {
+    wait = strtod(str, &end);
+    if (end == str || !isdigit((unsigned char)str[0])) return 1;
+    switch (*end) {
+    case 's': end++; break;
+    case 'm': wait *= 60; end++; break;
+    case 'h': wait *= 60 * 60; end++; break;
+    case 'd': wait *= 24 * 60 * 60; end++; break;
+    }
+    if (*end != '\0') return 1;
+  }
+
+  double mono = clock_secs(CLOCK_MONOTONIC) + wait;
+  if (mono <= 0) mono = 1e-9;
+  at->tv_sec = (time_t)mono;
+  at->tv_nsec = (long)((mono - at->tv_sec) * 1e9);
+  return 0;
+}
+
+// Set up the pace for the copy.
+void deadline_start(const struct timespec *at, unsigned long long total) {
+  if (at->tv_sec == 0 && at->tv_nsec == 0) return;
+
+  pthread_mutex_lock(&pace.lock);
+  pace.start = clock_secs(CLOCK_MONOTONIC);
+  pace.end = at->tv_sec + at->tv_nsec / 1e9;
+  pace.target = pace.start + (pace.end - pace.start) / DEADLINE_MARGIN;
+  pace.total = total;
+  pace.next = pace.start;
+  pace.last = 0;
+  pace.slept = 0;
+  pace.sleep_end = 0;
+  pace.share = 1;
+  pace.warned = 0;
+
+  if (pace.end <= pace.start) {
+    fprintf(stderr, "Deadline already passed %.1f s ago\n", pace.start - pace.end);
+    pace.warned = 1;
+  } else if (total == 0) {
+    fprintf(stderr, "Source size unknown, copying flat out and only reporting the deadline\n");
+  }
+  log("Deadline in %.1f s for %llu bytes\n", pace.end - pace.start, total);
+  pthread_mutex_unlock(&pace.lock);
+  atomic_store(&pace.active, 1);
+}
+
+/**
+ * Set the best-effort I/O priority of
+ * the calling thread, 0 being the
+ * highest and 7 the lowest.
+ *
+ * @param level priority level
+ */
+static void set_prio(int level) {
+  if (level == cur_prio) return;
+  cur_prio = level;
+  syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, level));
+  log("Deadline set I/O priority %d\n", level);
+}
+
+// Hold the reader to the pace the
+// deadline needs.
+void deadline_pace(void) {
+  if (!atomic_load(&pace.active)) return;
+
+  pthread_mutex_lock(&pace.lock);
+  double now = clock_secs(CLOCK_MONOTONIC);
+  unsigned long long done = atomic_load(&stats.bytes_read) + atomic_load(&stats.bytes_cached);
+  unsigned long long remaining = pace.total > done ? pace.total - done : 0;
+  double left = pace.end - now;
+
+  // Time spent sleeping does not count
+  // towards the rate the copy can reach
+  double busy = now - pace.start - pace.slept;
+  double reach = 0;
+  if (busy > 0 && (busy >= DEADLINE_WARMUP || done >= DEADLINE_WARMUP_BYTES)) reach = done / busy;
+
+  // The rate needed to reach the target,
+  // negative if there is none to pace to
+  double need = -1;
+  if (pace.total && pace.target > now) need = remaining / (pace.target - now);
+
+  if (!pace.warned && pace.total && reach > 0 && remaining / reach > left) {
+    pace.warned = 1;
+    fprintf(stderr, "Deadline at risk: %.1f MiB/s needed, %.1f MiB/s reached, "
+            "about %.0f s late\n", remaining / (left > 0 ? left : 1) / (1024 * 1024), reach / (1024 * 1024),
+            remaining / reach - left);
+  }
+
+  pace.share = reach > 0 && need >= 0 ? need / reach : 1;
+  if (pace.share > 1) pace.share = 1;
+  set_prio(reach == 0 ? 4 : pace.share > 0.75 ? 0 : pace.share > 0.25 ? 4 : 7);
+
+  double sleep = 0;
+  if (need > 0) {
+    double next = pace.next + (done - pace.last) / need;
+    if (next < now) next = now;
+    sleep = next - now;
+    if (sleep > DEADLINE_MAX_SLEEP) sleep = DEADLINE_MAX_SLEEP;
+    pace.next = now + sleep;
+    pace.last = done;
+
+    // Readers sleeping side by side only
+    // count once towards the time slept
+    double from = now > pace.sleep_end ? now : pace.sleep_end;
+    if (now + sleep > from) {
+      pace.slept += now + sleep - from;
+      pace.sleep_end = now + sleep;
+    }
+  }
+  pthread_mutex_unlock(&pace.lock);
+
+  if (sleep > 0) {
+    struct timespec ts = { (time_t)sleep, (long)((sleep - (time_t)sleep) * 1e9) };
+    nanosleep(&ts, NULL);
+  }
+}
+
+// Read the share under the lock.
+double deadline_share(void) {
+  if (!atomic_load(&pace.active)) return 1;
+  pthread_mutex_lock(&pace.lock);
+  double share = pace.share;
+  pthread_mutex_unlock(&pace.lock);
+  return share;
+}
+
+// Compare the time now with
+// the deadline.
+void deadline_finish(FILE *f, int verbose) {
+  if (!atomic_load(&pace.active)) return;
+
+  pthread_mutex_lock(&pace.lock);
+  double end = pace.end, slept = pace.slept;
+  pthread_mutex_unlock(&pace.lock);
+
+  double now = clock_secs(CLOCK_MONOTONIC);
+  if (now > end) {
+    fprintf(f, "Missed the deadline by %.1f s\n", now - end);
+  } else if (verbose) {
+    fprintf(f, "cpy: finished %.1f s before the deadline, %.1f s spent pacing\n", end - now, slept);
+  }
+}
@@ -0,0 +1,92 @@
+/**
+ * Pacing of a copy that has to finish
+ * by a deadline. The rate needed to
+ * finish in time is worked out from
+ * the bytes left and the time left at
+ * every chunk, and the copy is held to
+ * that rate plus a margin instead of
+ * running flat out. The same ratio of
+ * needed rate to the rate the copy has
+ * shown it can reach sets the I/O
+ * priority and the readahead depth,
+ * so a copy with plenty of slack takes
+ * little of a shared device. A warning
+ * is printed as soon as the deadline
+ * looks out of reach.
+ *
+ * @author Matt Stetter
+ * @file deadline.h
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#ifndef DEADLINE_H_
+#define DEADLINE_H_
+
+// The pace aims to finish in the time
+// to the deadline over this factor, so
+// stalls late in the copy do not miss it
+#define DEADLINE_MARGIN 1.2
+
+// Longest single sleep while pacing
+#define DEADLINE_MAX_SLEEP 0.5
+
+// Time and bytes copied before the
+// reachable rate is trusted
+#define DEADLINE_WARMUP 1.0
+#define DEADLINE_WARMUP_BYTES (16ULL * 1024 * 1024)
+
+/**
+ * Parse a deadline. TIME is either a
+ * duration from now with an s, m, h
+ * or d suffix (90s, 15m, 2h), a time
+ * of day HH:MM or HH:MM:SS (the next
+ * time that clock time comes round),
+ * or @SECONDS since the epoch.
+ *
+ * @param str string to parse
+ * @param at returned deadline on the CLOCK_MONOTONIC clock
+ * @return 0 if successful, 1 otherwise
+ */
+int deadline_parse(const char *str, struct timespec *at);
+
+/**
+ * Start pacing a copy. Does nothing
+ * if at is zero.
+ *
+ * @param at deadline on the CLOCK_MONOTONIC clock
+ * @param total bytes the copy will read, 0 if unknown
+ */
+void deadline_start(const struct timespec *at, unsigned long long total);
+
+/**
+ * Called by readers before each chunk.
+ * Sleeps if the copy is ahead of the
+ * pace the deadline needs, adjusts the
+ * calling thread's I/O priority and
+ * warns once if the deadline cannot be
+ * met at the rate reached so far.
+ */
+void deadline_pace(void);
+
+/**
+ * Get the share of the reachable rate
+ * the deadline needs, used to size the
+ * readahead depth.
+ *
+ * @return share between 0 and 1, 1 without a deadline
+ */
+double deadline_share(void);
+
+/**
+ * Report how the copy did against
+ * its deadline. A missed deadline is
+ * always reported.
+ *
+ * @param f stream to print to
+ * @param verbose non-zero to also report a met deadline
+ */
+void deadline_finish(FILE *f, int verbose);
+
+#endif
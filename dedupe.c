@@ -0,0 +1,206 @@
+/**
+ * Source implementation of the
+ * post-copy deduplication.
+ *
+ * @author Matt Stetter
+ * @file dedupe.c
+ */
+
+#include "cpy.h"
+#include "dedupe.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+// Multipliers of the chunk digest's
+// rounds, taken from xxHash64
+#define PRIME1 0x9e3779b185ebca87ULL
+#define PRIME2 0xc2b2ae3d27d4eb4fULL
+
+/**
+ * Rotate a word left.
+ *
+ * @param x the word
+ * @param r bits to rotate by
+ * @return the rotated word
+ */
+static unsigned long long rotl(unsigned long long x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+/**
+ * Scramble a word so every input bit
+ * reaches every output bit (the
+ * splitmix64 finalizer).
+ *
+ * @param x the word
+ * @return the scrambled word
+ */
+static unsigned long long scramble(unsigned long long x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+// Digest a chunk four words at a time
+// in four independent lanes, seeded by
+// the chunk's offset so the same data
+// elsewhere in a file adds up differently.
+unsigned long long dedupe_chunk(off_t off, const void *data, size_t len) {
+  const unsigned char *p = (const unsigned char *)data;
+  unsigned long long seed = scramble((unsigned long long)off);
+  unsigned long long lane[4] = { seed + PRIME1, seed + PRIME2, seed, seed - PRIME1 };
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    for (int l = 0; l < 4; l++) {
+      uint64_t w;
+      memcpy(&w, p + i + 8 * l, sizeof(w));
+      lane[l] = rotl(lane[l] + w * PRIME2, 31) * PRIME1;
+    }
+  }
+  unsigned long long h = rotl(lane[0], 1) + rotl(lane[1], 7) + rotl(lane[2], 12) + rotl(lane[3], 18);
+  for (; i < len; i++) h = rotl(h ^ (p[i] * PRIME1), 11) * PRIME2;
+  return scramble(h ^ len);
+}
+
+/**
+ * Order copies by size and then by
+ * digest, so duplicates sit together.
+ *
+ * @param a first dedupe_file_t
+ * @param b second dedupe_file_t
+ * @return negative, 0 or positive as for qsort
+ */
+static int compare_files(const void *a, const void *b) {
+  const dedupe_file_t *x = (const dedupe_file_t *)a;
+  const dedupe_file_t *y = (const dedupe_file_t *)b;
+  if (x->size != y->size) return x->size < y->size ? -1 : 1;
+  if (x->digest != y->digest) return x->digest < y->digest ? -1 : 1;
+  return 0;
+}
+
+/**
+ * Point some copies at the extents of
+ * the kept one, DEDUPE_STEP bytes per
+ * call. A copy whose data turns out
+ * to differ is left alone from then on.
+ *
+ * @param r range request with room for n copies
+ * @param src descriptor of the kept copy
+ * @param files the copies to share it with
+ * @param fds their descriptors, -1 for those left alone
+ * @param n number of copies
+ * @param size bytes in each copy
+ * @return 0 if successful, errno if extents cannot be shared at all
+ */
+static int dedupe_batch(struct file_dedupe_range *r, int src, dedupe_file_t *files, int *fds,
+                        unsigned int n, off_t size) {
+  unsigned long long shared[DEDUPE_BATCH] = { 0 };
+  unsigned int slot[DEDUPE_BATCH];
+  for (off_t off = 0; off < size; off += DEDUPE_STEP) {
+    memset(r, 0, sizeof(*r) + n * sizeof(r->info[0]));
+    r->src_offset = (unsigned long long)off;
+    r->src_length = (unsigned long long)(size - off < DEDUPE_STEP ? size - off : DEDUPE_STEP);
+    for (unsigned int i = 0; i < n; i++) {
+      if (fds[i] == -1) continue;
+      r->info[r->dest_count].dest_fd = fds[i];
+      r->info[r->dest_count].dest_offset = (unsigned long long)off;
+      slot[r->dest_count++] = i;
+    }
+    if (r->dest_count == 0) break;
+    if (ioctl(src, FIDEDUPERANGE, r) == -1) return errno;
+
+    for (unsigned int d = 0; d < r->dest_count; d++) {
+      unsigned int i = slot[d];
+      int status = r->info[d].status;
+      if (status == FILE_DEDUPE_RANGE_SAME) {
+        shared[i] += r->info[d].bytes_deduped;
+        continue;
+      }
+      if (status != FILE_DEDUPE_RANGE_DIFFERS) {
+        fprintf(stderr, "Could not share the extents of %s: %s\n", files[i].path, strerror(-status));
+      }
+      log("Dedupe leaving %s alone\n", files[i].path);
+      close(fds[i]);
+      fds[i] = -1;
+    }
+  }
+
+  for (unsigned int i = 0; i < n; i++) {
+    if (fds[i] == -1) continue;
+    atomic_fetch_add(&stats.dedupe_files, 1);
+    atomic_fetch_add(&stats.dedupe_bytes, shared[i]);
+  }
+  return 0;
+}
+
+/**
+ * Share the extents of the first copy of
+ * a group with the others, DEDUPE_BATCH
+ * copies at a time.
+ *
+ * @param files the group, all of one size and digest
+ * @param n number of copies in the group
+ * @return 0 if successful, errno if extents cannot be shared at all
+ */
+static int dedupe_group(dedupe_file_t *files, unsigned int n) {
+  int src = open(files[0].path, O_RDONLY);
+  if (src == -1) {
+    fprintf(stderr, "Could not open %s to share its extents: %s\n", files[0].path, strerror(errno));
+    return 0;
+  }
+  struct file_dedupe_range *r = (struct file_dedupe_range *)malloc(
+      sizeof(*r) + DEDUPE_BATCH * sizeof(r->info[0]));
+  if (r == NULL) {
+    close(src);
+    return ENOMEM;
+  }
+
+  int err = 0;
+  for (unsigned int i = 1; i < n && err == 0; i += DEDUPE_BATCH) {
+    unsigned int count = n - i < DEDUPE_BATCH ? n - i : DEDUPE_BATCH;
+    int fds[DEDUPE_BATCH];
+    for (unsigned int k = 0; k < count; k++) {
+      if ((fds[k] = open(files[i + k].path, O_WRONLY)) == -1) {
+        fprintf(stderr, "Could not open %s to share its extents: %s\n", files[i + k].path,
+                strerror(errno));
+      }
+    }
+    log("Dedupe sharing %s with %u copies\n", files[0].path, count);
+    err = dedupe_batch(r, src, files + i, fds, count, files[0].size);
+    for (unsigned int k = 0; k < count; k++) {
+      if (fds[k] != -1) close(fds[k]);
+    }
+  }
+
+  free(r);
+  close(src);
+  return err;
+}
+
+// Group the copies and share the
+// extents of each group.
+int dedupe_run(dedupe_file_t *files, unsigned int n) {
+  qsort(files, n, sizeof(dedupe_file_t), &compare_files);
+  for (unsigned int i = 0; i < n;) {
+    unsigned int end = i + 1;
+    while (end < n && compare_files(&files[i], &files[end]) == 0) end++;
+    int err = end - i > 1 && files[i].size >= DEDUPE_MIN ? dedupe_group(files + i, end - i) : 0;
+    if (err != 0) {
+      fprintf(stderr, "Could not deduplicate the copies: %s\n", strerror(err));
+      return err;
+    }
+    i = end;
+  }
+  return 0;
+}
@@ -0,0 +1,56 @@
+/**
+ * Sharing the extents of identical files
+ * once a copy into a directory is done.
+ * The pipeline's writers fold each chunk
+ * they write into a digest of its file,
+ * so finding the duplicates reads nothing
+ * back. Copies of the same size and
+ * digest are handed to FIDEDUPERANGE,
+ * which compares the data itself before
+ * sharing it, so a digest that collides
+ * only costs a wasted call.
+ *
+ * @author Matt Stetter
+ * @file dedupe.h
+ */
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifndef DEDUPE_H_
+#define DEDUPE_H_
+
+// A file copied into the destination
+typedef struct dedupe_file {
+  const char *path;	// Path of the copy
+  off_t size;		// Bytes in the copy
+  unsigned long long digest; // Sum of dedupe_chunk over its chunks
+} dedupe_file_t;
+
+/**
+ * Digest one chunk of a file. The digests
+ * of a file's chunks are added up, so
+ * writers may fold them in in any order.
+ *
+ * @param off offset of the chunk in the file
+ * @param data the chunk
+ * @param len bytes in the chunk
+ * @return the chunk's share of the file's digest
+ */
+unsigned long long dedupe_chunk(off_t off, const void *data, size_t len);
+
+/**
+ * Share the extents of every group of
+ * files with the same size and digest.
+ * The first file of a group is kept and
+ * the others are pointed at its extents.
+ * Failures are reported and leave the
+ * files as copied.
+ *
+ * @param files the copies, sorted in place
+ * @param n number of copies
+ * @return 0 if successful, errno if the destination cannot share extents
+ */
+int dedupe_run(dedupe_file_t *files, unsigned int n);
+
+#endif
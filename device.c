@@ -0,0 +1,193 @@
+/**
+ * Source implementation of the
+ * helpers used to open and probe
+ * regular files and block devices.
+ *
+ * @author Matt Stetter
+ * @file device.c
+ */
+
+#include "cpy.h"
+#include "device.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+// Probe an open file for its type,
+// size and sector sizes.
+int dev_probe(int fd, dev_info_t *info) {
+  struct stat st;
+  if (fstat(fd, &st) != 0) return errno;
+
+  info->is_blk = S_ISBLK(st.st_mode);
+  info->is_reg = S_ISREG(st.st_mode);
+  info->direct = (fcntl(fd, F_GETFL) & O_DIRECT) != 0;
+  info->size = S_ISREG(st.st_mode) ? st.st_size : -1;
+  info->lbs = 512;
+  info->pbs = 512;
+
+  if (!info->is_blk) return 0;
+
+  // Block devices always report a size
+  // of 0 from fstat, so ask the driver
+  uint64_t size;
+  int lbs;
+  unsigned int pbs;
+  if (ioctl(fd, BLKGETSIZE64, &size) != 0) return errno;
+  if (ioctl(fd, BLKSSZGET, &lbs) != 0) return errno;
+  if (ioctl(fd, BLKPBSZGET, &pbs) != 0) return errno;
+  info->size = (off_t)size;
+  info->lbs = (unsigned int)lbs;
+  info->pbs = pbs;
+
+  log("Block device has %lld bytes, logical sector %u, physical sector %u\n",
+      (long long)info->size, info->lbs, info->pbs);
+
+  return 0;
+}
+
+/**
+ * Open a file with the given flags,
+ * retrying without O_DIRECT if the
+ * file system does not support it,
+ * and probe the result.
+ *
+ * @param path file to open
+ * @param flags open flags without O_DIRECT
+ * @param direct non-zero to request O_DIRECT
+ * @param info struct to fill in
+ * @return file descriptor, -1 on failure
+ */
+static int dev_open(const char *path, int flags, int direct, dev_info_t *info) {
+  int fd = -1;
+  if (direct) {
+    fd = open(path, flags | O_DIRECT, 0600);
+    if (fd == -1 && errno != EINVAL) return -1;
+    if (fd == -1) {
+      fprintf(stderr, "O_DIRECT is not supported for %s, using buffered I/O\n", path);
+    }
+  }
+  if (fd == -1 && (fd = open(path, flags, 0600)) == -1) return -1;
+
+  int err;
+  if ((err = dev_probe(fd, info)) != 0) {
+    close(fd);
+    errno = err;
+    return -1;
+  }
+
+  // The buffer blocks are only aligned
+  // to BLOCK_ALIGN, so devices with larger
+  // sectors have to go through the page cache
+  if (info->direct && info->lbs > BLOCK_ALIGN) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+    info->direct = 0;
+  }
+
+  return fd;
+}
+
+// Open the source file or device.
+int dev_open_src(const char *path, int direct, dev_info_t *info) {
+  return dev_open(path, O_RDONLY, direct, info);
+}
+
+// Open the destination file or device.
+// Truncating or creating a device node
+// makes no sense, so existing block
+// devices are written in place.
+int dev_open_dst(const char *path, int direct, dev_info_t *info) {
+  struct stat st;
+  int flags = O_WRONLY | O_CREAT | O_TRUNC;
+  if (stat(path, &st) == 0 && S_ISBLK(st.st_mode)) {
+    flags = O_WRONLY;
+  }
+  return dev_open(path, flags, direct, info);
+}
+
+// Open and size a mapped destination.
+// Running out of space under a mapping
+// raises SIGBUS rather than failing a
+// write, so a file system that cannot
+// reserve the blocks is only told the
+// size.
+int dev_open_map(const char *path, off_t size, dev_info_t *info) {
+  int fd = dev_open(path, O_RDWR | O_CREAT | O_TRUNC, 0, info);
+  if (fd == -1) return -1;
+
+  int err = 0;
+  if (!info->is_reg) err = EINVAL;
+  else if (ftruncate(fd, size) != 0) err = errno;
+  else if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) != 0 && errno != EOPNOTSUPP) err = errno;
+  if (err != 0) {
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+
+// Zero out, punch or discard a range
+// of a file or block device.
+int dev_zero_range(int fd, dev_info_t *info, off_t off, off_t len, int discard) {
+  if (info->is_blk) {
+    uint64_t range[2] = { (uint64_t)off, (uint64_t)len };
+    if (ioctl(fd, discard ? BLKDISCARD : BLKZEROOUT, range) != 0) return errno;
+    return 0;
+  }
+
+  if (!info->is_reg) return EOPNOTSUPP;
+
+  // Punching keeps the file size and
+  // frees the blocks, zeroing the range
+  // works on file systems without holes
+  if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len) == 0) return 0;
+  if (fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, off, len) == 0) return 0;
+  return errno;
+}
+
+// Read the rotational attribute of
+// the disk holding a file.
+int dev_rotational(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) != 0) return 0;
+  return dev_rotational_id(S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev);
+}
+
+// Read queue/rotational of a device.
+// Partitions have no queue directory
+// of their own, so the parent disk
+// is tried too.
+int dev_rotational_id(dev_t dev) {
+  char path[128];
+  const char *attrs[] = { "queue/rotational", "../queue/rotational" };
+  for (int i = 0; i < 2; i++) {
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%s",
+             major(dev), minor(dev), attrs[i]);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) continue;
+    int rot = fgetc(f) == '1';
+    fclose(f);
+    return rot;
+  }
+  return 0;
+}
+
+// Check for an all-zero buffer by
+// comparing it against itself shifted
+// by one byte once the first byte
+// is known to be zero.
+int dev_is_zero(const char *buf, size_t len) {
+  if (len == 0) return 1;
+  if (buf[0] != 0) return 0;
+  return memcmp(buf, buf + 1, len - 1) == 0;
+}
@@ -0,0 +1,134 @@
+/**
+ * Helpers for opening the two ends of
+ * a copy and discovering what kind of
+ * file they are. Block devices report
+ * their size and sector sizes through
+ * ioctls instead of fstat.
+ *
+ * @author Matt Stetter
+ * @file device.h
+ */
+
+#include <sys/types.h>
+
+#ifndef DEVICE_H_
+#define DEVICE_H_
+
+// Information about an open file
+// that the producer and consumer
+// use to size and align their I/O.
+typedef struct dev_info {
+  int is_blk;		// Non-zero if the file is a block device
+  int is_reg;		// Non-zero if the file is a regular file
+  int direct;		// Non-zero if the file was opened with O_DIRECT
+  off_t size;		// Size in bytes, -1 if unknown (pipes, ttys)
+  unsigned int lbs;	// Logical sector size, the O_DIRECT alignment
+  unsigned int pbs;	// Physical sector size, the optimal alignment
+} dev_info_t;
+
+/**
+ * Fill in the dev_info_t struct
+ * for an already open file. For block
+ * devices the size comes from BLKGETSIZE64
+ * and the sector sizes from BLKSSZGET
+ * and BLKPBSZGET.
+ *
+ * @param fd open file descriptor
+ * @param info struct to fill in
+ * @return 0 if successful, errno otherwise
+ */
+int dev_probe(int fd, dev_info_t *info);
+
+/**
+ * Open the source of a copy for reading,
+ * optionally with O_DIRECT. If the file
+ * system refuses O_DIRECT the file is
+ * opened buffered instead.
+ *
+ * @param path file or device to read from
+ * @param direct non-zero to request O_DIRECT
+ * @param info struct filled in with the file's information
+ * @return file descriptor, -1 on failure with errno set
+ */
+int dev_open_src(const char *path, int direct, dev_info_t *info);
+
+/**
+ * Open the destination of a copy for
+ * writing. Regular files are created and
+ * truncated, block devices are opened
+ * in place without truncation.
+ *
+ * @param path file or device to write to
+ * @param direct non-zero to request O_DIRECT
+ * @param info struct filled in with the file's information
+ * @return file descriptor, -1 on failure with errno set
+ */
+int dev_open_dst(const char *path, int direct, dev_info_t *info);
+
+/**
+ * Open a regular destination file to be
+ * written through a shared mapping. The
+ * file is created or truncated, opened
+ * for reading too as mmap needs, set to
+ * its final size with ftruncate and, if
+ * the file system can, has its blocks
+ * reserved so stores into the mapping
+ * cannot fault for want of space.
+ *
+ * @param path file to write to
+ * @param size final size of the file
+ * @param info struct filled in with the file's information
+ * @return file descriptor, -1 on failure with errno set
+ */
+int dev_open_map(const char *path, off_t size, dev_info_t *info);
+
+/**
+ * Make a range of a file or block device
+ * read back as zeros without writing zero
+ * pages. Regular files get the range
+ * punched out with fallocate, falling back
+ * to FALLOC_FL_ZERO_RANGE. Block devices
+ * use BLKZEROOUT or, if discard is set,
+ * BLKDISCARD.
+ *
+ * @param fd open file or block device
+ * @param info information about the file from dev_probe
+ * @param off start of the range (sector aligned for devices)
+ * @param len length of the range (sector aligned for devices)
+ * @param discard non-zero to discard instead of zero out devices
+ * @return 0 if successful, errno otherwise
+ */
+int dev_zero_range(int fd, dev_info_t *info, off_t off, off_t len, int discard);
+
+/**
+ * Check whether the device holding
+ * an open file is rotational, using
+ * the queue/rotational attribute of
+ * the disk in sysfs.
+ *
+ * @param fd open file or block device
+ * @return 1 if rotational, 0 if not or unknown
+ */
+int dev_rotational(int fd);
+
+/**
+ * Check whether a device is
+ * rotational by its number, as in
+ * st_dev of the files it holds.
+ *
+ * @param dev the device
+ * @return 1 if rotational, 0 if not or unknown
+ */
+int dev_rotational_id(dev_t dev);
+
+/**
+ * Check whether a buffer contains
+ * only zero bytes.
+ *
+ * @param buf buffer to check
+ * @param len number of bytes in the buffer
+ * @return non-zero if every byte is zero
+ */
+int dev_is_zero(const char *buf, size_t len);
+
+#endif
@@ -0,0 +1,511 @@
+/**
+ * Source implementation of the
+ * erasure-coded copies.
+ *
+ * @author Matt Stetter
+ * @file ec.c
+ */
+
+#include "backend.h"
+#include "control.h"
+#include "cpy.h"
+#include "deadline.h"
+#include "ec.h"
+#include "gf.h"
+#include "hash.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Start of every shard's header
+static const char ec_magic[8] = { 'C', 'P', 'Y', 'E', 'C', 0, 0, 1 };
+
+// Header of a shard
+typedef struct ec_header {
+  unsigned int k;	// Data units in a stripe
+  unsigned int m;	// Parity units in a stripe
+  unsigned int index;	// Place of the shard, data shards first
+  unsigned int unit;	// Bytes in a unit
+  off_t size;		// Size of the source
+} ec_header_t;
+
+// State of an encoding
+typedef struct ec {
+  unsigned int k;	// Data units in a stripe
+  unsigned int m;	// Parity units in a stripe
+  uint8_t coef[EC_MAX * EC_MAX]; // Parity rows of the code, m by k
+  off_t size;		// Size of the source
+  backend_t dst[EC_MAX]; // One destination per shard
+  uint8_t *slab;	// EC_DEPTH stripes of k+m units
+  unsigned int pending[EC_DEPTH]; // Shards still to write each stripe
+  unsigned long long stripes; // Stripes encoded so far
+  int eof;		// Non-zero once every stripe is encoded
+  int status;		// 0, or the error that failed the copy
+  unsigned int started;	// Writers that picked their shard
+  pthread_mutex_t lock;	// Protects everything from pending on
+  pthread_cond_t cond;	// Signalled when a stripe is encoded or written
+} ec_t;
+
+/**
+ * Store an integer little-endian.
+ *
+ * @param p where to store it
+ * @param v the integer
+ * @param len bytes to store
+ */
+static void put_le(uint8_t *p, unsigned long long v, int len) {
+  for (int i = 0; i < len; i++) p[i] = (uint8_t)(v >> (8 * i));
+}
+
+/**
+ * Load a little-endian integer.
+ *
+ * @param p where it is stored
+ * @param len bytes stored
+ * @return the integer
+ */
+static unsigned long long get_le(const uint8_t *p, int len) {
+  unsigned long long v = 0;
+  for (int i = len - 1; i >= 0; i--) v = v << 8 | p[i];
+  return v;
+}
+
+/**
+ * Lay out a shard's header: the magic,
+ * k, m, index and unit as 32 bit and the
+ * size as 64 bit integers, then the
+ * CRC32C of those 32 bytes.
+ *
+ * @param h the header
+ * @param buf EC_HEADER bytes to fill
+ */
+static void header_pack(const ec_header_t *h, uint8_t *buf) {
+  memset(buf, 0, EC_HEADER);
+  memcpy(buf, ec_magic, sizeof(ec_magic));
+  put_le(buf + 8, h->k, 4);
+  put_le(buf + 12, h->m, 4);
+  put_le(buf + 16, h->index, 4);
+  put_le(buf + 20, h->unit, 4);
+  put_le(buf + 24, (unsigned long long)h->size, 8);
+  put_le(buf + 32, crc32c(0, buf, 32), 4);
+}
+
+/**
+ * Read back a shard's header.
+ *
+ * @param buf the EC_HEADER bytes
+ * @param h returned header
+ * @return 0 if successful, EINVAL if the bytes are not a valid header
+ */
+static int header_unpack(const uint8_t *buf, ec_header_t *h) {
+  if (memcmp(buf, ec_magic, sizeof(ec_magic)) != 0) return EINVAL;
+  if (get_le(buf + 32, 4) != crc32c(0, buf, 32)) return EINVAL;
+  h->k = (unsigned int)get_le(buf + 8, 4);
+  h->m = (unsigned int)get_le(buf + 12, 4);
+  h->index = (unsigned int)get_le(buf + 16, 4);
+  h->unit = (unsigned int)get_le(buf + 20, 4);
+  h->size = (off_t)get_le(buf + 24, 8);
+  if (h->k == 0 || h->k + h->m > EC_MAX || h->index >= h->k + h->m || h->unit == 0) return EINVAL;
+  return h->size < 0 ? EINVAL : 0;
+}
+
+/**
+ * Fill in the parity rows of the code.
+ * Entry (j, i) is 1 / (x_j + y_i) with
+ * x_j = j and y_i = m + i, a Cauchy
+ * matrix, so any k rows of the identity
+ * stacked on it can be inverted.
+ *
+ * @param k data units in a stripe
+ * @param m parity units in a stripe
+ * @param coef returned m by k matrix
+ */
+static void cauchy_rows(unsigned int k, unsigned int m, uint8_t *coef) {
+  for (unsigned int j = 0; j < m; j++) {
+    for (unsigned int i = 0; i < k; i++) coef[j * k + i] = gf_div(1, (uint8_t)(j ^ (m + i)));
+  }
+}
+
+/**
+ * Read until a buffer is full or the
+ * source ends.
+ *
+ * @param b the open source
+ * @param buf buffer to read into
+ * @param len bytes wanted
+ * @param got returned number of bytes read
+ * @return 0 if successful, errno otherwise
+ */
+static int read_full(backend_t *b, void *buf, size_t len, size_t *got) {
+  *got = 0;
+  while (*got < len) {
+    ssize_t n = backend_read(b, (char *)buf + *got, len - *got, -1);
+    if (n == -1) return errno;
+    if (n == 0) break;
+    *got += n;
+  }
+  return 0;
+}
+
+/**
+ * Thread target writing one shard: its
+ * header, then its unit of every stripe
+ * as the stripes are encoded.
+ *
+ * @param args the ec_t struct
+ * @return NULL
+ */
+static void *writer_target(void *args) {
+  ec_t *e = (ec_t *)args;
+  unsigned int n = e->k + e->m;
+  pthread_mutex_lock(&e->lock);
+  unsigned int i = e->started++;
+  pthread_mutex_unlock(&e->lock);
+
+  // The header is aligned like the
+  // units for O_DIRECT shards
+  backend_t *b = &e->dst[i];
+  uint8_t *hdr;
+  ec_header_t h = { e->k, e->m, i, EC_UNIT, e->size };
+  int err = posix_memalign((void **)&hdr, BLOCK_ALIGN, EC_HEADER);
+  if (err == 0) {
+    header_pack(&h, hdr);
+    err = backend_write(b, hdr, EC_HEADER, -1);
+    free(hdr);
+  }
+
+  for (unsigned long long s = 0; err == 0; s++) {
+    pthread_mutex_lock(&e->lock);
+    while (e->status == 0 && s >= e->stripes && !e->eof) pthread_cond_wait(&e->cond, &e->lock);
+    int stop = e->status != 0 || s >= e->stripes;
+    pthread_mutex_unlock(&e->lock);
+    if (stop) break;
+
+    uint8_t *unit = e->slab + ((s % EC_DEPTH) * n + i) * EC_UNIT;
+    if ((err = backend_write(b, unit, EC_UNIT, -1)) == 0) atomic_fetch_add(&stats.bytes_written, EC_UNIT);
+
+    pthread_mutex_lock(&e->lock);
+    e->pending[s % EC_DEPTH]--;
+    pthread_cond_broadcast(&e->cond);
+    pthread_mutex_unlock(&e->lock);
+  }
+  if (err == 0 && e->status == 0) err = backend_sync(b);
+
+  if (err != 0) {
+    fprintf(stderr, "Could not write shard %u to %s: %s\n", i, b->path, strerror(err));
+    pthread_mutex_lock(&e->lock);
+    if (e->status == 0) e->status = err;
+    pthread_cond_broadcast(&e->cond);
+    pthread_mutex_unlock(&e->lock);
+  }
+  return NULL;
+}
+
+/**
+ * Read the source a stripe at a time
+ * into the free slot of the slab,
+ * encode its parity units and hand the
+ * stripe to the writers.
+ *
+ * @param e the encoding
+ * @param src the open source
+ * @return 0 if successful, errno otherwise
+ */
+static int encode_stripes(ec_t *e, backend_t *src) {
+  unsigned int n = e->k + e->m;
+  size_t data = (size_t)e->k * EC_UNIT;
+  off_t off = 0;
+  int err = 0;
+  for (unsigned long long s = 0; err == 0 && off < e->size; s++) {
+    deadline_pace();
+
+    // A pause or cancel waits for the
+    // writers to catch up first
+    pthread_mutex_lock(&e->lock);
+    unsigned int busy = 0;
+    for (unsigned int d = 0; d < EC_DEPTH; d++) busy += e->pending[d];
+    while (e->status == 0 && (e->pending[s % EC_DEPTH] > 0 ||
+                              (busy > 0 && control_state() != CONTROL_RUNNING))) {
+      pthread_cond_wait(&e->cond, &e->lock);
+      busy = 0;
+      for (unsigned int d = 0; d < EC_DEPTH; d++) busy += e->pending[d];
+    }
+    err = e->status;
+    pthread_mutex_unlock(&e->lock);
+    if (err == 0 && control_state() != CONTROL_RUNNING) err = control_checkpoint();
+    if (err != 0) break;
+
+    // O_DIRECT reads are rounded up to
+    // whole sectors, the slot has room
+    uint8_t *stripe = e->slab + (s % EC_DEPTH) * n * EC_UNIT;
+    size_t want = e->size - off < (off_t)data ? (size_t)(e->size - off) : data;
+    size_t asked = src->info.direct ? (want + src->info.lbs - 1) / src->info.lbs * src->info.lbs : want;
+    size_t got;
+    if ((err = read_full(src, stripe, asked < data ? asked : data, &got)) == 0 && got < want) err = EIO;
+    if (err != 0) {
+      fprintf(stderr, "Could not read %s at offset %lld: %s\n", src->path, (long long)off, strerror(err));
+      break;
+    }
+    atomic_fetch_add(&stats.bytes_read, want);
+    memset(stripe + want, 0, data - want);
+
+    for (unsigned int j = 0; j < e->m; j++) {
+      uint8_t *parity = stripe + (e->k + j) * EC_UNIT;
+      memset(parity, 0, EC_UNIT);
+      for (unsigned int i = 0; i < e->k; i++) {
+        gf_mul_add(parity, stripe + i * EC_UNIT, e->coef[j * e->k + i], EC_UNIT);
+      }
+    }
+    atomic_fetch_add(&stats.ec_stripes, 1);
+
+    pthread_mutex_lock(&e->lock);
+    e->pending[s % EC_DEPTH] = n;
+    e->stripes = s + 1;
+    pthread_cond_broadcast(&e->cond);
+    pthread_mutex_unlock(&e->lock);
+    off += want;
+  }
+
+  pthread_mutex_lock(&e->lock);
+  if (err != 0 && e->status == 0) e->status = err;
+  e->eof = 1;
+  pthread_cond_broadcast(&e->cond);
+  pthread_mutex_unlock(&e->lock);
+  return err;
+}
+
+/**
+ * Encode the source into k+m shards,
+ * one per destination.
+ *
+ * @param o the parsed options
+ * @return 0 if successful, errno otherwise
+ */
+static int ec_encode(options_t *o) {
+  ec_t *e = (ec_t *)calloc(1, sizeof(ec_t));
+  if (e == NULL) return ENOMEM;
+  unsigned int n = o->ec_data + o->ec_parity;
+  e->k = o->ec_data;
+  e->m = o->ec_parity;
+  cauchy_rows(e->k, e->m, e->coef);
+  pthread_mutex_init(&e->lock, NULL);
+  pthread_cond_init(&e->cond, NULL);
+
+  backend_t src;
+  int err = backend_open(&src, o->src, BE_READ, o->direct);
+  int src_opened = err == 0;
+  if (err != 0) {
+    fprintf(stderr, "Could not open %s: %s\n", o->src, strerror(err));
+  } else if ((e->size = src.info.size) < 0) {
+    fprintf(stderr, "Erasure coding needs a source of known size: %s\n", o->src);
+    err = EINVAL;
+  } else if (posix_memalign((void **)&e->slab, BLOCK_ALIGN, (size_t)EC_DEPTH * n * EC_UNIT) != 0) {
+    err = ENOMEM;
+  }
+
+  unsigned int opened = 0;
+  for (; err == 0 && opened < n; opened++) {
+    if ((err = backend_open(&e->dst[opened], o->dsts[opened], BE_WRITE, o->direct)) != 0) {
+      fprintf(stderr, "Could not open shard %u at %s: %s\n", opened, o->dsts[opened], strerror(err));
+      break;
+    }
+  }
+
+  pthread_t threads[EC_MAX];
+  unsigned int num_threads = 0;
+  for (; err == 0 && num_threads < n; num_threads++) {
+    if ((err = pthread_create(&threads[num_threads], NULL, &writer_target, e)) != 0) break;
+  }
+  if (err == 0) {
+    deadline_start(&o->deadline, (unsigned long long)e->size);
+    log("Encoding %s into %u+%u shards with the %s kernel\n", o->src, e->k, e->m, gf_kernel());
+  }
+
+  // Writers already started are stopped
+  // if the others could not be
+  int enc = err == 0 ? encode_stripes(e, &src) : err;
+  if (err != 0) {
+    pthread_mutex_lock(&e->lock);
+    e->status = err;
+    e->eof = 1;
+    pthread_cond_broadcast(&e->cond);
+    pthread_mutex_unlock(&e->lock);
+  }
+  for (unsigned int i = 0; i < num_threads; i++) pthread_join(threads[i], NULL);
+  err = enc != 0 ? enc : e->status;
+
+  for (unsigned int i = 0; i < opened; i++) {
+    if (backend_close(&e->dst[i], err != 0) != 0) {
+      fprintf(stderr, "Could not close shard %u at %s\n", i, o->dsts[i]);
+    }
+  }
+  if (src_opened) backend_close(&src, err != 0);
+
+  stats.ec_data = e->k;
+  stats.ec_parity = e->m;
+  stats.ec_kernel = gf_kernel();
+  pthread_mutex_destroy(&e->lock);
+  pthread_cond_destroy(&e->cond);
+  free(e->slab);
+  free(e);
+  return err;
+}
+
+/**
+ * Open the shards given as sources,
+ * keeping those with a valid header that
+ * agrees with the first and dropping
+ * duplicates.
+ *
+ * @param o the parsed options
+ * @param shards returned shards, indexed by their place in the code
+ * @param have returned non-zero entries for the shards kept
+ * @param h returned header of the first valid shard
+ * @return number of shards kept
+ */
+static unsigned int open_shards(options_t *o, backend_t *shards, int *have, ec_header_t *h) {
+  uint8_t hdr[EC_HEADER];
+  unsigned int count = 0;
+  for (unsigned int i = 0; i < o->nsrcs; i++) {
+    backend_t b;
+    ec_header_t sh;
+    size_t got;
+    int err = backend_open(&b, o->srcs[i], BE_READ, 0);
+    if (err != 0) {
+      fprintf(stderr, "Could not open shard %s: %s\n", o->srcs[i], strerror(err));
+      continue;
+    }
+    if ((err = read_full(&b, hdr, EC_HEADER, &got)) == 0 && (got < EC_HEADER || header_unpack(hdr, &sh) != 0)) {
+      err = EINVAL;
+    }
+    if (err == 0 && count > 0 && (sh.k != h->k || sh.m != h->m || sh.unit != h->unit || sh.size != h->size)) {
+      err = ESTALE;
+    }
+    if (err == 0 && have[sh.index]) err = EEXIST;
+    if (err != 0) {
+      fprintf(stderr, "Not using shard %s: %s\n", o->srcs[i],
+              err == EINVAL ? "no valid header" : err == ESTALE ? "from another encoding" :
+              err == EEXIST ? "duplicate" : strerror(err));
+      backend_close(&b, 1);
+      continue;
+    }
+    if (count++ == 0) *h = sh;
+    shards[sh.index] = b;
+    have[sh.index] = 1;
+  }
+  return count;
+}
+
+/**
+ * Rebuild the source from any k of its
+ * shards. Data shards are used first,
+ * their units copied as they are, and
+ * the missing data units are computed
+ * from the parity shards through the
+ * inverse of the code's rows for the
+ * shards used.
+ *
+ * @param o the parsed options
+ * @return 0 if successful, errno otherwise
+ */
+static int ec_rebuild(options_t *o) {
+  backend_t shards[EC_MAX];
+  int have[EC_MAX] = { 0 };
+  ec_header_t h;
+  unsigned int count = open_shards(o, shards, have, &h);
+  if (count == 0 || count < h.k) {
+    fprintf(stderr, "Only %u shards could be used, %u are needed\n", count, count ? h.k : 1);
+    for (unsigned int i = 0; i < EC_MAX; i++) {
+      if (have[i]) backend_close(&shards[i], 1);
+    }
+    return EIO;
+  }
+
+  // Pick k shards, data shards first,
+  // and invert their rows of the code
+  unsigned int k = h.k, use[EC_MAX], nuse = 0;
+  uint8_t coef[EC_MAX * EC_MAX], inv[EC_MAX * EC_MAX];
+  cauchy_rows(k, h.m, coef);
+  memset(inv, 0, sizeof(inv));
+  for (unsigned int i = 0; i < h.k + h.m && nuse < k; i++) {
+    if (!have[i]) continue;
+    if (i < k) inv[nuse * k + i] = 1;
+    else memcpy(&inv[nuse * k], &coef[(i - k) * k], k);
+    use[nuse++] = i;
+  }
+  int err = gf_invert(inv, k);
+
+  backend_t dst;
+  uint8_t *out = NULL, *par = NULL;
+  if (err == 0 && (err = backend_open(&dst, o->dst, BE_WRITE, 0)) != 0) {
+    fprintf(stderr, "Could not open %s: %s\n", o->dst, strerror(err));
+  }
+  int opened = err == 0;
+  if (err == 0 && (posix_memalign((void **)&out, BLOCK_ALIGN, (size_t)k * h.unit) != 0 ||
+                   posix_memalign((void **)&par, BLOCK_ALIGN, (size_t)k * h.unit) != 0)) {
+    err = ENOMEM;
+  }
+  if (err == 0) {
+    deadline_start(&o->deadline, (unsigned long long)h.size);
+    log("Rebuilding %s from %u of %u+%u shards\n", o->dst, k, h.k, h.m);
+  }
+
+  size_t data = (size_t)k * h.unit;
+  uint8_t *in[EC_MAX];
+  for (off_t off = 0; err == 0 && off < h.size; off += data) {
+    deadline_pace();
+    if (control_state() != CONTROL_RUNNING && (err = control_checkpoint()) != 0) break;
+
+    // Data shards are read straight
+    // into their place in the stripe
+    for (unsigned int p = 0; err == 0 && p < k; p++) {
+      size_t got;
+      in[p] = use[p] < k ? out + use[p] * h.unit : par + p * h.unit;
+      if ((err = read_full(&shards[use[p]], in[p], h.unit, &got)) == 0 && got < h.unit) err = EIO;
+      if (err != 0) fprintf(stderr, "Could not read shard %s: %s\n", shards[use[p]].path, strerror(err));
+      else atomic_fetch_add(&stats.bytes_read, h.unit);
+    }
+
+    for (unsigned int i = 0; err == 0 && i < k; i++) {
+      if (have[i]) continue;
+      uint8_t *unit = out + i * h.unit;
+      memset(unit, 0, h.unit);
+      for (unsigned int p = 0; p < k; p++) gf_mul_add(unit, in[p], inv[i * k + p], h.unit);
+      atomic_fetch_add(&stats.ec_rebuilt, 1);
+    }
+
+    size_t len = h.size - off < (off_t)data ? (size_t)(h.size - off) : data;
+    if (err == 0 && (err = backend_write(&dst, out, len, -1)) != 0) {
+      fprintf(stderr, "Could not write %s: %s\n", o->dst, strerror(err));
+    }
+    if (err == 0) {
+      atomic_fetch_add(&stats.bytes_written, len);
+      atomic_fetch_add(&stats.ec_stripes, 1);
+    }
+  }
+  if (err == 0 && opened) err = backend_sync(&dst);
+
+  if (opened && backend_close(&dst, err != 0) != 0) {
+    fprintf(stderr, "Could not close %s\n", o->dst);
+  }
+  for (unsigned int i = 0; i < EC_MAX; i++) {
+    if (have[i]) backend_close(&shards[i], 0);
+  }
+
+  stats.ec_data = h.k;
+  stats.ec_parity = h.m;
+  stats.ec_kernel = gf_kernel();
+  free(out);
+  free(par);
+  return err;
+}
+
+// Encode or rebuild.
+int ec_run(options_t *o) {
+  return o->rebuild ? ec_rebuild(o) : ec_encode(o);
+}
@@ -0,0 +1,33 @@
+/**
+ * Erasure-coded copies. With --ec=K+M the
+ * source is cut into stripes of K units
+ * of EC_UNIT bytes, M parity units are
+ * computed for each stripe with a Cauchy
+ * Reed-Solomon code over GF(2^8), and
+ * each of the K+M shards is written to
+ * its own destination by its own thread.
+ * Every shard starts with an EC_HEADER
+ * byte header naming its place in the
+ * code and the source's size, so
+ * --rebuild can put the source back
+ * together from any K of them.
+ *
+ * @author Matt Stetter
+ * @file ec.h
+ */
+
+#include "options.h"
+
+#ifndef EC_H_
+#define EC_H_
+
+/**
+ * Encode the source into shards, or
+ * rebuild it from them with --rebuild.
+ *
+ * @param o the parsed options
+ * @return 0 if successful, errno otherwise
+ */
+int ec_run(options_t *o);
+
+#endif
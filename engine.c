@@ -0,0 +1,652 @@
+/**
+ * Source implementation of the
+ * probing and rule-based engine
+ * selection.
+ *
+ * @author Matt Stetter
+ * @file engine.c
+ */
+
+#include "backend.h"
+#include "buffer.h"
+#include "consumer.h"
+#include "cpy.h"
+#include "dbuf.h"
+#include "deadline.h"
+#include "device.h"
+#include "ec.h"
+#include "engine.h"
+#include "event.h"
+#include "pipeline.h"
+#include "producer.h"
+#include "profile.h"
+#include "simple.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <time.h>
+#include <unistd.h>
+
+// Names of the engines, indexed
+// by their ENGINE_* value
+static const char *engine_names[ENGINE_COUNT] = {
+  "auto", "ring", "dbuf", "reflink", "cfr", "splice", "sync", "pipeline", "event", "mmap"
+};
+
+// Built-in rules, tried after any
+// loaded from a rules file. Cloning
+// is tried first since it copies no
+// data at all, anything that needs
+// zeros skipped goes to the ring, and
+// the remaining copies go to the
+// cheapest engine for their endpoints.
+static const rule_t builtin_rules[] = {
+  // src     dst     samefs sparse zero direct magic min  max         engine
+  { EP_REG,  EP_REG,  1,    -1,    0,   0,     0,    -1,  -1,         ENGINE_REFLINK },
+  { EP_ANY,  EP_ANY, -1,    -1,    1,  -1,     0,    -1,  -1,         ENGINE_RING },
+  { EP_BLK,  EP_ANY, -1,    -1,   -1,  -1,     0,    -1,  -1,         ENGINE_RING },
+  { EP_ANY,  EP_BLK, -1,    -1,   -1,  -1,     0,    -1,  -1,         ENGINE_RING },
+  { EP_REG,  EP_ANY, -1,     1,   -1,  -1,     0,    -1,  -1,         ENGINE_RING },
+  { EP_ANY,  EP_ANY, -1,    -1,   -1,   1,     0,    -1,  -1,         ENGINE_DBUF },
+  { EP_REG,  EP_REG, -1,    -1,   -1,  -1,     0,    -1,  SMALL_FILE, ENGINE_SYNC },
+  { EP_REG,  EP_REG, -1,    -1,   -1,  -1,     0,    -1,  -1,         ENGINE_CFR },
+  { EP_PIPE, EP_ANY, -1,    -1,   -1,  -1,     0,    -1,  -1,         ENGINE_SPLICE },
+  { EP_REG,  EP_PIPE, -1,   -1,   -1,  -1,     0,    -1,  -1,         ENGINE_SPLICE },
+  { EP_ANY,  EP_ANY, -1,    -1,   -1,  -1,     0,    -1,  -1,         ENGINE_DBUF },
+  { EP_ANY,  EP_ANY, -1,    -1,   -1,  -1,     0,    -1,  -1,         ENGINE_RING },
+};
+
+#define NUM_BUILTIN_RULES (sizeof(builtin_rules) / sizeof(builtin_rules[0]))
+
+// BE_* capabilities each engine needs
+// from the source and the destination.
+// The ring goes through the backends,
+// the others work on file descriptors.
+static const int engine_needs[ENGINE_COUNT][2] = {
+  { 0, 0 },			// auto
+  { 0, 0 },			// ring
+  { BE_FD, BE_FD },		// dbuf
+  { BE_CLONE, BE_CLONE },	// reflink
+  { BE_CLONE, BE_CLONE },	// cfr
+  { BE_FD, BE_FD },		// splice
+  { BE_FD, BE_FD },		// sync
+  { BE_FD, BE_FD },		// pipeline
+  { BE_FD, BE_FD },		// event
+  { 0, BE_MAP },		// mmap
+};
+
+// Rules loaded from a file
+static rule_t *user_rules = NULL;
+static unsigned int num_user_rules = 0;
+
+// Look up an engine by name.
+int engine_lookup(const char *name) {
+  for (int i = 0; i < ENGINE_COUNT; i++) {
+    if (strcmp(engine_names[i], name) == 0) return i;
+  }
+  return -1;
+}
+
+// Name an engine.
+const char *engine_name(int engine) {
+  if (engine < 0 || engine >= ENGINE_COUNT) return "unknown";
+  return engine_names[engine];
+}
+
+/**
+ * Probe one endpoint. A destination
+ * that does not exist yet is described
+ * by the directory it will be created in.
+ * Endpoints of other backends are only
+ * described by their capabilities.
+ *
+ * @param path path of the endpoint
+ * @param mode BE_READ or BE_WRITE
+ * @param ep struct to fill in
+ */
+static void probe_endpoint(const char *path, int mode, endpoint_t *ep) {
+  memset(ep, 0, sizeof(*ep));
+  ep->size = -1;
+  ep->caps = backend_path_caps(path, mode);
+  if (!(ep->caps & BE_FD)) {
+    ep->type = EP_OBJ;
+    return;
+  }
+
+  struct stat st;
+  struct statfs sf;
+  if (stat(path, &st) != 0) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    ep->type = EP_REG;
+    if (stat(dirname(dir), &st) == 0) ep->dev = st.st_dev;
+    snprintf(dir, sizeof(dir), "%s", path);
+    if (statfs(dirname(dir), &sf) == 0) ep->fs_magic = sf.f_type;
+    return;
+  }
+
+  ep->exists = 1;
+  ep->dev = st.st_dev;
+  if (statfs(path, &sf) == 0) ep->fs_magic = sf.f_type;
+
+  if (S_ISREG(st.st_mode)) {
+    ep->type = EP_REG;
+    ep->size = st.st_size;
+    ep->sparse = (off_t)st.st_blocks * 512 < st.st_size;
+  } else if (S_ISBLK(st.st_mode)) {
+    ep->type = EP_BLK;
+    ep->dev = st.st_rdev;
+
+    dev_info_t info;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd != -1 && dev_probe(fd, &info) == 0) ep->size = info.size;
+    if (fd != -1) close(fd);
+  } else if (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode)) {
+    ep->type = EP_PIPE;
+  } else {
+    ep->type = EP_CHR;
+  }
+}
+
+// Probe the source and destination.
+void engine_probe(options_t *o, probe_t *pr) {
+  probe_endpoint(o->src, BE_READ, &pr->src);
+  probe_endpoint(o->dst, BE_WRITE, &pr->dst);
+  pr->same_fs = pr->src.type == EP_REG && pr->dst.type == EP_REG &&
+                pr->src.dev == pr->dst.dev;
+}
+
+/**
+ * Check whether a rule matches the
+ * probed endpoints and options.
+ *
+ * @param r rule to check
+ * @param o the parsed options
+ * @param pr the probed endpoints
+ * @return non-zero if the rule matches
+ */
+static int rule_matches(const rule_t *r, options_t *o, probe_t *pr) {
+  if (r->src != EP_ANY && r->src != pr->src.type) return 0;
+  if (r->dst != EP_ANY && r->dst != pr->dst.type) return 0;
+  if (r->same_fs != -1 && r->same_fs != pr->same_fs) return 0;
+  if (r->sparse != -1 && r->sparse != pr->src.sparse) return 0;
+  if (r->zero != -1 && r->zero != (o->sparse || o->discard)) return 0;
+  if (r->direct != -1 && r->direct != (o->direct != 0)) return 0;
+  if (r->fs_magic != 0 && r->fs_magic != pr->src.fs_magic) return 0;
+  if (r->min_size != -1 && (pr->src.size < 0 || pr->src.size < r->min_size)) return 0;
+  if (r->max_size != -1 && (pr->src.size < 0 || pr->src.size > r->max_size)) return 0;
+  return 1;
+}
+
+/**
+ * Parse the kind of an endpoint
+ * used in rules files.
+ *
+ * @param val value to parse
+ * @return EP_* value, -1 if unknown
+ */
+static int parse_endpoint(const char *val) {
+  const char *names[] = { "any", "reg", "blk", "pipe", "chr", "obj" };
+  for (int i = 0; i < 6; i++) {
+    if (strcmp(names[i], val) == 0) return i;
+  }
+  return -1;
+}
+
+/**
+ * Parse one line of a rules file.
+ *
+ * @param line line to parse, modified in place
+ * @param r rule to fill in
+ * @return 0 if successful, 1 otherwise
+ */
+static int parse_rule(char *line, rule_t *r) {
+  *r = (rule_t){ EP_ANY, EP_ANY, -1, -1, -1, -1, 0, -1, -1, -1 };
+
+  char *save;
+  for (char *tok = strtok_r(line, " \t\n", &save); tok; tok = strtok_r(NULL, " \t\n", &save)) {
+    char *val = strchr(tok, '=');
+    if (val == NULL) return 1;
+    *val++ = '\0';
+
+    if (strcmp(tok, "src") == 0) r->src = parse_endpoint(val);
+    else if (strcmp(tok, "dst") == 0) r->dst = parse_endpoint(val);
+    else if (strcmp(tok, "samefs") == 0) r->same_fs = atoi(val) != 0;
+    else if (strcmp(tok, "sparse") == 0) r->sparse = atoi(val) != 0;
+    else if (strcmp(tok, "zero") == 0) r->zero = atoi(val) != 0;
+    else if (strcmp(tok, "direct") == 0) r->direct = atoi(val) != 0;
+    else if (strcmp(tok, "fs") == 0) r->fs_magic = strtol(val, NULL, 0);
+    else if (strcmp(tok, "minsize") == 0) r->min_size = strtoll(val, NULL, 0);
+    else if (strcmp(tok, "maxsize") == 0) r->max_size = strtoll(val, NULL, 0);
+    else if (strcmp(tok, "engine") == 0) r->engine = engine_lookup(val);
+    else return 1;
+  }
+
+  return r->src == -1 || r->dst == -1 || r->engine <= ENGINE_AUTO;
+}
+
+// Load rules from a file, adding them
+// after any loaded before.
+int engine_load_rules(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) return errno;
+
+  char line[512];
+  int lineno = 0;
+  int err = 0;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    lineno++;
+    char *p = line + strspn(line, " \t");
+    if (*p == '#' || *p == '\n' || *p == '\0') continue;
+
+    rule_t r;
+    if (parse_rule(p, &r) != 0) {
+      fprintf(stderr, "%s:%d: invalid rule\n", path, lineno);
+      err = EINVAL;
+      break;
+    }
+
+    rule_t *tmp = (rule_t *)realloc(user_rules, (num_user_rules + 1) * sizeof(rule_t));
+    if (tmp == NULL) {
+      err = ENOMEM;
+      break;
+    }
+    user_rules = tmp;
+    user_rules[num_user_rules++] = r;
+  }
+
+  fclose(f);
+  return err;
+}
+
+/**
+ * Load the rules file named with
+ * --rules, or else the default one
+ * under $XDG_CONFIG_HOME if it exists.
+ *
+ * @param o the parsed options
+ * @return 0 if successful, errno otherwise
+ */
+static int load_config(options_t *o) {
+  if (o->rules != NULL) return engine_load_rules(o->rules);
+
+  char path[PATH_MAX];
+  const char *xdg = getenv("XDG_CONFIG_HOME");
+  const char *home = getenv("HOME");
+  if (xdg != NULL && *xdg != '\0') {
+    snprintf(path, sizeof(path), "%s/cpy/rules", xdg);
+  } else if (home != NULL) {
+    snprintf(path, sizeof(path), "%s/.config/cpy/rules", home);
+  } else {
+    return 0;
+  }
+
+  int err = engine_load_rules(path);
+  return err == ENOENT ? 0 : err;
+}
+
+/**
+ * Run the producer and consumer threads
+ * sharing the block ring.
+ *
+ * @param o the parsed options
+ * @param map_size size to map the destination at, 0 to write() it
+ * @return 0 if successful, errno otherwise
+ */
+static int run_ring(options_t *o, off_t map_size) {
+
+  // Initialize the shared buffer
+  buffer_t buf;
+  int err;
+  if ((err = buffer_init(&buf, o->depth, o->block_size)) != 0) {
+    fprintf(stderr, "Could not allocate the shared buffer: %s\n", strerror(err));
+    return err;
+  }
+
+  // Start the producer thread
+  producer_t *prod;
+  prod = producer_init(o, &buf);
+
+  // Start the consumer thread
+  consumer_t *cons;
+  cons = consumer_init(o, &buf, map_size);
+
+  // Join on producer and consumer
+  int prod_status = producer_join(prod);
+  int cons_status = consumer_join(cons);
+
+  // Free the buffer memory and destroy
+  // the mutex and semaphores
+  buffer_destroy(&buf);
+
+  return prod_status ? prod_status : cons_status;
+}
+
+/**
+ * Copy with the producer and consumer
+ * threads sharing the block ring.
+ *
+ * @param o the parsed options
+ * @return 0 if successful, errno otherwise
+ */
+static int ring_copy(options_t *o) {
+  return run_ring(o, 0);
+}
+
+/**
+ * Copy through the block ring with the
+ * consumer storing into a shared mapping
+ * of the destination. Needs a regular file
+ * (or block device) of known size as the
+ * source and a regular file as the target.
+ *
+ * @param o the parsed options
+ * @return 0 if successful, ENGINE_SKIP or errno otherwise
+ */
+static int mmap_copy(options_t *o) {
+  probe_t pr;
+  engine_probe(o, &pr);
+  if (o->direct || pr.src.size < 0 || pr.dst.type != EP_REG) return ENGINE_SKIP;
+  if (pr.src.type != EP_REG && pr.src.type != EP_BLK) return ENGINE_SKIP;
+
+  // An empty source leaves nothing to
+  // map, only the target to truncate
+  if (pr.src.size == 0) {
+    dev_info_t info;
+    int fd = dev_open_dst(o->dst, 0, &info);
+    if (fd == -1) {
+      int err = errno;
+      fprintf(stderr, "Could not open/create target file %s for writing\n", o->dst);
+      return err;
+    }
+    close(fd);
+    return 0;
+  }
+  return run_ring(o, pr.src.size);
+}
+
+/**
+ * Run one engine.
+ *
+ * @param engine ENGINE_* engine to run
+ * @param o the parsed options
+ * @return 0 if successful, ENGINE_SKIP or errno otherwise
+ */
+static int run_one(int engine, options_t *o) {
+  switch (engine) {
+  case ENGINE_RING: return ring_copy(o);
+  case ENGINE_DBUF: return dbuf_copy(o);
+  case ENGINE_REFLINK: return reflink_copy(o);
+  case ENGINE_CFR: return cfr_copy(o);
+  case ENGINE_SPLICE: return splice_copy(o);
+  case ENGINE_SYNC: return sync_copy(o);
+  case ENGINE_PIPELINE: return pipeline_copy(o);
+  case ENGINE_EVENT: return event_copy(o);
+  case ENGINE_MMAP: return mmap_copy(o);
+  }
+  return EINVAL;
+}
+
+/**
+ * Run an engine and record it in
+ * the stats and, with --verbose,
+ * on standard error. Engines needing
+ * capabilities the endpoints' backends
+ * lack are skipped without running.
+ *
+ * @param engine ENGINE_* engine to run
+ * @param rule description of the rule that chose it
+ * @param o the parsed options
+ * @param pr the probed endpoints, NULL for copies into a directory
+ * @return 0 if successful, ENGINE_SKIP or errno otherwise
+ */
+static int run_logged(int engine, const char *rule, options_t *o, const probe_t *pr) {
+  if (o->verbose) fprintf(stderr, "cpy: engine %s (%s)\n", engine_name(engine), rule);
+
+  int err = ENGINE_SKIP;
+  const int *needs = engine_needs[engine];
+  if (pr == NULL || ((pr->src.caps & needs[0]) == needs[0] && (pr->dst.caps & needs[1]) == needs[1])) {
+    err = run_one(engine, o);
+  }
+  if (err == ENGINE_SKIP) {
+    atomic_fetch_add(&stats.engine_skips, 1);
+    if (o->verbose) fprintf(stderr, "cpy: engine %s does not apply\n", engine_name(engine));
+  } else {
+    atomic_fetch_add(&stats.engine_runs[engine], 1);
+    stats.engine = engine;
+  }
+  return err;
+}
+
+/**
+ * Fill in the I/O size and queue depth
+ * for an engine from the tuning profile,
+ * leaving anything given on the command
+ * line alone. Variants being explored
+ * double or halve the cached I/O size.
+ *
+ * @param engine ENGINE_* engine about to run
+ * @param t the tuning profile
+ * @param o options to adjust
+ */
+static void apply_tuning(int engine, tune_t *t, options_t *o) {
+  if (engine != t->engine || t->explore == EXPLORE_ENGINE) return;
+  if (engine != ENGINE_RING && engine != ENGINE_MMAP && engine != ENGINE_DBUF) return;
+
+  size_t io_size = t->io_size;
+  if (t->explore == EXPLORE_LARGER && io_size <= DBUF_SIZE * 4) io_size *= 2;
+  if (t->explore == EXPLORE_SMALLER && io_size >= 2 * BLOCK_ALIGN) io_size /= 2;
+  io_size -= io_size % BLOCK_ALIGN;
+
+  if (o->block_size == 0 && io_size != 0) o->block_size = io_size;
+  if (engine != ENGINE_DBUF && o->depth == 0) o->depth = t->depth;
+  if (engine == ENGINE_DBUF && o->buffers == 0) o->buffers = t->depth;
+}
+
+/**
+ * Report the I/O size and queue depth
+ * an engine ran with, filling in the
+ * engine's defaults.
+ *
+ * @param engine ENGINE_* engine that ran
+ * @param o options it ran with
+ * @param io_size returned I/O size
+ * @param depth returned queue depth
+ */
+static void used_tuning(int engine, options_t *o, size_t *io_size, unsigned int *depth) {
+  *io_size = 0;
+  *depth = 0;
+  if (engine == ENGINE_RING || engine == ENGINE_MMAP) {
+    *io_size = o->block_size ? o->block_size : BLOCK_SIZE;
+    *depth = o->depth ? o->depth : NUM_BLOCKS;
+  } else if (engine == ENGINE_DBUF) {
+    *io_size = o->block_size ? o->block_size : DBUF_SIZE;
+    *depth = o->buffers ? o->buffers : DBUF_COUNT;
+  }
+}
+
+/**
+ * Check if every source of a copy
+ * into a directory is a stream.
+ *
+ * @param o the parsed options
+ * @return non-zero if they all are
+ */
+static int all_streams(options_t *o) {
+  for (unsigned int i = 0; i < o->nsrcs; i++) {
+    if (!event_is_stream(o->srcs[i])) return 0;
+  }
+  return o->nsrcs > 0;
+}
+
+// Pick the engine for the copy and
+// run it, falling through the rule
+// table while engines do not apply.
+// The engine cached in the tuning
+// profile goes first if one of the
+// matching rules names it, but never
+// ahead of a rule the zero, direct or
+// sparse conditions chose.
+int engine_run(options_t *o) {
+  int err;
+
+  // Erasure-coded copies have their own
+  // reader and a writer per shard
+  if (o->ec_data > 0 || o->rebuild) {
+    if (o->engine != ENGINE_AUTO) {
+      fprintf(stderr, "Engine %s cannot erasure code\n", engine_name(o->engine));
+      return EOPNOTSUPP;
+    }
+    return ec_run(o);
+  }
+
+  // Copies into a directory go through
+  // the shared pipeline, or the event
+  // loops if every source is a stream
+  if (o->dst_dir) {
+    if (o->engine != ENGINE_AUTO && o->engine != ENGINE_PIPELINE && o->engine != ENGINE_EVENT) {
+      fprintf(stderr, "Engine %s cannot copy into a directory\n", engine_name(o->engine));
+      return EOPNOTSUPP;
+    }
+    if (o->engine == ENGINE_AUTO && o->manifest == NULL && all_streams(o)) {
+      return run_logged(ENGINE_EVENT, "stream sources", o, NULL);
+    }
+    if (o->engine == ENGINE_EVENT) {
+      err = run_logged(ENGINE_EVENT, "forced", o, NULL);
+      if (err == ENGINE_SKIP) fprintf(stderr, "Engine event cannot copy a manifest\n");
+      return err == ENGINE_SKIP ? EOPNOTSUPP : err;
+    }
+    return run_logged(ENGINE_PIPELINE, "directory destination", o, NULL);
+  }
+
+  probe_t pr;
+  engine_probe(o, &pr);
+  deadline_start(&o->deadline, pr.src.size > 0 ? (unsigned long long)pr.src.size : 0);
+
+  // Only the ring's producer stripes
+  // reads across replicas
+  if (o->nreplicas > 0 && o->engine == ENGINE_AUTO) {
+    return run_logged(ENGINE_RING, "replicated source", o, &pr);
+  }
+  if (o->nreplicas > 0 && o->engine != ENGINE_RING && o->engine != ENGINE_MMAP) {
+    fprintf(stderr, "Engine %s cannot read replicas\n", engine_name(o->engine));
+    return EOPNOTSUPP;
+  }
+
+  if (o->engine != ENGINE_AUTO) {
+    err = run_logged(o->engine, "forced", o, &pr);
+    if (err == ENGINE_SKIP) {
+      fprintf(stderr, "Engine %s cannot copy %s to %s\n", engine_name(o->engine), o->src, o->dst);
+      err = EOPNOTSUPP;
+    }
+    return err;
+  }
+
+  if ((err = load_config(o)) != 0) {
+    fprintf(stderr, "Could not load the engine rules: %s\n", strerror(err));
+    return err;
+  }
+
+  // Collect the matching rules, keeping
+  // only the first rule for each engine
+  unsigned int total = num_user_rules + NUM_BUILTIN_RULES;
+  unsigned int *match = (unsigned int *)malloc(total * sizeof(unsigned int));
+  const rule_t **rules = (const rule_t **)malloc(total * sizeof(rule_t *));
+  if (match == NULL || rules == NULL) {
+    free(match);
+    free(rules);
+    return ENOMEM;
+  }
+  unsigned int count = 0;
+  int seen[ENGINE_COUNT] = { 0 };
+  for (unsigned int i = 0; i < total; i++) {
+    const rule_t *r = i < num_user_rules ? &user_rules[i] : &builtin_rules[i - num_user_rules];
+    if (!rule_matches(r, o, &pr) || seen[r->engine]) continue;
+    seen[r->engine] = 1;
+    rules[count] = r;
+    match[count++] = i;
+  }
+
+  // Rules up to the last one that asked
+  // for zeros skipped, direct I/O or a
+  // sparse source keep their place, as
+  // the profile's engine may not honour
+  // what they were matched for
+  unsigned int fixed = 0;
+  for (unsigned int i = 0; i < count; i++) {
+    if (rules[i]->zero == 1 || rules[i]->direct == 1 || rules[i]->sparse == 1) fixed = i + 1;
+  }
+
+  // Move the engine the profile prefers,
+  // or the one being explored, to the
+  // front of the rest
+  tune_t t = { -1, ENGINE_AUTO, 0, 0, EXPLORE_NONE };
+  if (!o->no_profile) profile_load(&pr, &t);
+  unsigned int pick = fixed;
+  for (unsigned int i = fixed; i < count; i++) {
+    if ((t.explore == EXPLORE_ENGINE) != (rules[i]->engine == t.engine)) {
+      pick = i;
+      break;
+    }
+  }
+  if (t.engine != ENGINE_AUTO && pick > fixed) {
+    const rule_t *r = rules[pick];
+    unsigned int m = match[pick];
+    memmove(&rules[fixed + 1], &rules[fixed], (pick - fixed) * sizeof(rule_t *));
+    memmove(&match[fixed + 1], &match[fixed], (pick - fixed) * sizeof(unsigned int));
+    rules[fixed] = r;
+    match[fixed] = m;
+  }
+
+  char desc[64];
+  int stored = 0;
+  err = EOPNOTSUPP;
+  for (unsigned int i = 0; i < count; i++) {
+    if (match[i] < num_user_rules) snprintf(desc, sizeof(desc), "rule %u from the rules file", match[i] + 1);
+    else snprintf(desc, sizeof(desc), "built-in rule %u", match[i] - num_user_rules + 1);
+    if (i == fixed && t.explore != EXPLORE_NONE) {
+      strncat(desc, ", re-validating profile", sizeof(desc) - strlen(desc) - 1);
+    } else if (i == fixed && rules[i]->engine == t.engine) {
+      strncat(desc, ", tuning profile", sizeof(desc) - strlen(desc) - 1);
+    }
+
+    options_t run = *o;
+    apply_tuning(rules[i]->engine, &t, &run);
+
+    struct timespec start, end;
+    unsigned long long before = atomic_load(&stats.bytes_written) + atomic_load(&stats.bytes_zeroed);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ((err = run_logged(rules[i]->engine, desc, &run, &pr)) == ENGINE_SKIP) continue;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // A copy one of the fixed rules ran
+    // says nothing about the profile's
+    // engine and is not recorded
+    if (err == 0 && i >= fixed) {
+      stored = 1;
+      size_t io_size;
+      unsigned int depth;
+      used_tuning(rules[i]->engine, &run, &io_size, &depth);
+      unsigned long long bytes = atomic_load(&stats.bytes_written) + atomic_load(&stats.bytes_zeroed) - before;
+      profile_store(&t, rules[i]->engine, io_size, depth, bytes,
+                    (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    }
+    break;
+  }
+
+  // The profile is left mapped if nothing
+  // was recorded
+  if (!stored) profile_store(&t, ENGINE_AUTO, 0, 0, 0, 0);
+
+  free(match);
+  free(rules);
+  return err == ENGINE_SKIP ? EOPNOTSUPP : err;
+}
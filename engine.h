@@ -0,0 +1,115 @@
+/**
+ * Automatic engine selection. Both
+ * endpoints of a copy are probed with
+ * stat and statfs and the result is
+ * matched against a table of rules,
+ * the first rule that matches naming
+ * the engine to use. Rules from a
+ * config file are tried before the
+ * built-in ones.
+ *
+ * @author Matt Stetter
+ * @file engine.h
+ */
+
+#include "options.h"
+
+#include <sys/types.h>
+
+#ifndef ENGINE_H_
+#define ENGINE_H_
+
+// Kinds of endpoint a rule can match
+#define EP_ANY 0	// Matches every endpoint
+#define EP_REG 1	// Regular file, or a path that does not exist yet
+#define EP_BLK 2	// Block device
+#define EP_PIPE 3	// FIFO or socket
+#define EP_CHR 4	// Character device such as a terminal
+#define EP_OBJ 5	// Endpoint served by a backend other than files
+
+// What was found out about one
+// end of the copy
+typedef struct endpoint {
+  int type;		// EP_* kind of the endpoint
+  int exists;		// Non-zero if the path exists
+  dev_t dev;		// Device holding the file (or its directory)
+  long fs_magic;	// statfs f_type of the file system
+  off_t size;		// Size of a regular file or block device
+  int sparse;		// Non-zero if a regular file has holes
+  int caps;		// BE_* capabilities of the endpoint's backend
+} endpoint_t;
+
+// Result of probing both ends
+typedef struct probe {
+  endpoint_t src;	// The source
+  endpoint_t dst;	// The destination
+  int same_fs;		// Non-zero if both are on the same file system
+} probe_t;
+
+// One row of the rule table. Fields
+// set to -1 (or EP_ANY, or 0 for the
+// magic) match anything.
+typedef struct rule {
+  int src;		// EP_* kind of source
+  int dst;		// EP_* kind of destination
+  int same_fs;		// 0 or 1 to require different or same file systems
+  int sparse;		// 0 or 1 to require a dense or sparse source
+  int zero;		// 0 or 1 on whether --sparse or --discard was given
+  int direct;		// 0 or 1 on whether --direct was given
+  long fs_magic;	// Source file system magic
+  off_t min_size;	// Smallest source size
+  off_t max_size;	// Largest source size
+  int engine;		// ENGINE_* engine to use
+} rule_t;
+
+/**
+ * Look up an engine by the name used
+ * for --engine and in rules files.
+ *
+ * @param name engine name
+ * @return ENGINE_* value, -1 if unknown
+ */
+int engine_lookup(const char *name);
+
+/**
+ * Name of an engine.
+ *
+ * @param engine ENGINE_* value
+ * @return the engine's name
+ */
+const char *engine_name(int engine);
+
+/**
+ * Probe both ends of a copy.
+ *
+ * @param o options naming the source and destination
+ * @param pr struct to fill in
+ */
+void engine_probe(options_t *o, probe_t *pr);
+
+/**
+ * Load rules from a file. Each line
+ * holds key=value conditions followed
+ * by engine=NAME, for example
+ * "src=reg dst=reg samefs=1 engine=reflink".
+ * Blank lines and lines starting with
+ * # are ignored.
+ *
+ * @param path file to load
+ * @return 0 if successful, errno otherwise
+ */
+int engine_load_rules(const char *path);
+
+/**
+ * Run the copy described by the options.
+ * An engine forced with --engine is used
+ * as is, otherwise every matching rule is
+ * tried in order until an engine accepts
+ * the endpoints.
+ *
+ * @param o options naming the source and destination
+ * @return 0 if successful, errno otherwise
+ */
+int engine_run(options_t *o);
+
+#endif
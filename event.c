@@ -0,0 +1,442 @@
+/**
+ * Source implementation of the
+ * event-driven stream engine.
+ *
+ * A stream moves data as far as it can
+ * whenever one of its ends is ready,
+ * reading until the source would block
+ * or its ring is full and writing until
+ * the destination would block or the
+ * ring is empty. Only then does it ask
+ * epoll to watch the end it is waiting
+ * for. Ends epoll cannot watch, such as
+ * regular files, are always ready, and
+ * a stream that used up its budget in
+ * one go is run again on the next lap
+ * so it cannot starve the others.
+ *
+ * @author Matt Stetter
+ * @file event.c
+ */
+
+#include "cgroup.h"
+#include "control.h"
+#include "cpy.h"
+#include "deadline.h"
+#include "device.h"
+#include "event.h"
+#include "simple.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Events taken from epoll at a time
+#define EVENT_MAX 256
+
+// Longest a loop waits for events, so
+// it notices a pause or cancel
+#define EVENT_TICK 100
+
+// End of a stream, kept in the low bit
+// of the epoll data next to its index
+#define END_IN 0
+#define END_OUT 1
+
+// One source copied to one destination
+typedef struct stream {
+  const char *src;	// Path of the source
+  char dst[PATH_MAX];	// Path of the destination
+  int fd[2];		// Source and destination, -1 if not open
+  int polled[2];	// Non-zero if epoll can watch the end
+  unsigned int events[2]; // Events epoll is watching on each end, 0 if not in the set
+  int ready[2];		// Non-zero if the end may not block
+  char *buf;		// Ring between the two ends
+  size_t head;		// Bytes read into the ring
+  size_t tail;		// Bytes written out of the ring
+  int eof;		// Non-zero once the source has ended
+  int more;		// Non-zero if the stream stopped on its budget
+  int status;		// 0 if the copy succeeded, errno otherwise
+} stream_t;
+
+// One thread and the streams it runs
+typedef struct loop {
+  stream_t *streams;	// Every stream of the copy
+  unsigned int first;	// Index of the loop's first stream
+  unsigned int step;	// Distance between the loop's streams
+  unsigned int count;	// Number of streams in the copy
+  size_t size;		// Capacity of each ring
+  int epfd;		// epoll instance of the loop
+  unsigned int active;	// Streams of the loop still copying
+  unsigned int more;	// Streams of the loop to run on the next lap
+} loop_t;
+
+/**
+ * Record the first error of a stream.
+ *
+ * @param s the stream
+ * @param err errno of the failure
+ */
+static void stream_fail(stream_t *s, int err) {
+  if (s->status == 0) s->status = err;
+}
+
+/**
+ * Close a stream that has finished
+ * or failed and report it.
+ *
+ * @param l the loop
+ * @param s the stream
+ */
+static void stream_close(loop_t *l, stream_t *s) {
+  if (s->fd[END_IN] != -1) close(s->fd[END_IN]);
+  if (s->fd[END_OUT] != -1 && close(s->fd[END_OUT]) != 0) stream_fail(s, errno);
+  s->fd[END_IN] = -1;
+  s->fd[END_OUT] = -1;
+  if (s->more) l->more--;
+  s->more = 0;
+  l->active--;
+
+  if (s->status != 0) fprintf(stderr, "Could not copy %s to %s: %s\n", s->src, s->dst, strerror(s->status));
+  log("Event loop finished %s\n", s->dst);
+}
+
+/**
+ * Watch the ends of a stream for what
+ * it is waiting on: a source with room
+ * in the ring that would block, and a
+ * destination with data that would.
+ * Ends with nothing to wait for leave
+ * the epoll set, as a hang-up would be
+ * reported over and over otherwise.
+ *
+ * @param l the loop
+ * @param s the stream
+ * @param idx index of the stream
+ */
+static void stream_watch(loop_t *l, stream_t *s, unsigned int idx) {
+  size_t used = s->head - s->tail;
+  unsigned int want[2];
+  want[END_IN] = !s->eof && used < l->size && !s->ready[END_IN] ? EPOLLIN : 0;
+  want[END_OUT] = used > 0 && !s->ready[END_OUT] ? EPOLLOUT : 0;
+
+  for (int end = END_IN; end <= END_OUT; end++) {
+    if (!s->polled[end] || want[end] == s->events[end]) continue;
+    struct epoll_event ev = { 0 };
+    ev.events = want[end];
+    ev.data.u64 = (unsigned long long)idx << 1 | (unsigned int)end;
+    int op = s->events[end] == 0 ? EPOLL_CTL_ADD : want[end] == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+    if (epoll_ctl(l->epfd, op, s->fd[end], &ev) != 0) stream_fail(s, errno);
+    s->events[end] = want[end];
+  }
+}
+
+/**
+ * Move as much of a stream as its
+ * ends allow without blocking, up to
+ * a budget of a few rings.
+ *
+ * @param l the loop
+ * @param s the stream
+ * @param idx index of the stream
+ */
+static void stream_pump(loop_t *l, stream_t *s, unsigned int idx) {
+  size_t budget = 4 * l->size;
+  size_t moved = 0;
+  int progress = 1;
+  while (s->status == 0 && progress && moved < budget) {
+    progress = 0;
+
+    size_t used = s->head - s->tail;
+    if (!s->eof && s->ready[END_IN] && used < l->size) {
+      size_t at = s->head % l->size;
+      size_t room = l->size - used < l->size - at ? l->size - used : l->size - at;
+      ssize_t n = read(s->fd[END_IN], s->buf + at, room);
+      if (n > 0) {
+        s->head += n;
+        moved += n;
+        atomic_fetch_add(&stats.bytes_read, n);
+        progress = 1;
+      } else if (n == 0) {
+        s->eof = 1;
+        progress = 1;
+      } else if (errno == EAGAIN) {
+        s->ready[END_IN] = !s->polled[END_IN];
+      } else if (errno != EINTR) {
+        stream_fail(s, errno);
+      }
+    }
+
+    used = s->head - s->tail;
+    if (s->status == 0 && used > 0 && s->ready[END_OUT]) {
+      size_t at = s->tail % l->size;
+      ssize_t n = write(s->fd[END_OUT], s->buf + at, used < l->size - at ? used : l->size - at);
+      if (n > 0) {
+        s->tail += n;
+        atomic_fetch_add(&stats.bytes_written, n);
+        progress = 1;
+      } else if (n == 0) {
+        stream_fail(s, ENOSPC);
+      } else if (errno == EAGAIN) {
+        s->ready[END_OUT] = !s->polled[END_OUT];
+      } else if (errno != EINTR) {
+        stream_fail(s, errno);
+      }
+    }
+  }
+
+  if (s->status != 0 || (s->eof && s->head == s->tail)) {
+    stream_close(l, s);
+    return;
+  }
+  stream_watch(l, s, idx);
+
+  // A stream that stopped on its budget
+  // could still move, but epoll may not
+  // say so again if its ends are files
+  if (progress && !s->more) {
+    s->more = 1;
+    l->more++;
+  }
+}
+
+/**
+ * Check if the loop's epoll instance
+ * can watch one end of a stream. Ends
+ * it cannot watch are always ready.
+ *
+ * @param l the loop
+ * @param s the stream
+ * @param idx index of the stream
+ * @param end END_IN or END_OUT
+ * @return 0 if successful, errno otherwise
+ */
+static int stream_probe(loop_t *l, stream_t *s, unsigned int idx, int end) {
+  struct epoll_event ev = { 0 };
+  ev.data.u64 = (unsigned long long)idx << 1 | (unsigned int)end;
+  s->ready[end] = 1;
+  if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, s->fd[end], &ev) != 0) return errno == EPERM ? 0 : errno;
+  epoll_ctl(l->epfd, EPOLL_CTL_DEL, s->fd[end], &ev);
+
+  // A source that is watched is only
+  // read once epoll says so, since a
+  // FIFO with no writer yet reads as
+  // ended rather than blocking
+  s->polled[end] = 1;
+  s->ready[end] = end == END_OUT;
+  return 0;
+}
+
+/**
+ * Open both ends of a stream, pipes
+ * and sockets non-blocking.
+ * A destination FIFO must already
+ * have a reader.
+ *
+ * @param l the loop
+ * @param s the stream
+ * @param idx index of the stream
+ * @return 0 if successful, errno otherwise
+ */
+static int stream_open(loop_t *l, stream_t *s, unsigned int idx) {
+  dev_info_t info = { 0 };
+  if ((s->fd[END_IN] = open(s->src, O_RDONLY | O_NONBLOCK)) == -1) return errno;
+  if (event_is_stream(s->dst)) s->fd[END_OUT] = open(s->dst, O_WRONLY | O_NONBLOCK);
+  else s->fd[END_OUT] = dev_open_dst(s->dst, 0, &info);
+  if (s->fd[END_OUT] == -1) return errno;
+
+  int err;
+  if ((err = stream_probe(l, s, idx, END_IN)) != 0 ||
+      (err = stream_probe(l, s, idx, END_OUT)) != 0) {
+    return err;
+  }
+  return 0;
+}
+
+/**
+ * Flush every open destination of a
+ * loop before it parks for a pause
+ * or stops for a cancel.
+ *
+ * @param l the loop
+ */
+static void loop_sync(loop_t *l) {
+  for (unsigned int i = l->first; i < l->count; i += l->step) {
+    stream_t *s = &l->streams[i];
+    if (s->fd[END_OUT] != -1 && s->status == 0) stream_fail(s, control_sync(s->fd[END_OUT]));
+  }
+}
+
+/**
+ * Thread target for a loop. Opens the
+ * loop's streams, then waits for their
+ * ends to become ready and pumps them
+ * until every one has finished.
+ *
+ * @param args loop_t struct pointer
+ * @return NULL
+ */
+static void *loop_target(void *args) {
+  loop_t *l = (loop_t *)args;
+
+  for (unsigned int i = l->first; i < l->count; i += l->step) {
+    stream_t *s = &l->streams[i];
+    l->active++;
+    int err = stream_open(l, s, i);
+    if (err != 0) stream_fail(s, err);
+    stream_pump(l, s, i);
+  }
+
+  struct epoll_event evs[EVENT_MAX];
+  while (l->active > 0) {
+    deadline_pace();
+    if (control_state() != CONTROL_RUNNING) {
+      loop_sync(l);
+      if (control_checkpoint() != 0) break;
+    }
+
+    int n = epoll_wait(l->epfd, evs, EVENT_MAX, l->more ? 0 : EVENT_TICK);
+    if (n == -1 && errno != EINTR) {
+      fprintf(stderr, "Event loop failed: %s\n", strerror(errno));
+      break;
+    }
+
+    // Errors and hang-ups are handed to
+    // the end as ready, so its next read
+    // or write reports them
+    for (int i = 0; i < n; i++) {
+      unsigned int idx = (unsigned int)(evs[i].data.u64 >> 1);
+      int end = (int)(evs[i].data.u64 & 1);
+      stream_t *s = &l->streams[idx];
+      if (s->fd[END_IN] == -1) continue;
+      s->ready[end] = 1;
+      stream_pump(l, s, idx);
+    }
+
+    for (unsigned int i = l->first; l->more > 0 && i < l->count; i += l->step) {
+      stream_t *s = &l->streams[i];
+      if (!s->more) continue;
+      s->more = 0;
+      l->more--;
+      stream_pump(l, s, i);
+    }
+  }
+
+  // A cancelled or failed loop leaves
+  // streams behind, synced and reported
+  for (unsigned int i = l->first; i < l->count && l->active > 0; i += l->step) {
+    stream_t *s = &l->streams[i];
+    if (s->fd[END_IN] == -1) continue;
+    if (s->status == 0) stream_fail(s, control_sync(s->fd[END_OUT]));
+    stream_fail(s, ECANCELED);
+    stream_close(l, s);
+  }
+  return NULL;
+}
+
+// Streams are whatever is not seekable
+// storage: FIFOs, sockets and character
+// devices such as terminals.
+int event_is_stream(const char *path) {
+  struct stat st;
+  if (stat(path, &st) != 0) return 0;
+  return S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode) || S_ISCHR(st.st_mode);
+}
+
+/**
+ * Raise the soft limit on open files
+ * to the hard limit, as every stream
+ * holds two descriptors for the whole
+ * copy.
+ *
+ * @param want number of descriptors needed
+ */
+static void raise_nofile(unsigned long long want) {
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur >= want + 64) return;
+  rl.rlim_cur = rl.rlim_max;
+  if (setrlimit(RLIMIT_NOFILE, &rl) != 0) return;
+  log("Raised the open file limit to %llu\n", (unsigned long long)rl.rlim_cur);
+}
+
+// Split the streams between the loops
+// and run one thread per loop.
+int event_copy(options_t *o) {
+  if (o->manifest != NULL) return ENGINE_SKIP;
+
+  unsigned int count = o->dst_dir ? o->nsrcs : 1;
+  size_t size = o->block_size ? o->block_size : EVENT_BUFFER;
+  unsigned int nloops = o->threads ? o->threads : cgroup.cpus;
+  if (nloops > count) nloops = count;
+
+  stream_t *streams = (stream_t *)calloc(count, sizeof(stream_t));
+  loop_t *loops = (loop_t *)calloc(nloops, sizeof(loop_t));
+  pthread_t *threads = (pthread_t *)calloc(nloops, sizeof(pthread_t));
+  char *slab = NULL;
+  if (streams == NULL || loops == NULL || threads == NULL ||
+      posix_memalign((void **)&slab, BLOCK_ALIGN, count * size) != 0) {
+    free(streams);
+    free(loops);
+    free(threads);
+    return ENOMEM;
+  }
+
+  for (unsigned int i = 0; i < nloops; i++) loops[i].epfd = -1;
+  for (unsigned int i = 0; i < count; i++) {
+    stream_t *s = &streams[i];
+    s->src = o->dst_dir ? o->srcs[i] : o->src;
+    const char *base = strrchr(s->src, '/');
+    if (o->dst_dir) snprintf(s->dst, sizeof(s->dst), "%s/%s", o->dst, base ? base + 1 : s->src);
+    else snprintf(s->dst, sizeof(s->dst), "%s", o->dst);
+    s->fd[END_IN] = -1;
+    s->fd[END_OUT] = -1;
+    s->buf = slab + (size_t)i * size;
+  }
+
+  // Writing to a pipe whose reader has
+  // gone fails that stream with EPIPE
+  // instead of killing the whole copy
+  signal(SIGPIPE, SIG_IGN);
+  raise_nofile(2ULL * count);
+
+  log("Event loops copying %u streams with %u threads\n", count, nloops);
+
+  int err = 0;
+  unsigned int started = 0;
+  for (unsigned int i = 0; i < nloops && err == 0; i++) {
+    loop_t *l = &loops[i];
+    l->streams = streams;
+    l->first = i;
+    l->step = nloops;
+    l->count = count;
+    l->size = size;
+    if ((l->epfd = epoll_create1(0)) == -1) err = errno;
+    else if (pthread_create(&threads[i], NULL, &loop_target, l) != 0) err = EAGAIN;
+    else started++;
+  }
+  if (err != 0) fprintf(stderr, "Failed to start the event loops: %s\n", strerror(err));
+
+  // The loops that did start still
+  // copy their streams to the end
+  for (unsigned int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+  for (unsigned int i = 0; i < nloops; i++) {
+    if (loops[i].epfd != -1) close(loops[i].epfd);
+  }
+  for (unsigned int i = 0; i < count && err == 0; i++) err = streams[i].status;
+
+  free(slab);
+  free(streams);
+  free(loops);
+  free(threads);
+  return err;
+}
@@ -0,0 +1,45 @@
+/**
+ * Event-driven engine for copying many
+ * slow streams, such as pipes, FIFOs
+ * and sockets, at once. Each of a few
+ * threads runs an epoll loop over its
+ * share of the streams with their
+ * descriptors non-blocking, and moves
+ * data through a small ring per stream
+ * whenever a source is readable or a
+ * destination writable. The number of
+ * streams is bounded by descriptors
+ * and memory, not by threads.
+ *
+ * @author Matt Stetter
+ * @file event.h
+ */
+
+#include "options.h"
+
+#ifndef EVENT_H_
+#define EVENT_H_
+
+/**
+ * Copy every source named in the
+ * options into the destination
+ * directory, or the one source into
+ * the destination. A failed stream is
+ * reported and the others carry on.
+ *
+ * @param o options naming the sources and destination
+ * @return 0 if every stream was copied, errno of a failure otherwise
+ */
+int event_copy(options_t *o);
+
+/**
+ * Check if a path names a stream,
+ * something that is read as it comes
+ * rather than seeked through.
+ *
+ * @param path the path
+ * @return non-zero for a FIFO, socket or character device
+ */
+int event_is_stream(const char *path);
+
+#endif
@@ -0,0 +1,163 @@
+/**
+ * Source implementation of the
+ * FIEMAP based extent map.
+ *
+ * @author Matt Stetter
+ * @file extent.c
+ */
+
+#include "cpy.h"
+#include "extent.h"
+
+#include <errno.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+// Number of extents fetched from
+// the kernel per FIEMAP call
+#define FIEMAP_BATCH 256
+
+/**
+ * Append an extent to the map,
+ * growing the array as needed.
+ *
+ * @param map map to append to
+ * @param logical offset in the file
+ * @param physical offset on the device
+ * @param len length of the extent
+ * @param flags EXT_* flags
+ * @return 0 if successful, errno otherwise
+ */
+static int extent_push(extent_map_t *map, off_t logical, off_t physical, off_t len,
+                       unsigned int flags) {
+  if (map->count == map->cap) {
+    unsigned int cap = map->cap ? map->cap * 2 : 16;
+    extent_t *tmp = (extent_t *)realloc(map->ext, cap * sizeof(extent_t));
+    if (tmp == NULL) return ENOMEM;
+    map->ext = tmp;
+    map->cap = cap;
+  }
+
+  extent_t *e = &map->ext[map->count++];
+  e->logical = logical;
+  e->physical = physical;
+  e->len = len;
+  e->flags = flags;
+  return 0;
+}
+
+// Load the extents of a file with
+// FS_IOC_FIEMAP, filling the gaps
+// between them with holes.
+int extent_map_load(int fd, off_t size, extent_map_t *map) {
+  map->ext = NULL;
+  map->count = 0;
+  map->cap = 0;
+  map->size = size;
+
+  struct fiemap *fm;
+  size_t fm_size = sizeof(struct fiemap) + FIEMAP_BATCH * sizeof(struct fiemap_extent);
+  if ((fm = (struct fiemap *)malloc(fm_size)) == NULL) return ENOMEM;
+
+  off_t pos = 0;
+  int last = 0;
+  int err = 0;
+  while (!last && pos < size) {
+    memset(fm, 0, sizeof(struct fiemap));
+    fm->fm_start = pos;
+    fm->fm_length = size - pos;
+    fm->fm_flags = FIEMAP_FLAG_SYNC;
+    fm->fm_extent_count = FIEMAP_BATCH;
+    if (ioctl(fd, FS_IOC_FIEMAP, fm) != 0) {
+      err = errno;
+      break;
+    }
+    if (fm->fm_mapped_extents == 0) break;
+
+    for (unsigned int i = 0; i < fm->fm_mapped_extents && !err; i++) {
+      struct fiemap_extent *fe = &fm->fm_extents[i];
+      off_t start = fe->fe_logical;
+      off_t end = fe->fe_logical + fe->fe_length;
+      if (fe->fe_flags & FIEMAP_EXTENT_LAST) last = 1;
+
+      // Clamp extents that straddle the
+      // previous batch or run past the
+      // end of the file
+      if (start < pos) start = pos;
+      if (end > size) end = size;
+      if (start >= end) continue;
+
+      unsigned int flags = 0;
+      if (fe->fe_flags & FIEMAP_EXTENT_UNWRITTEN) flags |= EXT_UNWRITTEN;
+      if (fe->fe_flags & FIEMAP_EXTENT_SHARED) flags |= EXT_SHARED;
+
+      if (start > pos) err = extent_push(map, pos, 0, start - pos, EXT_HOLE);
+      if (!err) err = extent_push(map, start, fe->fe_physical + (start - fe->fe_logical),
+                                  end - start, flags);
+      pos = end;
+    }
+  }
+  free(fm);
+
+  // Anything past the last extent
+  // is a hole at the end of the file
+  if (!err && pos < size) err = extent_push(map, pos, 0, size - pos, EXT_HOLE);
+  if (err) {
+    extent_map_free(map);
+    return err;
+  }
+
+  log("Loaded %u extents for a file of %lld bytes\n", map->count, (long long)size);
+
+  return 0;
+}
+
+// Map a single extent from the
+// start of the file.
+int extent_first(int fd, off_t *physical) {
+  union {
+    struct fiemap fm;
+    char buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+  } u;
+  memset(&u, 0, sizeof(u));
+  u.fm.fm_length = FIEMAP_MAX_OFFSET;
+  u.fm.fm_extent_count = 1;
+  if (ioctl(fd, FS_IOC_FIEMAP, &u.fm) != 0) return errno;
+  *physical = u.fm.fm_mapped_extents ? (off_t)u.fm.fm_extents[0].fe_physical : 0;
+  return 0;
+}
+
+/**
+ * Comparison function for qsort that
+ * orders extents by physical offset.
+ *
+ * @param a first extent
+ * @param b second extent
+ * @return negative, zero or positive like strcmp
+ */
+static int cmp_physical(const void *a, const void *b) {
+  const extent_t *ea = (const extent_t *)a;
+  const extent_t *eb = (const extent_t *)b;
+  off_t pa = (ea->flags & EXT_HOLE) ? -1 : ea->physical;
+  off_t pb = (eb->flags & EXT_HOLE) ? -1 : eb->physical;
+  if (pa != pb) return pa < pb ? -1 : 1;
+  return ea->logical < eb->logical ? -1 : ea->logical > eb->logical;
+}
+
+// Sort the map by physical offset.
+void extent_map_sort_physical(extent_map_t *map) {
+  qsort(map->ext, map->count, sizeof(extent_t), cmp_physical);
+}
+
+// Free the extent array.
+void extent_map_free(extent_map_t *map) {
+  free(map->ext);
+  map->ext = NULL;
+  map->count = 0;
+  map->cap = 0;
+}
@@ -0,0 +1,85 @@
+/**
+ * Extent map of a regular file read
+ * with the FS_IOC_FIEMAP ioctl. The
+ * producer uses it to read only the
+ * parts of a file that hold data, in
+ * physical order on rotational media.
+ *
+ * @author Matt Stetter
+ * @file extent.h
+ */
+
+#include <sys/types.h>
+
+#ifndef EXTENT_H_
+#define EXTENT_H_
+
+// Flags describing an extent
+#define EXT_UNWRITTEN 0x1	// Preallocated, reads back as zeros
+#define EXT_HOLE 0x2		// Not allocated at all, reads back as zeros
+#define EXT_SHARED 0x4		// Shared with another file (reflink)
+
+// One contiguous range of a file
+typedef struct extent {
+  off_t logical;	// Offset of the range in the file
+  off_t physical;	// Offset of the range on the device
+  off_t len;		// Length of the range in bytes
+  unsigned int flags;	// EXT_* flags for the range
+} extent_t;
+
+// All of the extents of a file,
+// in logical order unless sorted
+// with extent_map_sort_physical.
+// Holes are included as EXT_HOLE
+// extents so the map covers the
+// file from 0 to size.
+typedef struct extent_map {
+  extent_t *ext;	// Heap allocated array of extents
+  unsigned int count;	// Number of extents in the array
+  unsigned int cap;	// Number of extents the array has room for
+  off_t size;		// Size of the file the map covers
+} extent_map_t;
+
+/**
+ * Read the extent map of an open
+ * regular file, flushing delayed
+ * allocations first so every byte
+ * of data is covered by an extent.
+ *
+ * @param fd open regular file
+ * @param size size of the file
+ * @param map struct to fill in
+ * @return 0 if successful, errno otherwise
+ */
+int extent_map_load(int fd, off_t size, extent_map_t *map);
+
+/**
+ * Sort a map by physical offset so
+ * the extents can be read without
+ * seeking back and forth. Holes
+ * have no physical location and
+ * sort first.
+ *
+ * @param map map to sort
+ */
+void extent_map_sort_physical(extent_map_t *map);
+
+/**
+ * Find where a file's first extent
+ * starts on the device, without
+ * loading the whole map.
+ *
+ * @param fd open regular file
+ * @param physical returned offset on the device, 0 if the file has no extents
+ * @return 0 if successful, errno otherwise
+ */
+int extent_first(int fd, off_t *physical);
+
+/**
+ * Free the memory used by a map.
+ *
+ * @param map map to free (must be loaded)
+ */
+void extent_map_free(extent_map_t *map);
+
+#endif
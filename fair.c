@@ -0,0 +1,318 @@
+/**
+ * Source implementation of the
+ * fair scheduler.
+ *
+ * Both levels use the same deficit
+ * round robin: the flow whose turn it
+ * is keeps being picked while its
+ * deficit is positive, and once it
+ * has spent it the deficit is topped
+ * up by its weight times the quantum
+ * and the turn passes on. A flow with
+ * nothing queued forgets its deficit
+ * so it cannot save up a burst.
+ *
+ * @author Matt Stetter
+ * @file fair.c
+ */
+
+#include "cpy.h"
+#include "fair.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Set up the lock and the empty
+// tenant list.
+void fair_init(fair_t *s) {
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->cond, NULL);
+  s->tenants = NULL;
+  s->cur = NULL;
+  s->pending = 0;
+  s->feeding = 0;
+}
+
+// Free every class and tenant.
+void fair_destroy(fair_t *s) {
+  fair_tenant_t *t = s->tenants;
+  while (t != NULL) {
+    fair_class_t *c = t->classes;
+    while (c != NULL) {
+      fair_class_t *next = c->next;
+      free(c);
+      c = next;
+    }
+    fair_tenant_t *next = t->next;
+    free(t);
+    t = next;
+  }
+  pthread_cond_destroy(&s->cond);
+  pthread_mutex_destroy(&s->lock);
+}
+
+/**
+ * Find a tenant by name, appending
+ * a new one with weight 1 if there
+ * is none.
+ *
+ * @param s the scheduler (locked)
+ * @param name name of the tenant
+ * @return the tenant, NULL if out of memory
+ */
+static fair_tenant_t *find_tenant(fair_t *s, const char *name) {
+  fair_tenant_t **link = &s->tenants;
+  for (; *link != NULL; link = &(*link)->next) {
+    if (strcmp((*link)->name, name) == 0) return *link;
+  }
+
+  fair_tenant_t *t = (fair_tenant_t *)calloc(1, sizeof(fair_tenant_t));
+  if (t == NULL) return NULL;
+  strncpy(t->name, name, FAIR_NAME - 1);
+  t->weight = 1;
+  *link = t;
+  if (s->cur == NULL) s->cur = t;
+  return t;
+}
+
+/**
+ * Find a class of a tenant by name,
+ * appending a new one with weight 1
+ * if there is none.
+ *
+ * @param t the tenant
+ * @param name name of the class
+ * @return the class, NULL if out of memory
+ */
+static fair_class_t *find_class(fair_tenant_t *t, const char *name) {
+  fair_class_t **link = &t->classes;
+  for (; *link != NULL; link = &(*link)->next) {
+    if (strcmp((*link)->name, name) == 0) return *link;
+  }
+
+  fair_class_t *c = (fair_class_t *)calloc(1, sizeof(fair_class_t));
+  if (c == NULL) return NULL;
+  strncpy(c->name, name, FAIR_NAME - 1);
+  c->weight = 1;
+  c->tenant = t;
+  *link = c;
+  if (t->cur == NULL) t->cur = c;
+  return c;
+}
+
+// Look up or create the tenant or
+// class and set its weight.
+int fair_weight(fair_t *s, const char *tenant, const char *cls, unsigned int weight) {
+  if (weight == 0) return EINVAL;
+
+  pthread_mutex_lock(&s->lock);
+  int err = ENOMEM;
+  fair_tenant_t *t = find_tenant(s, tenant);
+  if (t != NULL && cls == NULL) {
+    t->weight = weight;
+    err = 0;
+  } else if (t != NULL) {
+    fair_class_t *c = find_class(t, cls);
+    if (c != NULL) {
+      c->weight = weight;
+      err = 0;
+    }
+  }
+  pthread_mutex_unlock(&s->lock);
+  return err;
+}
+
+// Append the job to the queue of
+// its class.
+int fair_add(fair_t *s, fair_entry_t *e, const char *tenant, const char *cls) {
+  pthread_mutex_lock(&s->lock);
+  fair_tenant_t *t = find_tenant(s, tenant);
+  fair_class_t *c = t ? find_class(t, cls) : NULL;
+  if (c == NULL) {
+    pthread_mutex_unlock(&s->lock);
+    return ENOMEM;
+  }
+
+  memset(e, 0, sizeof(*e));
+  e->cls = c;
+  clock_gettime(CLOCK_MONOTONIC, &e->queued);
+  if (c->tail != NULL) c->tail->next = e;
+  else c->head = e;
+  c->tail = e;
+  s->pending++;
+
+  pthread_cond_broadcast(&s->cond);
+  pthread_mutex_unlock(&s->lock);
+  return 0;
+}
+
+/**
+ * Find the oldest job of a class
+ * no reader is holding.
+ *
+ * @param c the class
+ * @return entry of the job, NULL if there is none
+ */
+static fair_entry_t *ready_job(fair_class_t *c) {
+  for (fair_entry_t *e = c->head; e != NULL; e = e->next) {
+    if (!e->busy) return e;
+  }
+  return NULL;
+}
+
+/**
+ * Check whether any class of a
+ * tenant has a job ready.
+ *
+ * @param t the tenant
+ * @return non-zero if a job is ready
+ */
+static int tenant_ready(fair_tenant_t *t) {
+  for (fair_class_t *c = t->classes; c != NULL; c = c->next) {
+    if (ready_job(c) != NULL) return 1;
+  }
+  return 0;
+}
+
+/**
+ * Check whether any class of a
+ * tenant has unfinished jobs.
+ *
+ * @param t the tenant
+ * @return non-zero if a job is queued
+ */
+static int tenant_queued(fair_tenant_t *t) {
+  for (fair_class_t *c = t->classes; c != NULL; c = c->next) {
+    if (c->head != NULL) return 1;
+  }
+  return 0;
+}
+
+/**
+ * Pick the tenant, then the class of
+ * that tenant, whose turn it is.
+ *
+ * @param s the scheduler (locked)
+ * @return entry of the job, NULL if every job is held
+ */
+static fair_entry_t *pick(fair_t *s) {
+  int any = 0;
+  for (fair_tenant_t *t = s->tenants; t != NULL && !any; t = t->next) {
+    any = tenant_ready(t);
+  }
+  if (!any) return NULL;
+
+  // Some tenant is ready, so every lap
+  // tops it up and one turn comes
+  fair_tenant_t *t = s->cur;
+  for (;;) {
+    if (!tenant_ready(t)) {
+      if (!tenant_queued(t)) t->deficit = 0;
+    } else if (t->deficit > 0) {
+      break;
+    } else {
+      t->deficit += (long long)t->weight * FAIR_QUANTUM;
+    }
+    t = t->next ? t->next : s->tenants;
+  }
+  s->cur = t;
+
+  fair_class_t *c = t->cur;
+  for (;;) {
+    if (ready_job(c) == NULL) {
+      if (c->head == NULL) c->deficit = 0;
+    } else if (c->deficit > 0) {
+      break;
+    } else {
+      c->deficit += (long long)c->weight * FAIR_QUANTUM;
+    }
+    c = c->next ? c->next : t->classes;
+  }
+  t->cur = c;
+
+  return ready_job(c);
+}
+
+/**
+ * Mark a picked job held by a reader,
+ * noting when it was first started.
+ *
+ * @param e entry of the job
+ */
+static void hold(fair_entry_t *e) {
+  e->busy = 1;
+  if (e->started.tv_sec == 0 && e->started.tv_nsec == 0) {
+    clock_gettime(CLOCK_MONOTONIC, &e->started);
+  }
+}
+
+// Wait for a job to be ready and
+// mark it held.
+fair_entry_t *fair_next(fair_t *s) {
+  pthread_mutex_lock(&s->lock);
+  fair_entry_t *e = NULL;
+  while ((s->pending > 0 || s->feeding) && (e = pick(s)) == NULL) {
+    pthread_cond_wait(&s->cond, &s->lock);
+  }
+
+  if (e != NULL) hold(e);
+  pthread_mutex_unlock(&s->lock);
+  return e;
+}
+
+// Mark the job whose turn it is held,
+// if any job is ready.
+fair_entry_t *fair_try_next(fair_t *s) {
+  pthread_mutex_lock(&s->lock);
+  fair_entry_t *e = s->pending > 0 ? pick(s) : NULL;
+  if (e != NULL) hold(e);
+  pthread_mutex_unlock(&s->lock);
+  return e;
+}
+
+// Charge the chunk and release the
+// job, dropping it once finished.
+void fair_yield(fair_t *s, fair_entry_t *e, size_t bytes, int finished) {
+  pthread_mutex_lock(&s->lock);
+  fair_class_t *c = e->cls;
+  c->deficit -= (long long)bytes;
+  c->tenant->deficit -= (long long)bytes;
+  e->bytes += bytes;
+  e->busy = 0;
+
+  if (finished) {
+    fair_entry_t **link = &c->head;
+    fair_entry_t *prev = NULL;
+    while (*link != e) {
+      prev = *link;
+      link = &(*link)->next;
+    }
+    *link = e->next;
+    if (c->tail == e) c->tail = prev;
+    s->pending--;
+    log("Fair scheduler finished a %s/%s job\n", c->tenant->name, c->name);
+  }
+
+  pthread_cond_broadcast(&s->cond);
+  pthread_mutex_unlock(&s->lock);
+}
+
+// Set the flag and wake the readers
+// and the feeder waiting on it.
+void fair_feed(fair_t *s, int feeding) {
+  pthread_mutex_lock(&s->lock);
+  s->feeding = feeding;
+  pthread_cond_broadcast(&s->cond);
+  pthread_mutex_unlock(&s->lock);
+}
+
+// Wait for finished jobs while
+// still feeding.
+int fair_drain(fair_t *s, unsigned int left) {
+  pthread_mutex_lock(&s->lock);
+  while (s->feeding && s->pending > left) pthread_cond_wait(&s->cond, &s->lock);
+  int stopped = !s->feeding;
+  pthread_mutex_unlock(&s->lock);
+  return stopped;
+}
@@ -0,0 +1,170 @@
+/**
+ * Deficit round robin scheduler for
+ * the shared pipeline. Jobs belong to
+ * a class within a tenant, and both
+ * tenants and the classes of a tenant
+ * take turns in proportion to their
+ * weights, charged by the bytes each
+ * chunk actually read. A job is only
+ * held for a single chunk at a time,
+ * so a huge file yields to the other
+ * classes between every chunk instead
+ * of holding a reader until it ends.
+ *
+ * @author Matt Stetter
+ * @file fair.h
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+#ifndef FAIR_H_
+#define FAIR_H_
+
+// Longest tenant or class name kept
+#define FAIR_NAME 32
+
+// Bytes added to a deficit per turn
+// and unit of weight
+#define FAIR_QUANTUM (256 * 1024)
+
+struct fair_class;
+struct fair_tenant;
+
+// Scheduling state of one job, embedded
+// as the first member of the job
+typedef struct fair_entry {
+  struct fair_entry *next;	// Next job of the same class
+  struct fair_class *cls;	// Class the job belongs to
+  int busy;			// Non-zero while a reader holds the job
+  struct timespec queued;	// Time the job was added
+  struct timespec started;	// Time the job's first chunk was picked
+  size_t bytes;			// Bytes charged to the job so far
+} fair_entry_t;
+
+// A class of jobs within a tenant
+typedef struct fair_class {
+  char name[FAIR_NAME];	// Name of the class
+  unsigned int weight;		// Share relative to the tenant's other classes
+  long long deficit;		// Bytes the class may still read this turn
+  fair_entry_t *head;		// Unfinished jobs in the order added
+  fair_entry_t *tail;		// Last unfinished job
+  struct fair_tenant *tenant;	// Tenant the class belongs to
+  struct fair_class *next;	// Next class of the same tenant
+} fair_class_t;
+
+// A tenant and its classes
+typedef struct fair_tenant {
+  char name[FAIR_NAME];	// Name of the tenant
+  unsigned int weight;		// Share relative to the other tenants
+  long long deficit;		// Bytes the tenant may still read this turn
+  fair_class_t *classes;	// Every class of the tenant
+  fair_class_t *cur;		// Class whose turn it is
+  struct fair_tenant *next;	// Next tenant
+} fair_tenant_t;
+
+// The scheduler
+typedef struct fair {
+  pthread_mutex_t lock;		// Protects everything below
+  pthread_cond_t cond;		// Signalled when a job is handed back
+  fair_tenant_t *tenants;	// Every tenant
+  fair_tenant_t *cur;		// Tenant whose turn it is
+  unsigned int pending;		// Jobs that have not finished
+  int feeding;			// Non-zero while more jobs are still to be added
+} fair_t;
+
+/**
+ * Initialize an empty scheduler.
+ *
+ * @param s scheduler to initialize
+ */
+void fair_init(fair_t *s);
+
+/**
+ * Free the tenants and classes
+ * of a scheduler.
+ *
+ * @param s the scheduler
+ */
+void fair_destroy(fair_t *s);
+
+/**
+ * Set the weight of a tenant or one
+ * of its classes, creating them if
+ * needed.
+ *
+ * @param s the scheduler
+ * @param tenant name of the tenant
+ * @param cls name of the class, NULL to weight the tenant
+ * @param weight share, at least 1
+ * @return 0 if successful, errno otherwise
+ */
+int fair_weight(fair_t *s, const char *tenant, const char *cls, unsigned int weight);
+
+/**
+ * Queue a job behind the other
+ * jobs of its class.
+ *
+ * @param s the scheduler
+ * @param e entry of the job
+ * @param tenant name of the tenant
+ * @param cls name of the class
+ * @return 0 if successful, errno otherwise
+ */
+int fair_add(fair_t *s, fair_entry_t *e, const char *tenant, const char *cls);
+
+/**
+ * Pick the job to read the next
+ * chunk of, waiting while every
+ * unfinished job is held by
+ * another reader.
+ *
+ * @param s the scheduler
+ * @return entry of the job, NULL once every job has finished
+ */
+fair_entry_t *fair_next(fair_t *s);
+
+/**
+ * Pick the job to read the next
+ * chunk of without waiting.
+ *
+ * @param s the scheduler
+ * @return entry of the job, NULL if every unfinished job is held
+ */
+fair_entry_t *fair_try_next(fair_t *s);
+
+/**
+ * Hand a job back after reading a
+ * chunk of it, charging the bytes
+ * read to its class and tenant.
+ *
+ * @param s the scheduler
+ * @param e entry of the job
+ * @param bytes bytes read
+ * @param finished non-zero if the job has nothing left to read
+ */
+void fair_yield(fair_t *s, fair_entry_t *e, size_t bytes, int finished);
+
+/**
+ * Mark whether more jobs are still to
+ * be added. While they are, fair_next
+ * waits for them instead of returning
+ * NULL once every queued job finished.
+ *
+ * @param s the scheduler
+ * @param feeding non-zero while jobs are still to be added
+ */
+void fair_feed(fair_t *s, int feeding);
+
+/**
+ * Wait until few enough jobs are left
+ * unfinished to add more.
+ *
+ * @param s the scheduler
+ * @param left unfinished jobs to wait for
+ * @return 0 once no more than left are unfinished, 1 if feeding was stopped
+ */
+int fair_drain(fair_t *s, unsigned int left);
+
+#endif
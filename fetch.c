@@ -0,0 +1,395 @@
+/**
+ * Source implementation of the
+ * parallel http:// range source.
+ *
+ * @author Matt Stetter
+ * @file fetch.c
+ */
+
+#include "backend.h"
+#include "cpy.h"
+#include "fetch.h"
+#include "http.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Times a range is requested before
+// the copy is given up on
+#define FETCH_TRIES 3
+
+// States of a window slot
+#define SLOT_FREE 0	// Waiting for a chunk to be assigned
+#define SLOT_FETCHING 1	// A thread is fetching its chunk
+#define SLOT_READY 2	// Holds its chunk for the producer
+
+// One chunk of the window
+typedef struct fetch_slot {
+  char *data;		// HTTP_CHUNK bytes, allocated on first use
+  int state;		// SLOT_* state
+} fetch_slot_t;
+
+// State of one download
+typedef struct fetch {
+  http_conn_t conn;	// Connection of the first request
+  http_resp_t resp;	// Response streamed when ranges are not taken
+  char target[4096];	// Path and query of the URL
+  char etag[128];	// ETag every range must match, empty if none
+  int ranged;		// Non-zero if the server takes ranges
+  off_t size;		// Size of the file, -1 if unknown
+  unsigned long long chunks; // Number of chunks in the file
+  pthread_mutex_t lock;	// Protects everything below
+  pthread_cond_t cond;	// Signalled when a slot changes state
+  fetch_slot_t *slots;	// The window
+  unsigned int window;	// Number of slots in the window
+  unsigned long long first; // Chunk the producer is reading
+  unsigned long long next; // Next chunk to assign
+  int closing;		// Non-zero once the producer is done
+  int status;		// 0, or the error that failed the download
+  pthread_t *threads;	// Fetching threads
+  unsigned int num_threads; // Number of fetching threads
+} fetch_t;
+
+// Connections fetching at once
+static unsigned int fetch_conns = HTTP_CONNS;
+
+/**
+ * Length of a chunk, the last one
+ * being cut short by the file's end.
+ *
+ * @param f the download
+ * @param i index of the chunk
+ * @return bytes in the chunk
+ */
+static size_t chunk_len(fetch_t *f, unsigned long long i) {
+  off_t off = (off_t)i * HTTP_CHUNK;
+  return f->size - off < HTTP_CHUNK ? (size_t)(f->size - off) : HTTP_CHUNK;
+}
+
+/**
+ * Request a chunk's range and check the
+ * server answered with that range of the
+ * same version of the file.
+ *
+ * @param f the download
+ * @param c connection to request on
+ * @param i index of the chunk
+ * @param r head of the response
+ * @return 0 if successful, errno otherwise
+ */
+static int request_range(fetch_t *f, http_conn_t *c, unsigned long long i, http_resp_t *r) {
+  off_t off = (off_t)i * HTTP_CHUNK;
+  char headers[256];
+  int n = snprintf(headers, sizeof(headers), "Range: bytes=%lld-%lld\r\n",
+                   (long long)off, (long long)off + HTTP_CHUNK - 1);
+  if (f->etag[0] != '\0') snprintf(headers + n, sizeof(headers) - n, "If-Match: %s\r\n", f->etag);
+
+  int err;
+  if ((err = http_request(c, "GET", f->target, headers, NULL, 0, r)) != 0) return err;
+  if (r->status == 412) {
+    fprintf(stderr, "%s:%s%s changed during the copy\n", c->host, c->port, f->target);
+    http_close(c);
+    return ESTALE;
+  }
+  if (r->status != 206 || r->range_start != off) {
+    http_close(c);
+    return EIO;
+  }
+  return 0;
+}
+
+/**
+ * Fetch one chunk into its slot,
+ * retrying failed requests.
+ *
+ * @param f the download
+ * @param c the fetching thread's connection
+ * @param i index of the chunk
+ * @param slot slot to fill
+ * @return 0 if successful, errno otherwise
+ */
+static int fetch_chunk(fetch_t *f, http_conn_t *c, unsigned long long i, fetch_slot_t *slot) {
+  if (slot->data == NULL && (slot->data = (char *)malloc(HTTP_CHUNK)) == NULL) return ENOMEM;
+
+  size_t len = chunk_len(f, i);
+  int err = 0;
+  for (int t = 0; t < FETCH_TRIES; t++) {
+    http_resp_t r;
+    size_t got;
+    if (t > 0) atomic_fetch_add(&stats.range_retries, 1);
+    if ((err = request_range(f, c, i, &r)) == ESTALE) return err;
+    if (err == 0 && (err = http_body(c, &r, slot->data, HTTP_CHUNK, &got)) == 0 && got != len) err = EIO;
+    if (err == 0) {
+      atomic_fetch_add(&stats.ranges_fetched, 1);
+      log("Fetched chunk %llu of %zu bytes\n", i, len);
+      return 0;
+    }
+  }
+  fprintf(stderr, "Could not fetch bytes %lld-%lld of %s:%s%s: %s\n", (long long)i * HTTP_CHUNK,
+          (long long)i * HTTP_CHUNK + (long long)len - 1, c->host, c->port, f->target, strerror(err));
+  return err;
+}
+
+/**
+ * Thread target fetching the chunks of
+ * the window until the file is fetched,
+ * the download fails or the producer
+ * closes it.
+ *
+ * @param args the fetch_t struct
+ * @return NULL
+ */
+static void *fetch_target(void *args) {
+  fetch_t *f = (fetch_t *)args;
+  http_conn_t c;
+  http_init(&c, f->conn.host, f->conn.port);
+
+  pthread_mutex_lock(&f->lock);
+  for (;;) {
+    while (f->status == 0 && !f->closing && f->next < f->chunks && f->next >= f->first + f->window) {
+      pthread_cond_wait(&f->cond, &f->lock);
+    }
+    if (f->status != 0 || f->closing || f->next >= f->chunks) break;
+    unsigned long long i = f->next++;
+    fetch_slot_t *slot = &f->slots[i % f->window];
+    slot->state = SLOT_FETCHING;
+    pthread_mutex_unlock(&f->lock);
+
+    int err = fetch_chunk(f, &c, i, slot);
+
+    pthread_mutex_lock(&f->lock);
+    if (err != 0 && f->status == 0) f->status = err;
+    if (err == 0) slot->state = SLOT_READY;
+    pthread_cond_broadcast(&f->cond);
+  }
+  pthread_mutex_unlock(&f->lock);
+
+  http_close(&c);
+  return NULL;
+}
+
+/**
+ * Stop the fetching threads and free
+ * the download.
+ *
+ * @param f the download
+ */
+static void fetch_free(fetch_t *f) {
+  pthread_mutex_lock(&f->lock);
+  f->closing = 1;
+  pthread_cond_broadcast(&f->cond);
+  pthread_mutex_unlock(&f->lock);
+  for (unsigned int i = 0; i < f->num_threads; i++) pthread_join(f->threads[i], NULL);
+
+  http_close(&f->conn);
+  for (unsigned int i = 0; f->slots != NULL && i < f->window; i++) free(f->slots[i].data);
+  free(f->slots);
+  free(f->threads);
+  pthread_mutex_destroy(&f->lock);
+  pthread_cond_destroy(&f->cond);
+  free(f);
+}
+
+/**
+ * Start a download. The first chunk is
+ * asked for as a range, which also tells
+ * whether the server takes ranges, the
+ * size of the file and its ETag.
+ *
+ * @param f the download
+ * @return 0 if successful, errno otherwise
+ */
+static int fetch_start(fetch_t *f) {
+  http_resp_t *r = &f->resp;
+  int err;
+  if ((err = request_range(f, &f->conn, 0, r)) != 0 && err != EIO) return err;
+
+  // An empty file cannot satisfy
+  // any range
+  if (err == EIO && r->status == 416) {
+    f->ranged = 1;
+    f->size = 0;
+    return 0;
+  }
+
+  // Servers that ignore ranges send the
+  // whole file, which is then streamed
+  if (err == EIO && r->status == 200) {
+    if ((err = http_request(&f->conn, "GET", f->target, NULL, NULL, 0, r)) != 0) return err;
+    if (r->status == 200) {
+      f->size = r->length;
+      return 0;
+    }
+  }
+  if (err == EIO || r->range_total < 0) {
+    fprintf(stderr, "%s:%s%s: status %d\n", f->conn.host, f->conn.port, f->target, r->status);
+    http_close(&f->conn);
+    return r->status == 404 ? ENOENT : r->status == 403 ? EACCES : EIO;
+  }
+
+  f->ranged = 1;
+  f->size = r->range_total;
+  f->chunks = ((unsigned long long)f->size + HTTP_CHUNK - 1) / HTTP_CHUNK;
+  snprintf(f->etag, sizeof(f->etag), "%s", r->etag);
+
+  // Keep the first chunk in the first
+  // slot of the window
+  size_t got;
+  fetch_slot_t *slot = &f->slots[0];
+  if ((slot->data = (char *)malloc(HTTP_CHUNK)) == NULL) return ENOMEM;
+  if ((err = http_body(&f->conn, r, slot->data, HTTP_CHUNK, &got)) != 0) return err;
+  if (got != chunk_len(f, 0)) return EIO;
+  atomic_fetch_add(&stats.ranges_fetched, 1);
+  slot->state = SLOT_READY;
+  f->next = 1;
+  return 0;
+}
+
+/**
+ * Open an http:// URL for reading and
+ * start the fetching threads.
+ *
+ * @param b endpoint being opened
+ * @param path the URL
+ * @param mode BE_READ
+ * @param direct unused
+ * @return 0 if successful, errno otherwise
+ */
+static int fetch_open(backend_t *b, const char *path, int mode, int direct) {
+  (void)mode;
+  (void)direct;
+  fetch_t *f = (fetch_t *)calloc(1, sizeof(fetch_t));
+  if (f == NULL) return ENOMEM;
+  pthread_mutex_init(&f->lock, NULL);
+  pthread_cond_init(&f->cond, NULL);
+  f->size = -1;
+
+  // Two chunks in the window for each
+  // connection, so every connection has
+  // a range to fetch while the producer
+  // drains the oldest
+  f->window = fetch_conns * 2;
+  f->slots = (fetch_slot_t *)calloc(f->window, sizeof(fetch_slot_t));
+  f->threads = (pthread_t *)malloc(fetch_conns * sizeof(pthread_t));
+
+  const char *target;
+  int err = f->slots == NULL || f->threads == NULL ? ENOMEM : http_parse_url(path, &f->conn, &target);
+  if (err == 0 && strlen(target) >= sizeof(f->target)) err = ENAMETOOLONG;
+  if (err == 0) {
+    snprintf(f->target, sizeof(f->target), "%s", target);
+    err = fetch_start(f);
+  }
+  for (unsigned int i = 0; err == 0 && f->ranged && i < fetch_conns && f->next < f->chunks; i++) {
+    if ((err = pthread_create(&f->threads[i], NULL, &fetch_target, f)) == 0) f->num_threads++;
+  }
+  if (err != 0) {
+    fetch_free(f);
+    return err;
+  }
+
+  log("Fetching %s, %lld bytes, %s\n", path, (long long)f->size,
+      f->ranged ? "in ranges" : "as one stream");
+  b->info.size = f->size;
+  b->priv = f;
+  return 0;
+}
+
+/**
+ * Hand the producer the next bytes of
+ * the file, waiting for their chunk to
+ * be fetched and freeing each chunk's
+ * slot once it has all been read.
+ *
+ * @param b the open endpoint
+ * @param iov spans to read into
+ * @param iovcnt number of spans
+ * @param off position of the read, which must follow on
+ * @return bytes read, 0 at the end, -1 on failure
+ */
+static ssize_t fetch_readv(backend_t *b, const struct iovec *iov, int iovcnt, off_t off) {
+  fetch_t *f = (fetch_t *)b->priv;
+  ssize_t done = 0;
+  int err;
+  for (int k = 0; k < iovcnt; k++) {
+    char *buf = (char *)iov[k].iov_base;
+    size_t len = iov[k].iov_len;
+
+    // Stream from the one response
+    if (!f->ranged) {
+      size_t got;
+      if ((err = http_read(&f->conn, &f->resp, buf, len, &got)) != 0) {
+        errno = err;
+        return done > 0 ? done : -1;
+      }
+      done += got;
+      if (got < len) break;
+      continue;
+    }
+
+    while (len > 0 && off < f->size) {
+      unsigned long long i = (unsigned long long)off / HTTP_CHUNK;
+      if (i != f->first) {
+        errno = ESPIPE;
+        return done > 0 ? done : -1;
+      }
+
+      fetch_slot_t *slot = &f->slots[i % f->window];
+      pthread_mutex_lock(&f->lock);
+      while (slot->state != SLOT_READY && f->status == 0) pthread_cond_wait(&f->cond, &f->lock);
+      err = slot->state == SLOT_READY ? 0 : f->status;
+      pthread_mutex_unlock(&f->lock);
+      if (err != 0) {
+        errno = err;
+        return done > 0 ? done : -1;
+      }
+
+      size_t at = (size_t)(off - (off_t)i * HTTP_CHUNK);
+      size_t n = chunk_len(f, i) - at < len ? chunk_len(f, i) - at : len;
+      memcpy(buf, slot->data + at, n);
+      buf += n;
+      len -= n;
+      off += n;
+      done += n;
+
+      // Give the slot to the next chunk
+      // once this one is read through
+      if (at + n == chunk_len(f, i)) {
+        pthread_mutex_lock(&f->lock);
+        slot->state = SLOT_FREE;
+        f->first++;
+        pthread_cond_broadcast(&f->cond);
+        pthread_mutex_unlock(&f->lock);
+      }
+    }
+  }
+  return done;
+}
+
+/**
+ * Stop the download.
+ *
+ * @param b the open endpoint
+ * @param abort unused
+ * @return 0
+ */
+static int fetch_close(backend_t *b, int abort) {
+  (void)abort;
+  fetch_free((fetch_t *)b->priv);
+  b->priv = NULL;
+  return 0;
+}
+
+// The http:// backend, which only reads
+static const backend_ops_t fetch_ops = {
+  "http", "http://", 0, fetch_open, fetch_readv, NULL, NULL, fetch_close
+};
+
+// Size the window and register.
+int fetch_register(options_t *o) {
+  if (o->threads != 0) fetch_conns = o->threads;
+  return backend_register(&fetch_ops);
+}
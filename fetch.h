@@ -0,0 +1,36 @@
+/**
+ * Source backend for http:// URLs.
+ * Servers that take Range requests have
+ * the file fetched in HTTP_CHUNK ranges
+ * by several threads, each over its own
+ * kept-alive connection, a window of
+ * chunks ahead of the producer. Chunks
+ * are handed to the producer in order
+ * from the window, which acts as the
+ * reorder buffer. Every range is fetched
+ * with If-Match on the first response's
+ * ETag, so a file replaced during the
+ * copy fails it instead of mixing the
+ * two versions. Servers that ignore
+ * ranges are read as a single stream.
+ *
+ * @author Matt Stetter
+ * @file fetch.h
+ */
+
+#include "options.h"
+
+#ifndef FETCH_H_
+#define FETCH_H_
+
+/**
+ * Register the http:// backend. The
+ * number of connections fetching at
+ * once is taken from --jobs.
+ *
+ * @param o the parsed options
+ * @return 0 if successful, errno otherwise
+ */
+int fetch_register(options_t *o);
+
+#endif
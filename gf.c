@@ -0,0 +1,203 @@
+/**
+ * Source implementation of the
+ * GF(2^8) arithmetic.
+ *
+ * @author Matt Stetter
+ * @file gf.c
+ */
+
+#include "gf.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GF_X86 1
+#endif
+
+// Field polynomial x^8 + x^4 + x^3 + x^2 + 1
+#define GF_POLY 0x11d
+
+// Region kernels
+#define KERNEL_SCALAR 0
+#define KERNEL_SSSE3 1
+#define KERNEL_AVX2 2
+
+// Logarithm and exponent tables, the
+// exponents doubled so sums of two
+// logarithms need no reduction, and
+// the kernel, picked on first use
+static uint8_t gf_log[256];
+static uint8_t gf_exp[510];
+static int kernel;
+static pthread_once_t gf_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Fill in the tables and pick the
+ * fastest kernel the CPU runs.
+ */
+static void gf_init(void) {
+  unsigned int x = 1;
+  for (int i = 0; i < 255; i++) {
+    gf_exp[i] = gf_exp[i + 255] = (uint8_t)x;
+    gf_log[x] = (uint8_t)i;
+    if ((x <<= 1) & 0x100) x ^= GF_POLY;
+  }
+
+  kernel = KERNEL_SCALAR;
+#ifdef GF_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("ssse3")) kernel = KERNEL_SSSE3;
+  if (__builtin_cpu_supports("avx2")) kernel = KERNEL_AVX2;
+#endif
+}
+
+// Multiply.
+uint8_t gf_mul(uint8_t a, uint8_t b) {
+  pthread_once(&gf_once, gf_init);
+  if (a == 0 || b == 0) return 0;
+  return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+// Divide.
+uint8_t gf_div(uint8_t a, uint8_t b) {
+  pthread_once(&gf_once, gf_init);
+  if (a == 0) return 0;
+  return gf_exp[gf_log[a] + 255 - gf_log[b]];
+}
+
+#ifdef GF_X86
+/**
+ * Multiply-add 16 bytes at a time
+ * with SSSE3's PSHUFB.
+ *
+ * @param dst region added to
+ * @param src region multiplied
+ * @param lo products of the low nibbles
+ * @param hi products of the high nibbles
+ * @param len bytes in each region, a multiple of 16
+ */
+__attribute__((target("ssse3")))
+static void mul_add_ssse3(uint8_t *dst, const uint8_t *src, const uint8_t *lo, const uint8_t *hi,
+                          size_t len) {
+  __m128i tlo = _mm_loadu_si128((const __m128i *)lo);
+  __m128i thi = _mm_loadu_si128((const __m128i *)hi);
+  __m128i mask = _mm_set1_epi8(0x0f);
+  for (size_t i = 0; i < len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i l = _mm_shuffle_epi8(tlo, _mm_and_si128(v, mask));
+    __m128i h = _mm_shuffle_epi8(thi, _mm_and_si128(_mm_srli_epi64(v, 4), mask));
+    __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, _mm_xor_si128(l, h)));
+  }
+}
+
+/**
+ * Multiply-add 32 bytes at a time
+ * with AVX2's VPSHUFB.
+ *
+ * @param dst region added to
+ * @param src region multiplied
+ * @param lo products of the low nibbles
+ * @param hi products of the high nibbles
+ * @param len bytes in each region, a multiple of 32
+ */
+__attribute__((target("avx2")))
+static void mul_add_avx2(uint8_t *dst, const uint8_t *src, const uint8_t *lo, const uint8_t *hi,
+                         size_t len) {
+  __m256i tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lo));
+  __m256i thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hi));
+  __m256i mask = _mm256_set1_epi8(0x0f);
+  for (size_t i = 0; i < len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i l = _mm256_shuffle_epi8(tlo, _mm256_and_si256(v, mask));
+    __m256i h = _mm256_shuffle_epi8(thi, _mm256_and_si256(_mm256_srli_epi64(v, 4), mask));
+    __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(d, _mm256_xor_si256(l, h)));
+  }
+}
+#endif
+
+// Multiply a region by a constant
+// and add it into another.
+void gf_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+  pthread_once(&gf_once, gf_init);
+  if (c == 0) return;
+
+  // The product of a byte is the sum of
+  // the products of its two nibbles
+  uint8_t lo[16], hi[16];
+  for (int x = 0; x < 16; x++) {
+    lo[x] = gf_mul(c, (uint8_t)x);
+    hi[x] = gf_mul(c, (uint8_t)(x << 4));
+  }
+
+  size_t done = 0;
+#ifdef GF_X86
+  if (kernel == KERNEL_AVX2) {
+    done = len / 32 * 32;
+    mul_add_avx2(dst, src, lo, hi, done);
+  } else if (kernel == KERNEL_SSSE3) {
+    done = len / 16 * 16;
+    mul_add_ssse3(dst, src, lo, hi, done);
+  }
+#endif
+  for (size_t i = done; i < len; i++) dst[i] ^= lo[src[i] & 0x0f] ^ hi[src[i] >> 4];
+}
+
+// Invert a matrix by Gauss-Jordan
+// elimination against the identity.
+int gf_invert(uint8_t *m, unsigned int n) {
+  uint8_t *inv = (uint8_t *)calloc(n * n, 1);
+  if (inv == NULL) return ENOMEM;
+  for (unsigned int i = 0; i < n; i++) inv[i * n + i] = 1;
+
+  for (unsigned int col = 0; col < n; col++) {
+
+    // Swap a row with a non-zero
+    // pivot into place
+    unsigned int piv = col;
+    while (piv < n && m[piv * n + col] == 0) piv++;
+    if (piv == n) {
+      free(inv);
+      return EINVAL;
+    }
+    for (unsigned int j = 0; piv != col && j < n; j++) {
+      uint8_t t = m[col * n + j];
+      m[col * n + j] = m[piv * n + j];
+      m[piv * n + j] = t;
+      t = inv[col * n + j];
+      inv[col * n + j] = inv[piv * n + j];
+      inv[piv * n + j] = t;
+    }
+
+    // Scale the pivot to 1 and clear
+    // the column from the other rows
+    uint8_t p = m[col * n + col];
+    for (unsigned int j = 0; j < n; j++) {
+      m[col * n + j] = gf_div(m[col * n + j], p);
+      inv[col * n + j] = gf_div(inv[col * n + j], p);
+    }
+    for (unsigned int r = 0; r < n; r++) {
+      uint8_t f = m[r * n + col];
+      if (r == col || f == 0) continue;
+      for (unsigned int j = 0; j < n; j++) {
+        m[r * n + j] ^= gf_mul(f, m[col * n + j]);
+        inv[r * n + j] ^= gf_mul(f, inv[col * n + j]);
+      }
+    }
+  }
+
+  memcpy(m, inv, n * n);
+  free(inv);
+  return 0;
+}
+
+// Name the kernel.
+const char *gf_kernel(void) {
+  pthread_once(&gf_once, gf_init);
+  return kernel == KERNEL_AVX2 ? "avx2" : kernel == KERNEL_SSSE3 ? "ssse3" : "scalar";
+}
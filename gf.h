@@ -0,0 +1,67 @@
+/**
+ * Arithmetic in GF(2^8) for the erasure
+ * coder. Regions are multiplied by a
+ * constant with two 16 entry tables, one
+ * for each nibble of a byte, looked up
+ * 16 or 32 bytes at a time with PSHUFB
+ * when the CPU has SSSE3 or AVX2, and a
+ * byte at a time otherwise.
+ *
+ * @author Matt Stetter
+ * @file gf.h
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef GF_H_
+#define GF_H_
+
+/**
+ * Multiply two elements.
+ *
+ * @param a first element
+ * @param b second element
+ * @return the product
+ */
+uint8_t gf_mul(uint8_t a, uint8_t b);
+
+/**
+ * Divide two elements.
+ *
+ * @param a dividend
+ * @param b divisor, which must not be 0
+ * @return the quotient
+ */
+uint8_t gf_div(uint8_t a, uint8_t b);
+
+/**
+ * Multiply a region by a constant and
+ * add (XOR) it into another.
+ *
+ * @param dst region added to
+ * @param src region multiplied
+ * @param c the constant
+ * @param len bytes in each region
+ */
+void gf_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len);
+
+/**
+ * Invert a square matrix in place by
+ * Gauss-Jordan elimination.
+ *
+ * @param m the matrix, row by row
+ * @param n number of rows and columns
+ * @return 0 if successful, EINVAL if the matrix is singular, ENOMEM otherwise
+ */
+int gf_invert(uint8_t *m, unsigned int n);
+
+/**
+ * Name of the region kernel in use,
+ * for the stats.
+ *
+ * @return "avx2", "ssse3" or "scalar"
+ */
+const char *gf_kernel(void);
+
+#endif
@@ -0,0 +1,197 @@
+/**
+ * Source implementation of SHA-256,
+ * HMAC-SHA256 and CRC32C.
+ *
+ * @author Matt Stetter
+ * @file hash.c
+ */
+
+#include "hash.h"
+
+#include <pthread.h>
+#include <string.h>
+
+// Round constants of SHA-256
+static const uint32_t k256[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+// Table for CRC32C a byte at a time,
+// filled in on first use
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/**
+ * Mix one 64 byte block into a digest.
+ *
+ * @param s the digest
+ * @param p the block
+ */
+static void sha256_block(sha256_t *s, const unsigned char *p) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++) {
+    w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 |
+           (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+  }
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  uint32_t a = s->h[0], b = s->h[1], c = s->h[2], d = s->h[3];
+  uint32_t e = s->h[4], f = s->h[5], g = s->h[6], h = s->h[7];
+  for (int i = 0; i < 64; i++) {
+    uint32_t t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + k256[i] + w[i];
+    uint32_t t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  s->h[0] += a;
+  s->h[1] += b;
+  s->h[2] += c;
+  s->h[3] += d;
+  s->h[4] += e;
+  s->h[5] += f;
+  s->h[6] += g;
+  s->h[7] += h;
+}
+
+// Load the initial hash values.
+void sha256_init(sha256_t *s) {
+  static const uint32_t init[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+  memcpy(s->h, init, sizeof(init));
+  s->len = 0;
+}
+
+// Fill the partial block and mix in
+// whole blocks straight from the data.
+void sha256_update(sha256_t *s, const void *data, size_t len) {
+  const unsigned char *p = (const unsigned char *)data;
+  size_t have = s->len % 64;
+  s->len += len;
+
+  if (have > 0) {
+    size_t n = 64 - have < len ? 64 - have : len;
+    memcpy(s->buf + have, p, n);
+    p += n;
+    len -= n;
+    if (have + n < 64) return;
+    sha256_block(s, s->buf);
+  }
+  for (; len >= 64; p += 64, len -= 64) sha256_block(s, p);
+  memcpy(s->buf, p, len);
+}
+
+// Pad with a one bit, zeros and the
+// length in bits.
+void sha256_final(sha256_t *s, unsigned char out[SHA256_LEN]) {
+  uint64_t bits = s->len * 8;
+  unsigned char pad[72] = { 0x80 };
+  size_t n = (s->len % 64 < 56 ? 56 : 120) - s->len % 64;
+  for (int i = 0; i < 8; i++) pad[n + i] = (unsigned char)(bits >> (56 - 8 * i));
+  sha256_update(s, pad, n + 8);
+
+  for (int i = 0; i < 8; i++) {
+    out[4 * i] = (unsigned char)(s->h[i] >> 24);
+    out[4 * i + 1] = (unsigned char)(s->h[i] >> 16);
+    out[4 * i + 2] = (unsigned char)(s->h[i] >> 8);
+    out[4 * i + 3] = (unsigned char)s->h[i];
+  }
+}
+
+// Digest a whole buffer.
+void sha256(const void *data, size_t len, unsigned char out[SHA256_LEN]) {
+  sha256_t s;
+  sha256_init(&s);
+  sha256_update(&s, data, len);
+  sha256_final(&s, out);
+}
+
+// HMAC with keys longer than a block
+// hashed down first.
+void hmac_sha256(const void *key, size_t key_len, const void *msg, size_t msg_len,
+                 unsigned char out[SHA256_LEN]) {
+  unsigned char k[64] = { 0 };
+  if (key_len > 64) sha256(key, key_len, k);
+  else memcpy(k, key, key_len);
+
+  unsigned char pad[64];
+  unsigned char inner[SHA256_LEN];
+  sha256_t s;
+  for (int i = 0; i < 64; i++) pad[i] = k[i] ^ 0x36;
+  sha256_init(&s);
+  sha256_update(&s, pad, 64);
+  sha256_update(&s, msg, msg_len);
+  sha256_final(&s, inner);
+
+  for (int i = 0; i < 64; i++) pad[i] = k[i] ^ 0x5c;
+  sha256_init(&s);
+  sha256_update(&s, pad, 64);
+  sha256_update(&s, inner, SHA256_LEN);
+  sha256_final(&s, out);
+}
+
+/**
+ * Fill in the CRC32C table for the
+ * reflected Castagnoli polynomial.
+ */
+static void crc_init(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int j = 0; j < 8; j++) c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+    crc_table[i] = c;
+  }
+}
+
+// Extend a CRC32C a byte at a time.
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+  pthread_once(&crc_once, crc_init);
+  const unsigned char *p = (const unsigned char *)data;
+  crc = ~crc;
+  while (len--) crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+// Hex encode.
+void hash_hex(const unsigned char *data, size_t len, char *out) {
+  static const char digits[] = "0123456789abcdef";
+  for (size_t i = 0; i < len; i++) {
+    out[2 * i] = digits[data[i] >> 4];
+    out[2 * i + 1] = digits[data[i] & 0xf];
+  }
+  out[2 * len] = '\0';
+}
+
+// Base64 encode with padding.
+void hash_base64(const unsigned char *data, size_t len, char *out) {
+  static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  size_t o = 0;
+  for (size_t i = 0; i < len; i += 3) {
+    uint32_t v = (uint32_t)data[i] << 16;
+    if (i + 1 < len) v |= (uint32_t)data[i + 1] << 8;
+    if (i + 2 < len) v |= data[i + 2];
+    out[o++] = digits[v >> 18];
+    out[o++] = digits[(v >> 12) & 0x3f];
+    out[o++] = i + 1 < len ? digits[(v >> 6) & 0x3f] : '=';
+    out[o++] = i + 2 < len ? digits[v & 0x3f] : '=';
+  }
+  out[o] = '\0';
+}
@@ -0,0 +1,102 @@
+/**
+ * Checksums and digests used to sign
+ * and verify data sent to and read from
+ * other backends: SHA-256 with HMAC for
+ * request signing and content hashes,
+ * and CRC32C for cheap per-part checks.
+ *
+ * @author Matt Stetter
+ * @file hash.h
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef HASH_H_
+#define HASH_H_
+
+// Bytes in a SHA-256 digest
+#define SHA256_LEN 32
+
+// State of a SHA-256 digest being computed
+typedef struct sha256 {
+  uint32_t h[8];	// Hash of the blocks so far
+  uint64_t len;		// Bytes added so far
+  unsigned char buf[64]; // Partial block
+} sha256_t;
+
+/**
+ * Start a SHA-256 digest.
+ *
+ * @param s state to set up
+ */
+void sha256_init(sha256_t *s);
+
+/**
+ * Add bytes to a SHA-256 digest.
+ *
+ * @param s the digest
+ * @param data bytes to add
+ * @param len number of bytes
+ */
+void sha256_update(sha256_t *s, const void *data, size_t len);
+
+/**
+ * Finish a SHA-256 digest.
+ *
+ * @param s the digest
+ * @param out the SHA256_LEN byte digest
+ */
+void sha256_final(sha256_t *s, unsigned char out[SHA256_LEN]);
+
+/**
+ * Digest a buffer in one call.
+ *
+ * @param data bytes to digest
+ * @param len number of bytes
+ * @param out the SHA256_LEN byte digest
+ */
+void sha256(const void *data, size_t len, unsigned char out[SHA256_LEN]);
+
+/**
+ * HMAC-SHA256 of a message.
+ *
+ * @param key the key
+ * @param key_len bytes in the key
+ * @param msg the message
+ * @param msg_len bytes in the message
+ * @param out the SHA256_LEN byte MAC
+ */
+void hmac_sha256(const void *key, size_t key_len, const void *msg, size_t msg_len,
+                 unsigned char out[SHA256_LEN]);
+
+/**
+ * Extend a CRC32C (Castagnoli) checksum.
+ * Start from 0 for a new checksum.
+ *
+ * @param crc checksum of the bytes before
+ * @param data bytes to add
+ * @param len number of bytes
+ * @return checksum including the bytes
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+/**
+ * Write bytes as lower case hex.
+ *
+ * @param data bytes to write
+ * @param len number of bytes
+ * @param out buffer of 2 * len + 1 characters
+ */
+void hash_hex(const unsigned char *data, size_t len, char *out);
+
+/**
+ * Write bytes as base64.
+ *
+ * @param data bytes to write
+ * @param len number of bytes
+ * @param out buffer of 4 * ((len + 2) / 3) + 1 characters
+ */
+void hash_base64(const unsigned char *data, size_t len, char *out);
+
+#endif
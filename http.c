@@ -0,0 +1,395 @@
+/**
+ * Source implementation of the
+ * minimal HTTP/1.1 client.
+ *
+ * @author Matt Stetter
+ * @file http.c
+ */
+
+#include "cpy.h"
+#include "http.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+// Split the URL, keeping the path in
+// the URL string.
+int http_parse_url(const char *url, http_conn_t *c, const char **path) {
+  if (strncmp(url, "https://", 8) == 0) return EPROTONOSUPPORT;
+  if (strncmp(url, "http://", 7) != 0) return EINVAL;
+
+  const char *host = url + 7;
+  const char *end = host + strcspn(host, "/");
+  const char *colon = memchr(host, ':', (size_t)(end - host));
+  const char *host_end = colon != NULL ? colon : end;
+  if (host_end == host || (size_t)(host_end - host) >= sizeof(c->host)) return EINVAL;
+
+  char h[sizeof(c->host)];
+  char p[sizeof(c->port)] = "80";
+  memcpy(h, host, (size_t)(host_end - host));
+  h[host_end - host] = '\0';
+  if (colon != NULL) {
+    if ((size_t)(end - colon - 1) >= sizeof(p) || end == colon + 1) return EINVAL;
+    memcpy(p, colon + 1, (size_t)(end - colon - 1));
+    p[end - colon - 1] = '\0';
+  }
+
+  http_init(c, h, p);
+  *path = *end != '\0' ? end : "/";
+  return 0;
+}
+
+// Remember the server.
+void http_init(http_conn_t *c, const char *host, const char *port) {
+  c->fd = -1;
+  snprintf(c->host, sizeof(c->host), "%s", host);
+  snprintf(c->port, sizeof(c->port), "%s", port);
+  c->pos = 0;
+  c->len = 0;
+}
+
+// Close the socket, dropping anything
+// still buffered from it.
+void http_close(http_conn_t *c) {
+  if (c->fd != -1) close(c->fd);
+  c->fd = -1;
+  c->pos = 0;
+  c->len = 0;
+}
+
+/**
+ * Connect to the server, trying each
+ * address it resolves to.
+ *
+ * @param c the connection
+ * @return 0 if successful, errno otherwise
+ */
+static int http_connect(http_conn_t *c) {
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(c->host, c->port, &hints, &res) != 0) return EHOSTUNREACH;
+
+  int err = ECONNREFUSED;
+  for (struct addrinfo *a = res; a != NULL; a = a->ai_next) {
+    int fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+    if (fd == -1) {
+      err = errno;
+      continue;
+    }
+    if (connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+      err = errno;
+      close(fd);
+      continue;
+    }
+
+    struct timeval tv = { HTTP_TIMEOUT, 0 };
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c->fd = fd;
+    c->pos = 0;
+    c->len = 0;
+    err = 0;
+    break;
+  }
+  freeaddrinfo(res);
+
+  log("Connected to %s:%s\n", c->host, c->port);
+  return err;
+}
+
+/**
+ * Receive more bytes into the buffer,
+ * moving the unconsumed ones to the
+ * front first.
+ *
+ * @param c the connection
+ * @return 0 if successful, ECONNRESET at the end, errno otherwise
+ */
+static int fill(http_conn_t *c) {
+  if (c->pos > 0) {
+    memmove(c->buf, c->buf + c->pos, c->len - c->pos);
+    c->len -= c->pos;
+    c->pos = 0;
+  }
+  if (c->len == sizeof(c->buf)) return EMSGSIZE;
+
+  ssize_t n;
+  do {
+    n = recv(c->fd, c->buf + c->len, sizeof(c->buf) - c->len, 0);
+  } while (n == -1 && errno == EINTR);
+  if (n == 0) return ECONNRESET;
+  if (n == -1) return errno == EAGAIN ? ETIMEDOUT : errno;
+  c->len += n;
+  return 0;
+}
+
+/**
+ * Take the next CRLF terminated line.
+ * The line stays valid until the
+ * connection is read from again.
+ *
+ * @param c the connection
+ * @param line returned line without its CRLF
+ * @return 0 if successful, errno otherwise
+ */
+static int read_line(http_conn_t *c, char **line) {
+  int err;
+  for (;;) {
+    char *start = c->buf + c->pos;
+    char *nl = memchr(start, '\n', c->len - c->pos);
+    if (nl != NULL) {
+      *nl = '\0';
+      if (nl > start && nl[-1] == '\r') nl[-1] = '\0';
+      c->pos = (size_t)(nl + 1 - c->buf);
+      *line = start;
+      return 0;
+    }
+    if ((err = fill(c)) != 0) return err;
+  }
+}
+
+/**
+ * Send all of the request head and body.
+ *
+ * @param c the connection
+ * @param head the request head
+ * @param head_len bytes in the head
+ * @param body request body, or NULL
+ * @param len bytes in the body
+ * @return 0 if successful, errno otherwise
+ */
+static int send_all(http_conn_t *c, const char *head, size_t head_len, const void *body, size_t len) {
+  struct iovec iov[2] = { { (void *)head, head_len }, { (void *)body, len } };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = body != NULL && len > 0 ? 2 : 1;
+
+  while (msg.msg_iovlen > 0) {
+    ssize_t n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+    if (n == -1 && errno == EINTR) continue;
+    if (n == -1) return errno == EAGAIN ? ETIMEDOUT : errno;
+    while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov[0].iov_len) {
+      n -= msg.msg_iov[0].iov_len;
+      msg.msg_iov++;
+      msg.msg_iovlen--;
+    }
+    if (msg.msg_iovlen > 0) {
+      msg.msg_iov[0].iov_base = (char *)msg.msg_iov[0].iov_base + n;
+      msg.msg_iov[0].iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Read the status line and headers
+ * of a response.
+ *
+ * @param c the connection
+ * @param r head to fill in
+ * @return 0 if successful, errno otherwise
+ */
+static int read_head(http_conn_t *c, http_resp_t *r) {
+  char *line;
+  int err;
+  if ((err = read_line(c, &line)) != 0) return err;
+
+  int minor;
+  if (sscanf(line, "HTTP/1.%d %d", &minor, &r->status) != 2) return EPROTO;
+  r->length = -1;
+  r->chunked = 0;
+  r->close = minor == 0;
+  r->etag[0] = '\0';
+  r->range_start = -1;
+  r->range_total = -1;
+
+  for (;;) {
+    if ((err = read_line(c, &line)) != 0) return err;
+    if (*line == '\0') break;
+
+    char *val = strchr(line, ':');
+    if (val == NULL) continue;
+    *val++ = '\0';
+    val += strspn(val, " \t");
+
+    if (strcasecmp(line, "Content-Length") == 0) {
+      r->length = strtoll(val, NULL, 10);
+    } else if (strcasecmp(line, "Transfer-Encoding") == 0) {
+      r->chunked = strcasestr(val, "chunked") != NULL;
+    } else if (strcasecmp(line, "Connection") == 0) {
+      if (strcasecmp(val, "close") == 0) r->close = 1;
+      if (strcasecmp(val, "keep-alive") == 0) r->close = 0;
+    } else if (strcasecmp(line, "ETag") == 0) {
+      snprintf(r->etag, sizeof(r->etag), "%s", val);
+    } else if (strcasecmp(line, "Content-Range") == 0) {
+      long long start, last, total;
+      if (sscanf(val, "bytes %lld-%lld/%lld", &start, &last, &total) == 3) {
+        r->range_start = start;
+        r->range_total = total;
+      } else if (sscanf(val, "bytes %lld-%lld/*", &start, &last) == 2) {
+        r->range_start = start;
+      }
+    }
+  }
+  return 0;
+}
+
+// Send the request, resending it once
+// on a fresh connection if a kept-alive
+// one turns out to have been closed.
+int http_request(http_conn_t *c, const char *method, const char *target, const char *headers,
+                 const void *body, size_t len, http_resp_t *r) {
+  if (headers == NULL) headers = "";
+  size_t cap = strlen(method) + strlen(target) + strlen(c->host) + strlen(headers) + 128;
+  char *head = (char *)malloc(cap);
+  if (head == NULL) return ENOMEM;
+
+  int has_body = body != NULL || strcmp(method, "PUT") == 0 || strcmp(method, "POST") == 0;
+  int n = snprintf(head, cap, "%s %s HTTP/1.1\r\nHost: %s%s%s\r\n%s", method, target, c->host,
+                   strcmp(c->port, "80") == 0 ? "" : ":", strcmp(c->port, "80") == 0 ? "" : c->port,
+                   headers);
+  if (has_body) n += snprintf(head + n, cap - n, "Content-Length: %zu\r\n", len);
+  n += snprintf(head + n, cap - n, "\r\n");
+
+  int err = 0;
+  for (int attempt = 0; attempt < 2; attempt++) {
+    int reused = c->fd != -1;
+    if (!reused && (err = http_connect(c)) != 0) break;
+    if ((err = send_all(c, head, (size_t)n, body, len)) == 0 && (err = read_head(c, r)) == 0) break;
+    http_close(c);
+    if (!reused || err == ETIMEDOUT) break;
+    log("Reconnecting to %s:%s after %s\n", c->host, c->port, strerror(err));
+  }
+  free(head);
+  if (err != 0) return err;
+
+  // Responses to HEAD, and these
+  // statuses, never have a body
+  if (strcmp(method, "HEAD") == 0 || r->status == 204 || r->status == 304) {
+    r->length = 0;
+    r->chunked = 0;
+  }
+  r->left = r->length;
+  return 0;
+}
+
+/**
+ * Consume bytes of the body, storing
+ * as many as fit in the buffer. Large
+ * reads go straight from the socket
+ * into the buffer.
+ *
+ * @param c the connection
+ * @param want bytes to consume, -1 for everything up to the end
+ * @param buf buffer for the body, or NULL
+ * @param cap size of the buffer
+ * @param got bytes stored so far, updated
+ * @return 0 if successful, errno otherwise
+ */
+static int consume(http_conn_t *c, long long want, char *buf, size_t cap, size_t *got) {
+  int err;
+  while (want != 0) {
+    if (c->pos == c->len) {
+      size_t room = buf != NULL ? cap - *got : 0;
+      if (want > 0 && (long long)room >= want && room >= sizeof(c->buf)) {
+        ssize_t n;
+        do {
+          n = recv(c->fd, buf + *got, (size_t)want, 0);
+        } while (n == -1 && errno == EINTR);
+        if (n == 0) return ECONNRESET;
+        if (n == -1) return errno == EAGAIN ? ETIMEDOUT : errno;
+        *got += n;
+        want -= n;
+        continue;
+      }
+      if ((err = fill(c)) != 0) return want < 0 && err == ECONNRESET ? 0 : err;
+    }
+
+    size_t n = c->len - c->pos;
+    if (want > 0 && (long long)n > want) n = (size_t)want;
+    if (buf != NULL && *got < cap) {
+      size_t keep = n < cap - *got ? n : cap - *got;
+      memcpy(buf + *got, c->buf + c->pos, keep);
+      *got += keep;
+    }
+    c->pos += n;
+    if (want > 0) want -= n;
+  }
+  return 0;
+}
+
+// Read the body by its length, its
+// chunks or up to the end of the
+// connection.
+int http_body(http_conn_t *c, http_resp_t *r, void *buf, size_t cap, size_t *got) {
+  *got = 0;
+  int err = 0;
+  if (r->chunked) {
+    char *line;
+    for (;;) {
+      if ((err = read_line(c, &line)) != 0) break;
+      long long size = strtoll(line, NULL, 16);
+      if (size == 0) {
+        do {
+          err = read_line(c, &line);
+        } while (err == 0 && *line != '\0');
+        break;
+      }
+      if ((err = consume(c, size, (char *)buf, cap, got)) != 0) break;
+      if ((err = read_line(c, &line)) != 0) break;
+    }
+  } else if (r->length >= 0) {
+    err = consume(c, r->length, (char *)buf, cap, got);
+  } else {
+    err = consume(c, -1, (char *)buf, cap, got);
+    r->close = 1;
+  }
+
+  if (err != 0 || r->close) http_close(c);
+  return err;
+}
+
+// Hand out buffered bytes first, then
+// receive straight into the buffer.
+int http_read(http_conn_t *c, http_resp_t *r, void *buf, size_t cap, size_t *got) {
+  *got = 0;
+  if (r->chunked) return EOPNOTSUPP;
+  size_t want = r->left >= 0 && (long long)cap > r->left ? (size_t)r->left : cap;
+  if (want == 0) return 0;
+
+  if (c->pos < c->len) {
+    size_t n = c->len - c->pos < want ? c->len - c->pos : want;
+    memcpy(buf, c->buf + c->pos, n);
+    c->pos += n;
+    *got = n;
+  } else {
+    ssize_t n;
+    do {
+      n = recv(c->fd, buf, want, 0);
+    } while (n == -1 && errno == EINTR);
+    if (n == -1) return errno == EAGAIN ? ETIMEDOUT : errno;
+    if (n == 0) {
+      http_close(c);
+      return r->left > 0 ? ECONNRESET : 0;
+    }
+    *got = (size_t)n;
+  }
+
+  if (r->left > 0) r->left -= *got;
+  if (r->left == 0 && r->close) http_close(c);
+  return 0;
+}
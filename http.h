@@ -0,0 +1,127 @@
+/**
+ * Minimal HTTP/1.1 client for the
+ * backends that talk to object stores
+ * and mirrors. Connections are kept
+ * alive between requests, bodies are
+ * sent from and read into the caller's
+ * buffers, and only plain http:// URLs
+ * are supported since cpy links no TLS
+ * library.
+ *
+ * @author Matt Stetter
+ * @file http.h
+ */
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifndef HTTP_H_
+#define HTTP_H_
+
+// Bytes buffered from the socket, which
+// bounds the size of a response head
+#define HTTP_BUF (16 * 1024)
+
+// Seconds a send or receive may stall
+// before the request fails
+#define HTTP_TIMEOUT 30
+
+// A connection to one server
+typedef struct http_conn {
+  int fd;		// Socket, -1 while not connected
+  char host[256];	// Host name or address of the server
+  char port[8];		// Port of the server
+  char buf[HTTP_BUF];	// Bytes received and not consumed yet
+  size_t pos;		// Start of the unconsumed bytes
+  size_t len;		// End of the unconsumed bytes
+} http_conn_t;
+
+// Head of a response
+typedef struct http_resp {
+  int status;		// Status code
+  long long length;	// Content-Length, -1 if not given
+  int chunked;		// Non-zero for a chunked body
+  int close;		// Non-zero if the server closes the connection after
+  char etag[128];	// ETag header, empty if there was none
+  off_t range_start;	// First byte of a Content-Range, -1 if none
+  off_t range_total;	// Total size from a Content-Range, -1 if unknown
+  long long left;	// Body bytes http_read has not returned yet
+} http_resp_t;
+
+/**
+ * Split an http:// URL into its host,
+ * port (80 if not given) and path.
+ *
+ * @param url the URL
+ * @param c connection to set the server of
+ * @param path returned path, "/" if the URL has none
+ * @return 0 if successful, EPROTONOSUPPORT or EINVAL otherwise
+ */
+int http_parse_url(const char *url, http_conn_t *c, const char **path);
+
+/**
+ * Set up a connection to a server
+ * without connecting yet.
+ *
+ * @param c connection to set up
+ * @param host host name or address
+ * @param port port number
+ */
+void http_init(http_conn_t *c, const char *host, const char *port);
+
+/**
+ * Send a request and read the head of
+ * the response, connecting first if
+ * needed. A kept-alive connection the
+ * server has since closed is opened
+ * again and the request resent.
+ *
+ * @param c the connection
+ * @param method request method
+ * @param target path and query of the request
+ * @param headers extra header lines, each ending in CRLF, or NULL
+ * @param body request body, or NULL
+ * @param len bytes in the body
+ * @param r head of the response to fill in
+ * @return 0 if successful, errno otherwise
+ */
+int http_request(http_conn_t *c, const char *method, const char *target, const char *headers,
+                 const void *body, size_t len, http_resp_t *r);
+
+/**
+ * Read the body of a response. Bytes
+ * past the end of the buffer are read
+ * and thrown away, so the connection
+ * can carry the next request.
+ *
+ * @param c the connection
+ * @param r head of the response
+ * @param buf buffer for the body, or NULL to discard it
+ * @param cap size of the buffer
+ * @param got returned number of bytes stored
+ * @return 0 if successful, errno otherwise
+ */
+int http_body(http_conn_t *c, http_resp_t *r, void *buf, size_t cap, size_t *got);
+
+/**
+ * Read the next bytes of a body that is
+ * not chunked, returning as soon as any
+ * arrive like read does.
+ *
+ * @param c the connection
+ * @param r head of the response
+ * @param buf buffer for the bytes
+ * @param cap size of the buffer
+ * @param got returned number of bytes, 0 at the end of the body
+ * @return 0 if successful, errno otherwise
+ */
+int http_read(http_conn_t *c, http_resp_t *r, void *buf, size_t cap, size_t *got);
+
+/**
+ * Close the connection's socket.
+ *
+ * @param c the connection
+ */
+void http_close(http_conn_t *c);
+
+#endif
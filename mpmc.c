@@ -0,0 +1,169 @@
+/**
+ * Source implementation of the
+ * bounded MPMC queue.
+ *
+ * @author Matt Stetter
+ * @file mpmc.c
+ */
+
+#include "mpmc.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Create the queue with every slot
+// ready for the push at its index.
+int mpmc_init(mpmc_t *q, size_t capacity) {
+  size_t size = 2;
+  while (size < capacity) size <<= 1;
+
+  q->cells = (mpmc_cell_t *)malloc(size * sizeof(mpmc_cell_t));
+  if (q->cells == NULL) return ENOMEM;
+  for (size_t i = 0; i < size; i++) {
+    atomic_init(&q->cells[i].seq, i);
+  }
+  q->mask = size - 1;
+  atomic_init(&q->head, 0);
+  atomic_init(&q->tail, 0);
+  atomic_init(&q->pushed, 0);
+  atomic_init(&q->popped, 0);
+  atomic_init(&q->sleepers, 0);
+  return 0;
+}
+
+// Free the slots.
+void mpmc_destroy(mpmc_t *q) {
+  free(q->cells);
+  q->cells = NULL;
+}
+
+// A slot whose sequence equals the
+// head position is free for that push.
+// A smaller sequence means the pop of
+// the previous lap has not finished,
+// so the queue is full.
+int mpmc_try_push(mpmc_t *q, void *item) {
+  size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+  for (;;) {
+    mpmc_cell_t *cell = &q->cells[pos & q->mask];
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+                                                memory_order_relaxed, memory_order_relaxed)) {
+        cell->item = item;
+        atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+        return 0;
+      }
+    } else if (diff < 0) {
+      return EAGAIN;
+    } else {
+      pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    }
+  }
+}
+
+// A slot whose sequence is one past
+// the tail position holds the item for
+// that pop. Once taken, the slot is
+// handed to the push one lap later.
+int mpmc_try_pop(mpmc_t *q, void **item) {
+  size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  for (;;) {
+    mpmc_cell_t *cell = &q->cells[pos & q->mask];
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+                                                memory_order_relaxed, memory_order_relaxed)) {
+        *item = cell->item;
+        atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+        return 0;
+      }
+    } else if (diff < 0) {
+      return EAGAIN;
+    } else {
+      pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    }
+  }
+}
+
+/**
+ * Bump an event counter and wake
+ * every thread asleep on the queue
+ * if there are any.
+ *
+ * @param q the queue
+ * @param ev pushed or popped counter
+ */
+static void signal_event(mpmc_t *q, atomic_uint *ev) {
+  atomic_fetch_add(ev, 1);
+  if (atomic_load(&q->sleepers) != 0) {
+    syscall(SYS_futex, (uint32_t *)ev, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+  }
+}
+
+/**
+ * Sleep until an event counter moves
+ * past the value read before the last
+ * failed attempt. Registering as a
+ * sleeper before the final attempt
+ * means a push or pop that races with
+ * the sleep always sees the sleeper
+ * or changes the counter first.
+ *
+ * @param q the queue
+ * @param ev pushed or popped counter
+ * @param seen value of the counter before the failed attempt
+ */
+static void wait_event(mpmc_t *q, atomic_uint *ev, unsigned int seen) {
+  syscall(SYS_futex, (uint32_t *)ev, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+  atomic_fetch_sub(&q->sleepers, 1);
+}
+
+// Push, sleeping until a pop frees
+// a slot if the queue is full.
+void mpmc_push(mpmc_t *q, void *item) {
+  for (;;) {
+    unsigned int seen = atomic_load(&q->popped);
+    if (mpmc_try_push(q, item) == 0) break;
+    atomic_fetch_add(&q->sleepers, 1);
+    if (mpmc_try_push(q, item) == 0) {
+      atomic_fetch_sub(&q->sleepers, 1);
+      break;
+    }
+    wait_event(q, &q->popped, seen);
+  }
+  signal_event(q, &q->pushed);
+}
+
+// Pop, sleeping until a push fills
+// a slot if the queue is empty.
+void *mpmc_pop(mpmc_t *q) {
+  void *item;
+  for (;;) {
+    unsigned int seen = atomic_load(&q->pushed);
+    if (mpmc_try_pop(q, &item) == 0) break;
+    atomic_fetch_add(&q->sleepers, 1);
+    if (mpmc_try_pop(q, &item) == 0) {
+      atomic_fetch_sub(&q->sleepers, 1);
+      break;
+    }
+    wait_event(q, &q->pushed, seen);
+  }
+  signal_event(q, &q->popped);
+  return item;
+}
+
+// Count the items between the
+// tail and the head.
+size_t mpmc_size(mpmc_t *q) {
+  size_t tail = atomic_load(&q->tail);
+  size_t head = atomic_load(&q->head);
+  return head > tail ? head - tail : 0;
+}
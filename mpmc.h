@@ -0,0 +1,106 @@
+/**
+ * Bounded multi-producer multi-consumer
+ * queue of pointers. Each slot carries
+ * a sequence number that tells pushers
+ * and poppers whose turn the slot is,
+ * so any number of threads can push
+ * and pop with a compare-and-swap on
+ * the head or tail and no lock
+ * (Dmitry Vyukov's bounded queue).
+ * Threads that find the queue full or
+ * empty sleep on a futex.
+ *
+ * @author Matt Stetter
+ * @file mpmc.h
+ */
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#ifndef MPMC_H_
+#define MPMC_H_
+
+// Size of a cache line, used to keep
+// the head and tail from sharing one
+#define CACHE_LINE 64
+
+// One slot of the queue
+typedef struct mpmc_cell {
+  atomic_size_t seq;	// Position this slot is ready for
+  void *item;		// Item stored in the slot
+} mpmc_cell_t;
+
+// The queue
+typedef struct mpmc {
+  mpmc_cell_t *cells;	// Heap allocated slots
+  size_t mask;		// Number of slots minus one
+  _Alignas(CACHE_LINE) atomic_size_t head; // Next position to push at
+  _Alignas(CACHE_LINE) atomic_size_t tail; // Next position to pop from
+  _Alignas(CACHE_LINE) atomic_uint pushed; // Bumped after every push
+  atomic_uint popped;	// Bumped after every pop
+  atomic_uint sleepers;	// Threads asleep on pushed or popped
+} mpmc_t;
+
+/**
+ * Initialize an empty queue.
+ *
+ * @param q queue to initialize
+ * @param capacity number of slots, rounded up to a power of two
+ * @return 0 if successful, errno otherwise
+ */
+int mpmc_init(mpmc_t *q, size_t capacity);
+
+/**
+ * Free the slots of a queue.
+ *
+ * @param q queue to destroy (must be initialized)
+ */
+void mpmc_destroy(mpmc_t *q);
+
+/**
+ * Push an item without blocking.
+ *
+ * @param q the queue
+ * @param item item to push
+ * @return 0 if successful, EAGAIN if the queue is full
+ */
+int mpmc_try_push(mpmc_t *q, void *item);
+
+/**
+ * Pop an item without blocking.
+ *
+ * @param q the queue
+ * @param item returned item
+ * @return 0 if successful, EAGAIN if the queue is empty
+ */
+int mpmc_try_pop(mpmc_t *q, void **item);
+
+/**
+ * Push an item, sleeping while
+ * the queue is full.
+ *
+ * @param q the queue
+ * @param item item to push
+ */
+void mpmc_push(mpmc_t *q, void *item);
+
+/**
+ * Pop an item, sleeping while
+ * the queue is empty.
+ *
+ * @param q the queue
+ * @return the item
+ */
+void *mpmc_pop(mpmc_t *q);
+
+/**
+ * Count the items in the queue. The
+ * count may be stale by the time it
+ * is returned.
+ *
+ * @param q the queue
+ * @return number of items pushed and not yet popped
+ */
+size_t mpmc_size(mpmc_t *q);
+
+#endif
@@ -0,0 +1,392 @@
+/**
+ * Source implementation of the
+ * command-line parser for cpy.
+ *
+ * @author Matt Stetter
+ * @file options.c
+ */
+
+#include "cgroup.h"
+#include "cpy.h"
+#include "dbuf.h"
+#include "deadline.h"
+#include "engine.h"
+#include "options.h"
+#include "psi.h"
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// Long options understood by cpy
+static const struct option long_opts[] = {
+  { "direct",  no_argument, NULL, 'd' },
+  { "discard", no_argument, NULL, 'D' },
+  { "sparse",  no_argument, NULL, 's' },
+  { "zero-threshold", required_argument, NULL, 'z' },
+  { "stats",   no_argument, NULL, 'S' },
+  { "readahead", required_argument, NULL, 'r' },
+  { "engine",  required_argument, NULL, 'e' },
+  { "buffers", required_argument, NULL, 'n' },
+  { "block-size", required_argument, NULL, 'b' },
+  { "depth",   required_argument, NULL, 'q' },
+  { "rules",   required_argument, NULL, 'R' },
+  { "no-profile", no_argument, NULL, 'P' },
+  { "jobs",    required_argument, NULL, 'j' },
+  { "manifest", required_argument, NULL, 'M' },
+  { "deadline", required_argument, NULL, 'T' },
+  { "cache",   required_argument, NULL, 'C' },
+  { "no-uring", no_argument, NULL, 'U' },
+  { "replica", required_argument, NULL, 'm' },
+  { "ec",      required_argument, NULL, 'E' },
+  { "rebuild", no_argument, NULL, 'X' },
+  { "order",   required_argument, NULL, 'O' },
+  { "lookahead", required_argument, NULL, 'W' },
+  { "dedupe",  no_argument, NULL, 'u' },
+  { "pressure", required_argument, NULL, 'p' },
+  { "verbose", no_argument, NULL, 'v' },
+  { "help",    no_argument, NULL, 'h' },
+  { NULL, 0, NULL, 0 }
+};
+
+/**
+ * Print the usage message for cpy
+ * to standard error.
+ *
+ * @param prog name the program was run as
+ */
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [OPTIONS] SRC DST\n"
+          "       %s [OPTIONS] SRC... DIR\n"
+          "       %s [OPTIONS] -M FILE [SRC...] DIR\n"
+          "  -d, --direct   use O_DIRECT for the source and destination\n"
+          "  -D, --discard  discard zero blocks on block device targets\n"
+          "                 instead of zeroing them out\n"
+          "  -s, --sparse   punch runs of zeros out of regular file targets\n"
+          "  -z, --zero-threshold=BYTES\n"
+          "                 shortest zero run that is punched or zeroed\n"
+          "                 instead of written (default %d)\n"
+          "  -S, --stats    print statistics and the source's extent map\n"
+          "  -r, --readahead=BYTES\n"
+          "                 largest window read ahead of the producer,\n"
+          "                 0 to turn readahead off (default %d)\n"
+          "  -e, --engine=NAME\n"
+          "                 copy engine: ring, dbuf, reflink, cfr, splice,\n"
+          "                 sync, pipeline, event or mmap, chosen by the\n"
+          "                 rules if not given, and event when copying only\n"
+          "                 pipes, sockets and character devices into a\n"
+          "                 directory\n"
+          "  -n, --buffers=N\n"
+          "                 number of dbuf buffers, 2 or 3 (default %d)\n"
+          "  -b, --block-size=BYTES\n"
+          "                 size of each ring block (default %d), dbuf\n"
+          "                 buffer (default %d) or event stream ring\n"
+          "                 (default %d), a multiple of %d\n"
+          "  -q, --depth=N  number of ring blocks (default %d)\n"
+          "  -R, --rules=FILE\n"
+          "                 engine selection rules tried before the\n"
+          "                 built-in ones (default $XDG_CONFIG_HOME/cpy/rules)\n"
+          "  -P, --no-profile\n"
+          "                 neither use nor update the tuning profiles\n"
+          "                 cached in $XDG_CACHE_HOME/cpy/profiles\n"
+          "  -j, --jobs=N   reader and writer threads copying into a\n"
+          "                 directory (default %d), whose shared pool\n"
+          "                 has --depth chunks (default %d), or event\n"
+          "                 loops of the event engine (default one per CPU\n"
+          "                 its affinity and cgroup quota allow),\n"
+          "                 parts uploaded at once to s3:// (default %d)\n"
+          "                 or ranges fetched at once from http:// (default %d)\n"
+          "  -M, --manifest=FILE\n"
+          "                 copy the sources listed one per line, each\n"
+          "                 optionally followed by dst=DIR, tenant=NAME,\n"
+          "                 class=NAME, weight=N and tenant-weight=N, sharing\n"
+          "                 the pipeline fairly between tenants and classes\n"
+          "  -C, --cache=BYTES\n"
+          "                 memory for sources copied by several jobs, so\n"
+          "                 each is read once, 0 to turn off (default %d)\n"
+          "  -O, --order=ORDER\n"
+          "                 start the files copied into a directory as\n"
+          "                 given (none), by inode number (inode) or by\n"
+          "                 where their data starts on the disk (extent),\n"
+          "                 by default extent if a source is on a\n"
+          "                 rotational disk and none otherwise\n"
+          "  -W, --lookahead=N\n"
+          "                 files sorted together by --order (default %d)\n"
+          "  -u, --dedupe   once the files are copied into a directory,\n"
+          "                 share the extents of identical copies on file\n"
+          "                 systems that support it, such as btrfs and XFS\n"
+          "  -U, --no-uring look up, read and write the files copied into\n"
+          "                 a directory one system call at a time instead\n"
+          "                 of in batches of %d through io_uring\n"
+          "  -p, --pressure=LIMITS\n"
+          "                 use fewer readers, buffers and less readahead\n"
+          "                 while the share of time tasks stall on I/O,\n"
+          "                 memory or CPU, system wide or in cpy's cgroup,\n"
+          "                 is above LIMITS: a percentage for all three or\n"
+          "                 a list such as io=20,memory=10,cpu=50\n"
+          "  -T, --deadline=TIME\n"
+          "                 finish by TIME (a duration such as 90s, 15m or\n"
+          "                 2h, a time of day HH:MM[:SS] or @EPOCH) using\n"
+          "                 as little of the devices as that allows\n"
+          "  -m, --replica=PATH\n"
+          "                 identical copy of SRC to stripe reads across,\n"
+          "                 given up to %d times, each stripe checked\n"
+          "                 against SRC.merkle if it exists: the SHA-256 of\n"
+          "                 every %d bytes, one per line, as printed by\n"
+          "                 split -b %d --filter=sha256sum SRC\n"
+          "  -E, --ec=K+M   erasure code SRC into K data and M parity shards\n"
+          "                 of %d byte units, written to K+M destinations\n"
+          "                 given after SRC, at most %d in all\n"
+          "  -X, --rebuild  rebuild DST from any K of the shards given as\n"
+          "                 sources\n"
+          "  -v, --verbose  report the engine chosen for the copy\n"
+          "  -h, --help     show this message\n"
+          "DST may be s3://BUCKET/KEY, uploaded in parts of %d bytes or more\n"
+          "to the store at $AWS_ENDPOINT_URL, signed with $AWS_ACCESS_KEY_ID\n"
+          "and $AWS_SECRET_ACCESS_KEY if they are set. SRC may be\n"
+          "http://HOST[:PORT]/PATH, fetched in ranges of %d bytes\n",
+          prog, prog, prog, ZERO_THRESHOLD, READAHEAD_MAX, DBUF_COUNT, BLOCK_SIZE, DBUF_SIZE,
+          EVENT_BUFFER, BLOCK_ALIGN, NUM_BLOCKS, PIPELINE_THREADS, POOL_CHUNKS, S3_UPLOADS,
+          HTTP_CONNS, CACHE_SIZE, ORDER_WINDOW, URING_BATCH, REPLICA_MAX, REPLICA_LEAF, REPLICA_LEAF,
+          EC_UNIT, EC_MAX, S3_PART_SIZE, HTTP_CHUNK);
+}
+
+/**
+ * Parse a byte count with an optional
+ * K, M or G binary suffix.
+ *
+ * @param str string to parse
+ * @param out parsed number of bytes
+ * @return 0 if successful, 1 otherwise
+ */
+static int parse_size(const char *str, size_t *out) {
+  char *end;
+  unsigned long long val = strtoull(str, &end, 10);
+  if (end == str) return 1;
+
+  int shift = 0;
+  switch (*end) {
+  case 'k': case 'K': shift = 10; end++; break;
+  case 'm': case 'M': shift = 20; end++; break;
+  case 'g': case 'G': shift = 30; end++; break;
+  }
+  if (*end != '\0' || val > (SIZE_MAX >> shift)) return 1;
+
+  *out = (size_t)(val << shift);
+  return 0;
+}
+
+// Parse the command line arguments
+// into the options struct.
+int options_parse(options_t *o, int argc, char *argv[]) {
+  memset(o, 0, sizeof(*o));
+  o->zero_threshold = ZERO_THRESHOLD;
+  o->readahead = READAHEAD_MAX;
+  o->cache = CACHE_SIZE;
+  int cache_set = 0;
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "dDsz:Sr:e:n:b:q:R:Pj:M:T:C:Um:E:XO:W:up:vh", long_opts, NULL)) != -1) {
+    switch (opt) {
+    case 'd':
+      o->direct = 1;
+      break;
+    case 'D':
+      o->discard = 1;
+      break;
+    case 's':
+      o->sparse = 1;
+      break;
+    case 'S':
+      o->stats = 1;
+      break;
+    case 'r':
+      if (parse_size(optarg, &o->readahead) != 0) {
+        fprintf(stderr, "Invalid readahead window: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'e':
+      if ((o->engine = engine_lookup(optarg)) == -1) {
+        fprintf(stderr, "Unknown engine: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'n':
+      o->buffers = (unsigned int)strtoul(optarg, NULL, 10);
+      if (o->buffers < DBUF_MIN || o->buffers > DBUF_MAX) {
+        fprintf(stderr, "The number of buffers must be %d or %d\n", DBUF_MIN, DBUF_MAX);
+        return 1;
+      }
+      break;
+    case 'b':
+      if (parse_size(optarg, &o->block_size) != 0 || o->block_size == 0 ||
+          o->block_size % BLOCK_ALIGN != 0) {
+        fprintf(stderr, "Invalid block size: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'q':
+      o->depth = (unsigned int)strtoul(optarg, NULL, 10);
+      if (o->depth == 0) {
+        fprintf(stderr, "Invalid depth: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'P':
+      o->no_profile = 1;
+      break;
+    case 'U':
+      o->no_uring = 1;
+      break;
+    case 'u':
+      o->dedupe = 1;
+      break;
+    case 'p':
+      if (psi_parse(optarg, o->pressure) != 0) {
+        fprintf(stderr, "Invalid pressure limits: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'R':
+      o->rules = optarg;
+      break;
+    case 'T':
+      if (deadline_parse(optarg, &o->deadline) != 0) {
+        fprintf(stderr, "Invalid deadline: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'C':
+      if (parse_size(optarg, &o->cache) != 0) {
+        fprintf(stderr, "Invalid cache size: %s\n", optarg);
+        return 1;
+      }
+      cache_set = 1;
+      break;
+    case 'M':
+      o->manifest = optarg;
+      break;
+    case 'E': {
+      char end;
+      if (sscanf(optarg, "%u+%u%c", &o->ec_data, &o->ec_parity, &end) != 2 || o->ec_data == 0 ||
+          o->ec_parity == 0 || o->ec_data + o->ec_parity > EC_MAX) {
+        fprintf(stderr, "Invalid erasure code: %s\n", optarg);
+        return 1;
+      }
+      break;
+    }
+    case 'X':
+      o->rebuild = 1;
+      break;
+    case 'O':
+      if (strcmp(optarg, "auto") == 0) o->order = ORDER_AUTO;
+      else if (strcmp(optarg, "none") == 0) o->order = ORDER_NONE;
+      else if (strcmp(optarg, "inode") == 0) o->order = ORDER_INODE;
+      else if (strcmp(optarg, "extent") == 0) o->order = ORDER_EXTENT;
+      else {
+        fprintf(stderr, "Unknown file order: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'W':
+      o->lookahead = (unsigned int)strtoul(optarg, NULL, 10);
+      if (o->lookahead == 0) {
+        fprintf(stderr, "Invalid lookahead: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'm':
+      if (o->nreplicas == REPLICA_MAX) {
+        fprintf(stderr, "At most %d replicas can be given\n", REPLICA_MAX);
+        return 1;
+      }
+      o->replicas[o->nreplicas++] = optarg;
+      break;
+    case 'j':
+      o->threads = (unsigned int)strtoul(optarg, NULL, 10);
+      if (o->threads == 0) {
+        fprintf(stderr, "Invalid number of jobs: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'v':
+      o->verbose = 1;
+      break;
+    case 'z':
+      if (parse_size(optarg, &o->zero_threshold) != 0) {
+        fprintf(stderr, "Invalid zero threshold: %s\n", optarg);
+        return 1;
+      }
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  // At least a source and a destination
+  // must follow the options, or just the
+  // destination if a manifest lists sources
+  if (argc - optind < (o->manifest ? 1 : 2)) {
+    usage(argv[0]);
+    return 1;
+  }
+  o->srcs = &argv[optind];
+  o->nsrcs = (unsigned int)(argc - optind - 1);
+  o->src = o->nsrcs ? o->srcs[0] : o->manifest;
+  o->dst = argv[argc - 1];
+
+  // An erasure-coded copy names a shard
+  // destination for every unit of the
+  // code after the source, a rebuild
+  // takes any shards as its sources
+  if (o->ec_data > 0 && !o->rebuild) {
+    if ((unsigned int)(argc - optind) != 1 + o->ec_data + o->ec_parity || o->manifest) {
+      fprintf(stderr, "An erasure code of %u+%u needs one source and %u destinations\n",
+              o->ec_data, o->ec_parity, o->ec_data + o->ec_parity);
+      return 1;
+    }
+    o->nsrcs = 1;
+    o->dsts = &argv[optind + 1];
+    o->dst = o->dsts[0];
+    return 0;
+  }
+  if (o->rebuild) {
+    if (o->manifest || o->nreplicas > 0 || o->dedupe) {
+      fprintf(stderr, "Rebuilding takes shards and a destination only\n");
+      return 1;
+    }
+    return 0;
+  }
+
+  // Files are copied into the destination
+  // if it is a directory, which it has to
+  // be when there are several sources
+  // or a manifest
+  struct stat st;
+  o->dst_dir = stat(o->dst, &st) == 0 && S_ISDIR(st.st_mode);
+  if ((o->nsrcs > 1 || o->manifest) && !o->dst_dir) {
+    fprintf(stderr, "Target is not a directory: %s\n", o->dst);
+    return 1;
+  }
+  if (o->nreplicas > 0 && (o->nsrcs != 1 || o->dst_dir)) {
+    fprintf(stderr, "Replicas can only be given when copying one file\n");
+    return 1;
+  }
+  if (o->dedupe && !o->dst_dir) {
+    fprintf(stderr, "Only copies into a directory can be deduplicated\n");
+    return 1;
+  }
+
+  // Only the pipeline keeps a cache, which
+  // is held to the cgroup's memory unless
+  // its size was given
+  if (o->dst_dir && !cache_set) o->cache = cgroup_cache(o->cache);
+
+  return 0;
+}
@@ -0,0 +1,101 @@
+/**
+ * Command-line options of the cpy
+ * program and the parser that fills
+ * them in from argv.
+ *
+ * @author Matt Stetter
+ * @file options.h
+ */
+
+#include <stddef.h>
+#include <time.h>
+
+#ifndef OPTIONS_H_
+#define OPTIONS_H_
+
+// Copy engines that can be chosen
+// with --engine
+#define ENGINE_AUTO 0	// Pick an engine from the options and endpoints
+#define ENGINE_RING 1	// Producer and consumer sharing the block ring
+#define ENGINE_DBUF 2	// Reader and writer swapping a few large buffers
+#define ENGINE_REFLINK 3 // Share the source's extents with FICLONE
+#define ENGINE_CFR 4	// Copy inside the kernel with copy_file_range
+#define ENGINE_SPLICE 5	// Move pages with splice or sendfile
+#define ENGINE_SYNC 6	// Read and write a small file in one thread
+#define ENGINE_PIPELINE 7 // Many files through one shared chunk pool
+#define ENGINE_EVENT 8	// Many streams multiplexed by epoll loops
+#define ENGINE_MMAP 9	// Block ring with the consumer storing into a mapping
+#define ENGINE_COUNT 10	// Number of ENGINE_* values
+
+// Orders the files copied into a
+// directory can be started in
+#define ORDER_AUTO 0	// By first extent if a source is on a rotational disk
+#define ORDER_NONE 1	// As given
+#define ORDER_INODE 2	// By inode number
+#define ORDER_EXTENT 3	// By where the first extent starts on the device
+
+// Resources whose pressure stalls
+// --pressure can throttle the copy on
+#define PRESSURE_IO 0
+#define PRESSURE_MEMORY 1
+#define PRESSURE_CPU 2
+#define PRESSURE_COUNT 3
+
+// Most copies of the source that
+// can be given with --replica
+#define REPLICA_MAX 8
+
+// Options controlling a single copy.
+// The struct is filled in once by
+// main and then shared read-only
+// with the producer and consumer.
+typedef struct options {
+  char *src;		// Path of the file or device to read from
+  char *dst;		// Path of the file, device or directory to write to
+  char **srcs;		// Every source path given
+  unsigned int nsrcs;	// Number of source paths
+  int dst_dir;		// Non-zero if dst is a directory to copy into
+  int direct;		// Non-zero to use O_DIRECT on both ends
+  int discard;		// Non-zero to discard zero blocks on devices
+  int sparse;		// Non-zero to punch zero runs out of regular files
+  size_t zero_threshold; // Shortest zero run that is not written
+  int stats;		// Non-zero to print statistics after the copy
+  size_t readahead;	// Largest readahead window, 0 to turn it off
+  int engine;		// ENGINE_* engine to copy with
+  unsigned int buffers;	// Number of dbuf buffers, 0 for the default
+  unsigned int depth;	// Number of ring blocks, 0 for the default
+  size_t block_size;	// Ring block or engine buffer size, 0 for the default
+  char *rules;		// Engine selection rules file, NULL for the default
+  int verbose;		// Non-zero to report the chosen engine
+  int no_profile;	// Non-zero to ignore the tuning profile cache
+  unsigned int threads;	// Pipeline readers and writers, 0 for the default
+  char *manifest;	// File listing more sources with their classes
+  struct timespec deadline; // Monotonic time to finish by, zero for none
+  size_t cache;		// Bytes of sources the pipeline keeps, 0 for none
+  int no_uring;		// Non-zero to copy into a directory without io_uring
+  char *replicas[REPLICA_MAX]; // Identical copies of the source to stripe reads across
+  unsigned int nreplicas; // Number of replicas
+  unsigned int ec_data;	// Data shards of an erasure-coded copy, 0 for none
+  unsigned int ec_parity; // Parity shards of an erasure-coded copy
+  int rebuild;		// Non-zero to rebuild dst from the shards given as sources
+  char **dsts;		// Shard destinations of an erasure-coded copy
+  int order;		// ORDER_* order files are started in
+  unsigned int lookahead; // Files sorted together, 0 for the default
+  int dedupe;		// Non-zero to share the extents of identical copies
+  double pressure[PRESSURE_COUNT]; // Stall percentages to throttle above, 0 if not watched
+} options_t;
+
+/**
+ * Parse the command line into
+ * an options_t struct. Prints a
+ * usage message if the arguments
+ * are invalid.
+ *
+ * @param o options_t struct to fill in
+ * @param argc argument count from main
+ * @param argv argument vector from main
+ * @return 0 if successful, 1 otherwise
+ */
+int options_parse(options_t *o, int argc, char *argv[]);
+
+#endif
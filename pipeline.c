@@ -0,0 +1,1230 @@
+/**
+ * Source implementation of the
+ * shared multi-file pipeline.
+ *
+ * Each job holds a reference count of
+ * the chunks it has in flight plus one
+ * held until its source is read to the
+ * end. Whichever thread drops the last
+ * reference closes the destination,
+ * so no thread ever waits for a
+ * particular job to drain. Readers ask
+ * the fair scheduler for a job before
+ * every chunk, so the jobs of every
+ * class make progress side by side.
+ * Sources named by more than one job
+ * are kept in the cache the first time
+ * they are read. The other jobs of the
+ * same source are only queued once
+ * that first read is done, and then
+ * hand the cached memory straight to
+ * the writers. Files that fit in one
+ * chunk are opened, written and closed
+ * by the writers through io_uring,
+ * a batch of them per system call. The
+ * readers open, read and close them
+ * the same way, and every source is
+ * looked up with batched statx calls,
+ * so slow metadata lookups overlap
+ * instead of running one by one. With
+ * --dedupe the writers digest every
+ * chunk they write, and identical
+ * copies share their extents once
+ * every job is done.
+ *
+ * @author Matt Stetter
+ * @file pipeline.c
+ */
+
+#include "cache.h"
+#include "cgroup.h"
+#include "control.h"
+#include "cpy.h"
+#include "deadline.h"
+#include "dedupe.h"
+#include "device.h"
+#include "extent.h"
+#include "fair.h"
+#include "mpmc.h"
+#include "pipeline.h"
+#include "psi.h"
+#include "simple.h"
+#include "stats.h"
+#include "uring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+// Longest line of a manifest
+#define MANIFEST_LINE (PATH_MAX + 256)
+
+// Steps of a batched file, kept in the
+// low bits of each completion's user_data
+#define BATCH_OPEN 0
+#define BATCH_IO 1	// The read or the write
+#define BATCH_CLOSE 2
+#define BATCH_STEPS 3
+
+// Sources looked up per statx batch
+#define STATX_BATCH 64
+
+// One file being copied
+typedef struct job {
+  fair_entry_t entry;	// Scheduling state, must come first
+  char *src;		// Path of the source
+  char dst[PATH_MAX];	// Path of the destination
+  char tenant[FAIR_NAME]; // Tenant the job belongs to
+  char cls[FAIR_NAME];	// Class of the job within its tenant
+  int owned;		// Non-zero if src was allocated for a manifest
+  unsigned long weight;	// Weight of the class from the manifest, 0 for none
+  unsigned long tenant_weight; // Weight of the tenant from the manifest, 0 for none
+  cache_key_t key;	// Version of the source
+  unsigned long long place; // Inode or first extent the job is started by
+  int cacheable;	// Non-zero if other jobs copy the same version
+  int batched;		// Non-zero if a writer opens, writes and closes it at once
+  struct job *followers; // Jobs of the same version queued after this one
+  struct job *next_follower; // Next job in the leader's follower list
+  struct job *leader;	// Job this one is queued after, NULL if none
+  int opened;		// Non-zero once the job was first picked
+  cache_entry_t *hit;	// Cached copy the job is served from
+  cache_entry_t *fill;	// Cache entry the job is filling in
+  int in_fd;		// Source descriptor, -1 if not open
+  off_t off;		// Offset of the next chunk to read
+  int out_fd;		// Destination descriptor, -1 if not open
+  atomic_int refs;	// Chunks in flight plus one for the reader
+  atomic_int status;	// 0 if the copy succeeded, errno otherwise
+  atomic_ullong digest;	// Sum of the dedupe digests of the chunks written
+} job_t;
+
+// A chunk of a file travelling from
+// a reader to a writer, tagged with
+// the job it belongs to
+typedef struct chunk {
+  job_t *job;		// Job the data belongs to
+  off_t off;		// Offset of the data in the file
+  size_t len;		// Number of valid bytes in data
+  char *data;		// Data to write, in buf or in the cache
+  char *buf;		// Slice of the shared pool owned by the chunk
+} chunk_t;
+
+// State shared by every thread
+// of the pipeline
+typedef struct pipeline {
+  options_t *opts;	// The parsed options
+  job_t *jobs;		// One job per source
+  unsigned int njobs;	// Number of jobs
+  fair_t sched;		// Picks the job each chunk is read from
+  cache_t cache;	// Sources read for earlier jobs
+  chunk_t *chunks;	// Every chunk of the pool
+  unsigned int nchunks;	// Number of chunks in the pool
+  size_t chunk_size;	// Capacity of each chunk
+  char *slab;		// Aligned memory backing every chunk
+  mpmc_t free_q;	// Chunks waiting to be filled
+  mpmc_t full_q;	// Tagged chunks waiting to be written
+  unsigned int nbatched; // Number of batched jobs
+  unsigned int threads;	// Readers to start, and as many writers
+  atomic_uint reader_ids; // Next number handed to a starting reader
+  job_t **order;	// Jobs in the order they were given, sorted a window at a time
+  unsigned int queued;	// Jobs of order handed to the scheduler
+  int order_by;		// ORDER_* the windows are sorted by
+  unsigned int window;	// Jobs mapped and sorted at a time
+} pipeline_t;
+
+// Small files a reader or writer has
+// queued on its ring but not submitted yet
+typedef struct batch {
+  uring_t ring;		// Ring of the writer, fd -1 if not set up
+  chunk_t *chunks[URING_BATCH]; // Chunk of the file in each slot
+  unsigned int count;	// Number of files queued
+} batch_t;
+
+/**
+ * Record the first error of a job.
+ *
+ * @param j the job
+ * @param err errno of the failure
+ */
+static void job_fail(job_t *j, int err) {
+  int ok = 0;
+  atomic_compare_exchange_strong(&j->status, &ok, err);
+}
+
+/**
+ * Drop a reference to a job, closing
+ * its destination once the reader
+ * is done and every chunk is written.
+ *
+ * @param p the pipeline
+ * @param j the job
+ */
+static void job_release(pipeline_t *p, job_t *j) {
+  if (atomic_fetch_sub(&j->refs, 1) != 1) return;
+
+  if (j->hit != NULL) cache_put(&p->cache, j->hit);
+  j->hit = NULL;
+
+  if (j->out_fd != -1 && close(j->out_fd) != 0) job_fail(j, errno);
+  j->out_fd = -1;
+
+  int err = atomic_load(&j->status);
+  if (err != 0) fprintf(stderr, "Could not copy %s to %s: %s\n", j->src, j->dst, strerror(err));
+  log("Pipeline finished %s\n", j->dst);
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  fair_entry_t *e = &j->entry;
+  double wait = (e->started.tv_sec - e->queued.tv_sec) + (e->started.tv_nsec - e->queued.tv_nsec) / 1e9;
+  double done = (now.tv_sec - e->queued.tv_sec) + (now.tv_nsec - e->queued.tv_nsec) / 1e9;
+  stats_add_job(j->tenant, j->cls, e->bytes, wait, done);
+}
+
+/**
+ * Open both ends of a job the first
+ * time it is picked. A source that
+ * is cached is not opened at all,
+ * and one that other jobs copy too
+ * gets a cache entry to fill in. The
+ * destination of a batched job is left
+ * to the writer.
+ *
+ * @param p the pipeline
+ * @param j the job
+ * @return 0 if successful, errno otherwise
+ */
+static int open_job(pipeline_t *p, job_t *j) {
+  dev_info_t info = { 0 };
+  j->opened = 1;
+  if (j->cacheable && (j->hit = cache_get(&p->cache, &j->key)) != NULL) {
+    atomic_fetch_add(&stats.cache_hits, 1);
+    log("Pipeline serving %s from the cache\n", j->src);
+  } else {
+    if ((j->in_fd = dev_open_src(j->src, 0, &info)) == -1) return errno;
+    if (j->cacheable) j->fill = cache_fill(&p->cache, &j->key);
+  }
+  if (!j->batched && (j->out_fd = dev_open_dst(j->dst, 0, &info)) == -1) return errno;
+  return 0;
+}
+
+/**
+ * Read the next chunk of a job and
+ * queue it for the writers.
+ *
+ * @param p the pipeline
+ * @param j the job
+ * @return bytes read, 0 at the end of the source or -1 on error
+ */
+static ssize_t read_chunk(pipeline_t *p, job_t *j) {
+  chunk_t *c = (chunk_t *)mpmc_pop(&p->free_q);
+  c->data = c->buf;
+  ssize_t n;
+  if (j->hit != NULL) {
+    size_t left = j->hit->len - (size_t)j->off;
+    n = (ssize_t)(left < p->chunk_size ? left : p->chunk_size);
+    c->data = j->hit->data + j->off;
+  } else {
+    do {
+      n = read(j->in_fd, c->data, p->chunk_size);
+    } while (n == -1 && errno == EINTR);
+  }
+
+  // A batched job is written in one go,
+  // so a source that grew since it was
+  // looked at cannot be finished
+  if (n > 0 && j->batched && j->off > 0) {
+    fprintf(stderr, "%s grew while it was copied\n", j->src);
+    errno = EAGAIN;
+    n = -1;
+  }
+
+  if (n <= 0) {
+    if (n == -1) job_fail(j, errno);
+    mpmc_push(&p->free_q, c);
+    return n;
+  }
+
+  c->job = j;
+  c->off = j->off;
+  c->len = (size_t)n;
+  j->off += n;
+  if (j->fill != NULL) cache_append(j->fill, c->data, (size_t)n);
+  atomic_fetch_add(j->hit ? &stats.bytes_cached : &stats.bytes_read, n);
+  atomic_fetch_add(&j->refs, 1);
+  mpmc_push(&p->full_q, c);
+  return n;
+}
+
+/**
+ * Pace the copy for a deadline and
+ * check for a pause or cancel before
+ * a reader picks its next job. Under
+ * pressure the readers numbered past
+ * the share the copy may use wait, as
+ * do all of them while that share of
+ * the chunks is in flight. The first
+ * reader to see a pause gives the
+ * memory of the idle chunks back, the
+ * writers release the others as they
+ * finish with them.
+ *
+ * @param p the pipeline
+ * @param id number of the calling reader, from 0
+ * @return 0 to carry on, ECANCELED if the copy was cancelled
+ */
+static int checkpoint(pipeline_t *p, unsigned int id) {
+  deadline_pace();
+  while (control_state() == CONTROL_RUNNING &&
+         (psi_over(id, p->threads) ||
+          psi_over(p->nchunks - (unsigned int)mpmc_size(&p->free_q), p->nchunks))) {
+    psi_wait();
+  }
+  if (control_state() == CONTROL_RUNNING) return 0;
+
+  void *item;
+  for (unsigned int i = 0; control_state() == CONTROL_PAUSED && i < p->nchunks &&
+       mpmc_try_pop(&p->free_q, &item) == 0; i++) {
+    control_release(((chunk_t *)item)->buf, p->chunk_size);
+    mpmc_push(&p->free_q, item);
+  }
+  return control_checkpoint();
+}
+
+/**
+ * Queue the jobs that waited for a
+ * job to read their source.
+ *
+ * @param p the pipeline
+ * @param j the job that read the source
+ */
+static void queue_followers(pipeline_t *p, job_t *j) {
+  for (job_t *f = j->followers; f != NULL; f = f->next_follower) {
+    if (fair_add(&p->sched, &f->entry, f->tenant, f->cls) != 0) job_fail(f, ENOMEM);
+  }
+  j->followers = NULL;
+}
+
+/**
+ * Check if a reader can open, read
+ * and close a job in one go. Sources
+ * of the cache are left out, as their
+ * reads feed the cache entry.
+ *
+ * @param p the pipeline
+ * @param j the job
+ * @return non-zero if it can
+ */
+static int read_batchable(pipeline_t *p, job_t *j) {
+  return !j->opened && j->batched && !j->cacheable && (size_t)j->key.size < p->chunk_size;
+}
+
+/**
+ * Queue a linked openat, read and
+ * close of a batched job's whole
+ * source into a chunk. The read asks
+ * for a whole chunk so a source that
+ * grew shows up, and the close is
+ * hard linked so the short read that
+ * ends a source does not cancel it.
+ *
+ * @param p the pipeline
+ * @param b the reader's batch, with room for the file
+ * @param j the job
+ * @param c free chunk to read into
+ */
+static void read_batch_add(pipeline_t *p, batch_t *b, job_t *j, chunk_t *c) {
+  unsigned int slot = b->count++;
+  unsigned long long tag = (unsigned long long)slot << 2;
+  b->chunks[slot] = c;
+  j->opened = 1;
+  c->job = j;
+  c->off = 0;
+  c->len = 0;
+  c->data = c->buf;
+  uring_openat(&b->ring, j->src, O_RDONLY, 0, slot, tag | BATCH_OPEN, URING_LINK);
+  uring_read(&b->ring, slot, c->data, p->chunk_size, 0, tag | BATCH_IO, URING_HARDLINK);
+  uring_close(&b->ring, slot, tag | BATCH_CLOSE, 0);
+}
+
+/**
+ * Read a batch of small sources,
+ * starting with a job the reader was
+ * handed and adding the jobs the
+ * scheduler picks next for as long as
+ * they can be batched and free chunks
+ * are left. One io_uring_enter opens,
+ * reads and closes all of them, then
+ * each chunk is queued for the writers
+ * and its job finished.
+ *
+ * @param p the pipeline
+ * @param b the reader's batch, empty
+ * @param j the first job
+ */
+static void read_batch(pipeline_t *p, batch_t *b, job_t *j) {
+  read_batch_add(p, b, j, (chunk_t *)mpmc_pop(&p->free_q));
+  void *item;
+  while (b->count < URING_BATCH) {
+    fair_entry_t *e = fair_try_next(&p->sched);
+    if (e == NULL) break;
+    if (!read_batchable(p, (job_t *)e) || mpmc_try_pop(&p->free_q, &item) != 0) {
+      fair_yield(&p->sched, e, 0, 0);
+      break;
+    }
+    read_batch_add(p, b, (job_t *)e, (chunk_t *)item);
+  }
+
+  unsigned int left = b->count * BATCH_STEPS;
+  int err = uring_submit(&b->ring, left);
+  while (err == 0 && left > 0) {
+    unsigned long long tag;
+    int res;
+    if (uring_reap(&b->ring, &tag, &res) != 0) {
+      err = uring_submit(&b->ring, left);
+      continue;
+    }
+    left--;
+
+    chunk_t *c = b->chunks[tag >> 2];
+    unsigned int step = (unsigned int)(tag & 3);
+    if (res == -ECANCELED) continue;
+    if (res < 0) job_fail(c->job, -res);
+    else if (step == BATCH_IO) c->len = (size_t)res;
+  }
+
+  // The ring is torn down if it failed,
+  // cancelling whatever is in flight,
+  // and the jobs of the batch are failed
+  if (err != 0) {
+    fprintf(stderr, "io_uring failed, reading small files one at a time: %s\n", strerror(err));
+    uring_destroy(&b->ring);
+  }
+
+  for (unsigned int i = 0; i < b->count; i++) {
+    chunk_t *c = b->chunks[i];
+    j = c->job;
+    if (err != 0) job_fail(j, err);
+    if (c->len == p->chunk_size) {
+      fprintf(stderr, "%s grew while it was copied\n", j->src);
+      job_fail(j, EAGAIN);
+    }
+
+    size_t n = atomic_load(&j->status) == 0 ? c->len : 0;
+    if (n > 0) {
+      j->off = (off_t)n;
+      atomic_fetch_add(&stats.bytes_read, n);
+      atomic_fetch_add(&j->refs, 1);
+      mpmc_push(&p->full_q, c);
+    } else {
+      mpmc_push(&p->free_q, c);
+    }
+    fair_yield(&p->sched, &j->entry, n, 1);
+    job_release(p, j);
+  }
+  b->count = 0;
+}
+
+/**
+ * Thread target for a reader. Reads
+ * one chunk of whichever job the
+ * scheduler picks, hands the job
+ * back and asks again, until every
+ * job is read. Small sources are
+ * read whole, in batches.
+ *
+ * @param args pipeline_t struct pointer
+ * @return NULL
+ */
+static void *reader_target(void *args) {
+  pipeline_t *p = (pipeline_t *)args;
+
+  batch_t b;
+  b.count = 0;
+  b.ring.fd = -1;
+  if (p->nbatched > 0 && uring_init(&b.ring, URING_BATCH * BATCH_STEPS, URING_BATCH) != 0) {
+    log("io_uring is not available, reading small files one at a time\n");
+  }
+
+  unsigned int id = atomic_fetch_add(&p->reader_ids, 1);
+  fair_entry_t *e;
+  while (checkpoint(p, id) == 0 && (e = fair_next(&p->sched)) != NULL) {
+    job_t *j = (job_t *)e;
+    if (b.ring.fd != -1 && read_batchable(p, j)) {
+      read_batch(p, &b, j);
+      continue;
+    }
+
+    ssize_t n = -1;
+    int err = 0;
+    if (!j->opened && (err = open_job(p, j)) != 0) job_fail(j, err);
+    else n = read_chunk(p, j);
+
+    // Queue the followers before the job
+    // is finished so the scheduler never
+    // runs out of jobs in between
+    if (n <= 0) {
+      if (j->fill != NULL) cache_done(&p->cache, j->fill, n == 0 && j->off == j->key.size);
+      j->fill = NULL;
+      queue_followers(p, j);
+    }
+    fair_yield(&p->sched, e, n > 0 ? (size_t)n : 0, n <= 0);
+
+    if (n <= 0) {
+      if (j->in_fd != -1) close(j->in_fd);
+      j->in_fd = -1;
+      job_release(p, j);
+    }
+  }
+
+  if (b.ring.fd != -1) uring_destroy(&b.ring);
+  return NULL;
+}
+
+/**
+ * Write a chunk at its offset and
+ * hand it back to the pool.
+ *
+ * @param p the pipeline
+ * @param c the chunk
+ */
+static void write_chunk(pipeline_t *p, chunk_t *c) {
+  job_t *j = c->job;
+  size_t done = 0;
+  while (atomic_load(&j->status) == 0 && done < c->len) {
+    ssize_t n = pwrite(j->out_fd, c->data + done, c->len - done, c->off + done);
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) {
+      job_fail(j, n == 0 ? ENOSPC : errno);
+      break;
+    }
+    done += n;
+  }
+  atomic_fetch_add(&stats.bytes_written, done);
+  if (p->opts->dedupe && done == c->len) {
+    atomic_fetch_add(&j->digest, dedupe_chunk(c->off, c->data, c->len));
+  }
+
+  // While paused or cancelled each chunk
+  // is synced once written, and a paused
+  // copy gives its memory back
+  if (control_state() != CONTROL_RUNNING) {
+    int err = atomic_load(&j->status) == 0 ? control_sync(j->out_fd) : 0;
+    if (err != 0) job_fail(j, err);
+    if (control_state() == CONTROL_PAUSED) control_release(c->buf, p->chunk_size);
+  }
+
+  mpmc_push(&p->free_q, c);
+  job_release(p, j);
+}
+
+/**
+ * Open the destination of a batched
+ * job and write its only chunk with
+ * plain system calls.
+ *
+ * @param p the pipeline
+ * @param c the chunk
+ */
+static void write_small(pipeline_t *p, chunk_t *c) {
+  dev_info_t info = { 0 };
+  job_t *j = c->job;
+  if (atomic_load(&j->status) == 0 && (j->out_fd = dev_open_dst(j->dst, 0, &info)) == -1) {
+    job_fail(j, errno);
+  }
+  write_chunk(p, c);
+}
+
+/**
+ * Queue a linked openat, write and
+ * close of a batched job's only chunk.
+ * The file lives in the ring's table
+ * under the chunk's slot, so it never
+ * gets a descriptor of its own.
+ *
+ * @param b the writer's batch, with room for the file
+ * @param c the chunk
+ */
+static void batch_add(batch_t *b, chunk_t *c) {
+  unsigned int slot = b->count++;
+  unsigned long long tag = (unsigned long long)slot << 2;
+  b->chunks[slot] = c;
+  uring_openat(&b->ring, c->job->dst, O_WRONLY | O_CREAT | O_TRUNC, 0600, slot, tag | BATCH_OPEN, URING_LINK);
+  uring_write(&b->ring, slot, c->data, c->len, c->off, tag | BATCH_IO, URING_LINK);
+  uring_close(&b->ring, slot, tag | BATCH_CLOSE, 0);
+}
+
+/**
+ * Submit every file of a batch and
+ * wait for all of them with one
+ * io_uring_enter. If the ring fails
+ * it is torn down and the files are
+ * written again with plain system
+ * calls, which is safe as each write
+ * starts by truncating the file.
+ *
+ * @param p the pipeline
+ * @param b the writer's batch
+ */
+static void batch_flush(pipeline_t *p, batch_t *b) {
+  if (b->count == 0) return;
+
+  unsigned int left = b->count * BATCH_STEPS;
+  int err = uring_submit(&b->ring, left);
+  atomic_fetch_add(&stats.uring_enters, 1);
+  while (err == 0 && left > 0) {
+    unsigned long long tag;
+    int res;
+    if (uring_reap(&b->ring, &tag, &res) != 0) {
+      err = uring_submit(&b->ring, left);
+      atomic_fetch_add(&stats.uring_enters, 1);
+      continue;
+    }
+    left--;
+
+    // A failed step cancels the ones
+    // linked after it, which is not
+    // an error of their own
+    chunk_t *c = b->chunks[tag >> 2];
+    unsigned int step = (unsigned int)(tag & 3);
+    if (res == -ECANCELED) continue;
+    if (res < 0) job_fail(c->job, -res);
+    else if (step == BATCH_IO) {
+      atomic_fetch_add(&stats.bytes_written, res);
+      if ((size_t)res < c->len) job_fail(c->job, ENOSPC);
+    }
+  }
+
+  if (err != 0) {
+    fprintf(stderr, "io_uring failed, writing small files one at a time: %s\n", strerror(err));
+    uring_destroy(&b->ring);
+  }
+  for (unsigned int i = 0; i < b->count; i++) {
+    chunk_t *c = b->chunks[i];
+    if (err != 0) {
+      write_small(p, c);
+      continue;
+    }
+    job_t *j = c->job;
+    atomic_fetch_add(&stats.batched_files, 1);
+    if (p->opts->dedupe) atomic_fetch_add(&j->digest, dedupe_chunk(c->off, c->data, c->len));
+    mpmc_push(&p->free_q, c);
+    job_release(p, j);
+  }
+  b->count = 0;
+}
+
+/**
+ * Thread target for a writer. Writes
+ * chunks of any job at their offsets
+ * until it pops the NULL that ends
+ * the copy. Batched jobs are queued
+ * on the writer's ring and submitted
+ * once the batch is full or no more
+ * chunks are waiting, so a small file
+ * is never held back for company.
+ *
+ * @param args pipeline_t struct pointer
+ * @return NULL
+ */
+static void *writer_target(void *args) {
+  pipeline_t *p = (pipeline_t *)args;
+
+  batch_t b;
+  b.count = 0;
+  b.ring.fd = -1;
+  if (p->nbatched > 0 && uring_init(&b.ring, URING_BATCH * BATCH_STEPS, URING_BATCH) != 0) {
+    log("io_uring is not available, writing small files one at a time\n");
+  }
+
+  void *item;
+  for (;;) {
+    chunk_t *c;
+    if (b.count == 0) c = (chunk_t *)mpmc_pop(&p->full_q);
+    else if (mpmc_try_pop(&p->full_q, &item) == 0) c = (chunk_t *)item;
+    else {
+      batch_flush(p, &b);
+      continue;
+    }
+    if (c == NULL) break;
+
+    job_t *j = c->job;
+    if (!j->batched) write_chunk(p, c);
+    else if (b.ring.fd == -1 || control_state() != CONTROL_RUNNING || atomic_load(&j->status) != 0) {
+      write_small(p, c);
+    } else {
+      batch_add(&b, c);
+      if (b.count == URING_BATCH) batch_flush(p, &b);
+    }
+  }
+
+  batch_flush(p, &b);
+  if (b.ring.fd != -1) uring_destroy(&b.ring);
+  return NULL;
+}
+
+/**
+ * Fill in the tenant and class of a
+ * job that was not given them. The
+ * tenant is the owner of the source,
+ * and the class splits sources by size
+ * so small files are not stuck behind
+ * big ones. Regular files also get
+ * their cache key.
+ *
+ * @param j the job
+ * @param st status of the source, NULL if it could not be looked up
+ */
+static void job_defaults(job_t *j, const struct stat *st) {
+  if (st != NULL && S_ISREG(st->st_mode)) cache_key(&j->key, st);
+  if (j->tenant[0] == '\0') snprintf(j->tenant, FAIR_NAME, "uid%u", st ? (unsigned int)st->st_uid : 0);
+  if (j->cls[0] == '\0') strcpy(j->cls, st && st->st_size > SMALL_FILE ? "large" : "small");
+}
+
+/**
+ * Copy the fields of a statx result
+ * the pipeline uses into a struct stat.
+ *
+ * @param stx the statx result
+ * @param st struct to fill in
+ */
+static void stat_from_statx(const struct statx *stx, struct stat *st) {
+  memset(st, 0, sizeof(*st));
+  st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+  st->st_ino = stx->stx_ino;
+  st->st_mode = stx->stx_mode;
+  st->st_uid = stx->stx_uid;
+  st->st_size = (off_t)stx->stx_size;
+  st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+  st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+}
+
+/**
+ * Look up every source and fill in
+ * the defaults of its job. The lookups
+ * go out STATX_BATCH at a time through
+ * io_uring, so on a network file system
+ * they wait on the server side by side,
+ * and one by one with stat otherwise.
+ *
+ * @param p the pipeline
+ */
+static void stat_jobs(pipeline_t *p) {
+  uring_t r;
+  struct statx *stx = NULL;
+  int ring = !p->opts->no_uring && p->njobs > 1 &&
+    (stx = (struct statx *)calloc(STATX_BATCH, sizeof(struct statx))) != NULL &&
+    uring_init(&r, STATX_BATCH, 0) == 0;
+
+  struct stat st;
+  unsigned int next = 0;
+  while (ring && next < p->njobs) {
+    unsigned int count = p->njobs - next < STATX_BATCH ? p->njobs - next : STATX_BATCH;
+    int res[STATX_BATCH];
+    for (unsigned int i = 0; i < count; i++) {
+      uring_statx(&r, p->jobs[next + i].src, STATX_BASIC_STATS, &stx[i], i);
+      res[i] = -ECANCELED;
+    }
+
+    unsigned int left = count;
+    int err = uring_submit(&r, left);
+    while (err == 0 && left > 0) {
+      unsigned long long tag;
+      int ret;
+      if (uring_reap(&r, &tag, &ret) != 0) {
+        err = uring_submit(&r, left);
+        continue;
+      }
+      res[tag] = ret;
+      left--;
+    }
+    if (err != 0) {
+      uring_destroy(&r);
+      ring = 0;
+      break;
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+      if (res[i] == 0) stat_from_statx(&stx[i], &st);
+      job_defaults(&p->jobs[next + i], res[i] == 0 ? &st : NULL);
+    }
+    next += count;
+  }
+  if (ring) uring_destroy(&r);
+  free(stx);
+
+  for (; next < p->njobs; next++) {
+    job_t *j = &p->jobs[next];
+    job_defaults(j, stat(j->src, &st) == 0 ? &st : NULL);
+  }
+}
+
+/**
+ * Count the jobs listed in a manifest,
+ * skipping blank and comment lines.
+ *
+ * @param f the manifest
+ * @return number of jobs
+ */
+static unsigned int count_manifest(FILE *f) {
+  char line[MANIFEST_LINE];
+  unsigned int count = 0;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char *tok = strtok(line, " \t\r\n");
+    if (tok != NULL && tok[0] != '#') count++;
+  }
+  rewind(f);
+  return count;
+}
+
+/**
+ * Read the jobs of a manifest. Each
+ * line names a source followed by
+ * optional dst=DIR, tenant=NAME,
+ * class=NAME, weight=N (of the class
+ * within its tenant) and
+ * tenant-weight=N terms.
+ *
+ * @param p the pipeline
+ * @param f the manifest
+ * @param path path of the manifest, for messages
+ * @param next index of the first job to fill in, advanced
+ * @return 0 if successful, errno otherwise
+ */
+static int load_manifest(pipeline_t *p, FILE *f, const char *path, unsigned int *next) {
+  char line[MANIFEST_LINE];
+  unsigned int num = 0;
+  while (*next < p->njobs && fgets(line, sizeof(line), f) != NULL) {
+    num++;
+    char *tok = strtok(line, " \t\r\n");
+    if (tok == NULL || tok[0] == '#') continue;
+
+    job_t *j = &p->jobs[(*next)++];
+    if ((j->src = strdup(tok)) == NULL) return ENOMEM;
+    j->owned = 1;
+
+    while ((tok = strtok(NULL, " \t\r\n")) != NULL) {
+      char *val = strchr(tok, '=');
+      if (val == NULL) {
+        fprintf(stderr, "%s:%u: expected key=value, got %s\n", path, num, tok);
+        return EINVAL;
+      }
+      *val++ = '\0';
+      if (strcmp(tok, "dst") == 0) {
+        const char *base = strrchr(j->src, '/');
+        snprintf(j->dst, sizeof(j->dst), "%s/%s", val, base ? base + 1 : j->src);
+      } else if (strcmp(tok, "tenant") == 0) strncpy(j->tenant, val, FAIR_NAME - 1);
+      else if (strcmp(tok, "class") == 0) strncpy(j->cls, val, FAIR_NAME - 1);
+      else if (strcmp(tok, "weight") == 0) j->weight = strtoul(val, NULL, 10);
+      else if (strcmp(tok, "tenant-weight") == 0) j->tenant_weight = strtoul(val, NULL, 10);
+      else {
+        fprintf(stderr, "%s:%u: unknown key %s\n", path, num, tok);
+        return EINVAL;
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * Order jobs by the version of their
+ * source for qsort.
+ *
+ * @param a pointer to the first job pointer
+ * @param b pointer to the second job pointer
+ * @return negative, 0 or positive like strcmp
+ */
+static int compare_keys(const void *a, const void *b) {
+  return cache_key_cmp(&(*(job_t *const *)a)->key, &(*(job_t *const *)b)->key);
+}
+
+/**
+ * Mark the jobs whose source is the
+ * same version of a regular file as
+ * another job's, the only ones worth
+ * keeping in the cache. The first job
+ * of each source leads, the others
+ * follow it.
+ *
+ * @param p the pipeline
+ * @return 0 if successful, errno otherwise
+ */
+static int mark_repeats(pipeline_t *p) {
+  if (p->njobs < 2) return 0;
+  job_t **order = (job_t **)malloc(p->njobs * sizeof(job_t *));
+  if (order == NULL) return ENOMEM;
+  for (unsigned int i = 0; i < p->njobs; i++) order[i] = &p->jobs[i];
+  qsort(order, p->njobs, sizeof(job_t *), compare_keys);
+
+  unsigned int end;
+  for (unsigned int i = 0; i < p->njobs; i = end) {
+    job_t *lead = order[i];
+    for (end = i + 1; end < p->njobs && cache_key_cmp(&order[end]->key, &lead->key) == 0; end++) {
+      if (order[end] < lead) lead = order[end];
+    }
+    if (end - i < 2 || lead->key.size == 0) continue;
+
+    for (unsigned int k = i; k < end; k++) {
+      order[k]->cacheable = 1;
+      if (order[k] == lead) continue;
+      order[k]->leader = lead;
+      order[k]->next_follower = lead->followers;
+      lead->followers = order[k];
+    }
+  }
+
+  free(order);
+  return 0;
+}
+
+/**
+ * Order jobs by device, then by their
+ * place on it, for qsort.
+ *
+ * @param a pointer to the first job pointer
+ * @param b pointer to the second job pointer
+ * @return negative, 0 or positive like strcmp
+ */
+static int compare_places(const void *a, const void *b) {
+  const job_t *ja = *(job_t *const *)a;
+  const job_t *jb = *(job_t *const *)b;
+  if (ja->key.dev != jb->key.dev) return ja->key.dev < jb->key.dev ? -1 : 1;
+  if (ja->place != jb->place) return ja->place < jb->place ? -1 : 1;
+  return ja < jb ? -1 : ja > jb;
+}
+
+/**
+ * Check whether any source is on a
+ * rotational disk, looking each
+ * device up once in a row.
+ *
+ * @param p the pipeline
+ * @return non-zero if one is
+ */
+static int any_rotational(pipeline_t *p) {
+  dev_t last = 0;
+  for (unsigned int i = 0; i < p->njobs; i++) {
+    dev_t dev = p->jobs[i].key.dev;
+    if (dev == 0 || dev == last) continue;
+    if (dev_rotational_id(dev)) return 1;
+    last = dev;
+  }
+  return 0;
+}
+
+/**
+ * Work out the order jobs are queued
+ * in. On rotational disks starting
+ * files in the order they lie on the
+ * disk saves a seek between most of
+ * them, so jobs can be sorted by inode
+ * number, which most file systems
+ * allocate near the data, or by where
+ * their first extent starts. Jobs are
+ * mapped and sorted a window of
+ * --lookahead at a time, in the order
+ * they were given, as they are queued.
+ *
+ * @param p the pipeline, with order allocated
+ */
+static void order_jobs(pipeline_t *p) {
+  for (unsigned int i = 0; i < p->njobs; i++) p->order[i] = &p->jobs[i];
+  p->order_by = p->opts->order;
+  if (p->order_by == ORDER_AUTO) p->order_by = any_rotational(p) ? ORDER_EXTENT : ORDER_NONE;
+  if (p->order_by == ORDER_NONE || p->njobs < 2) {
+    p->order_by = ORDER_NONE;
+    p->window = p->njobs;
+    return;
+  }
+
+  p->window = p->opts->lookahead ? p->opts->lookahead : ORDER_WINDOW;
+  stats.file_order = p->order_by == ORDER_EXTENT ? "first extent" : "inode";
+  stats.order_window = p->window;
+
+  log("Pipeline starting files by %s, %u at a time\n", stats.file_order, p->window);
+}
+
+/**
+ * Map and sort the next window of
+ * jobs, then queue them with the
+ * scheduler. Jobs waiting for a
+ * leader are left to it.
+ *
+ * @param p the pipeline
+ */
+static void queue_window(pipeline_t *p) {
+  job_t **w = &p->order[p->queued];
+  unsigned int n = p->njobs - p->queued < p->window ? p->njobs - p->queued : p->window;
+  p->queued += n;
+
+  // Files without a mapped extent, such
+  // as empty ones, sort first
+  for (unsigned int i = 0; p->order_by != ORDER_NONE && i < n; i++) {
+    job_t *j = w[i];
+    j->place = j->key.ino;
+    if (p->order_by != ORDER_EXTENT || j->key.size == 0) continue;
+
+    off_t physical = 0;
+    int fd = open(j->src, O_RDONLY);
+    if (fd != -1 && extent_first(fd, &physical) == 0) j->place = (unsigned long long)physical;
+    else j->place = 0;
+    if (fd != -1) close(fd);
+  }
+  if (p->order_by != ORDER_NONE) qsort(w, n, sizeof(job_t *), compare_places);
+
+  for (unsigned int i = 0; i < n; i++) {
+    job_t *j = w[i];
+    if (j->leader == NULL && fair_add(&p->sched, &j->entry, j->tenant, j->cls) != 0) {
+      job_fail(j, ENOMEM);
+    }
+  }
+}
+
+/**
+ * Thread target queueing the windows
+ * after the first. Each is mapped once
+ * no more than a window is left to
+ * copy, so window N+1 is mapped while
+ * window N is copied, without mapping
+ * far ahead of the copy.
+ *
+ * @param args pipeline_t struct pointer
+ * @return NULL
+ */
+static void *feed_target(void *args) {
+  pipeline_t *p = (pipeline_t *)args;
+  while (p->queued < p->njobs && fair_drain(&p->sched, p->window) == 0) queue_window(p);
+  fair_feed(&p->sched, 0);
+  return NULL;
+}
+
+/**
+ * Allocate the pool and queues and
+ * queue one job per source, from the
+ * command line and then the manifest.
+ *
+ * @param p pipeline to set up
+ * @param o the parsed options
+ * @return 0 if successful, errno otherwise
+ */
+static int pipeline_init(pipeline_t *p, options_t *o) {
+  memset(p, 0, sizeof(*p));
+  p->opts = o;
+  p->threads = o->threads ? o->threads : cgroup_threads(PIPELINE_THREADS);
+  p->chunk_size = o->block_size ? o->block_size : BLOCK_SIZE;
+  p->nchunks = o->depth ? o->depth : cgroup_buffers(POOL_CHUNKS, p->chunk_size, 2 * p->threads);
+  fair_init(&p->sched);
+  cache_init(&p->cache, o->cache);
+
+  FILE *manifest = NULL;
+  if (o->manifest != NULL && (manifest = fopen(o->manifest, "r")) == NULL) {
+    int err = errno;
+    fprintf(stderr, "Could not open %s: %s\n", o->manifest, strerror(err));
+    return err;
+  }
+  p->njobs = o->nsrcs + (manifest ? count_manifest(manifest) : 0);
+
+  p->jobs = (job_t *)calloc(p->njobs ? p->njobs : 1, sizeof(job_t));
+  p->chunks = (chunk_t *)calloc(p->nchunks, sizeof(chunk_t));
+  if (p->jobs == NULL || p->chunks == NULL ||
+      posix_memalign((void **)&p->slab, BLOCK_ALIGN, p->nchunks * p->chunk_size) != 0) {
+    if (manifest) fclose(manifest);
+    return ENOMEM;
+  }
+
+  // Both queues can hold every chunk,
+  // so pushing never has to wait
+  if (mpmc_init(&p->free_q, p->nchunks) != 0 || mpmc_init(&p->full_q, p->nchunks + 64) != 0) {
+    if (manifest) fclose(manifest);
+    return ENOMEM;
+  }
+  for (unsigned int i = 0; i < p->nchunks; i++) {
+    p->chunks[i].buf = p->slab + (size_t)i * p->chunk_size;
+    mpmc_push(&p->free_q, &p->chunks[i]);
+  }
+
+  unsigned int next = 0;
+  for (; next < o->nsrcs; next++) p->jobs[next].src = o->srcs[next];
+  int err = 0;
+  if (manifest) {
+    err = load_manifest(p, manifest, o->manifest, &next);
+    fclose(manifest);
+  }
+  p->njobs = next;
+  if (err == 0) stat_jobs(p);
+
+  for (unsigned int i = 0; i < p->njobs && err == 0; i++) {
+    job_t *j = &p->jobs[i];
+    if ((j->weight && fair_weight(&p->sched, j->tenant, j->cls, j->weight) != 0) ||
+        (j->tenant_weight && fair_weight(&p->sched, j->tenant, NULL, j->tenant_weight) != 0)) {
+      err = ENOMEM;
+    }
+
+    const char *base = strrchr(j->src, '/');
+    if (j->dst[0] == '\0') snprintf(j->dst, sizeof(j->dst), "%s/%s", o->dst, base ? base + 1 : j->src);
+    j->in_fd = -1;
+    j->out_fd = -1;
+    atomic_init(&j->refs, 1);
+    atomic_init(&j->status, 0);
+    atomic_init(&j->digest, 0);
+
+    // Files that fit in one chunk are
+    // read and written in batches
+    j->batched = !o->no_uring && j->key.size > 0 && (size_t)j->key.size <= p->chunk_size;
+    if (j->batched) p->nbatched++;
+  }
+  if (err == 0 && o->cache > 0) err = mark_repeats(p);
+
+  p->order = err == 0 ? (job_t **)malloc((p->njobs ? p->njobs : 1) * sizeof(job_t *)) : NULL;
+  if (err == 0 && p->order == NULL) err = ENOMEM;
+  if (err == 0) {
+    order_jobs(p);
+    queue_window(p);
+    if (p->queued < p->njobs) fair_feed(&p->sched, 1);
+  }
+
+  unsigned long long total = 0;
+  for (unsigned int i = 0; i < p->njobs; i++) total += p->jobs[i].key.size;
+  if (err == 0) deadline_start(&o->deadline, total);
+
+  return err;
+}
+
+/**
+ * Free everything allocated by
+ * pipeline_init.
+ *
+ * @param p the pipeline
+ */
+static void pipeline_destroy(pipeline_t *p) {
+  for (unsigned int i = 0; p->jobs != NULL && i < p->njobs; i++) {
+    if (p->jobs[i].owned) free(p->jobs[i].src);
+  }
+  fair_destroy(&p->sched);
+  cache_destroy(&p->cache);
+  if (p->free_q.cells) mpmc_destroy(&p->free_q);
+  if (p->full_q.cells) mpmc_destroy(&p->full_q);
+  free(p->slab);
+  free(p->chunks);
+  free(p->order);
+  free(p->jobs);
+}
+
+/**
+ * Share the extents of the copies that
+ * came out identical, going by their
+ * sizes and the digests the writers
+ * summed up. A failure here leaves the
+ * copies as they are and does not fail
+ * the copy.
+ *
+ * @param p the pipeline, with every job done
+ */
+static void dedupe_copies(pipeline_t *p) {
+  dedupe_file_t *files = (dedupe_file_t *)calloc(p->njobs ? p->njobs : 1, sizeof(dedupe_file_t));
+  if (files == NULL) {
+    fprintf(stderr, "Could not deduplicate the copies: %s\n", strerror(ENOMEM));
+    return;
+  }
+
+  unsigned int n = 0;
+  for (unsigned int i = 0; i < p->njobs; i++) {
+    job_t *j = &p->jobs[i];
+    if (atomic_load(&j->status) != 0 || j->off < DEDUPE_MIN) continue;
+    files[n].path = j->dst;
+    files[n].size = j->off;
+    files[n++].digest = atomic_load(&j->digest);
+  }
+  stats.dedupe_candidates = n;
+  log("Pipeline looking for duplicates among %u copies\n", n);
+  dedupe_run(files, n);
+  free(files);
+}
+
+// Run the readers and writers over
+// every source.
+int pipeline_copy(options_t *o) {
+  if (!o->dst_dir) return ENGINE_SKIP;
+
+  pipeline_t p;
+  int err;
+  if ((err = pipeline_init(&p, o)) != 0) {
+    if (err == ENOMEM) fprintf(stderr, "Could not allocate the pipeline: %s\n", strerror(err));
+    pipeline_destroy(&p);
+    return err;
+  }
+
+  unsigned int threads = p.threads;
+  atomic_init(&p.reader_ids, 0);
+  pthread_t *readers = (pthread_t *)calloc(threads, sizeof(pthread_t));
+  pthread_t *writers = (pthread_t *)calloc(threads, sizeof(pthread_t));
+  if (readers == NULL || writers == NULL) {
+    free(readers);
+    free(writers);
+    pipeline_destroy(&p);
+    return ENOMEM;
+  }
+
+  log("Pipeline copying %u files with %u readers and writers\n", p.njobs, threads);
+
+  unsigned int nwriters = 0, nreaders = 0;
+  while (nwriters < threads && pthread_create(&writers[nwriters], NULL, &writer_target, &p) == 0) {
+    nwriters++;
+  }
+  while (nwriters > 0 && nreaders < threads &&
+         pthread_create(&readers[nreaders], NULL, &reader_target, &p) == 0) {
+    nreaders++;
+  }
+
+  // Windows after the first are queued
+  // as the scheduler drains, or all at
+  // once without a feeder thread
+  pthread_t feeder;
+  int feeding = nreaders > 0 && p.queued < p.njobs &&
+    pthread_create(&feeder, NULL, &feed_target, &p) == 0;
+  while (nreaders > 0 && !feeding && p.queued < p.njobs) queue_window(&p);
+  if (!feeding) fair_feed(&p.sched, 0);
+
+  // Once every job is read, one NULL
+  // per writer ends the copy
+  for (unsigned int i = 0; i < nreaders; i++) pthread_join(readers[i], NULL);
+  fair_feed(&p.sched, 0);
+  if (feeding) pthread_join(feeder, NULL);
+  for (unsigned int i = 0; i < nwriters; i++) mpmc_push(&p.full_q, NULL);
+  for (unsigned int i = 0; i < nwriters; i++) pthread_join(writers[i], NULL);
+
+  if (nreaders == 0) {
+    fprintf(stderr, "Failed to start the pipeline threads\n");
+    err = EAGAIN;
+  }
+
+  // A cancelled copy leaves jobs behind.
+  // Those already started are synced and
+  // reported, the others were never opened
+  for (unsigned int i = 0; i < p.njobs; i++) {
+    job_t *j = &p.jobs[i];
+    if (atomic_load(&j->refs) == 0) continue;
+    job_fail(j, ECANCELED);
+    if (!j->opened) continue;
+    if (j->fill != NULL) cache_done(&p.cache, j->fill, 0);
+    j->fill = NULL;
+    if (j->in_fd != -1) close(j->in_fd);
+    j->in_fd = -1;
+    control_sync(j->out_fd);
+    job_release(&p, j);
+  }
+  for (unsigned int i = 0; i < p.njobs && err == 0; i++) {
+    err = atomic_load(&p.jobs[i].status);
+  }
+  if (o->dedupe && nreaders > 0 && control_state() != CONTROL_CANCELLED) dedupe_copies(&p);
+
+  free(readers);
+  free(writers);
+  pipeline_destroy(&p);
+  return err;
+}
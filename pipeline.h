@@ -0,0 +1,35 @@
+/**
+ * Shared pipeline for copying many
+ * files at once. Several reader threads
+ * take files from the job list and push
+ * chunks tagged with their job through
+ * an MPMC queue, several writer threads
+ * pull the chunks and write them out.
+ * All of the chunks come from one
+ * shared memory pool, so many small
+ * files are multiplexed through the
+ * same memory instead of each getting
+ * a ring of its own.
+ *
+ * @author Matt Stetter
+ * @file pipeline.h
+ */
+
+#include "options.h"
+
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+/**
+ * Copy every source named in the
+ * options into the destination
+ * directory. A failed file is
+ * reported and the others are
+ * still copied.
+ *
+ * @param o options naming the sources and destination directory
+ * @return 0 if every file was copied, errno of a failure otherwise
+ */
+int pipeline_copy(options_t *o);
+
+#endif
@@ -0,0 +1,84 @@
+/**
+ * Source implementation of the
+ * producer's readahead control.
+ *
+ * @author Matt Stetter
+ * @file prefetch.c
+ */
+
+#include "cpy.h"
+#include "prefetch.h"
+#include "stats.h"
+
+#include <fcntl.h>
+#include <semaphore.h>
+#include <stdio.h>
+
+// Set up the window and give the
+// kernel the sequential access hint.
+void prefetch_init(prefetch_t *pf, int fd, dev_info_t *info, size_t min, size_t max) {
+  pf->fd = -1;
+  pf->issued = 0;
+  pf->min = min < max ? min : max;
+  pf->max = max;
+  pf->ceiling = max;
+  pf->window = pf->min;
+
+  if (max == 0 || info->direct || !(info->is_reg || info->is_blk)) return;
+
+  pf->fd = fd;
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  log("Producer prefetching between %zu and %zu bytes ahead\n", pf->min, pf->max);
+}
+
+// Adapt the window and keep it filled.
+void prefetch_advance(prefetch_t *pf, buffer_t *buf, off_t off, off_t limit) {
+  if (pf->fd == -1) return;
+
+  // A nearly empty buffer means the
+  // consumer is waiting on the source,
+  // a nearly full one means the source
+  // is already ahead of the consumer
+  int full;
+  sem_getvalue(&buf->full_spaces, &full);
+  if ((unsigned int)full < buf->num_blocks / 4 && pf->window < pf->max) {
+    pf->window = pf->window * 2 < pf->max ? pf->window * 2 : pf->max;
+  } else if ((unsigned int)full > buf->num_blocks * 3 / 4 && pf->window > pf->min) {
+    pf->window = pf->window / 2 > pf->min ? pf->window / 2 : pf->min;
+  }
+
+  // Jumping to a new extent starts
+  // the window over at the cursor
+  if (pf->issued < off || pf->issued > limit) pf->issued = off;
+
+  off_t target = off + (off_t)pf->window;
+  if (target > limit) target = limit;
+
+  // Only top the window up once half of
+  // it has been consumed, so readahead is
+  // issued in large requests
+  if (target - pf->issued < (off_t)pf->window / 2 && target < limit) return;
+  if (target <= pf->issued) return;
+
+  size_t len = (size_t)(target - pf->issued);
+  if (readahead(pf->fd, pf->issued, len) != 0) {
+    posix_fadvise(pf->fd, pf->issued, len, POSIX_FADV_WILLNEED);
+  }
+  atomic_fetch_add(&stats.bytes_prefetched, len);
+
+  log("Producer prefetching %zu bytes at %lld, window %zu\n",
+      len, (long long)pf->issued, pf->window);
+
+  pf->issued = target;
+}
+
+// Move the largest window between the
+// smallest and the original largest.
+void prefetch_scale(prefetch_t *pf, double share) {
+  size_t max = (size_t)(pf->ceiling * share);
+  if (max < pf->min) max = pf->min;
+  if (max > pf->ceiling) max = pf->ceiling;
+  pf->max = max;
+  if (pf->window > max) pf->window = max;
+}
@@ -0,0 +1,74 @@
+/**
+ * Readahead control for the producer.
+ * Keeps a window of the source ahead
+ * of the read cursor in flight with
+ * readahead(2), growing the window
+ * while the consumer drains the buffer
+ * faster than the producer fills it
+ * and shrinking it while the buffer
+ * stays full.
+ *
+ * @author Matt Stetter
+ * @file prefetch.h
+ */
+
+#include "buffer.h"
+#include "device.h"
+
+#include <sys/types.h>
+
+#ifndef PREFETCH_H_
+#define PREFETCH_H_
+
+// State of the readahead window
+// for one open source file
+typedef struct prefetch {
+  int fd;		// Source file, -1 if prefetching is off
+  off_t issued;		// End of the range already handed to readahead
+  size_t window;	// Current distance kept ahead of the cursor
+  size_t min;		// Smallest the window shrinks to
+  size_t max;		// Largest the window grows to
+  size_t ceiling;	// Largest max can be scaled back up to
+} prefetch_t;
+
+/**
+ * Set up readahead for a source file
+ * and tell the kernel it will be read
+ * sequentially. Prefetching is turned
+ * off for sources without a page cache
+ * (pipes, O_DIRECT) or if max is 0.
+ *
+ * @param pf prefetch_t struct to fill in
+ * @param fd open source file
+ * @param info information about the source
+ * @param min smallest window in bytes
+ * @param max largest window in bytes
+ */
+void prefetch_init(prefetch_t *pf, int fd, dev_info_t *info, size_t min, size_t max);
+
+/**
+ * Resize the window from how full the
+ * buffer is and issue readahead for
+ * anything between the end of the last
+ * request and the cursor plus the window,
+ * without going past limit.
+ *
+ * @param pf prefetch_t struct
+ * @param buf the buffer the producer fills
+ * @param off current read cursor
+ * @param limit end of the range being read
+ */
+void prefetch_advance(prefetch_t *pf, buffer_t *buf, off_t off, off_t limit);
+
+/**
+ * Scale the largest window down to a
+ * share of the one prefetch_init was
+ * given, shrinking the window if it
+ * is now too large.
+ *
+ * @param pf prefetch_t struct
+ * @param share share of the original largest window, 0 to 1
+ */
+void prefetch_scale(prefetch_t *pf, double share);
+
+#endif
@@ -9,11 +9,20 @@
  * @file producer.c
  */
 
+#include "backend.h"
 #include "buffer.h"
+#include "control.h"
 #include "cpy.h"
+#include "deadline.h"
+#include "device.h"
+#include "extent.h"
+#include "prefetch.h"
 #include "producer.h"
+#include "psi.h"
+#include "replica.h"
+#include "stats.h"
 
-#include <fcntl.h>
+#include <errno.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <stdio.h>
@@ -24,82 +33,354 @@
 // for the producer to copy the file
 // to the buffer.
 typedef struct producer {
-  char *in_file;	// Name of the file to read from
+  options_t *opts;	// Options naming the file to read from
   pthread_t *thread;	// Producer's thread of execution
   buffer_t *buf;	// The buffer struct to write to
-  unsigned int write;	// The index to write to the shared buffer at
+  unsigned int write;	// The index of the block to claim next
+  int status;		// 0 if the copy succeeded, errno otherwise
+  prefetch_t pf;	// Readahead window ahead of the read cursor
 } producer_t;
 
 /**
- * Function to write data to
- * the buffer, and alert the consumer that
- * there is new data to be read.
- * This is the producer's critical section.
+ * Wait for an empty block in the
+ * buffer and lock it so the producer
+ * can fill it. This is the start of
+ * the producer's critical section.
  *
  * @param p the producer_t struct
- * @param d the data to write
- * @param length the number of bytes to write
+ * @return the locked block
  */
-void send_data(producer_t *p, char *d, int length) {
-  
-  // Get the block number and mutex
-  // for the block the producer wants
-  // to write to
-  unsigned int cur_block = p->write / BLOCK_SIZE;
-  pthread_mutex_t *cur_mutex = &p->buf->buf[cur_block].mutex;
-  unsigned int end_of_block = p->write - (p->write % BLOCK_SIZE) + BLOCK_SIZE;
-
-  // Wait until there are empty spaces in
-  // the buffer, and then acquire the mutex lock
+static block_t *claim_block(producer_t *p) {
   sem_wait(&p->buf->empty_spaces);
-  pthread_mutex_lock(cur_mutex);
-
-  log("Producer got the mutex lock on block %u\n", cur_block);
-  
-  for (int i = 0; i < length; i++) {
-
-    // Write a new byte in the buffer and
-    // increment the field variables
-    p->buf->buf[cur_block].blk[p->write % BLOCK_SIZE] = d[i];
-
-    // Increment the index for writing to the buffer
-    p->write = (p->write + 1) % BUFFER_SIZE;
-  
-    //log("Producer wrote character %c to buffer\n", d[i]);
-    
-    // Alert the consumer that there is a new character
-    // available to be read in the buffer
-    sem_post(&p->buf->full_spaces);
-
-    // If there are no spaces available, give up
-    // the mutex lock and wait until there are
-    // spaces available. Once at least one space
-    // is available, get the mutex lock again.
-    if (sem_trywait(&p->buf->empty_spaces) == -1) {
-      pthread_mutex_unlock(cur_mutex);
-      log("Producer ran out of buffer space\n");
-      sem_wait(&p->buf->empty_spaces);
-      pthread_mutex_lock(cur_mutex);
+  block_t *blk = &p->buf->buf[p->write];
+  pthread_mutex_lock(&blk->mutex);
+
+  log("Producer got the mutex lock on block %u\n", p->write);
+
+  // Move to the next block in the ring,
+  // so several blocks can be claimed
+  // before the first is sent
+  p->write = (p->write + 1) % p->buf->num_blocks;
+
+  return blk;
+}
+
+/**
+ * Release a filled block and alert
+ * the consumer that there is a new
+ * block to be written. This is the
+ * end of the producer's critical section.
+ *
+ * @param p the producer_t struct
+ * @param blk the block returned by claim_block
+ * @param off offset of the data in the source
+ * @param len number of valid bytes in the block
+ * @param flags BLK_* flags for the block
+ */
+static void send_block(producer_t *p, block_t *blk, off_t off, size_t len, int flags) {
+  blk->off = off;
+  blk->len = len;
+  blk->flags = flags;
+  pthread_mutex_unlock(&blk->mutex);
+  sem_post(&p->buf->full_spaces);
+
+  log("Producer sent %zu bytes at offset %lld\n", len, (long long)off);
+}
+
+/**
+ * Pace the copy for a deadline, hold
+ * the blocks in flight to the share
+ * pressure stalls leave the copy, and
+ * check for a pause or cancel before
+ * the next block is read. The consumer
+ * is sent a BLK_SYNC block to write
+ * and sync everything read so far,
+ * and every block of the ring is then
+ * claimed so none is in use while a
+ * paused copy releases the ring's
+ * memory. Resuming carries on from
+ * the same offset.
+ *
+ * @param p the producer_t struct
+ * @param off offset of the next read
+ * @return 0 to carry on, ECANCELED if the copy was cancelled
+ */
+static int checkpoint(producer_t *p, off_t off) {
+  deadline_pace();
+  prefetch_scale(&p->pf, deadline_share() * psi_share());
+  buffer_t *b = p->buf;
+  int idle;
+  while (control_state() == CONTROL_RUNNING && sem_getvalue(&b->empty_spaces, &idle) == 0 &&
+         psi_over(b->num_blocks - (unsigned int)idle, b->num_blocks)) {
+    psi_wait();
+  }
+  if (control_state() == CONTROL_RUNNING) return 0;
+
+  send_block(p, claim_block(p), off, 0, BLK_SYNC);
+  for (unsigned int i = 0; i < b->num_blocks; i++) sem_wait(&b->empty_spaces);
+
+  if (control_state() == CONTROL_PAUSED) {
+    control_release(b->slab, b->num_blocks * b->block_size);
+    if (p->opts->verbose) fprintf(stderr, "cpy: paused at offset %lld\n", (long long)off);
+  }
+  int err = control_checkpoint();
+
+  for (unsigned int i = 0; i < b->num_blocks; i++) sem_post(&b->empty_spaces);
+  return err;
+}
+
+/**
+ * Read a source whose extent map is
+ * unknown from start to end. Block
+ * devices are read up to the size the
+ * driver reports instead of relying on
+ * read returning 0.
+ *
+ * @param p the producer_t struct
+ * @param src the open source
+ * @return 0 if successful, errno otherwise
+ */
+static int copy_stream(producer_t *p, backend_t *src) {
+  dev_info_t *info = &src->info;
+  off_t off = 0;
+  off_t remaining = info->is_blk ? info->size : -1;
+  ssize_t status = 1;
+  int err;
+
+  // While there are still bytes to be read from
+  // the input file, read them straight into
+  // the next block of the shared buffer so the
+  // consumer can save them to the output file
+  while (status > 0 && remaining != 0) {
+    size_t want = p->buf->block_size;
+    if (remaining > 0 && (off_t)want > remaining) want = (size_t)remaining;
+
+    if ((err = checkpoint(p, off)) != 0) return err;
+    prefetch_advance(&p->pf, p->buf, off, info->size);
+    block_t *blk = claim_block(p);
+    status = backend_read(src, blk->blk, want, -1);
+
+    log("Producer read %ld bytes from file %s\n", status, p->opts->src);
+
+    // A failed read, or a block device that
+    // ends before its reported size, releases
+    // the block empty and fails the copy
+    if (status == -1 || (status == 0 && remaining > 0)) {
+      err = status == -1 ? errno : EIO;
+      send_block(p, blk, off, 0, 0);
+      fprintf(stderr, "Producer could not read file %s at offset %lld\n",
+              p->opts->src, (long long)off);
+      return err;
     }
 
-    // If the loop has entered a new block,
-    // change the mutex and cur_block
-    if (p->write == end_of_block) {
-      pthread_mutex_unlock(cur_mutex);
-      cur_block = (cur_block + 1) % NUM_BLOCKS;
-      cur_mutex = &p->buf->buf[cur_block].mutex;
-      end_of_block = (end_of_block + BLOCK_SIZE) % BUFFER_SIZE;
-      log("Producer reached end of block, new end of block is %u\n", end_of_block);
-      pthread_mutex_lock(cur_mutex);
+    send_block(p, blk, off, (size_t)status, 0);
+    atomic_fetch_add(&stats.bytes_read, status);
+    off += status;
+    if (remaining > 0) remaining -= status;
+  }
+
+  return 0;
+}
+
+/**
+ * Read a range of a file that holds
+ * data into the shared buffer at its
+ * offsets, one block at a time.
+ *
+ * @param p the producer_t struct
+ * @param src the open source
+ * @param off start of the range
+ * @param len length of the range
+ * @return 0 if successful, errno otherwise
+ */
+static int read_range(producer_t *p, backend_t *src, off_t off, off_t len) {
+  dev_info_t *info = &src->info;
+  off_t end = off + len;
+  int err;
+  while (len > 0) {
+    size_t want = p->buf->block_size;
+    if ((off_t)want > len) want = (size_t)len;
+
+    // O_DIRECT reads must be a whole number
+    // of sectors, the tail of the file is
+    // still returned as a short read
+    if (info->direct) want = (want + info->lbs - 1) / info->lbs * info->lbs;
+
+    if ((err = checkpoint(p, off)) != 0) return err;
+    prefetch_advance(&p->pf, p->buf, off, end);
+    block_t *blk = claim_block(p);
+    ssize_t status = backend_read(src, blk->blk, want, off);
+
+    // The file shrinking under the
+    // copy counts as a read error
+    if (status <= 0) {
+      err = status == -1 ? errno : EIO;
+      send_block(p, blk, off, 0, 0);
+      fprintf(stderr, "Producer could not read file %s at offset %lld\n",
+              p->opts->src, (long long)off);
+      return err;
     }
 
+    if (status > len) status = len;
+    send_block(p, blk, off, (size_t)status, 0);
+    atomic_fetch_add(&stats.bytes_read, status);
+    off += status;
+    len -= status;
   }
 
-  // Release the lock on the last block
-  // being written to
-  pthread_mutex_unlock(cur_mutex);
+  return 0;
+}
 
-  log("Producer release mutex lock\n");
+/**
+ * Read a regular file following its
+ * extent map. Only extents holding data
+ * are read, holes and unwritten extents
+ * are sent as BLK_ZERO blocks. On
+ * rotational media the extents are read
+ * in physical order if the destination
+ * can be written at arbitrary offsets.
+ *
+ * @param p the producer_t struct
+ * @param src the open source
+ * @param map extent map of the file in logical order
+ * @return 0 if successful, errno otherwise
+ */
+static int copy_extents(producer_t *p, backend_t *src, extent_map_t *map) {
+  int physical = dev_rotational(src->fd) &&
+    (backend_path_caps(p->opts->dst, BE_WRITE) & BE_PWRITE);
+  if (p->opts->stats) stats_set_extents(map, physical);
+  if (physical) extent_map_sort_physical(map);
+
+  log("Producer copying %u extents in %s order\n", map->count,
+      physical ? "physical" : "logical");
+
+  int err;
+  for (unsigned int i = 0; i < map->count; i++) {
+    extent_t *e = &map->ext[i];
+    if (e->flags & (EXT_HOLE | EXT_UNWRITTEN)) {
+      if ((err = checkpoint(p, e->logical)) != 0) return err;
+      send_block(p, claim_block(p), e->logical, (size_t)e->len, BLK_ZERO);
+    } else if ((err = read_range(p, src, e->logical, e->len)) != 0) {
+      return err;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Send a stripe's blocks to the consumer
+ * once its copy has read it, empty if
+ * every copy failed.
+ *
+ * @param p the producer_t struct
+ * @param r the replica set
+ * @param job the stripe
+ * @param blks the stripe's claimed blocks
+ * @return 0 if successful, errno otherwise
+ */
+static int send_stripe(producer_t *p, replica_t *r, replica_job_t *job, block_t **blks) {
+  int err = replica_wait(r, job);
+  for (int i = 0; i < job->iovcnt; i++) {
+    off_t off = job->off + (off_t)i * p->buf->block_size;
+    send_block(p, blks[i], off, err ? 0 : job->iov[i].iov_len, 0);
+  }
+  if (err != 0) {
+    fprintf(stderr, "Producer could not read file %s at offset %lld from any copy\n",
+            p->opts->src, (long long)job->off);
+    return err;
+  }
+  atomic_fetch_add(&stats.bytes_read, job->len);
+  return 0;
+}
+
+/**
+ * Read a regular file in stripes spread
+ * over the source and its replicas. The
+ * blocks of several stripes are claimed
+ * ahead so every copy has one to read,
+ * and each stripe's blocks are sent in
+ * order once it is read. Stripes hold
+ * whole leaves of the sidecar, so the
+ * whole file is read rather than its
+ * extents, leaving holes to the
+ * consumer's zero detection.
+ *
+ * @param p the producer_t struct
+ * @param r the replica set
+ * @param size size of the file
+ * @return 0 if successful, errno otherwise
+ */
+static int copy_striped(producer_t *p, replica_t *r, off_t size) {
+  size_t bs = p->buf->block_size;
+  size_t stripe = bs > REPLICA_LEAF ? bs / REPLICA_LEAF * REPLICA_LEAF : REPLICA_LEAF;
+  unsigned int per = (unsigned int)((stripe + bs - 1) / bs);
+  unsigned int window = p->buf->num_blocks / per;
+  if (window == 0) {
+    fprintf(stderr, "The ring needs at least %u blocks to read replicas\n", per);
+    return EINVAL;
+  }
+
+  replica_job_t *jobs = (replica_job_t *)calloc(window, sizeof(replica_job_t));
+  struct iovec *iov = (struct iovec *)calloc(window * per, sizeof(struct iovec));
+  block_t **blks = (block_t **)calloc(window * per, sizeof(block_t *));
+  if (jobs == NULL || iov == NULL || blks == NULL) {
+    free(jobs);
+    free(iov);
+    free(blks);
+    return ENOMEM;
+  }
+
+  unsigned int first = 0, next = 0;
+  off_t off = 0;
+  int err = 0;
+  while (err == 0 && (off < size || first != next)) {
+
+    // Start another stripe while the
+    // window has room and the copy is
+    // not being paused or cancelled
+    if (off < size && next - first < window && control_state() == CONTROL_RUNNING) {
+      deadline_pace();
+      unsigned int slot = next++ % window;
+      replica_job_t *job = &jobs[slot];
+      job->off = off;
+      job->len = size - off < (off_t)stripe ? (size_t)(size - off) : stripe;
+      job->iov = &iov[slot * per];
+      job->iovcnt = (int)((job->len + bs - 1) / bs);
+      for (int i = 0; i < job->iovcnt; i++) {
+        block_t *blk = blks[slot * per + i] = claim_block(p);
+        job->iov[i].iov_base = blk->blk;
+        job->iov[i].iov_len = job->len - i * bs < bs ? job->len - i * bs : bs;
+      }
+      replica_submit(r, job);
+      off += job->len;
+      continue;
+    }
+
+    // The ring is only handed over for a
+    // pause once every stripe is sent
+    if (first == next) {
+      err = checkpoint(p, off);
+      continue;
+    }
+    unsigned int slot = first++ % window;
+    err = send_stripe(p, r, &jobs[slot], &blks[slot * per]);
+  }
+
+  // Stripes still being read after a
+  // failure are sent empty
+  while (first != next) {
+    unsigned int slot = first++ % window;
+    replica_wait(r, &jobs[slot]);
+    for (int i = 0; i < jobs[slot].iovcnt; i++) {
+      send_block(p, blks[slot * per + i], jobs[slot].off + (off_t)i * bs, 0, 0);
+    }
+  }
+
+  free(jobs);
+  free(iov);
+  free(blks);
+  return err;
 }
 
 /** 
@@ -114,53 +395,51 @@ void send_data(producer_t *p, char *d, int length) {
  */
 void *prod_target(void *args) {
   producer_t *p = (producer_t *)args;
+  char *in_file = p->opts->src;
 
   // Producer attempts to open the input
   // file. An error message is printed
+  // and the consumer is told to stop
   // if this could not be completed.
-  int fd;
-  if ((fd = open(p->in_file, O_RDONLY)) == -1) {
-    fprintf(stderr, "Producer thread could not open file: %s\n", p->in_file);
+  backend_t src;
+  if ((p->status = backend_open(&src, in_file, BE_READ, p->opts->direct)) != 0) {
+    fprintf(stderr, "Producer thread could not open file: %s\n", in_file);
+    send_block(p, claim_block(p), 0, 0, BLK_EOF | BLK_ERROR);
     return NULL;
   }
 
-  log("Producer successfully opened file %s\n", p->in_file);
-
-  // Initialize file reading variables and read
-  // the first block of data from the input file
-  ssize_t status;
-  char temp_buf[PROD_BUFFER_SIZE];
-  status = read(fd, temp_buf, PROD_BUFFER_SIZE);
-
-  log("Producer read %ld bytes from file %s\n", status, p->in_file);
+  log("Producer successfully opened file %s\n", in_file);
 
-  // While there are still bytes to be read from
-  // the input file, push each character to
-  // the shared buffer so the consumer can
-  // save them to the output file
-  while (status) {
-   
-    // Write each character from the file
-    // buffer to the shared buffer
-    send_data(p, temp_buf, status);
-
-    // Read the next block of data from the file
-    status = read(fd, temp_buf, PROD_BUFFER_SIZE);
+  prefetch_init(&p->pf, src.fd, &src.info, p->buf->block_size, p->opts->readahead);
 
-    log("Producer read %ld bytes from file %s\n", status, p->in_file);
+  // Regular files are copied extent by
+  // extent when the file system can map
+  // them, or striped across their replicas,
+  // everything else is streamed
+  extent_map_t map;
+  replica_t *rep;
+  if (p->opts->nreplicas > 0) {
+    if ((p->status = replica_open(&rep, &src, p->opts)) == 0) {
+      p->status = copy_striped(p, rep, src.info.size);
+      replica_close(rep);
+    }
+  } else if (src.info.is_reg && extent_map_load(src.fd, src.info.size, &map) == 0) {
+    p->status = copy_extents(p, &src, &map);
+    extent_map_free(&map);
+  } else {
+    p->status = copy_stream(p, &src);
   }
 
-  // Send the null byte to terminate
-  // the buffered file copy
-  temp_buf[0] = '\0';
-  send_data(p, temp_buf, 1);
+  // Send the end of file block to
+  // terminate the buffered file copy
+  send_block(p, claim_block(p), 0, 0, p->status ? BLK_EOF | BLK_ERROR : BLK_EOF);
 
   // Try to close the input file
-  if (close(fd) != 0) {
-    fprintf(stderr, "Producer thread could not close file: %s\n", p->in_file);
+  if (backend_close(&src, p->status != 0) != 0) {
+    fprintf(stderr, "Producer thread could not close file: %s\n", in_file);
   }
 
-  log("Producer successfully closed file %s\n", p->in_file);
+  log("Producer successfully closed file %s\n", in_file);
 
   return NULL;
 }
@@ -168,8 +447,8 @@ void *prod_target(void *args) {
 // Function to initialize the producer
 // struct before the file copy
 // can begin.
-producer_t *producer_init(char *file_name, buffer_t *buf) {
-  if (file_name == NULL) return NULL;
+producer_t *producer_init(options_t *o, buffer_t *buf) {
+  if (o == NULL || o->src == NULL) return NULL;
 
   // Allocate enough heap memory for the
   // producer struct itself
@@ -183,12 +462,13 @@ producer_t *producer_init(char *file_name, buffer_t *buf) {
 
   log("Successfully allocated memory for the producer struct\n");
 
-  // Store the file name and
+  // Store the options and
   // the buffer struct in the
   // producer struct
-  p->in_file = file_name;
+  p->opts = o;
   p->buf = buf;
   p->write = 0;
+  p->status = 0;
 
   // Spawn the producer thread
   pthread_t *temp;
@@ -214,11 +494,13 @@ producer_t *producer_init(char *file_name, buffer_t *buf) {
 // Join on the producer's thread
 // of execution.
 int producer_join(producer_t *p) {
+  if (p == NULL) return 1;
 
   log("Main thread joining on producer thread\n");
 
   // Join on the internal thread
   pthread_join(*p->thread, NULL);
+  int status = p->status;
 
   // When the producer is finished,
   // free the thread's memory
@@ -229,6 +511,5 @@ int producer_join(producer_t *p) {
 
   log("Main thread freed producer memory\n");
 
-  return 0;
+  return status;
 }
-
@@ -10,12 +10,11 @@
  */
 
 #include "buffer.h"
+#include "options.h"
 
 #ifndef PRODUCER_H_
 #define PRODUCER_H_
 
-#define PROD_BUFFER_SIZE 64
-
 // Main struct of this producer
 // implementation. Contains a pthread
 // and the information needed to
@@ -28,11 +27,11 @@ typedef struct producer producer_t;
  * the producer struct before the 
  * file copy can begin.
  *
- * @param file_name the name of the file to read from
+ * @param o options naming the file to read from
  * @param buf the buffer to write to
  * @return pointer to struct if successful, NULL otherwise
  */
-producer_t *producer_init(char *file_name, buffer_t *buf);
+producer_t *producer_init(options_t *o, buffer_t *buf);
 
 /**
  * Joins on the specified
@@ -0,0 +1,269 @@
+/**
+ * Source implementation of the
+ * tuning profile cache.
+ *
+ * @author Matt Stetter
+ * @file profile.c
+ */
+
+#include "cpy.h"
+#include "profile.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <time.h>
+#include <unistd.h>
+
+// Identifies a cache file and its layout
+#define PROFILE_MAGIC "cpyprof1"
+
+// Length of the stored device models
+#define MODEL_LEN 32
+
+// One cached profile
+typedef struct profile_entry {
+  uint64_t src_magic;		// File system magic of the source
+  uint64_t dst_magic;		// File system magic of the destination
+  char src_model[MODEL_LEN];	// Model of the source's device
+  char dst_model[MODEL_LEN];	// Model of the destination's device
+  int32_t engine;		// Best engine, ENGINE_AUTO if unused
+  uint32_t depth;		// Best queue depth
+  uint64_t io_size;		// Best I/O size
+  double rate;			// Throughput of the best settings in bytes/s
+  uint32_t runs;		// Copies since the last re-validation
+  uint32_t explored;		// Re-validations done, picks the next variant
+  int64_t validated;		// Time of the last re-validation
+} profile_entry_t;
+
+// Layout of the cache file
+typedef struct profile_file {
+  char magic[8];		// PROFILE_MAGIC
+  profile_entry_t slots[PROFILE_SLOTS]; // The cached profiles
+} profile_file_t;
+
+// Mapping of the cache file between
+// profile_load and profile_store
+static profile_file_t *cache = NULL;
+static int cache_fd = -1;
+
+/**
+ * Read the model of the device behind
+ * a file system from sysfs. Partitions
+ * use their disk's model, devices
+ * without one use their block device
+ * name, and file systems without a
+ * device (tmpfs) get an empty model.
+ *
+ * @param dev device number of the file system
+ * @param model buffer of MODEL_LEN bytes
+ */
+static void read_model(dev_t dev, char *model) {
+  char path[PATH_MAX];
+  memset(model, 0, MODEL_LEN);
+
+  const char *attrs[] = { "device/model", "../device/model" };
+  for (int i = 0; i < 2; i++) {
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%s", major(dev), minor(dev), attrs[i]);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) continue;
+    if (fgets(model, MODEL_LEN, f) != NULL) model[strcspn(model, " \n")] = '\0';
+    fclose(f);
+    if (model[0] != '\0') return;
+  }
+
+  char link[PATH_MAX];
+  snprintf(path, sizeof(path), "/sys/dev/block/%u:%u", major(dev), minor(dev));
+  ssize_t n = readlink(path, link, sizeof(link) - 1);
+  if (n <= 0) return;
+  link[n] = '\0';
+  char *name = strrchr(link, '/');
+  strncpy(model, name ? name + 1 : link, MODEL_LEN - 1);
+}
+
+/**
+ * Open and map the cache file,
+ * creating it if needed.
+ *
+ * @return 0 if successful, errno otherwise
+ */
+static int cache_map(void) {
+  char path[PATH_MAX];
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  if (xdg != NULL && *xdg != '\0') snprintf(path, sizeof(path), "%s", xdg);
+  else if (home != NULL) snprintf(path, sizeof(path), "%s/.cache", home);
+  else return ENOENT;
+
+  // Create the cache directory and
+  // the cpy directory inside it
+  if (mkdir(path, 0700) != 0 && errno != EEXIST) return errno;
+  strncat(path, "/cpy", sizeof(path) - strlen(path) - 1);
+  if (mkdir(path, 0700) != 0 && errno != EEXIST) return errno;
+  strncat(path, "/profiles", sizeof(path) - strlen(path) - 1);
+
+  if ((cache_fd = open(path, O_RDWR | O_CREAT, 0600)) == -1) return errno;
+
+  // Several copies may run at once,
+  // each holds the lock while it reads
+  // or updates the cache
+  struct stat st;
+  if (flock(cache_fd, LOCK_EX) != 0 || fstat(cache_fd, &st) != 0 ||
+      (st.st_size != sizeof(profile_file_t) && ftruncate(cache_fd, sizeof(profile_file_t)) != 0)) {
+    int err = errno;
+    close(cache_fd);
+    cache_fd = -1;
+    return err;
+  }
+
+  cache = (profile_file_t *)mmap(NULL, sizeof(profile_file_t), PROT_READ | PROT_WRITE,
+                                 MAP_SHARED, cache_fd, 0);
+  if (cache == MAP_FAILED) {
+    int err = errno;
+    cache = NULL;
+    close(cache_fd);
+    cache_fd = -1;
+    return err;
+  }
+
+  // A new or foreign file starts empty
+  if (memcmp(cache->magic, PROFILE_MAGIC, sizeof(cache->magic)) != 0) {
+    memset(cache, 0, sizeof(profile_file_t));
+    memcpy(cache->magic, PROFILE_MAGIC, sizeof(cache->magic));
+  }
+
+  return 0;
+}
+
+/**
+ * Unmap the cache file and release
+ * the lock on it.
+ */
+static void cache_unmap(void) {
+  if (cache == NULL) return;
+  msync(cache, sizeof(profile_file_t), MS_ASYNC);
+  munmap(cache, sizeof(profile_file_t));
+  close(cache_fd);
+  cache = NULL;
+  cache_fd = -1;
+}
+
+/**
+ * Find or create the entry for the
+ * endpoints and decide whether this
+ * copy re-validates it. The cache
+ * must be mapped and locked.
+ *
+ * @param pr the probed endpoints
+ * @param t struct to fill in
+ */
+static void lookup(probe_t *pr, tune_t *t) {
+  char src_model[MODEL_LEN], dst_model[MODEL_LEN];
+  read_model(pr->src.dev, src_model);
+  read_model(pr->dst.dev, dst_model);
+
+  // Look for the entry, remembering
+  // the least recently validated slot
+  // to reuse if there is none
+  int oldest = 0;
+  for (int i = 0; i < PROFILE_SLOTS; i++) {
+    profile_entry_t *e = &cache->slots[i];
+    if (e->src_magic == (uint64_t)pr->src.fs_magic && e->dst_magic == (uint64_t)pr->dst.fs_magic &&
+        memcmp(e->src_model, src_model, MODEL_LEN) == 0 &&
+        memcmp(e->dst_model, dst_model, MODEL_LEN) == 0) {
+      t->slot = i;
+      break;
+    }
+    if (e->validated < cache->slots[oldest].validated) oldest = i;
+  }
+
+  int64_t now = time(NULL);
+  if (t->slot == -1) {
+    profile_entry_t *e = &cache->slots[oldest];
+    memset(e, 0, sizeof(*e));
+    e->src_magic = pr->src.fs_magic;
+    e->dst_magic = pr->dst.fs_magic;
+    memcpy(e->src_model, src_model, MODEL_LEN);
+    memcpy(e->dst_model, dst_model, MODEL_LEN);
+    e->engine = ENGINE_AUTO;
+    e->validated = now;
+    t->slot = oldest;
+    return;
+  }
+
+  profile_entry_t *e = &cache->slots[t->slot];
+  t->engine = e->engine;
+  t->io_size = e->io_size;
+  t->depth = e->depth;
+
+  // Cycle through the variants each
+  // time the entry is due for checking
+  if (e->engine != ENGINE_AUTO &&
+      (e->runs >= PROFILE_REVALIDATE || now - e->validated > PROFILE_MAX_AGE)) {
+    t->explore = EXPLORE_ENGINE + e->explored % 3;
+  }
+
+  log("Profile slot %d: engine %d, io size %zu, depth %u, explore %d\n",
+      t->slot, t->engine, t->io_size, t->depth, t->explore);
+}
+
+// Look up the tuning for a copy,
+// holding the lock only while the
+// cache is searched.
+void profile_load(probe_t *pr, tune_t *t) {
+  memset(t, 0, sizeof(*t));
+  t->slot = -1;
+  t->engine = ENGINE_AUTO;
+
+  if (cache_map() != 0) return;
+  lookup(pr, t);
+  flock(cache_fd, LOCK_UN);
+}
+
+// Fold the throughput of a copy
+// into its entry.
+void profile_store(tune_t *t, int engine, size_t io_size, unsigned int depth,
+                   unsigned long long bytes, double secs) {
+  if (cache == NULL) return;
+  if (t->slot == -1 || bytes < PROFILE_MIN_BYTES || secs <= 0) {
+    cache_unmap();
+    return;
+  }
+
+  flock(cache_fd, LOCK_EX);
+  profile_entry_t *e = &cache->slots[t->slot];
+  double rate = bytes / secs;
+  int same = engine == e->engine && io_size == e->io_size && depth == e->depth;
+
+  if (e->engine == ENGINE_AUTO || (!same && rate > e->rate)) {
+
+    // First measurement, or a variant
+    // that beat the cached settings
+    e->engine = engine;
+    e->io_size = io_size;
+    e->depth = depth;
+    e->rate = rate;
+  } else if (same) {
+
+    // Let the rate of the cached settings
+    // follow the device as it ages
+    e->rate = e->rate * 0.75 + rate * 0.25;
+  }
+
+  if (t->explore != EXPLORE_NONE) {
+    e->runs = 0;
+    e->explored++;
+    e->validated = time(NULL);
+  } else {
+    e->runs++;
+  }
+
+  cache_unmap();
+}
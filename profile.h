@@ -0,0 +1,91 @@
+/**
+ * Persistent cache of tuning profiles.
+ * For each pair of source and
+ * destination file systems, identified
+ * by file system magic and the model of
+ * the device behind them, the cache
+ * remembers the engine, I/O size and
+ * queue depth that gave the best
+ * throughput, so a copy can start at
+ * the tuned settings. The cache is a
+ * small file under $XDG_CACHE_HOME that
+ * is mapped into memory.
+ *
+ * Every PROFILE_REVALIDATE copies, or
+ * when an entry is older than
+ * PROFILE_MAX_AGE, a copy tries a
+ * variant of the cached settings and
+ * the variant replaces them if it is
+ * faster.
+ *
+ * @author Matt Stetter
+ * @file profile.h
+ */
+
+#include "engine.h"
+
+#include <stdint.h>
+
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+// Number of entries in the cache file
+#define PROFILE_SLOTS 64
+
+// Copies between re-validations of
+// an entry, and the age in seconds
+// after which an entry is
+// re-validated regardless
+#define PROFILE_REVALIDATE 16
+#define PROFILE_MAX_AGE (7 * 24 * 3600)
+
+// Copies shorter than this are too
+// noisy to learn a throughput from
+#define PROFILE_MIN_BYTES (16 * 1024 * 1024)
+
+// Variants tried by a re-validation
+#define EXPLORE_NONE 0		// Use the cached settings
+#define EXPLORE_ENGINE 1	// Try the best engine other than the cached one
+#define EXPLORE_LARGER 2	// Try twice the cached I/O size
+#define EXPLORE_SMALLER 3	// Try half the cached I/O size
+
+// Settings for one copy taken from
+// the cache
+typedef struct tune {
+  int slot;		// Index of the cache entry, -1 if there is none
+  int engine;		// Cached engine, ENGINE_AUTO if nothing is cached
+  size_t io_size;	// Cached I/O size, 0 for the engine's default
+  unsigned int depth;	// Cached queue depth, 0 for the engine's default
+  int explore;		// EXPLORE_* variant to try on this copy
+} tune_t;
+
+/**
+ * Map the cache and look up the entry
+ * for the probed endpoints, creating
+ * it if there is none. Any failure
+ * leaves t describing an empty entry
+ * so the copy runs untuned.
+ *
+ * @param pr the probed endpoints
+ * @param t struct to fill in
+ */
+void profile_load(probe_t *pr, tune_t *t);
+
+/**
+ * Record the throughput of a finished
+ * copy in the cache and unmap it.
+ * The settings replace the cached ones
+ * if the entry was empty, or if they were
+ * a variant that beat the cached rate.
+ *
+ * @param t the struct filled in by profile_load
+ * @param engine ENGINE_* engine that ran
+ * @param io_size I/O size the engine used
+ * @param depth queue depth the engine used
+ * @param bytes bytes copied
+ * @param secs seconds the copy took
+ */
+void profile_store(tune_t *t, int engine, size_t io_size, unsigned int depth,
+                   unsigned long long bytes, double secs);
+
+#endif
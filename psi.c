@@ -0,0 +1,242 @@
+/**
+ * Source implementation of the
+ * pressure stall throttling.
+ *
+ * Each pressure file starts with a
+ * line such as "some avg10=1.20 avg60=0.80
+ * avg300=0.30 total=123456", total being
+ * the microseconds some task stalled.
+ * The kernel's averages lag by ten
+ * seconds or more, so the stall is
+ * worked out from the change in total
+ * between two samples instead. The
+ * system's and the cgroup's files are
+ * both read and the larger stall
+ * counts, so pressure inside a
+ * container's limits is seen as well.
+ *
+ * @author Matt Stetter
+ * @file psi.c
+ */
+
+#include "cgroup.h"
+#include "cpy.h"
+#include "psi.h"
+#include "stats.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Where each resource's pressure is
+// read from: the system and the cgroup
+#define PSI_SOURCES 2
+
+// Names of the PRESSURE_* resources,
+// as in the pressure file names
+static const char *const names[PRESSURE_COUNT] = { "io", "memory", "cpu" };
+
+// Sampling state shared by every thread
+static struct {
+  pthread_mutex_t lock;		// Held by the thread taking a sample
+  int active;			// Non-zero once a resource is watched
+  double limits[PRESSURE_COUNT]; // Stall percentage of each resource to back off above
+  int fds[PRESSURE_COUNT][PSI_SOURCES]; // Pressure files, -1 if not open
+  unsigned long long totals[PRESSURE_COUNT][PSI_SOURCES]; // Stall at the last sample
+  atomic_ullong last;		// Time of the last sample in nanoseconds
+  atomic_uint share;		// Share the copy may use, in thousandths
+} psi = { .lock = PTHREAD_MUTEX_INITIALIZER, .share = 1000 };
+
+/**
+ * Read the monotonic clock in
+ * nanoseconds.
+ *
+ * @return the time in nanoseconds
+ */
+static unsigned long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+// Parse one limit for all or a
+// list of named limits.
+int psi_parse(const char *str, double limits[PRESSURE_COUNT]) {
+  char *end;
+  for (int r = 0; r < PRESSURE_COUNT; r++) limits[r] = 0;
+
+  double all = strtod(str, &end);
+  if (end != str && *end == '\0') {
+    if (all <= 0 || all > 100) return 1;
+    for (int r = 0; r < PRESSURE_COUNT; r++) limits[r] = all;
+    return 0;
+  }
+
+  const char *p = str;
+  while (*p != '\0') {
+    int r = 0;
+    size_t len = strcspn(p, "=");
+    while (r < PRESSURE_COUNT && (strlen(names[r]) != len || strncmp(p, names[r], len) != 0)) r++;
+    if (r == PRESSURE_COUNT || p[len] != '=') return 1;
+    limits[r] = strtod(p + len + 1, &end);
+    if (end == p + len + 1 || limits[r] <= 0 || limits[r] > 100) return 1;
+    if (*end == ',' && end[1] != '\0') end++;
+    else if (*end != '\0') return 1;
+    p = end;
+  }
+  return 0;
+}
+
+/**
+ * Open the pressure file of a resource
+ * in the cgroup v2 group the copy
+ * runs in.
+ *
+ * @param name name of the resource
+ * @return the open file, -1 if there is none
+ */
+static int open_cgroup(const char *name) {
+  char dir[PATH_MAX], path[PATH_MAX + 32];
+  if (cgroup_dir(dir, sizeof(dir)) != 0) return -1;
+  snprintf(path, sizeof(path), "%s/%s.pressure", dir, name);
+  return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+/**
+ * Read the stall total of the first
+ * line of a pressure file.
+ *
+ * @param fd the pressure file
+ * @param total returned microseconds some task stalled
+ * @return 0 if successful, 1 otherwise
+ */
+static int read_total(int fd, unsigned long long *total) {
+  char buf[256];
+  ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+  if (n <= 0) return 1;
+  buf[n] = '\0';
+  buf[strcspn(buf, "\n")] = '\0';
+  char *t = strstr(buf, "total=");
+  if (strncmp(buf, "some ", 5) != 0 || t == NULL) return 1;
+  *total = strtoull(t + 6, NULL, 10);
+  return 0;
+}
+
+// Open the pressure files of the
+// watched resources.
+void psi_start(const double limits[PRESSURE_COUNT]) {
+  int watched = 0, found = 0;
+  for (int r = 0; r < PRESSURE_COUNT; r++) {
+    psi.limits[r] = limits[r];
+    psi.fds[r][0] = psi.fds[r][1] = -1;
+    if (limits[r] <= 0) continue;
+    watched = 1;
+
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/pressure/%s", names[r]);
+    psi.fds[r][0] = open(path, O_RDONLY | O_CLOEXEC);
+    psi.fds[r][1] = open_cgroup(names[r]);
+    for (int s = 0; s < PSI_SOURCES; s++) {
+      if (psi.fds[r][s] != -1 && read_total(psi.fds[r][s], &psi.totals[r][s]) != 0) {
+        close(psi.fds[r][s]);
+        psi.fds[r][s] = -1;
+      }
+      if (psi.fds[r][s] != -1) found++;
+    }
+    log("Pressure of %s read from %s%s\n", names[r], psi.fds[r][0] != -1 ? "the system" : "",
+        psi.fds[r][1] != -1 ? " and the cgroup" : "");
+  }
+  if (!watched) return;
+  if (found == 0) {
+    fprintf(stderr, "Pressure stall information is not available, not throttling\n");
+    return;
+  }
+
+  atomic_store(&psi.last, now_ns());
+  psi.active = 1;
+  stats.pressure_low = 1;
+}
+
+/**
+ * Sample the pressure files and move
+ * the share down if a stall is above
+ * its limit, or up if all are below.
+ * Called with the lock held.
+ *
+ * @param now the time of the sample in nanoseconds
+ */
+static void sample(unsigned long long now) {
+  double elapsed = (now - atomic_load(&psi.last)) / 1e3;
+  int over = 0;
+  for (int r = 0; r < PRESSURE_COUNT; r++) {
+    double stall = 0;
+    for (int s = 0; s < PSI_SOURCES; s++) {
+      unsigned long long total;
+      if (psi.fds[r][s] == -1 || read_total(psi.fds[r][s], &total) != 0) continue;
+      double pct = (total - psi.totals[r][s]) / elapsed * 100;
+      if (pct > stall) stall = pct;
+      psi.totals[r][s] = total;
+    }
+    if (stall > stats.pressure_peak[r]) stats.pressure_peak[r] = stall;
+    if (psi.limits[r] > 0 && stall > psi.limits[r]) over = 1;
+  }
+  atomic_store(&psi.last, now);
+
+  double share = atomic_load(&psi.share) / 1000.0;
+  double next = over ? share * PSI_BACKOFF : share + PSI_RAMP;
+  if (next < PSI_FLOOR) next = PSI_FLOOR;
+  if (next > 1) next = 1;
+  if (over && next < share) stats.pressure_backoffs++;
+  if (next < stats.pressure_low) stats.pressure_low = next;
+  log("Pressure %s, share now %.0f%%\n", over ? "high" : "low", next * 100);
+  atomic_store(&psi.share, (unsigned int)(next * 1000 + 0.5));
+}
+
+// Get the share, sampling once every
+// PSI_INTERVAL by whichever thread
+// gets there first. The time of the
+// last sample is atomic so threads
+// can check it without the lock.
+double psi_share(void) {
+  if (!psi.active) return 1;
+  unsigned long long now = now_ns();
+  unsigned long long interval = (unsigned long long)(PSI_INTERVAL * 1e9);
+  if (now - atomic_load(&psi.last) >= interval && pthread_mutex_trylock(&psi.lock) == 0) {
+    now = now_ns();
+    if (now - atomic_load(&psi.last) >= interval) sample(now);
+    pthread_mutex_unlock(&psi.lock);
+  }
+  return atomic_load(&psi.share) / 1000.0;
+}
+
+// Compare what is used with the
+// share of the total, which is
+// never less than one unit.
+int psi_over(unsigned int used, unsigned int total) {
+  if (!psi.active) return 0;
+  unsigned int limit = (unsigned int)(total * psi_share() + 0.999);
+  return used >= (limit > 0 ? limit : 1);
+}
+
+// Sleep a poll interval.
+void psi_wait(void) {
+  struct timespec ts = { 0, (long)(PSI_POLL * 1e9) };
+  nanosleep(&ts, NULL);
+}
+
+// Close the files.
+void psi_stop(void) {
+  for (int r = 0; psi.active && r < PRESSURE_COUNT; r++) {
+    for (int s = 0; s < PSI_SOURCES; s++) {
+      if (psi.fds[r][s] != -1) close(psi.fds[r][s]);
+      psi.fds[r][s] = -1;
+    }
+  }
+  psi.active = 0;
+}
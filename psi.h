@@ -0,0 +1,95 @@
+/**
+ * Throttling on pressure stall
+ * information. The share of time tasks
+ * stalled on I/O, memory or CPU is
+ * sampled from /proc/pressure and from
+ * the pressure files of the copy's own
+ * cgroup. While any stall is above its
+ * limit the copy halves the share of
+ * its readers, in-flight buffers and
+ * readahead it lets itself use, and
+ * while all are below it takes the
+ * share back a step at a time, so a
+ * background copy runs on whatever
+ * the rest of the system leaves idle.
+ *
+ * @author Matt Stetter
+ * @file psi.h
+ */
+
+#include "options.h"
+
+#ifndef PSI_H_
+#define PSI_H_
+
+// Seconds between two samples of the
+// pressure files
+#define PSI_INTERVAL 0.5
+
+// Share kept after a sample above a
+// limit, share given back after one
+// below every limit, and the least
+// share the copy is held to
+#define PSI_BACKOFF 0.5
+#define PSI_RAMP 0.1
+#define PSI_FLOOR (1.0 / 16)
+
+// Seconds a throttled thread sleeps
+// before looking at the share again
+#define PSI_POLL 0.01
+
+/**
+ * Parse the stall limits of --pressure:
+ * either one percentage for every
+ * resource, or a comma separated list
+ * of io=PCT, memory=PCT and cpu=PCT
+ * naming the resources to watch.
+ *
+ * @param str string to parse
+ * @param limits returned limit of each PRESSURE_* resource, 0 if not watched
+ * @return 0 if successful, 1 otherwise
+ */
+int psi_parse(const char *str, double limits[PRESSURE_COUNT]);
+
+/**
+ * Open the pressure files of the
+ * watched resources and take the
+ * first sample. Does nothing if no
+ * resource is watched, and warns if
+ * the kernel reports no pressure.
+ *
+ * @param limits limit of each PRESSURE_* resource, 0 if not watched
+ */
+void psi_start(const double limits[PRESSURE_COUNT]);
+
+/**
+ * Get the share of its resources the
+ * copy may use, sampling the pressure
+ * files if PSI_INTERVAL has passed.
+ *
+ * @return share between PSI_FLOOR and 1, 1 if not throttling
+ */
+double psi_share(void);
+
+/**
+ * Check whether a resource is used up
+ * to the share the copy may use.
+ *
+ * @param used units in use, such as busy threads or buffers
+ * @param total units the copy was given
+ * @return non-zero if used has reached the share, 0 otherwise
+ */
+int psi_over(unsigned int used, unsigned int total);
+
+/**
+ * Sleep for PSI_POLL seconds, for a
+ * thread held back by psi_over.
+ */
+void psi_wait(void);
+
+/**
+ * Close the pressure files.
+ */
+void psi_stop(void);
+
+#endif
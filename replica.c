@@ -0,0 +1,406 @@
+/**
+ * Source implementation of the
+ * striped reads across replicas.
+ *
+ * @author Matt Stetter
+ * @file replica.c
+ */
+
+#include "cpy.h"
+#include "device.h"
+#include "hash.h"
+#include "replica.h"
+#include "stats.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// State of the replica set
+struct replica {
+  int fds[REPLICA_MAX + 1];	// Source first, then the replicas kept
+  const char *paths[REPLICA_MAX + 1]; // Paths of the copies
+  unsigned int count;		// Number of copies
+  unsigned int align;		// Read alignment, the largest O_DIRECT sector
+  unsigned char *leaves;	// Leaf hashes from the sidecar, NULL if none
+  unsigned long long num_leaves; // Number of leaf hashes
+  pthread_mutex_t lock;		// Protects the queue and the jobs' states
+  pthread_cond_t cond;		// Signalled when a job is queued or done
+  replica_job_t *head;		// Oldest queued stripe
+  replica_job_t *tail;		// Newest queued stripe
+  int closing;			// Non-zero once the threads should stop
+  unsigned int started;		// Threads that picked their copy
+  pthread_t threads[REPLICA_MAX + 1]; // One thread per copy
+  unsigned int num_threads;	// Threads running
+};
+
+/**
+ * Read a range of a copy with pread,
+ * rounding the length up to the read
+ * alignment.
+ *
+ * @param fd the copy
+ * @param buf buffer of the rounded length
+ * @param len bytes wanted
+ * @param off offset of the range
+ * @param align read alignment
+ * @return bytes read, -1 on failure with errno set
+ */
+static ssize_t read_full(int fd, char *buf, size_t len, off_t off, unsigned int align) {
+  size_t want = (len + align - 1) / align * align;
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = pread(fd, buf + done, want - done, off + done);
+    if (n == -1 && errno == EINTR) continue;
+    if (n == -1) return -1;
+    if (n == 0) break;
+    done += n;
+  }
+  return (ssize_t)done;
+}
+
+/**
+ * Hash one leaf of a copy for the
+ * check made when it is opened.
+ *
+ * @param r the replica set
+ * @param fd the copy
+ * @param buf buffer of REPLICA_LEAF bytes
+ * @param off offset of the leaf
+ * @param len bytes in the leaf
+ * @param out returned hash
+ * @return 0 if successful, errno otherwise
+ */
+static int hash_leaf(replica_t *r, int fd, char *buf, off_t off, size_t len,
+                     unsigned char out[SHA256_LEN]) {
+  ssize_t n = read_full(fd, buf, len, off, r->align);
+  if (n == -1) return errno;
+  if ((size_t)n < len) return EIO;
+  sha256(buf, len, out);
+  return 0;
+}
+
+/**
+ * Check that a replica holds the same
+ * file as the source: the same size and
+ * modification time, and the same first
+ * and last leaves.
+ *
+ * @param r the replica set, with the source as its first copy
+ * @param fd the replica
+ * @param size size of the source
+ * @param buf buffer of REPLICA_LEAF bytes
+ * @return 0 if it matches, errno otherwise
+ */
+static int check_replica(replica_t *r, int fd, off_t size, char *buf) {
+  struct stat a, b;
+  if (fstat(r->fds[0], &a) == -1 || fstat(fd, &b) == -1) return errno;
+  if (!S_ISREG(b.st_mode) || b.st_size != size || a.st_mtim.tv_sec != b.st_mtim.tv_sec) return ESTALE;
+  if (size == 0) return 0;
+
+  off_t last = (size - 1) / REPLICA_LEAF * REPLICA_LEAF;
+  off_t offs[2] = { 0, last };
+  for (int i = 0; i < (last > 0 ? 2 : 1); i++) {
+    size_t len = size - offs[i] < REPLICA_LEAF ? (size_t)(size - offs[i]) : REPLICA_LEAF;
+    unsigned char want[SHA256_LEN], got[SHA256_LEN];
+    int err;
+    if ((err = hash_leaf(r, r->fds[0], buf, offs[i], len, want)) != 0) return err;
+    if ((err = hash_leaf(r, fd, buf, offs[i], len, got)) != 0) return err;
+    if (memcmp(want, got, SHA256_LEN) != 0) return ESTALE;
+  }
+  return 0;
+}
+
+/**
+ * Load the leaf hashes of the SRC.merkle
+ * sidecar if there is one. Each line
+ * starts with the hex SHA-256 of one
+ * leaf, as split -b with a sha256sum
+ * filter prints them.
+ *
+ * @param r the replica set
+ * @param src path of the source
+ * @param size size of the source
+ * @return 0 if successful or there is no sidecar, errno otherwise
+ */
+static int load_sidecar(replica_t *r, const char *src, off_t size) {
+  char path[4096];
+  if (snprintf(path, sizeof(path), "%s.merkle", src) >= (int)sizeof(path)) return 0;
+  FILE *f = fopen(path, "r");
+  if (f == NULL) return errno == ENOENT ? 0 : errno;
+
+  unsigned long long want = ((unsigned long long)size + REPLICA_LEAF - 1) / REPLICA_LEAF;
+  r->leaves = (unsigned char *)malloc(want > 0 ? want * SHA256_LEN : 1);
+  if (r->leaves == NULL) {
+    fclose(f);
+    return ENOMEM;
+  }
+
+  char line[256];
+  int err = 0;
+  while (err == 0 && fgets(line, sizeof(line), f) != NULL) {
+    unsigned char *leaf = &r->leaves[r->num_leaves * SHA256_LEN];
+    if (r->num_leaves == want) {
+      err = EINVAL;
+      break;
+    }
+
+    // The hash must be whole and end the
+    // line or be followed by a space
+    line[strcspn(line, "\n")] = '\0';
+    size_t digits = strspn(line, "0123456789abcdefABCDEF");
+    if (digits != SHA256_LEN * 2 || (line[digits] != '\0' && !isspace((unsigned char)line[digits]))) {
+      fprintf(stderr, "Sidecar %s has a corrupt line %llu\n", path, r->num_leaves + 1);
+      err = EINVAL;
+      break;
+    }
+    for (int i = 0; err == 0 && i < SHA256_LEN; i++) {
+      unsigned int byte;
+      if (sscanf(&line[i * 2], "%2x", &byte) != 1) err = EINVAL;
+      else leaf[i] = (unsigned char)byte;
+    }
+    r->num_leaves++;
+  }
+  fclose(f);
+
+  if (err != 0 || r->num_leaves != want) {
+    fprintf(stderr, "Sidecar %s does not list the %llu leaves of %s\n", path, want, src);
+    return EINVAL;
+  }
+  log("Loaded %llu leaf hashes from %s\n", want, path);
+  return 0;
+}
+
+/**
+ * Check a stripe read into its ring
+ * blocks against the sidecar's hashes
+ * of the leaves it holds.
+ *
+ * @param r the replica set
+ * @param job the stripe
+ * @return 0 if every leaf matches, EBADMSG otherwise
+ */
+static int verify_stripe(replica_t *r, replica_job_t *job) {
+  unsigned long long leaf = (unsigned long long)job->off / REPLICA_LEAF;
+  unsigned char got[SHA256_LEN];
+  sha256_t s;
+  size_t in_leaf = 0;
+  sha256_init(&s);
+  for (int i = 0; i < job->iovcnt; i++) {
+    const char *buf = (const char *)job->iov[i].iov_base;
+    size_t left = job->iov[i].iov_len;
+    while (left > 0) {
+      size_t n = REPLICA_LEAF - in_leaf < left ? REPLICA_LEAF - in_leaf : left;
+      sha256_update(&s, buf, n);
+      buf += n;
+      left -= n;
+      if ((in_leaf += n) < REPLICA_LEAF) continue;
+
+      sha256_final(&s, got);
+      if (memcmp(got, &r->leaves[leaf++ * SHA256_LEN], SHA256_LEN) != 0) return EBADMSG;
+      sha256_init(&s);
+      in_leaf = 0;
+    }
+  }
+  if (in_leaf == 0) return 0;
+  sha256_final(&s, got);
+  return memcmp(got, &r->leaves[leaf * SHA256_LEN], SHA256_LEN) != 0 ? EBADMSG : 0;
+}
+
+/**
+ * Read a stripe from one copy into
+ * its ring blocks. The last block's
+ * length is rounded up to the read
+ * alignment.
+ *
+ * @param r the replica set
+ * @param fd the copy
+ * @param job the stripe
+ * @param iov scratch spans, as many as the stripe's blocks
+ * @return 0 if successful, errno otherwise
+ */
+static int read_stripe(replica_t *r, int fd, replica_job_t *job, struct iovec *iov) {
+  int cnt = job->iovcnt;
+  memcpy(iov, job->iov, cnt * sizeof(struct iovec));
+  iov[cnt - 1].iov_len = (iov[cnt - 1].iov_len + r->align - 1) / r->align * r->align;
+
+  size_t done = 0;
+  int i = 0;
+  while (done < job->len) {
+    ssize_t n = preadv(fd, &iov[i], cnt - i, job->off + done);
+    if (n == -1 && errno == EINTR) continue;
+    if (n == -1) return errno;
+
+    // The copy shrinking under the
+    // copy counts as a read error
+    if (n == 0) return EIO;
+    done += n;
+    while (n > 0 && i < cnt) {
+      if ((size_t)n < iov[i].iov_len) {
+        iov[i].iov_base = (char *)iov[i].iov_base + n;
+        iov[i].iov_len -= n;
+        break;
+      }
+      n -= iov[i++].iov_len;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Thread target reading queued stripes
+ * from one copy, falling back to the
+ * others in turn when a read fails or
+ * a leaf does not match the sidecar.
+ *
+ * @param args the replica set
+ * @return NULL
+ */
+static void *replica_target(void *args) {
+  replica_t *r = (replica_t *)args;
+  struct iovec *iov = NULL;
+  int iov_cap = 0;
+
+  pthread_mutex_lock(&r->lock);
+  unsigned int k = r->started++;
+  for (;;) {
+    while (r->head == NULL && !r->closing) pthread_cond_wait(&r->cond, &r->lock);
+    if (r->head == NULL) break;
+    replica_job_t *job = r->head;
+    if ((r->head = job->next) == NULL) r->tail = NULL;
+    pthread_mutex_unlock(&r->lock);
+
+    int err = 0;
+    if (iov_cap < job->iovcnt) {
+      struct iovec *tmp = (struct iovec *)realloc(iov, job->iovcnt * sizeof(struct iovec));
+      if (tmp == NULL) {
+        err = ENOMEM;
+      } else {
+        iov = tmp;
+        iov_cap = job->iovcnt;
+      }
+    }
+    for (unsigned int t = 0; err != ENOMEM && t < r->count; t++) {
+      unsigned int c = (k + t) % r->count;
+      if ((err = read_stripe(r, r->fds[c], job, iov)) == 0 && r->leaves != NULL) {
+        err = verify_stripe(r, job);
+      }
+      if (err == 0) {
+        atomic_fetch_add(&stats.stripes_read, 1);
+        if (t > 0) atomic_fetch_add(&stats.stripe_fallbacks, 1);
+        break;
+      }
+      fprintf(stderr, "Could not read %s at offset %lld: %s\n", r->paths[c],
+              (long long)job->off, err == EBADMSG ? "does not match the sidecar" : strerror(err));
+    }
+
+    pthread_mutex_lock(&r->lock);
+    job->status = err;
+    job->done = 1;
+    pthread_cond_broadcast(&r->cond);
+  }
+  pthread_mutex_unlock(&r->lock);
+
+  free(iov);
+  return NULL;
+}
+
+// Open the replicas, check them and
+// start a thread for each copy.
+int replica_open(replica_t **rp, backend_t *src, options_t *o) {
+  if (!src->info.is_reg || src->fd == -1) {
+    fprintf(stderr, "Replicas need a regular file as the source: %s\n", src->path);
+    return EINVAL;
+  }
+
+  replica_t *r = (replica_t *)calloc(1, sizeof(replica_t));
+  char *buf = NULL;
+  if (r == NULL || posix_memalign((void **)&buf, BLOCK_ALIGN, REPLICA_LEAF) != 0) {
+    free(r);
+    return ENOMEM;
+  }
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->cond, NULL);
+  r->fds[0] = src->fd;
+  r->paths[0] = src->path;
+  r->count = 1;
+  r->align = src->info.direct ? src->info.lbs : 1;
+
+  // Replicas that do not match are left
+  // out rather than failing the copy
+  int err = 0;
+  for (unsigned int i = 0; i < o->nreplicas; i++) {
+    dev_info_t info;
+    int fd = dev_open_src(o->replicas[i], src->info.direct, &info);
+    if (fd == -1) {
+      fprintf(stderr, "Could not open replica %s: %s\n", o->replicas[i], strerror(errno));
+      continue;
+    }
+    if (info.direct && info.lbs > r->align) r->align = info.lbs;
+    if ((err = check_replica(r, fd, src->info.size, buf)) != 0) {
+      fprintf(stderr, "Replica %s does not match %s (%s), not reading from it\n", o->replicas[i],
+              src->path, err == ESTALE ? "different contents" : strerror(err));
+      close(fd);
+      continue;
+    }
+    r->fds[r->count] = fd;
+    r->paths[r->count++] = o->replicas[i];
+  }
+  free(buf);
+
+  err = load_sidecar(r, src->path, src->info.size);
+  for (unsigned int i = 0; err == 0 && i < r->count; i++) {
+    if ((err = pthread_create(&r->threads[i], NULL, &replica_target, r)) == 0) r->num_threads++;
+  }
+  if (err != 0) {
+    replica_close(r);
+    return err;
+  }
+
+  log("Striping reads across %u copies of %s\n", r->count, src->path);
+  stats.replica_copies = r->count;
+  *rp = r;
+  return 0;
+}
+
+// Queue a stripe.
+void replica_submit(replica_t *r, replica_job_t *job) {
+  job->done = 0;
+  job->status = 0;
+  job->next = NULL;
+  pthread_mutex_lock(&r->lock);
+  if (r->tail != NULL) r->tail->next = job;
+  else r->head = job;
+  r->tail = job;
+  pthread_cond_broadcast(&r->cond);
+  pthread_mutex_unlock(&r->lock);
+}
+
+// Wait for a queued stripe.
+int replica_wait(replica_t *r, replica_job_t *job) {
+  pthread_mutex_lock(&r->lock);
+  while (!job->done) pthread_cond_wait(&r->cond, &r->lock);
+  pthread_mutex_unlock(&r->lock);
+  return job->status;
+}
+
+// Stop the threads and close
+// the replicas.
+void replica_close(replica_t *r) {
+  pthread_mutex_lock(&r->lock);
+  r->closing = 1;
+  pthread_cond_broadcast(&r->cond);
+  pthread_mutex_unlock(&r->lock);
+  for (unsigned int i = 0; i < r->num_threads; i++) pthread_join(r->threads[i], NULL);
+
+  for (unsigned int i = 1; i < r->count; i++) close(r->fds[i]);
+  pthread_mutex_destroy(&r->lock);
+  pthread_cond_destroy(&r->cond);
+  free(r->leaves);
+  free(r);
+}
@@ -0,0 +1,84 @@
+/**
+ * Striped reads across identical copies
+ * of the source given with --replica.
+ * One thread per copy takes stripes off
+ * a shared queue, so faster copies read
+ * more of them, and reads them straight
+ * into the ring blocks the producer
+ * claimed for them. A stripe that cannot
+ * be read, or whose leaves do not match
+ * the SRC.merkle sidecar, is read again
+ * from the next copy.
+ *
+ * @author Matt Stetter
+ * @file replica.h
+ */
+
+#include "backend.h"
+#include "options.h"
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifndef REPLICA_H_
+#define REPLICA_H_
+
+// One stripe of the source, made of
+// whole leaves of REPLICA_LEAF bytes
+// except at the end of the file
+typedef struct replica_job {
+  off_t off;		// Offset of the stripe in the source
+  size_t len;		// Bytes in the stripe
+  struct iovec *iov;	// Ring blocks the stripe is read into
+  int iovcnt;		// Number of ring blocks
+  int done;		// Non-zero once the stripe is read or failed
+  int status;		// 0, or the error of the last copy tried
+  struct replica_job *next; // Next stripe in the queue
+} replica_job_t;
+
+// Copies of the source with the
+// threads reading them
+typedef struct replica replica_t;
+
+/**
+ * Open the replicas named in the options
+ * next to the open source and start a
+ * thread for each copy. A replica whose
+ * size, modification time or first and
+ * last leaves differ from the source's
+ * is left out with a warning.
+ *
+ * @param r returned replica set
+ * @param src the open source, a regular file
+ * @param o the parsed options
+ * @return 0 if successful, errno otherwise
+ */
+int replica_open(replica_t **r, backend_t *src, options_t *o);
+
+/**
+ * Queue a stripe to be read by the
+ * next idle copy.
+ *
+ * @param r the replica set
+ * @param job the stripe, which must stay in place until replica_wait
+ */
+void replica_submit(replica_t *r, replica_job_t *job);
+
+/**
+ * Wait for a queued stripe.
+ *
+ * @param r the replica set
+ * @param job the stripe
+ * @return 0 if a copy returned it intact, errno otherwise
+ */
+int replica_wait(replica_t *r, replica_job_t *job);
+
+/**
+ * Stop the threads and close the
+ * replicas. The source is left open.
+ *
+ * @param r the replica set
+ */
+void replica_close(replica_t *r);
+
+#endif
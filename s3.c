@@ -0,0 +1,680 @@
+/**
+ * Source implementation of the S3
+ * multipart upload sink.
+ *
+ * @author Matt Stetter
+ * @file s3.c
+ */
+
+#include "backend.h"
+#include "cpy.h"
+#include "hash.h"
+#include "http.h"
+#include "s3.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Times a part is sent before
+// the upload is given up on
+#define S3_TRIES 3
+
+// Parts uploaded at each part size.
+// The size doubles after each run so
+// any object fits in the store's limit
+// of 10000 parts.
+#define S3_PARTS_PER_SIZE 1000
+
+// Largest part the store accepts
+#define S3_PART_MAX (5ULL * 1024 * 1024 * 1024)
+
+// A part being filled or uploaded
+typedef struct s3_part {
+  char *data;		// Bytes of the part
+  size_t len;		// Bytes filled in
+  size_t cap;		// Size of the data buffer
+  unsigned int number;	// Part number, counting from 1
+} s3_part_t;
+
+// What an uploaded part is
+// completed with
+typedef struct s3_done {
+  char etag[128];	// ETag the store returned
+  uint32_t crc;		// CRC32C of the part
+} s3_done_t;
+
+// State of one upload
+typedef struct s3 {
+  http_conn_t server;	// Connection of the consumer's requests
+  char target[3 * PATH_MAX]; // Encoded /BUCKET/KEY
+  char upload_id[768];	// Encoded upload ID
+  const char *key_id;	// Access key, NULL to send unsigned requests
+  const char *secret;	// Secret key
+  const char *token;	// Session token, NULL if none
+  const char *region;	// Region requests are signed for
+  pthread_mutex_t lock;	// Protects everything below
+  pthread_cond_t cond;	// Signalled when a part is queued or freed
+  s3_part_t *parts;	// Every part buffer
+  s3_part_t **free_parts; // Part buffers not in use
+  unsigned int num_free; // Number of free part buffers
+  s3_part_t **queue;	// Parts waiting to be uploaded
+  unsigned int head;	// Index of the first queued part
+  unsigned int queued;	// Number of queued parts
+  unsigned int num_parts; // Number of part buffers
+  s3_part_t *cur;	// Part the consumer is filling
+  unsigned int next;	// Number of the next part
+  off_t written;	// Bytes handed to the sink
+  s3_done_t *done;	// Uploaded parts by number
+  unsigned int done_cap; // Entries in done
+  int closing;		// Non-zero once no more parts will come
+  int status;		// 0, or the error that failed the upload
+  pthread_t *threads;	// Uploading threads
+  unsigned int num_threads; // Number of uploading threads
+} s3_t;
+
+// Concurrent part uploads
+static unsigned int s3_uploads = S3_UPLOADS;
+
+/**
+ * Percent encode a string the way the
+ * signature expects. Unreserved characters
+ * and, in paths, slashes are kept.
+ *
+ * @param in string to encode
+ * @param len bytes of the string to encode
+ * @param out buffer for the result
+ * @param cap size of the buffer
+ * @param path non-zero to keep slashes
+ * @return 0 if successful, ENAMETOOLONG otherwise
+ */
+static int uri_encode(const char *in, size_t len, char *out, size_t cap, int path) {
+  static const char digits[] = "0123456789ABCDEF";
+  size_t o = 0;
+  for (size_t i = 0; i < len; i++) {
+    unsigned char ch = (unsigned char)in[i];
+    int keep = (ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z') || (ch >= '0' && ch <= '9') ||
+               ch == '-' || ch == '_' || ch == '.' || ch == '~' || (path && ch == '/');
+    if (o + 4 > cap) return ENAMETOOLONG;
+    if (keep) {
+      out[o++] = (char)ch;
+    } else {
+      out[o++] = '%';
+      out[o++] = digits[ch >> 4];
+      out[o++] = digits[ch & 0xf];
+    }
+  }
+  out[o] = '\0';
+  return 0;
+}
+
+/**
+ * Send a request to the store, signed
+ * with Signature Version 4 if there are
+ * keys. Payloads are not hashed into the
+ * signature, parts carry a CRC32C the
+ * store checks instead.
+ *
+ * @param s the upload
+ * @param c connection to send on
+ * @param method request method
+ * @param query canonical query string
+ * @param extra one more x-amz-checksum-* header as name:value, or NULL
+ * @param body request body, or NULL
+ * @param len bytes in the body
+ * @param r head of the response
+ * @return 0 if successful, errno otherwise
+ */
+static int s3_send(s3_t *s, http_conn_t *c, const char *method, const char *query,
+                   const char *extra, const void *body, size_t len, http_resp_t *r) {
+  char date[32], day[16];
+  time_t now = time(NULL);
+  struct tm tm;
+  gmtime_r(&now, &tm);
+  strftime(date, sizeof(date), "%Y%m%dT%H%M%SZ", &tm);
+  strftime(day, sizeof(day), "%Y%m%d", &tm);
+
+  char extra_name[64] = "";
+  const char *extra_val = "";
+  if (extra != NULL) {
+    const char *colon = strchr(extra, ':');
+    snprintf(extra_name, sizeof(extra_name), "%.*s", (int)(colon - extra), extra);
+    extra_val = colon + 1;
+  }
+
+  char headers[4096];
+  int n = snprintf(headers, sizeof(headers), "%s%s%s%sx-amz-content-sha256: UNSIGNED-PAYLOAD\r\n"
+                   "x-amz-date: %s\r\n", extra_name, extra ? ": " : "", extra_val, extra ? "\r\n" : "", date);
+  if (s->token != NULL) n += snprintf(headers + n, sizeof(headers) - n, "x-amz-security-token: %s\r\n", s->token);
+
+  if (s->key_id != NULL) {
+    char host[sizeof(c->host) + sizeof(c->port) + 1];
+    snprintf(host, sizeof(host), "%s%s%s", c->host, strcmp(c->port, "80") == 0 ? "" : ":",
+             strcmp(c->port, "80") == 0 ? "" : c->port);
+    char signed_names[160];
+    snprintf(signed_names, sizeof(signed_names), "host;%s%sx-amz-content-sha256;x-amz-date%s",
+             extra_name, extra ? ";" : "", s->token ? ";x-amz-security-token" : "");
+
+    // The canonical request, hashed
+    // into the string to sign
+    size_t cap = strlen(s->target) + strlen(query) + (s->token ? strlen(s->token) : 0) + 1024;
+    char *canon = (char *)malloc(cap);
+    if (canon == NULL) return ENOMEM;
+    int m = snprintf(canon, cap, "%s\n%s\n%s\nhost:%s\n", method, s->target, query, host);
+    if (extra != NULL) m += snprintf(canon + m, cap - m, "%s:%s\n", extra_name, extra_val);
+    m += snprintf(canon + m, cap - m, "x-amz-content-sha256:UNSIGNED-PAYLOAD\nx-amz-date:%s\n", date);
+    if (s->token != NULL) m += snprintf(canon + m, cap - m, "x-amz-security-token:%s\n", s->token);
+    m += snprintf(canon + m, cap - m, "\n%s\nUNSIGNED-PAYLOAD", signed_names);
+
+    unsigned char digest[SHA256_LEN];
+    char hex[2 * SHA256_LEN + 1];
+    sha256(canon, (size_t)m, digest);
+    free(canon);
+    hash_hex(digest, SHA256_LEN, hex);
+
+    char scope[128], to_sign[256];
+    snprintf(scope, sizeof(scope), "%s/%s/s3/aws4_request", day, s->region);
+    int t = snprintf(to_sign, sizeof(to_sign), "AWS4-HMAC-SHA256\n%s\n%s\n%s", date, scope, hex);
+
+    // Derive the signing key for the
+    // day, region and service
+    char secret[256];
+    unsigned char key[SHA256_LEN];
+    int k = snprintf(secret, sizeof(secret), "AWS4%s", s->secret);
+    hmac_sha256(secret, (size_t)k, day, strlen(day), key);
+    hmac_sha256(key, SHA256_LEN, s->region, strlen(s->region), key);
+    hmac_sha256(key, SHA256_LEN, "s3", 2, key);
+    hmac_sha256(key, SHA256_LEN, "aws4_request", 12, key);
+    hmac_sha256(key, SHA256_LEN, to_sign, (size_t)t, digest);
+    hash_hex(digest, SHA256_LEN, hex);
+
+    snprintf(headers + n, sizeof(headers) - n,
+             "Authorization: AWS4-HMAC-SHA256 Credential=%s/%s, SignedHeaders=%s, Signature=%s\r\n",
+             s->key_id, scope, signed_names, hex);
+  }
+
+  size_t tlen = strlen(s->target) + strlen(query) + 2;
+  char *target = (char *)malloc(tlen);
+  if (target == NULL) return ENOMEM;
+  snprintf(target, tlen, "%s?%s", s->target, query);
+  int err = http_request(c, method, target, headers, body, len, r);
+  free(target);
+  return err;
+}
+
+/**
+ * Send a request and read the response
+ * body, turning error statuses into
+ * errno values.
+ *
+ * @param s the upload
+ * @param c connection to send on
+ * @param method request method
+ * @param query canonical query string
+ * @param extra one more x-amz-checksum-* header as name:value, or NULL
+ * @param body request body, or NULL
+ * @param len bytes in the body
+ * @param r head of the response
+ * @param out buffer for the response body, NUL terminated
+ * @param cap size of the buffer
+ * @return 0 if successful, errno otherwise
+ */
+static int s3_call(s3_t *s, http_conn_t *c, const char *method, const char *query, const char *extra,
+                   const void *body, size_t len, http_resp_t *r, char *out, size_t cap) {
+  size_t got;
+  int err;
+  if ((err = s3_send(s, c, method, query, extra, body, len, r)) != 0 ||
+      (err = http_body(c, r, out, cap - 1, &got)) != 0) {
+    fprintf(stderr, "S3 %s %s failed: %s\n", method, s->target, strerror(err));
+    return err;
+  }
+  out[got] = '\0';
+
+  // Errors can also come back in the
+  // body of a 200 to a long request
+  if (r->status / 100 == 2 && strstr(out, "<Error>") == NULL) return 0;
+
+  const char *code = strstr(out, "<Code>");
+  fprintf(stderr, "S3 %s %s?%s failed with status %d%s%.*s\n", method, s->target, query, r->status,
+          code ? ": " : "", code ? (int)strcspn(code + 6, "<") : 0, code ? code + 6 : "");
+  if (r->status == 403) return EACCES;
+  if (r->status == 404) return ENOENT;
+  return EIO;
+}
+
+/**
+ * Upload one part, retrying failures
+ * that could be transient.
+ *
+ * @param s the upload
+ * @param c the uploading thread's connection
+ * @param p part to upload
+ * @param d returned ETag and checksum
+ * @return 0 if successful, errno otherwise
+ */
+static int upload_part(s3_t *s, http_conn_t *c, s3_part_t *p, s3_done_t *d) {
+  d->crc = crc32c(0, p->data, p->len);
+  unsigned char be[4] = { (unsigned char)(d->crc >> 24), (unsigned char)(d->crc >> 16),
+                          (unsigned char)(d->crc >> 8), (unsigned char)d->crc };
+  char crc[16], extra[64], query[1024], body[1024];
+  hash_base64(be, 4, crc);
+  snprintf(extra, sizeof(extra), "x-amz-checksum-crc32c:%s", crc);
+  snprintf(query, sizeof(query), "partNumber=%u&uploadId=%s", p->number, s->upload_id);
+
+  int err = 0;
+  for (int i = 0; i < S3_TRIES; i++) {
+    http_resp_t r;
+    if (i > 0) atomic_fetch_add(&stats.part_retries, 1);
+    err = s3_call(s, c, "PUT", query, extra, p->data, p->len, &r, body, sizeof(body));
+    if (err == 0 && r.etag[0] == '\0') err = EPROTO;
+    if (err == 0) {
+      snprintf(d->etag, sizeof(d->etag), "%s", r.etag);
+      atomic_fetch_add(&stats.parts_uploaded, 1);
+      log("Uploaded part %u of %zu bytes\n", p->number, p->len);
+      return 0;
+    }
+    if (err == EACCES || err == ENOENT) break;
+  }
+  return err;
+}
+
+/**
+ * Thread target uploading queued parts
+ * until the upload is closed. Once the
+ * upload has failed, queued parts are
+ * only given back.
+ *
+ * @param args the s3_t struct
+ * @return NULL
+ */
+static void *upload_target(void *args) {
+  s3_t *s = (s3_t *)args;
+  http_conn_t c;
+  http_init(&c, s->server.host, s->server.port);
+
+  pthread_mutex_lock(&s->lock);
+  for (;;) {
+    while (s->queued == 0 && !s->closing) pthread_cond_wait(&s->cond, &s->lock);
+    if (s->queued == 0) break;
+    s3_part_t *p = s->queue[s->head];
+    s->head = (s->head + 1) % s->num_parts;
+    s->queued--;
+    int failed = s->status != 0;
+    pthread_mutex_unlock(&s->lock);
+
+    s3_done_t d;
+    int err = failed ? 0 : upload_part(s, &c, p, &d);
+
+    pthread_mutex_lock(&s->lock);
+    if (err != 0 && s->status == 0) s->status = err;
+    if (!failed && err == 0) s->done[p->number - 1] = d;
+    s->free_parts[s->num_free++] = p;
+    pthread_cond_broadcast(&s->cond);
+  }
+  pthread_mutex_unlock(&s->lock);
+
+  http_close(&c);
+  return NULL;
+}
+
+/**
+ * Take a free part buffer for the next
+ * part, waiting for an upload to finish
+ * if all are in use, and size it for
+ * the part's number. A failure is kept
+ * as the upload's status, so every
+ * later write fails with it too.
+ *
+ * @param s the upload
+ * @return 0 if successful, errno otherwise
+ */
+static int take_part(s3_t *s) {
+  pthread_mutex_lock(&s->lock);
+  while (s->num_free == 0 && s->status == 0) pthread_cond_wait(&s->cond, &s->lock);
+  int err = s->status;
+
+  // Make room in the done table
+  // for the part's result
+  if (err == 0 && s->next == s->done_cap) {
+    s3_done_t *done = (s3_done_t *)realloc(s->done, 2 * s->done_cap * sizeof(s3_done_t));
+    if (done == NULL) err = ENOMEM;
+    if (done != NULL) {
+      s->done = done;
+      s->done_cap *= 2;
+    }
+  }
+  if (err != 0 && s->status == 0) s->status = err;
+  s3_part_t *p = err == 0 ? s->free_parts[--s->num_free] : NULL;
+  pthread_mutex_unlock(&s->lock);
+  if (err != 0) return err;
+
+  // The part belongs to the consumer
+  // from here, even if sizing it fails
+  p->len = 0;
+  p->number = ++s->next;
+  s->cur = p;
+
+  unsigned int shift = (p->number - 1) / S3_PARTS_PER_SIZE;
+  unsigned long long size = shift < 16 ? (unsigned long long)S3_PART_SIZE << shift : S3_PART_MAX;
+  if (size > S3_PART_MAX) size = S3_PART_MAX;
+  if (p->cap < size) {
+    char *data = (char *)realloc(p->data, (size_t)size);
+    if (data == NULL) {
+      pthread_mutex_lock(&s->lock);
+      if (s->status == 0) s->status = ENOMEM;
+      pthread_mutex_unlock(&s->lock);
+      return ENOMEM;
+    }
+    p->data = data;
+    p->cap = (size_t)size;
+  }
+  return 0;
+}
+
+/**
+ * Hand the part being filled to the
+ * uploading threads.
+ *
+ * @param s the upload
+ */
+static void queue_part(s3_t *s) {
+  pthread_mutex_lock(&s->lock);
+  s->queue[(s->head + s->queued) % s->num_parts] = s->cur;
+  s->queued++;
+  s->cur = NULL;
+  pthread_cond_broadcast(&s->cond);
+  pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * Complete the upload with the list
+ * of parts, their ETags and checksums.
+ *
+ * @param s the upload
+ * @return 0 if successful, errno otherwise
+ */
+static int complete_upload(s3_t *s) {
+  size_t cap = (size_t)s->next * 256 + 128;
+  char *xml = (char *)malloc(cap);
+  if (xml == NULL) return ENOMEM;
+
+  size_t n = (size_t)snprintf(xml, cap, "<CompleteMultipartUpload>");
+  for (unsigned int i = 0; i < s->next; i++) {
+    uint32_t crc = s->done[i].crc;
+    unsigned char be[4] = { (unsigned char)(crc >> 24), (unsigned char)(crc >> 16),
+                            (unsigned char)(crc >> 8), (unsigned char)crc };
+    char b64[16];
+    hash_base64(be, 4, b64);
+    n += snprintf(xml + n, cap - n, "<Part><PartNumber>%u</PartNumber><ETag>%s</ETag>"
+                  "<ChecksumCRC32C>%s</ChecksumCRC32C></Part>", i + 1, s->done[i].etag, b64);
+  }
+  n += snprintf(xml + n, cap - n, "</CompleteMultipartUpload>");
+
+  char query[1024], body[4096];
+  http_resp_t r;
+  snprintf(query, sizeof(query), "uploadId=%s", s->upload_id);
+  int err = s3_call(s, &s->server, "POST", query, NULL, xml, n, &r, body, sizeof(body));
+  free(xml);
+  return err;
+}
+
+/**
+ * Abort the upload so the store frees
+ * the parts it holds.
+ *
+ * @param s the upload
+ * @param path path the upload was opened with
+ */
+static void abort_upload(s3_t *s, const char *path) {
+  char query[1024], body[1024];
+  http_resp_t r;
+  snprintf(query, sizeof(query), "uploadId=%s", s->upload_id);
+  if (s3_call(s, &s->server, "DELETE", query, NULL, NULL, 0, &r, body, sizeof(body)) != 0) {
+    fprintf(stderr, "Could not abort the S3 upload of %s\n", path);
+  }
+}
+
+/**
+ * Stop the uploading threads and free
+ * the upload.
+ *
+ * @param s the upload
+ */
+static void s3_free(s3_t *s) {
+  pthread_mutex_lock(&s->lock);
+  s->closing = 1;
+  pthread_cond_broadcast(&s->cond);
+  pthread_mutex_unlock(&s->lock);
+  for (unsigned int i = 0; i < s->num_threads; i++) pthread_join(s->threads[i], NULL);
+
+  http_close(&s->server);
+  for (unsigned int i = 0; s->parts != NULL && i < s->num_parts; i++) free(s->parts[i].data);
+  free(s->parts);
+  free(s->free_parts);
+  free(s->queue);
+  free(s->done);
+  free(s->threads);
+  pthread_mutex_destroy(&s->lock);
+  pthread_cond_destroy(&s->cond);
+  free(s);
+}
+
+/**
+ * Split s3://BUCKET/KEY into the
+ * encoded path-style target.
+ *
+ * @param s the upload
+ * @param path the s3:// path
+ * @return 0 if successful, errno otherwise
+ */
+static int parse_target(s3_t *s, const char *path) {
+  const char *bucket = path + strlen("s3://");
+  const char *slash = strchr(bucket, '/');
+  if (slash == NULL || slash == bucket || slash[1] == '\0' || slash[strlen(slash) - 1] == '/') {
+    fprintf(stderr, "S3 destinations are s3://BUCKET/KEY: %s\n", path);
+    return EINVAL;
+  }
+
+  s->target[0] = '/';
+  int err;
+  if ((err = uri_encode(bucket, (size_t)(slash - bucket), s->target + 1, sizeof(s->target) - 2, 0)) != 0) return err;
+  size_t n = strlen(s->target);
+  s->target[n++] = '/';
+  return uri_encode(slash + 1, strlen(slash + 1), s->target + n, sizeof(s->target) - n, 1);
+}
+
+/**
+ * Start a multipart upload and the
+ * threads that upload its parts.
+ *
+ * @param b endpoint being opened
+ * @param path s3://BUCKET/KEY
+ * @param mode BE_WRITE
+ * @param direct unused
+ * @return 0 if successful, errno otherwise
+ */
+static int s3_open(backend_t *b, const char *path, int mode, int direct) {
+  (void)mode;
+  (void)direct;
+  s3_t *s = (s3_t *)calloc(1, sizeof(s3_t));
+  if (s == NULL) return ENOMEM;
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->cond, NULL);
+
+  const char *url = getenv("AWS_ENDPOINT_URL_S3");
+  if (url == NULL) url = getenv("AWS_ENDPOINT_URL");
+  if (url == NULL) url = "http://127.0.0.1:9000";
+  const char *ignored;
+  int err = http_parse_url(url, &s->server, &ignored);
+  if (err != 0) {
+    fprintf(stderr, "S3 endpoint must be an http:// URL: %s\n", url);
+    s3_free(s);
+    return err;
+  }
+  s->key_id = getenv("AWS_ACCESS_KEY_ID");
+  s->secret = getenv("AWS_SECRET_ACCESS_KEY");
+  s->token = getenv("AWS_SESSION_TOKEN");
+  s->region = getenv("AWS_REGION");
+  if (s->key_id == NULL || s->secret == NULL) s->key_id = NULL;
+  if (s->region == NULL) s->region = "us-east-1";
+
+  // Start the upload and pick the
+  // upload ID out of the response
+  char body[4096];
+  http_resp_t r;
+  if ((err = parse_target(s, path)) != 0 ||
+      (err = s3_call(s, &s->server, "POST", "uploads=", "x-amz-checksum-algorithm:CRC32C",
+                     NULL, 0, &r, body, sizeof(body))) != 0) {
+    s3_free(s);
+    return err;
+  }
+  char *id = strstr(body, "<UploadId>");
+  char *id_end = id != NULL ? strstr(id, "</UploadId>") : NULL;
+  if (id_end == NULL || uri_encode(id + 10, (size_t)(id_end - id - 10), s->upload_id, sizeof(s->upload_id), 0) != 0) {
+    fprintf(stderr, "S3 did not return an upload ID for %s\n", path);
+    s3_free(s);
+    return EPROTO;
+  }
+
+  // One part buffer more than there
+  // are uploads, for the consumer to
+  // fill while the others upload
+  s->num_threads = s3_uploads;
+  s->num_parts = s3_uploads + 1;
+  s->done_cap = 64;
+  s->parts = (s3_part_t *)calloc(s->num_parts, sizeof(s3_part_t));
+  s->free_parts = (s3_part_t **)malloc(s->num_parts * sizeof(s3_part_t *));
+  s->queue = (s3_part_t **)malloc(s->num_parts * sizeof(s3_part_t *));
+  s->done = (s3_done_t *)malloc(s->done_cap * sizeof(s3_done_t));
+  s->threads = (pthread_t *)malloc(s->num_threads * sizeof(pthread_t));
+  if (s->parts == NULL || s->free_parts == NULL || s->queue == NULL || s->done == NULL || s->threads == NULL) {
+    s->num_threads = 0;
+    err = ENOMEM;
+  }
+  for (unsigned int i = 0; err == 0 && i < s->num_parts; i++) s->free_parts[s->num_free++] = &s->parts[i];
+  for (unsigned int i = 0; err == 0 && i < s->num_threads; i++) {
+    if ((err = pthread_create(&s->threads[i], NULL, &upload_target, s)) != 0) s->num_threads = i;
+  }
+  if (err == 0) err = take_part(s);
+  if (err != 0) {
+    abort_upload(s, path);
+    s3_free(s);
+    return err;
+  }
+
+  log("Started S3 upload of %s with %u part uploads\n", path, s->num_threads);
+  b->priv = s;
+  return 0;
+}
+
+/**
+ * Append the consumer's data to the
+ * part being filled, queueing each
+ * part as it fills up. Once a part has
+ * failed every write fails, including
+ * the retry of a short write, so the
+ * copy stops and the upload is aborted.
+ *
+ * @param b the open endpoint
+ * @param iov spans to write
+ * @param iovcnt number of spans
+ * @param off position of the data, which must follow on
+ * @return bytes written, -1 on failure
+ */
+static ssize_t s3_writev(backend_t *b, const struct iovec *iov, int iovcnt, off_t off) {
+  s3_t *s = (s3_t *)b->priv;
+  if (off >= 0 && off != s->written) {
+    errno = ESPIPE;
+    return -1;
+  }
+
+  pthread_mutex_lock(&s->lock);
+  int err = s->status;
+  pthread_mutex_unlock(&s->lock);
+  if (err != 0 || s->cur == NULL) {
+    errno = err != 0 ? err : EIO;
+    return -1;
+  }
+
+  ssize_t done = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    const char *data = (const char *)iov[i].iov_base;
+    size_t len = iov[i].iov_len;
+    while (len > 0) {
+      s3_part_t *p = s->cur;
+      size_t n = p->cap - p->len < len ? p->cap - p->len : len;
+      memcpy(p->data + p->len, data, n);
+      p->len += n;
+      data += n;
+      len -= n;
+      done += n;
+      s->written += n;
+      if (p->len < p->cap) continue;
+
+      queue_part(s);
+      if ((err = take_part(s)) != 0) {
+        errno = err;
+        return done > 0 ? done : -1;
+      }
+    }
+  }
+  return done;
+}
+
+/**
+ * Finish the upload. The last part is
+ * queued, even if empty when it is the
+ * only one, and once every part is in
+ * the upload is completed. A failed or
+ * aborted copy aborts the upload instead,
+ * so the store frees the parts.
+ *
+ * @param b the open endpoint
+ * @param abort non-zero if the copy failed
+ * @return 0 if successful, errno otherwise
+ */
+static int s3_close(backend_t *b, int abort) {
+  s3_t *s = (s3_t *)b->priv;
+  if (s->cur != NULL && !abort && s->status == 0 && (s->cur->len > 0 || s->next == 1)) {
+    queue_part(s);
+  }
+
+  // Give back a part that will not be
+  // sent, skip the queued ones of an
+  // aborted copy and wait for the
+  // uploads to drain
+  pthread_mutex_lock(&s->lock);
+  if (s->cur != NULL) {
+    s->free_parts[s->num_free++] = s->cur;
+    s->cur = NULL;
+    s->next--;
+  }
+  if (abort && s->status == 0) s->status = ECANCELED;
+  while (s->num_free < s->num_parts) pthread_cond_wait(&s->cond, &s->lock);
+  int err = s->status;
+  pthread_mutex_unlock(&s->lock);
+
+  if (err == 0) err = complete_upload(s);
+  if (err != 0) abort_upload(s, b->path);
+
+  s3_free(s);
+  b->priv = NULL;
+  return abort ? 0 : err;
+}
+
+// The S3 backend, which only writes
+static const backend_ops_t s3_ops = {
+  "s3", "s3://", 0, s3_open, NULL, s3_writev, NULL, s3_close
+};
+
+// Size the uploads and register.
+int s3_register(options_t *o) {
+  if (o->threads != 0) s3_uploads = o->threads;
+  return backend_register(&s3_ops);
+}
@@ -0,0 +1,41 @@
+/**
+ * Sink backend for S3 compatible object
+ * stores, serving s3://BUCKET/KEY paths.
+ * The consumer's stream is cut into
+ * parts of a multipart upload, several
+ * of which are PUT at once over their
+ * own kept-alive connections, each with
+ * a CRC32C checksum the store verifies.
+ * The upload is completed when the copy
+ * finishes and aborted if it fails, so
+ * a failed copy leaves no object behind.
+ *
+ * The store is found at $AWS_ENDPOINT_URL_S3
+ * or $AWS_ENDPOINT_URL (default
+ * http://127.0.0.1:9000) and addressed
+ * path style. Requests are signed with
+ * AWS Signature Version 4 when
+ * $AWS_ACCESS_KEY_ID and
+ * $AWS_SECRET_ACCESS_KEY are set, for the
+ * region in $AWS_REGION (default us-east-1).
+ *
+ * @author Matt Stetter
+ * @file s3.h
+ */
+
+#include "options.h"
+
+#ifndef S3_H_
+#define S3_H_
+
+/**
+ * Register the S3 backend. The number
+ * of concurrent part uploads is taken
+ * from --jobs.
+ *
+ * @param o the parsed options
+ * @return 0 if successful, errno otherwise
+ */
+int s3_register(options_t *o);
+
+#endif
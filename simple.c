@@ -0,0 +1,253 @@
+/**
+ * Source implementation of the
+ * single-threaded copy engines.
+ *
+ * @author Matt Stetter
+ * @file simple.c
+ */
+
+#include "control.h"
+#include "cpy.h"
+#include "deadline.h"
+#include "device.h"
+#include "simple.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Largest request handed to the
+// kernel by one copy system call
+#define KCOPY_CHUNK (1 << 30)
+
+// Smaller chunk used when a deadline is
+// set, so the copy can be paced
+#define PACED_CHUNK (8 << 20)
+
+/**
+ * Open both ends of a copy. The
+ * destination is created or truncated
+ * like it is for the other engines.
+ *
+ * @param o options naming the source and destination
+ * @param in returned source descriptor
+ * @param out returned destination descriptor
+ * @return 0 if successful, errno otherwise
+ */
+static int open_ends(options_t *o, int *in, int *out) {
+  dev_info_t info;
+  if ((*in = dev_open_src(o->src, 0, &info)) == -1) {
+    int err = errno;
+    fprintf(stderr, "Could not open file: %s\n", o->src);
+    return err;
+  }
+  if ((*out = dev_open_dst(o->dst, 0, &info)) == -1) {
+    int err = errno;
+    fprintf(stderr, "Could not open/create target file %s for writing\n", o->dst);
+    close(*in);
+    return err;
+  }
+  return 0;
+}
+
+/**
+ * Close both ends of a copy.
+ *
+ * @param o options naming the destination
+ * @param in source descriptor
+ * @param out destination descriptor
+ * @return 0 if successful, errno otherwise
+ */
+static int close_ends(options_t *o, int in, int out) {
+  close(in);
+  if (close(out) != 0) {
+    fprintf(stderr, "Could not close target file %s\n", o->dst);
+    return errno;
+  }
+  return 0;
+}
+
+/**
+ * Check whether a failed first call
+ * means the engine does not apply,
+ * as opposed to a real I/O error.
+ *
+ * @param err errno of the failed call
+ * @return non-zero if another engine should be tried
+ */
+static int not_applicable(int err) {
+  return err == EXDEV || err == EOPNOTSUPP || err == EINVAL ||
+         err == ENOSYS || err == ENOTTY || err == EBADF;
+}
+
+// Clone the whole file in one ioctl.
+// The destination is only cut to the
+// source's size once the clone took,
+// so when cloning does not apply an
+// existing file is left as it was and
+// one this call created is removed.
+int reflink_copy(options_t *o) {
+  dev_info_t info;
+  int in, out, err;
+  if ((in = dev_open_src(o->src, 0, &info)) == -1) {
+    err = errno;
+    fprintf(stderr, "Could not open file: %s\n", o->src);
+    return err;
+  }
+  int created = 1;
+  out = open(o->dst, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  if (out == -1 && errno == EEXIST) {
+    created = 0;
+    out = open(o->dst, O_WRONLY);
+  }
+  if (out == -1) {
+    err = errno;
+    fprintf(stderr, "Could not open/create target file %s for writing\n", o->dst);
+    close(in);
+    return err;
+  }
+
+  struct stat st;
+  if (ioctl(out, FICLONE, in) != 0) {
+    err = errno;
+    if (created) unlink(o->dst);
+    close_ends(o, in, out);
+    return not_applicable(err) ? ENGINE_SKIP : err;
+  }
+  if (fstat(in, &st) != 0 || ftruncate(out, st.st_size) != 0) {
+    err = errno;
+    fprintf(stderr, "Could not truncate target file %s\n", o->dst);
+    close_ends(o, in, out);
+    return err;
+  }
+  atomic_fetch_add(&stats.bytes_written, st.st_size);
+
+  return close_ends(o, in, out);
+}
+
+/**
+ * Pace the copy for a deadline and
+ * check for a pause or cancel between
+ * two chunks copied inside the kernel.
+ * There is no buffer to drain, only
+ * the destination to sync.
+ *
+ * @param out open destination
+ * @return 0 to carry on, ECANCELED or errno otherwise
+ */
+static int checkpoint(int out) {
+  deadline_pace();
+  if (control_state() == CONTROL_RUNNING) return 0;
+
+  int err;
+  if ((err = control_sync(out)) != 0) return err;
+  return control_checkpoint();
+}
+
+// Copy with copy_file_range until
+// the source is exhausted.
+int cfr_copy(options_t *o) {
+  int in, out, err = 0;
+  if ((err = open_ends(o, &in, &out)) != 0) return err;
+
+  int first = 1;
+  ssize_t n;
+  size_t chunk = o->deadline.tv_sec || o->deadline.tv_nsec ? PACED_CHUNK : KCOPY_CHUNK;
+  while ((n = copy_file_range(in, NULL, out, NULL, chunk, 0)) != 0) {
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      err = errno;
+      if (first && not_applicable(err)) err = ENGINE_SKIP;
+      else fprintf(stderr, "Could not copy %s to %s\n", o->src, o->dst);
+      break;
+    }
+    first = 0;
+    atomic_fetch_add(&stats.bytes_read, n);
+    atomic_fetch_add(&stats.bytes_written, n);
+    if ((err = checkpoint(out)) != 0) break;
+  }
+
+  int cerr = close_ends(o, in, out);
+  return err ? err : cerr;
+}
+
+// Copy with splice or sendfile until
+// the source is exhausted.
+int splice_copy(options_t *o) {
+  int in, out, err = 0;
+  if ((err = open_ends(o, &in, &out)) != 0) return err;
+
+  struct stat st;
+  int from_pipe = fstat(in, &st) == 0 && S_ISFIFO(st.st_mode);
+
+  int first = 1;
+  ssize_t n;
+  size_t chunk = o->deadline.tv_sec || o->deadline.tv_nsec ? PACED_CHUNK : KCOPY_CHUNK;
+  for (;;) {
+    if (from_pipe) n = splice(in, NULL, out, NULL, chunk, SPLICE_F_MOVE);
+    else n = sendfile(out, in, NULL, chunk);
+    if (n == 0) break;
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      err = errno;
+      if (first && not_applicable(err)) err = ENGINE_SKIP;
+      else fprintf(stderr, "Could not copy %s to %s\n", o->src, o->dst);
+      break;
+    }
+    first = 0;
+    atomic_fetch_add(&stats.bytes_read, n);
+    atomic_fetch_add(&stats.bytes_written, n);
+    if ((err = checkpoint(out)) != 0) break;
+  }
+
+  int cerr = close_ends(o, in, out);
+  return err ? err : cerr;
+}
+
+// Copy a small file through one
+// heap buffer.
+int sync_copy(options_t *o) {
+  int in, out, err = 0;
+  if ((err = open_ends(o, &in, &out)) != 0) return err;
+
+  char *buf = (char *)malloc(SMALL_FILE);
+  if (buf == NULL) {
+    close_ends(o, in, out);
+    return ENOMEM;
+  }
+
+  ssize_t n;
+  while (err == 0 && (n = read(in, buf, SMALL_FILE)) != 0) {
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      err = errno;
+      fprintf(stderr, "Could not read file %s\n", o->src);
+      break;
+    }
+    atomic_fetch_add(&stats.bytes_read, n);
+
+    ssize_t done = 0;
+    while (done < n) {
+      ssize_t w = write(out, buf + done, n - done);
+      if (w == -1 && errno == EINTR) continue;
+      if (w <= 0) {
+        err = w == 0 ? ENOSPC : errno;
+        fprintf(stderr, "Could not write to file %s\n", o->dst);
+        break;
+      }
+      done += w;
+    }
+    atomic_fetch_add(&stats.bytes_written, done);
+  }
+
+  free(buf);
+  int cerr = close_ends(o, in, out);
+  return err ? err : cerr;
+}
@@ -0,0 +1,66 @@
+/**
+ * Copy engines that run entirely in
+ * the calling thread, either because
+ * the kernel does the copying (reflink,
+ * copy_file_range, splice) or because
+ * the file is too small to be worth
+ * starting threads for.
+ *
+ * Each engine returns ENGINE_SKIP if
+ * it does not apply to the endpoints,
+ * before any data has been copied,
+ * so another engine can be tried.
+ *
+ * @author Matt Stetter
+ * @file simple.h
+ */
+
+#include "options.h"
+
+#ifndef SIMPLE_H_
+#define SIMPLE_H_
+
+// Returned by an engine that cannot
+// copy between the given endpoints
+#define ENGINE_SKIP (-1)
+
+/**
+ * Clone the source into the destination
+ * with the FICLONE ioctl, sharing extents
+ * on file systems such as btrfs and XFS.
+ *
+ * @param o options naming the source and destination
+ * @return 0 if successful, ENGINE_SKIP or errno otherwise
+ */
+int reflink_copy(options_t *o);
+
+/**
+ * Copy with copy_file_range, letting
+ * the kernel or the file system move
+ * the data without a user space buffer.
+ *
+ * @param o options naming the source and destination
+ * @return 0 if successful, ENGINE_SKIP or errno otherwise
+ */
+int cfr_copy(options_t *o);
+
+/**
+ * Copy with splice when the source is
+ * a pipe and with sendfile otherwise,
+ * keeping the data in kernel pages.
+ *
+ * @param o options naming the source and destination
+ * @return 0 if successful, ENGINE_SKIP or errno otherwise
+ */
+int splice_copy(options_t *o);
+
+/**
+ * Copy a small file with plain reads
+ * and writes in the calling thread.
+ *
+ * @param o options naming the source and destination
+ * @return 0 if successful, errno otherwise
+ */
+int sync_copy(options_t *o);
+
+#endif
@@ -0,0 +1,256 @@
+/**
+ * Source implementation of the
+ * copy statistics.
+ *
+ * @author Matt Stetter
+ * @file stats.c
+ */
+
+#include "cgroup.h"
+#include "engine.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+stats_t stats;
+
+// Reset every counter and note
+// when the copy started.
+void stats_start(void) {
+  atomic_init(&stats.bytes_read, 0);
+  atomic_init(&stats.bytes_written, 0);
+  atomic_init(&stats.bytes_zeroed, 0);
+  atomic_init(&stats.bytes_prefetched, 0);
+  atomic_init(&stats.bytes_cached, 0);
+  atomic_init(&stats.cache_hits, 0);
+  atomic_init(&stats.batched_files, 0);
+  atomic_init(&stats.uring_enters, 0);
+  atomic_init(&stats.parts_uploaded, 0);
+  atomic_init(&stats.part_retries, 0);
+  atomic_init(&stats.ranges_fetched, 0);
+  atomic_init(&stats.range_retries, 0);
+  atomic_init(&stats.stripes_read, 0);
+  atomic_init(&stats.stripe_fallbacks, 0);
+  stats.replica_copies = 0;
+  atomic_init(&stats.ec_stripes, 0);
+  atomic_init(&stats.ec_rebuilt, 0);
+  stats.ec_data = 0;
+  stats.ec_parity = 0;
+  stats.ec_kernel = NULL;
+  stats.file_order = NULL;
+  stats.order_window = 0;
+  stats.dedupe_candidates = 0;
+  atomic_init(&stats.dedupe_files, 0);
+  atomic_init(&stats.dedupe_bytes, 0);
+  stats.pressure_low = 0;
+  stats.pressure_backoffs = 0;
+  for (int i = 0; i < PRESSURE_COUNT; i++) stats.pressure_peak[i] = 0;
+  memset(&stats.extents, 0, sizeof(stats.extents));
+  stats.physical_order = 0;
+  stats.engine = ENGINE_AUTO;
+  for (int i = 0; i < ENGINE_COUNT; i++) {
+    atomic_init(&stats.engine_runs[i], 0);
+  }
+  atomic_init(&stats.engine_skips, 0);
+  pthread_mutex_init(&stats.class_lock, NULL);
+  stats.num_classes = 0;
+  clock_gettime(CLOCK_MONOTONIC, &stats.start);
+}
+
+// Copy the extent map into the stats.
+// Failing to allocate the copy only
+// drops the map from the output.
+void stats_set_extents(const extent_map_t *map, int physical) {
+  extent_t *ext = (extent_t *)malloc(map->count * sizeof(extent_t));
+  if (ext == NULL) return;
+  memcpy(ext, map->ext, map->count * sizeof(extent_t));
+
+  free(stats.extents.ext);
+  stats.extents = *map;
+  stats.extents.ext = ext;
+  stats.extents.cap = map->count;
+  stats.physical_order = physical;
+}
+
+// Add the job's latencies to its
+// class, adding the class if needed.
+void stats_add_job(const char *tenant, const char *cls, size_t bytes, double wait, double done) {
+  char name[sizeof(stats.classes[0].name)];
+  snprintf(name, sizeof(name), "%s/%s", tenant, cls);
+
+  pthread_mutex_lock(&stats.class_lock);
+  stats_class_t *c = NULL;
+  for (unsigned int i = 0; i < stats.num_classes && c == NULL; i++) {
+    if (strcmp(stats.classes[i].name, name) == 0) c = &stats.classes[i];
+  }
+  if (c == NULL && stats.num_classes < STATS_CLASSES) {
+    c = &stats.classes[stats.num_classes++];
+    memset(c, 0, sizeof(*c));
+    strcpy(c->name, name);
+  }
+  if (c != NULL) {
+    c->jobs++;
+    c->bytes += bytes;
+    c->wait_sum += wait;
+    c->done_sum += done;
+    if (wait > c->wait_max) c->wait_max = wait;
+    if (done > c->done_max) c->done_max = done;
+  }
+  pthread_mutex_unlock(&stats.class_lock);
+}
+
+/**
+ * Print the limits of the cgroup and
+ * what was sized to fit them.
+ *
+ * @param f stream to print to
+ */
+static void print_cgroup(FILE *f) {
+  fprintf(f, "cgroup:         v%d, %u CPUs", cgroup.version, cgroup.cpus);
+  if (cgroup.quota > 0) fprintf(f, " (quota %.2f)", cgroup.quota);
+  if (cgroup.memory > 0) fprintf(f, ", memory %llu, budget %zu", cgroup.memory, cgroup.budget);
+  fprintf(f, "\n");
+  if (cgroup.threads == 0 && cgroup.buffers == 0 && cgroup.cache == 0) return;
+
+  const char *sep = "";
+  fprintf(f, "sized:          ");
+  if (cgroup.threads > 0) {
+    fprintf(f, "%u threads", cgroup.threads);
+    sep = ", ";
+  }
+  if (cgroup.buffers > 0) {
+    fprintf(f, "%s%u buffers of %zu", sep, cgroup.buffers, cgroup.buffer_size);
+    sep = ", ";
+  }
+  if (cgroup.cache > 0) fprintf(f, "%scache %zu", sep, cgroup.cache);
+  fprintf(f, "\n");
+}
+
+/**
+ * Print the latencies of each class
+ * of pipeline jobs.
+ *
+ * @param f stream to print to
+ */
+static void print_classes(FILE *f) {
+  fprintf(f, "job classes:    %u\n", stats.num_classes);
+  fprintf(f, "  %-24s %6s %14s %10s %10s %10s %10s\n",
+          "class", "jobs", "bytes", "wait avg", "wait max", "done avg", "done max");
+  for (unsigned int i = 0; i < stats.num_classes; i++) {
+    stats_class_t *c = &stats.classes[i];
+    fprintf(f, "  %-24s %6llu %14llu %9.3fs %9.3fs %9.3fs %9.3fs\n",
+            c->name, c->jobs, c->bytes, c->wait_sum / c->jobs, c->wait_max,
+            c->done_sum / c->jobs, c->done_max);
+  }
+}
+
+/**
+ * Print a summary of the extent map
+ * followed by the first extents.
+ *
+ * @param f stream to print to
+ */
+static void print_extents(FILE *f) {
+  extent_map_t *map = &stats.extents;
+  off_t data = 0, unwritten = 0, holes = 0;
+  for (unsigned int i = 0; i < map->count; i++) {
+    if (map->ext[i].flags & EXT_HOLE) holes += map->ext[i].len;
+    else if (map->ext[i].flags & EXT_UNWRITTEN) unwritten += map->ext[i].len;
+    else data += map->ext[i].len;
+  }
+
+  fprintf(f, "extents:        %u (data %lld, unwritten %lld, holes %lld bytes)%s\n",
+          map->count, (long long)data, (long long)unwritten, (long long)holes,
+          stats.physical_order ? ", read in physical order" : "");
+  for (unsigned int i = 0; i < map->count && i < STATS_MAX_EXTENTS; i++) {
+    extent_t *e = &map->ext[i];
+    fprintf(f, "  %12lld %12lld %12lld %s%s%s\n",
+            (long long)e->logical, (long long)e->physical, (long long)e->len,
+            (e->flags & EXT_HOLE) ? "hole" : "data",
+            (e->flags & EXT_UNWRITTEN) ? ",unwritten" : "",
+            (e->flags & EXT_SHARED) ? ",shared" : "");
+  }
+  if (map->count > STATS_MAX_EXTENTS) {
+    fprintf(f, "  ... %u more\n", map->count - STATS_MAX_EXTENTS);
+  }
+}
+
+// Print the counters, the throughput
+// and the extent map if there is one.
+void stats_print(FILE *f) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double secs = (now.tv_sec - stats.start.tv_sec) +
+                (now.tv_nsec - stats.start.tv_nsec) / 1e9;
+  unsigned long long written = atomic_load(&stats.bytes_written);
+  unsigned long long zeroed = atomic_load(&stats.bytes_zeroed);
+
+  fprintf(f, "engine:         %s (%u tried that did not apply)\n",
+          engine_name(stats.engine), atomic_load(&stats.engine_skips));
+  fprintf(f, "engine runs:   ");
+  for (int i = 0; i < ENGINE_COUNT; i++) {
+    unsigned int runs = atomic_load(&stats.engine_runs[i]);
+    if (runs) fprintf(f, " %s=%u", engine_name(i), runs);
+  }
+  fprintf(f, "\n");
+  fprintf(f, "bytes read:     %llu\n", atomic_load(&stats.bytes_read));
+  fprintf(f, "bytes written:  %llu\n", written);
+  fprintf(f, "bytes zeroed:   %llu\n", zeroed);
+  fprintf(f, "prefetched:     %llu\n", atomic_load(&stats.bytes_prefetched));
+  if (atomic_load(&stats.cache_hits) > 0) {
+    fprintf(f, "cached:         %llu (%u sources read once)\n",
+            atomic_load(&stats.bytes_cached), atomic_load(&stats.cache_hits));
+  }
+  if (atomic_load(&stats.batched_files) > 0) {
+    fprintf(f, "batched:        %u small files in %u io_uring_enter calls\n",
+            atomic_load(&stats.batched_files), atomic_load(&stats.uring_enters));
+  }
+  if (atomic_load(&stats.parts_uploaded) > 0) {
+    fprintf(f, "uploaded:       %u parts (%u sent again)\n",
+            atomic_load(&stats.parts_uploaded), atomic_load(&stats.part_retries));
+  }
+  if (atomic_load(&stats.ranges_fetched) > 0) {
+    fprintf(f, "fetched:        %u ranges (%u requested again)\n",
+            atomic_load(&stats.ranges_fetched), atomic_load(&stats.range_retries));
+  }
+  if (stats.replica_copies > 0) {
+    fprintf(f, "striped:        %u stripes over %u copies (%u read from another copy)\n",
+            atomic_load(&stats.stripes_read), stats.replica_copies,
+            atomic_load(&stats.stripe_fallbacks));
+  }
+  if (stats.ec_data > 0) {
+    fprintf(f, "erasure:        %u stripes of %u+%u shards, %s kernel (%u units rebuilt)\n",
+            atomic_load(&stats.ec_stripes), stats.ec_data, stats.ec_parity, stats.ec_kernel,
+            atomic_load(&stats.ec_rebuilt));
+  }
+  if (stats.file_order != NULL) {
+    fprintf(f, "file order:     by %s, %u files at a time\n", stats.file_order, stats.order_window);
+  }
+  if (stats.dedupe_candidates > 0) {
+    fprintf(f, "deduplicated:   %u of %u copies, %llu bytes reclaimed\n",
+            atomic_load(&stats.dedupe_files), stats.dedupe_candidates,
+            atomic_load(&stats.dedupe_bytes));
+  }
+  if (stats.pressure_low > 0) {
+    fprintf(f, "pressure:       %u backoffs, down to %.0f%%, peak stall io %.1f%% "
+            "memory %.1f%% cpu %.1f%%\n",
+            stats.pressure_backoffs, stats.pressure_low * 100, stats.pressure_peak[PRESSURE_IO],
+            stats.pressure_peak[PRESSURE_MEMORY], stats.pressure_peak[PRESSURE_CPU]);
+  }
+  if (cgroup.quota > 0 || cgroup.memory > 0) print_cgroup(f);
+  fprintf(f, "elapsed:        %.3f s\n", secs);
+  if (secs > 0) {
+    fprintf(f, "throughput:     %.1f MiB/s\n", (written + zeroed) / secs / (1024 * 1024));
+  }
+  if (stats.num_classes > 0) print_classes(f);
+  if (stats.extents.ext != NULL) print_extents(f);
+}
+
+// Free the copied extent map.
+void stats_destroy(void) {
+  free(stats.extents.ext);
+  memset(&stats.extents, 0, sizeof(stats.extents));
+  pthread_mutex_destroy(&stats.class_lock);
+}
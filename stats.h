@@ -0,0 +1,131 @@
+/**
+ * Counters collected while a copy
+ * runs and printed at the end of
+ * the copy when --stats is given.
+ *
+ * @author Matt Stetter
+ * @file stats.h
+ */
+
+#include "extent.h"
+#include "options.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifndef STATS_H_
+#define STATS_H_
+
+// Maximum number of extents listed
+// individually in the stats output
+#define STATS_MAX_EXTENTS 64
+
+// Maximum number of job classes whose
+// latencies are kept separately
+#define STATS_CLASSES 16
+
+// Latencies of the jobs of one class,
+// in seconds from when the job was
+// queued
+typedef struct stats_class {
+  char name[64];		// Tenant and class, as tenant/class
+  unsigned long long jobs;	// Jobs finished
+  unsigned long long bytes;	// Bytes those jobs read
+  double wait_sum;		// Total time until the first chunk was read
+  double wait_max;		// Longest time until the first chunk was read
+  double done_sum;		// Total time until the job finished
+  double done_max;		// Longest time until the job finished
+} stats_class_t;
+
+// Counters shared by every thread
+// taking part in the copy. The byte
+// counters are atomic so the producer
+// and consumer can update them
+// without locking.
+typedef struct stats {
+  atomic_ullong bytes_read;	// Bytes read from the source
+  atomic_ullong bytes_written;	// Bytes written to the destination
+  atomic_ullong bytes_zeroed;	// Bytes punched, zeroed or discarded instead
+  atomic_ullong bytes_prefetched; // Bytes handed to readahead ahead of reads
+  atomic_ullong bytes_cached;	// Bytes served from the source cache
+  atomic_uint cache_hits;	// Sources served from the source cache
+  atomic_uint batched_files;	// Small files written through io_uring
+  atomic_uint uring_enters;	// io_uring_enter calls that wrote them
+  atomic_uint parts_uploaded;	// Parts of multipart uploads sent
+  atomic_uint part_retries;	// Part uploads sent again after failing
+  atomic_uint ranges_fetched;	// Ranges fetched from http:// sources
+  atomic_uint range_retries;	// Ranges requested again after failing
+  atomic_uint stripes_read;	// Stripes read from the source and its replicas
+  atomic_uint stripe_fallbacks;	// Stripes read again from another copy
+  unsigned int replica_copies;	// Copies of the source stripes were read from
+  atomic_uint ec_stripes;	// Erasure-coded stripes encoded or rebuilt
+  atomic_uint ec_rebuilt;	// Data units computed from parity
+  unsigned int ec_data;		// Data shards of the code, 0 if not erasure coding
+  unsigned int ec_parity;	// Parity shards of the code
+  const char *ec_kernel;	// GF(2^8) kernel the code ran with
+  const char *file_order;	// What files were started in order of, NULL if as given
+  unsigned int order_window;	// Files sorted together
+  unsigned int dedupe_candidates; // Copies checked for duplicates
+  atomic_uint dedupe_files;	// Copies now sharing another's extents
+  atomic_ullong dedupe_bytes;	// Bytes of those copies the kernel shared
+  double pressure_low;		// Least share stalls left the copy, 0 if not throttling
+  unsigned int pressure_backoffs; // Samples that found a stall above its limit
+  double pressure_peak[PRESSURE_COUNT]; // Highest stall percentage of each resource
+  struct timespec start;	// Time the copy started
+  extent_map_t extents;		// Copy of the source's extent map
+  int physical_order;		// Non-zero if extents were read in physical order
+  int engine;			// ENGINE_* engine that ran the last copy
+  atomic_uint engine_runs[ENGINE_COUNT]; // Copies run by each engine
+  atomic_uint engine_skips;	// Engines tried that did not apply
+  pthread_mutex_t class_lock;	// Protects the class latencies
+  stats_class_t classes[STATS_CLASSES]; // Latencies of each job class
+  unsigned int num_classes;	// Number of classes seen
+} stats_t;
+
+// The statistics of the running copy
+extern stats_t stats;
+
+/**
+ * Reset the counters and record
+ * the start time of the copy.
+ */
+void stats_start(void);
+
+/**
+ * Keep a copy of the extent map
+ * the producer planned its reads with.
+ *
+ * @param map extent map in logical order
+ * @param physical non-zero if reads are in physical order
+ */
+void stats_set_extents(const extent_map_t *map, int physical);
+
+/**
+ * Record a finished job of the
+ * shared pipeline. Classes beyond
+ * STATS_CLASSES are not kept.
+ *
+ * @param tenant tenant of the job
+ * @param cls class of the job
+ * @param bytes bytes the job read
+ * @param wait seconds from queueing to the first chunk
+ * @param done seconds from queueing to the end of the job
+ */
+void stats_add_job(const char *tenant, const char *cls, size_t bytes, double wait, double done);
+
+/**
+ * Print the statistics of the copy.
+ *
+ * @param f stream to print to
+ */
+void stats_print(FILE *f);
+
+/**
+ * Free the memory held by the
+ * statistics.
+ */
+void stats_destroy(void);
+
+#endif
@@ -0,0 +1,126 @@
+"""
+Stand-in for a web server, enough of
+one to serve cpy's range requests.
+
+Files are served from a directory.
+A GET with a Range header gets that
+range back with 206, or 416 if the
+file is empty, and one with If-Match
+gets 412 if the file's ETag is no
+longer the one given. Each request is
+logged to requests.log in the log
+directory as
+
+  GET PATH range=FIRST-LAST|- status=CODE
+
+Faults are injected from the
+environment:
+  NO_RANGES=1      ignore Range and send the whole file with 200
+  FAIL_EVERY=N     answer every Nth GET with 503
+  CHANGE_AFTER=N   give every file a new ETag after N GETs, as
+                   if it were rewritten during the copy
+
+Usage: python3 http_server.py PORT ROOT LOGDIR
+
+@author Matt Stetter
+@file http_server.py
+"""
+
+import hashlib
+import os
+import re
+import sys
+import threading
+import urllib.parse
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+NO_RANGES = os.environ.get("NO_RANGES") == "1"
+FAIL_EVERY = int(os.environ.get("FAIL_EVERY", "0"))
+CHANGE_AFTER = int(os.environ.get("CHANGE_AFTER", "0"))
+
+RANGE = re.compile(r"bytes=(\d+)-(\d*)$")
+
+
+class Server(ThreadingHTTPServer):
+    """The served directory, the log and the GET count, shared by every handler."""
+
+    def __init__(self, port, root, logs):
+        super().__init__(("127.0.0.1", port), Handler)
+        self.root = root
+        self.logs = logs
+        self.lock = threading.Lock()
+        self.gets = 0
+
+    def log(self, line):
+        with self.lock, open(os.path.join(self.logs, "requests.log"), "a") as f:
+            f.write(line + "\n")
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, *args):
+        pass
+
+    def reply(self, code, body=b"", headers=None, first=None, last=None):
+        path = urllib.parse.urlsplit(self.path).path
+        span = f"{first}-{last}" if first is not None else "-"
+        self.server.log(f"{self.command} {path} range={span} status={code}")
+        self.send_response(code)
+        for k, v in (headers or {}).items():
+            self.send_header(k, v)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+
+        # cpy hangs up on a whole file sent
+        # for its first range, then asks for
+        # it again without one
+        try:
+            self.wfile.write(body)
+        except (BrokenPipeError, ConnectionResetError):
+            self.close_connection = True
+
+    def do_GET(self):
+        server = self.server
+        with server.lock:
+            server.gets += 1
+            n = server.gets
+        if FAIL_EVERY and n % FAIL_EVERY == 0:
+            return self.reply(503, b"busy\n")
+
+        path = urllib.parse.unquote(urllib.parse.urlsplit(self.path).path).lstrip("/")
+        try:
+            with open(os.path.join(server.root, path), "rb") as f:
+                data = f.read()
+        except OSError:
+            return self.reply(404, b"not found\n")
+
+        generation = 1 if CHANGE_AFTER and n > CHANGE_AFTER else 0
+        etag = f'"{hashlib.md5(data).hexdigest()}-{generation}"'
+        headers = {"ETag": etag, "Accept-Ranges": "none" if NO_RANGES else "bytes"}
+        match = self.headers.get("If-Match")
+        if match is not None and match != etag:
+            return self.reply(412, b"changed\n", headers)
+
+        m = RANGE.match(self.headers.get("Range", ""))
+        if NO_RANGES or m is None:
+            return self.reply(200, data, headers)
+        first = int(m.group(1))
+        last = int(m.group(2)) if m.group(2) else len(data) - 1
+        if first >= len(data):
+            headers["Content-Range"] = f"bytes */{len(data)}"
+            return self.reply(416, b"", headers, first, last)
+        last = min(last, len(data) - 1)
+        headers["Content-Range"] = f"bytes {first}-{last}/{len(data)}"
+        self.reply(206, data[first:last + 1], headers, first, last)
+
+
+def main():
+    if len(sys.argv) != 4:
+        sys.exit("Usage: http_server.py PORT ROOT LOGDIR")
+    os.makedirs(sys.argv[3], exist_ok=True)
+    Server(int(sys.argv[1]), sys.argv[2], sys.argv[3]).serve_forever()
+
+
+if __name__ == "__main__":
+    main()
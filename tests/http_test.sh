@@ -0,0 +1,131 @@
+#!/bin/bash
+#
+# Test of the http:// range source
+# against the stand-in server in
+# http_server.py. Run from the top of
+# the tree, or with make test.
+#
+# @author Matt Stetter
+# @file http_test.sh
+
+set -u
+
+TESTS=$(cd "$(dirname "$0")" && pwd)
+CPY="$TESTS/../cpy"
+PORT=${HTTP_TEST_PORT:-19410}
+WORK=$(mktemp -d)
+SERVER=
+FAILED=0
+
+# Stop the server and remove the
+# scratch directory on the way out
+finish() {
+  stop_server
+  rm -rf "$WORK"
+}
+trap finish EXIT
+
+# Start the server with a fresh log
+# directory, passing on any fault
+# settings given as VAR=VALUE
+start_server() {
+  rm -rf "$WORK/out"
+  mkdir -p "$WORK/out"
+  env "$@" python3 "$TESTS/http_server.py" "$PORT" "$WORK/www" "$WORK/out" &
+  SERVER=$!
+  for _ in $(seq 50); do
+    (exec 3<>"/dev/tcp/127.0.0.1/$PORT") 2>/dev/null && return 0
+    sleep 0.1
+  done
+  echo "Server did not start on port $PORT"
+  exit 1
+}
+
+stop_server() {
+  if [ -n "$SERVER" ]; then
+    kill "$SERVER" 2>/dev/null
+    wait "$SERVER" 2>/dev/null
+  fi
+  SERVER=
+}
+
+# Record a check's result
+check() {
+  local name=$1
+  shift
+  if "$@"; then
+    echo "ok   $name"
+  else
+    echo "FAIL $name"
+    FAILED=1
+  fi
+}
+
+# Count the logged requests matching a pattern
+logged() {
+  grep -c -- "$1" "$WORK/out/requests.log" 2>/dev/null
+}
+
+no_crash() {
+  [ "$1" -lt 128 ]
+}
+
+if [ ! -x "$CPY" ]; then
+  make -C "$TESTS/.." cpy >/dev/null || exit 1
+fi
+
+# A file of five chunks, the last one
+# short, and an empty one
+mkdir -p "$WORK/www"
+head -c $((18 * 1024 * 1024 + 1000)) /dev/urandom > "$WORK/www/big"
+: > "$WORK/www/empty"
+URL="http://127.0.0.1:$PORT"
+
+# A server taking ranges gets one 206
+# request per chunk
+start_server
+"$CPY" -S "$URL/big" "$WORK/big" 2>"$WORK/err"
+check "ranged copy" [ $? -eq 0 ]
+check "ranged copy matches" cmp -s "$WORK/www/big" "$WORK/big"
+check "ranged copy fetched each chunk" [ "$(logged 'status=206')" -eq 5 ]
+check "ranged copy counted" grep -q "fetched: *5 ranges" "$WORK/err"
+stop_server
+
+# A server ignoring Range sends the
+# whole file, which is streamed
+start_server NO_RANGES=1
+"$CPY" "$URL/big" "$WORK/whole" 2>"$WORK/err"
+check "full-body copy" [ $? -eq 0 ]
+check "full-body copy matches" cmp -s "$WORK/www/big" "$WORK/whole"
+check "full-body copy got 200" [ "$(logged 'status=200')" -ge 1 ]
+stop_server
+
+# An empty file cannot satisfy a range
+start_server
+"$CPY" "$URL/empty" "$WORK/empty" 2>"$WORK/err"
+check "empty copy" [ $? -eq 0 ]
+check "empty copy is empty" [ -f "$WORK/empty" ] && [ ! -s "$WORK/empty" ]
+check "empty copy got 416" [ "$(logged 'status=416')" -eq 1 ]
+stop_server
+
+# A file that changes after the first
+# chunks fails the copy
+start_server CHANGE_AFTER=2
+"$CPY" "$URL/big" "$WORK/changed" 2>"$WORK/err"
+status=$?
+check "changed file fails the copy" [ $status -ne 0 ]
+check "changed file does not crash" no_crash $status
+check "changed file got 412" [ "$(logged 'status=412')" -ge 1 ]
+check "changed file reported" grep -q "changed during the copy" "$WORK/err"
+stop_server
+
+# A 503 on a range is requested again
+start_server FAIL_EVERY=3
+"$CPY" -S "$URL/big" "$WORK/retry" 2>"$WORK/err"
+check "retry after 503" [ $? -eq 0 ]
+check "retry matches" cmp -s "$WORK/www/big" "$WORK/retry"
+check "retry logged" [ "$(logged 'status=503')" -ge 1 ]
+check "retry counted" grep -Eq "\([1-9][0-9]* requested again\)" "$WORK/err"
+stop_server
+
+exit $FAILED
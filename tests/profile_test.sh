@@ -0,0 +1,81 @@
+#!/bin/bash
+#
+# Test that a warm tuning profile does
+# not override the engines the rules
+# pick for --sparse, --discard and
+# --direct. Run from the top of the
+# tree, or with make test.
+#
+# @author Matt Stetter
+# @file profile_test.sh
+
+set -u
+
+TESTS=$(cd "$(dirname "$0")" && pwd)
+CPY="$TESTS/../cpy"
+WORK=$(mktemp -d)
+FAILED=0
+
+# Keep the profile out of the user's cache
+export XDG_CACHE_HOME="$WORK/cache"
+
+trap 'rm -rf "$WORK"' EXIT
+
+# Record a check's result
+check() {
+  local name=$1
+  shift
+  if "$@"; then
+    echo "ok   $name"
+  else
+    echo "FAIL $name"
+    FAILED=1
+  fi
+}
+
+# Check that a copy allocated less than
+# half of its size
+sparse() {
+  [ $(($(stat -c %b "$1") * 512)) -lt $(($(stat -c %s "$1") / 2)) ]
+}
+
+if [ ! -x "$CPY" ]; then
+  make -C "$TESTS/.." cpy >/dev/null || exit 1
+fi
+
+# A dense file to warm the profile with,
+# and a sparse one with 5M of data
+head -c $((100 * 1024 * 1024)) /dev/urandom > "$WORK/dense"
+truncate -s 100M "$WORK/sparse"
+dd if=/dev/urandom of="$WORK/sparse" bs=1M count=5 conv=notrunc status=none
+
+# Warm the profile until a copy runs
+# the engine it cached
+for i in 1 2 3; do
+  "$CPY" -v "$WORK/dense" "$WORK/warm" 2>"$WORK/err"
+done
+check "profile warmed" grep -q "tuning profile" "$WORK/err"
+
+# The zero rules still go first
+"$CPY" -v -s "$WORK/sparse" "$WORK/sparse_s" 2>"$WORK/err"
+check "sparse copy" [ $? -eq 0 ]
+check "sparse copy matches" cmp -s "$WORK/sparse" "$WORK/sparse_s"
+check "sparse copy ignores the profile" grep -q "engine ring (built-in rule 2)" "$WORK/err"
+check "sparse copy keeps holes" sparse "$WORK/sparse_s"
+
+"$CPY" -v -D "$WORK/sparse" "$WORK/sparse_d" 2>"$WORK/err"
+check "discard copy matches" cmp -s "$WORK/sparse" "$WORK/sparse_d"
+check "discard copy ignores the profile" grep -q "engine ring (built-in rule 2)" "$WORK/err"
+
+# So does the direct I/O rule, whether
+# or not the file system takes O_DIRECT
+"$CPY" -v -d "$WORK/dense" "$WORK/direct" 2>"$WORK/err"
+check "direct copy ignores the profile" grep -q "engine dbuf (built-in rule 6)" "$WORK/err"
+
+# And the profile still leads a copy
+# none of them apply to
+"$CPY" -v "$WORK/dense" "$WORK/again" 2>"$WORK/err"
+check "plain copy uses the profile" grep -q "tuning profile" "$WORK/err"
+check "plain copy matches" cmp -s "$WORK/dense" "$WORK/again"
+
+exit $FAILED
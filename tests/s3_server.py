@@ -0,0 +1,223 @@
+"""
+Stand-in for an S3 endpoint, enough of
+one to take cpy's multipart uploads.
+
+Every request's SigV4 signature is
+checked against the test credentials
+and every part's x-amz-checksum-crc32c
+against its data. Each request is
+logged to requests.log in the output
+directory as
+
+  METHOD PATH part=N sig=ok|bad crc=ok|bad|- status=CODE
+
+Completed objects are written to the
+output directory with / in the key
+replaced by __, and the path of each
+aborted upload is added to ABORTED.
+
+Faults are injected from the
+environment:
+  FAIL_EVERY=N     answer every Nth part PUT with 500
+  CORRUPT_EVERY=N  flip a byte of every Nth part PUT before
+                   checking its checksum, as if it were
+                   damaged on the way
+
+Usage: python3 s3_server.py PORT OUTDIR
+
+@author Matt Stetter
+@file s3_server.py
+"""
+
+import base64
+import hashlib
+import hmac
+import os
+import re
+import sys
+import threading
+import urllib.parse
+import uuid
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+KEY_ID = "AKTEST"
+SECRET = "secretkey"
+
+# Smallest part but the last the store takes
+MIN_PART = 5 * 1024 * 1024
+
+FAIL_EVERY = int(os.environ.get("FAIL_EVERY", "0"))
+CORRUPT_EVERY = int(os.environ.get("CORRUPT_EVERY", "0"))
+
+AUTH = re.compile(r"AWS4-HMAC-SHA256 Credential=([^/]+)/(\d+)/([^/]+)/s3/aws4_request, "
+                  r"SignedHeaders=([^,]+), Signature=(\w+)")
+PART = re.compile(r"<Part><PartNumber>(\d+)</PartNumber><ETag>([^<]+)</ETag>"
+                  r"<ChecksumCRC32C>([^<]+)</ChecksumCRC32C></Part>")
+
+
+def crc_table():
+    """Build the table of the reflected Castagnoli polynomial."""
+    table = []
+    for i in range(256):
+        c = i
+        for _ in range(8):
+            c = (c >> 1) ^ 0x82f63b78 if c & 1 else c >> 1
+        table.append(c)
+    return table
+
+
+TABLE = crc_table()
+
+
+def crc32c(data):
+    """CRC32C of some bytes, as S3 checks it."""
+    c = 0xffffffff
+    for b in data:
+        c = TABLE[(c ^ b) & 0xff] ^ (c >> 8)
+    return c ^ 0xffffffff
+
+
+class Store:
+    """Uploads in progress and the request log, shared by every handler."""
+
+    def __init__(self, out):
+        self.out = out
+        self.lock = threading.Lock()
+        self.uploads = {}
+        self.puts = 0
+
+    def log(self, line):
+        with self.lock, open(os.path.join(self.out, "requests.log"), "a") as f:
+            f.write(line + "\n")
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, *args):
+        pass
+
+    def signature_ok(self):
+        """Rebuild the canonical request from the signed headers and check the signature."""
+        m = AUTH.match(self.headers.get("Authorization", ""))
+        if not m or m.group(1) != KEY_ID:
+            return False
+        day, region, signed, sig = m.group(2), m.group(3), m.group(4), m.group(5)
+        u = urllib.parse.urlsplit(self.path)
+        query = "&".join(sorted(u.query.split("&"))) if u.query else ""
+        headers = [f"{h}:{self.headers.get(h, '').strip()}" for h in signed.split(";")]
+        canon = "\n".join([self.command, u.path, query] + headers +
+                          ["", signed, self.headers.get("x-amz-content-sha256", "")])
+        scope = f"{day}/{region}/s3/aws4_request"
+        sts = "\n".join(["AWS4-HMAC-SHA256", self.headers.get("x-amz-date", ""), scope,
+                         hashlib.sha256(canon.encode()).hexdigest()])
+        key = ("AWS4" + SECRET).encode()
+        for part in (day, region, "s3", "aws4_request"):
+            key = hmac.new(key, part.encode(), hashlib.sha256).digest()
+        return hmac.compare_digest(hmac.new(key, sts.encode(), hashlib.sha256).hexdigest(), sig)
+
+    def reply(self, code, body=b"", headers=None, part="-", sig="ok", crc="-"):
+        path = urllib.parse.urlsplit(self.path).path
+        self.server.store.log(f"{self.command} {path} part={part} sig={sig} crc={crc} status={code}")
+        self.send_response(code)
+        for k, v in (headers or {}).items():
+            self.send_header(k, v)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def error(self, code, name, **log):
+        self.reply(code, f"<Error><Code>{name}</Code></Error>".encode(), **log)
+
+    def read_body(self):
+        return self.rfile.read(int(self.headers.get("Content-Length", 0)))
+
+    def query(self):
+        u = urllib.parse.urlsplit(self.path)
+        return u.path, urllib.parse.parse_qs(u.query, keep_blank_values=True)
+
+    def do_POST(self):
+        data = self.read_body()
+        if not self.signature_ok():
+            return self.error(403, "SignatureDoesNotMatch", sig="bad")
+        store = self.server.store
+        path, q = self.query()
+
+        if "uploads" in q:
+            upload_id = "up/" + uuid.uuid4().hex + "+="
+            with store.lock:
+                store.uploads[upload_id] = {}
+            return self.reply(200, ("<InitiateMultipartUploadResult><UploadId>" + upload_id +
+                                    "</UploadId></InitiateMultipartUploadResult>").encode())
+
+        with store.lock:
+            parts = store.uploads.get(q.get("uploadId", [""])[0])
+        if parts is None:
+            return self.error(404, "NoSuchUpload")
+        listed = PART.findall(data.decode())
+        out = bytearray()
+        for i, (number, etag, crc) in enumerate(listed):
+            p = parts.get(int(number))
+            if int(number) != i + 1 or p is None or p[1] != etag or p[2] != crc:
+                return self.error(400, "InvalidPart")
+            if i < len(listed) - 1 and len(p[0]) < MIN_PART:
+                return self.error(400, "EntityTooSmall")
+            out += p[0]
+        name = urllib.parse.unquote(path).strip("/").replace("/", "__")
+        with open(os.path.join(store.out, name), "wb") as f:
+            f.write(out)
+        with store.lock:
+            del store.uploads[q["uploadId"][0]]
+        self.reply(200, b"<CompleteMultipartUploadResult></CompleteMultipartUploadResult>")
+
+    def do_PUT(self):
+        data = self.read_body()
+        path, q = self.query()
+        part = q.get("partNumber", ["-"])[0]
+        if not self.signature_ok():
+            return self.error(403, "SignatureDoesNotMatch", part=part, sig="bad")
+        store = self.server.store
+        with store.lock:
+            store.puts += 1
+            n = store.puts
+        if FAIL_EVERY and n % FAIL_EVERY == 0:
+            return self.error(500, "InternalError", part=part)
+        if CORRUPT_EVERY and n % CORRUPT_EVERY == 0 and data:
+            data = bytes([data[0] ^ 0xff]) + data[1:]
+
+        crc = base64.b64encode(crc32c(data).to_bytes(4, "big")).decode()
+        if self.headers.get("x-amz-checksum-crc32c") != crc:
+            return self.error(400, "BadDigest", part=part, crc="bad")
+        with store.lock:
+            parts = store.uploads.get(q.get("uploadId", [""])[0])
+            if parts is not None:
+                etag = '"' + hashlib.md5(data).hexdigest() + '"'
+                parts[int(part)] = (data, etag, crc)
+        if parts is None:
+            return self.error(404, "NoSuchUpload", part=part, crc="ok")
+        self.reply(200, headers={"ETag": etag}, part=part, crc="ok")
+
+    def do_DELETE(self):
+        self.read_body()
+        if not self.signature_ok():
+            return self.error(403, "SignatureDoesNotMatch", sig="bad")
+        store = self.server.store
+        path, q = self.query()
+        with store.lock:
+            store.uploads.pop(q.get("uploadId", [""])[0], None)
+            with open(os.path.join(store.out, "ABORTED"), "a") as f:
+                f.write(path + "\n")
+        self.reply(204)
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit("Usage: s3_server.py PORT OUTDIR")
+    os.makedirs(sys.argv[2], exist_ok=True)
+    server = ThreadingHTTPServer(("127.0.0.1", int(sys.argv[1])), Handler)
+    server.store = Store(sys.argv[2])
+    server.serve_forever()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,145 @@
+#!/bin/bash
+#
+# Test of the S3 multipart-upload sink
+# against the stand-in server in
+# s3_server.py. Run from the top of the
+# tree, or with make test.
+#
+# @author Matt Stetter
+# @file s3_test.sh
+
+set -u
+
+TESTS=$(cd "$(dirname "$0")" && pwd)
+CPY="$TESTS/../cpy"
+PORT=${S3_TEST_PORT:-19400}
+WORK=$(mktemp -d)
+SERVER=
+FAILED=0
+
+export AWS_ENDPOINT_URL="http://127.0.0.1:$PORT"
+export AWS_ACCESS_KEY_ID=AKTEST
+export AWS_SECRET_ACCESS_KEY=secretkey
+unset AWS_ENDPOINT_URL_S3 AWS_SESSION_TOKEN AWS_REGION
+
+# Stop the server and remove the
+# scratch directory on the way out
+finish() {
+  stop_server
+  rm -rf "$WORK"
+}
+trap finish EXIT
+
+# Start the server with a fresh
+# output directory, passing on any
+# fault settings given as VAR=VALUE
+start_server() {
+  rm -rf "$WORK/out"
+  mkdir -p "$WORK/out"
+  env "$@" python3 "$TESTS/s3_server.py" "$PORT" "$WORK/out" &
+  SERVER=$!
+  for _ in $(seq 50); do
+    (exec 3<>"/dev/tcp/127.0.0.1/$PORT") 2>/dev/null && return 0
+    sleep 0.1
+  done
+  echo "Server did not start on port $PORT"
+  exit 1
+}
+
+stop_server() {
+  if [ -n "$SERVER" ]; then
+    kill "$SERVER" 2>/dev/null
+    wait "$SERVER" 2>/dev/null
+  fi
+  SERVER=
+}
+
+# Record a check's result
+check() {
+  local name=$1
+  shift
+  if "$@"; then
+    echo "ok   $name"
+  else
+    echo "FAIL $name"
+    FAILED=1
+  fi
+}
+
+# Count the logged requests matching a pattern
+logged() {
+  grep -c -- "$1" "$WORK/out/requests.log" 2>/dev/null
+}
+
+no_crash() {
+  [ "$1" -lt 128 ]
+}
+
+if [ ! -x "$CPY" ]; then
+  make -C "$TESTS/.." cpy >/dev/null || exit 1
+fi
+
+# Two full 8M parts and a short last one,
+# a file under one part, and an empty one
+head -c $((20 * 1024 * 1024)) /dev/urandom > "$WORK/big"
+head -c 1000 /dev/urandom > "$WORK/small"
+: > "$WORK/empty"
+
+# A normal upload of each, every request
+# signed and every part's checksum right
+start_server
+for f in big small empty; do
+  "$CPY" "$WORK/$f" "s3://bkt/dir/$f key" 2>"$WORK/err"
+  check "upload $f" [ $? -eq 0 ]
+  check "upload $f matches" cmp -s "$WORK/$f" "$WORK/out/bkt__dir__$f key"
+done
+check "every request signed" [ "$(logged 'sig=bad')" -eq 0 ]
+check "every part checksummed" [ "$(logged '^PUT .* crc=ok status=200')" -eq "$(logged '^PUT ')" ]
+check "big sent as three parts" [ "$(logged '^PUT /bkt/dir/big%20key part=3 ')" -eq 1 ]
+check "no upload aborted" [ ! -e "$WORK/out/ABORTED" ]
+stop_server
+
+# A 500 on one part is sent again
+start_server FAIL_EVERY=2
+"$CPY" -S "$WORK/big" s3://bkt/retry 2>"$WORK/err"
+check "retry after 500" [ $? -eq 0 ]
+check "retry matches" cmp -s "$WORK/big" "$WORK/out/bkt__retry"
+check "retry counted" grep -q "sent again" "$WORK/err"
+check "retry logged" [ "$(logged ' status=500')" -ge 1 ]
+stop_server
+
+# A part damaged on the way fails its
+# checksum and is sent again
+start_server CORRUPT_EVERY=2
+"$CPY" "$WORK/big" s3://bkt/corrupt 2>"$WORK/err"
+check "retry after bad digest" [ $? -eq 0 ]
+check "bad digest matches" cmp -s "$WORK/big" "$WORK/out/bkt__corrupt"
+check "bad digest logged" [ "$(logged 'crc=bad status=400')" -ge 1 ]
+stop_server
+
+# A part that fails every try fails the
+# copy and aborts the upload, also with
+# one uploader, where the failure shows
+# up as a short write
+for jobs in 4 1; do
+  start_server FAIL_EVERY=1
+  "$CPY" -j $jobs "$WORK/big" s3://bkt/failed 2>"$WORK/err"
+  status=$?
+  check "failed part fails the copy (-j $jobs)" [ $status -ne 0 ]
+  check "failed part does not crash (-j $jobs)" no_crash $status
+  check "failed part aborts (-j $jobs)" grep -qx /bkt/failed "$WORK/out/ABORTED"
+  check "failed part leaves no object (-j $jobs)" [ ! -e "$WORK/out/bkt__failed" ]
+  stop_server
+done
+
+# A wrong secret is refused
+start_server
+AWS_SECRET_ACCESS_KEY=wrong "$CPY" "$WORK/small" s3://bkt/denied 2>"$WORK/err"
+status=$?
+check "wrong secret fails the copy" [ $status -ne 0 ]
+check "wrong secret does not crash" no_crash $status
+check "wrong secret refused" [ "$(logged 'sig=bad .*status=403')" -ge 1 ]
+check "wrong secret leaves no object" [ ! -e "$WORK/out/bkt__denied" ]
+stop_server
+
+exit $FAILED
@@ -0,0 +1,221 @@
+/**
+ * Source implementation of the
+ * io_uring wrapper.
+ *
+ * The ring indices are shared with the
+ * kernel as plain integers, so they are
+ * read and written with the compiler's
+ * __atomic builtins.
+ *
+ * @author Matt Stetter
+ * @file uring.c
+ */
+
+#include "cpy.h"
+#include "uring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+ * Register an empty table of direct
+ * descriptors with a ring.
+ *
+ * @param r the ring
+ * @param files number of slots
+ * @return 0 if successful, errno otherwise
+ */
+static int register_files(uring_t *r, unsigned int files) {
+  int *fds = (int *)malloc(files * sizeof(int));
+  if (fds == NULL) return ENOMEM;
+  for (unsigned int i = 0; i < files; i++) fds[i] = -1;
+  int err = 0;
+  if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES, fds, files) != 0) err = errno;
+  free(fds);
+  return err;
+}
+
+// Create the ring and map its
+// submission and completion queues.
+int uring_init(uring_t *r, unsigned int entries, unsigned int files) {
+  memset(r, 0, sizeof(*r));
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  if ((r->fd = (int)syscall(__NR_io_uring_setup, entries, &p)) == -1) return errno;
+  r->entries = p.sq_entries;
+
+  r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_len > r->sq_len) r->sq_len = r->cq_len;
+    r->cq_len = 0;
+  }
+
+  r->sq_map = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQ_RING);
+  r->cq_map = r->cq_len == 0 ? r->sq_map :
+    mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+         r->fd, IORING_OFF_CQ_RING);
+  r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = (struct io_uring_sqe *)mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sq_map == MAP_FAILED || r->cq_map == MAP_FAILED || r->sqes == MAP_FAILED) {
+    int err = errno;
+    uring_destroy(r);
+    return err;
+  }
+
+  char *sq = (char *)r->sq_map;
+  char *cq = (char *)r->cq_map;
+  r->sq_head = (unsigned int *)(sq + p.sq_off.head);
+  r->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned int *)(sq + p.sq_off.array);
+  r->cq_head = (unsigned int *)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  r->tail = *r->sq_tail;
+
+  int err;
+  if (files > 0 && (err = register_files(r, files)) != 0) {
+    uring_destroy(r);
+    return err;
+  }
+
+  log("Set up an io_uring with %u entries and %u files\n", r->entries, files);
+  return 0;
+}
+
+// Unmap whatever was mapped
+// and close the ring.
+void uring_destroy(uring_t *r) {
+  if (r->sqes != NULL && r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_len);
+  if (r->cq_map != NULL && r->cq_map != MAP_FAILED && r->cq_map != r->sq_map) {
+    munmap(r->cq_map, r->cq_len);
+  }
+  if (r->sq_map != NULL && r->sq_map != MAP_FAILED) munmap(r->sq_map, r->sq_len);
+  if (r->fd != -1) close(r->fd);
+  memset(r, 0, sizeof(*r));
+  r->fd = -1;
+}
+
+/**
+ * Take a cleared submission entry.
+ *
+ * @param r the ring
+ * @param opcode IORING_OP_* operation of the entry
+ * @param tag value returned with the completion
+ * @param link URING_LINK or URING_HARDLINK to link it to the next, 0 for none
+ * @return the entry, NULL if every entry is queued
+ */
+static struct io_uring_sqe *get_sqe(uring_t *r, int opcode, unsigned long long tag, int link) {
+  unsigned int head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  if (r->tail - head >= r->entries) return NULL;
+
+  unsigned int idx = r->tail & *r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = (unsigned char)opcode;
+  sqe->user_data = tag;
+  if (link & URING_LINK) sqe->flags = IOSQE_IO_LINK;
+  if (link & URING_HARDLINK) sqe->flags = IOSQE_IO_HARDLINK;
+  r->sq_array[idx] = idx;
+  r->tail++;
+  return sqe;
+}
+
+// Open into slot + 1, as 0 means
+// a plain descriptor to io_uring.
+int uring_openat(uring_t *r, const char *path, int flags, mode_t mode, unsigned int slot,
+                 unsigned long long tag, int link) {
+  struct io_uring_sqe *sqe = get_sqe(r, IORING_OP_OPENAT, tag, link);
+  if (sqe == NULL) return EBUSY;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (unsigned long long)(uintptr_t)path;
+  sqe->open_flags = (unsigned int)flags;
+  sqe->len = mode;
+  sqe->file_index = slot + 1;
+  return 0;
+}
+
+// Write through the file table.
+int uring_write(uring_t *r, unsigned int slot, const void *buf, size_t len, off_t off,
+                unsigned long long tag, int link) {
+  struct io_uring_sqe *sqe = get_sqe(r, IORING_OP_WRITE, tag, link);
+  if (sqe == NULL) return EBUSY;
+  sqe->flags |= IOSQE_FIXED_FILE;
+  sqe->fd = (int)slot;
+  sqe->addr = (unsigned long long)(uintptr_t)buf;
+  sqe->len = (unsigned int)len;
+  sqe->off = (unsigned long long)off;
+  return 0;
+}
+
+// Read through the file table.
+int uring_read(uring_t *r, unsigned int slot, void *buf, size_t len, off_t off,
+               unsigned long long tag, int link) {
+  struct io_uring_sqe *sqe = get_sqe(r, IORING_OP_READ, tag, link);
+  if (sqe == NULL) return EBUSY;
+  sqe->flags |= IOSQE_FIXED_FILE;
+  sqe->fd = (int)slot;
+  sqe->addr = (unsigned long long)(uintptr_t)buf;
+  sqe->len = (unsigned int)len;
+  sqe->off = (unsigned long long)off;
+  return 0;
+}
+
+// Close a slot of the file table.
+int uring_close(uring_t *r, unsigned int slot, unsigned long long tag, int link) {
+  struct io_uring_sqe *sqe = get_sqe(r, IORING_OP_CLOSE, tag, link);
+  if (sqe == NULL) return EBUSY;
+  sqe->file_index = slot + 1;
+  return 0;
+}
+
+// Look up a path relative to the
+// working directory.
+int uring_statx(uring_t *r, const char *path, unsigned int mask, struct statx *stx,
+                unsigned long long tag) {
+  struct io_uring_sqe *sqe = get_sqe(r, IORING_OP_STATX, tag, 0);
+  if (sqe == NULL) return EBUSY;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (unsigned long long)(uintptr_t)path;
+  sqe->len = mask;
+  sqe->off = (unsigned long long)(uintptr_t)stx;
+  return 0;
+}
+
+// Publish the local tail and enter
+// the kernel once.
+int uring_submit(uring_t *r, unsigned int wait) {
+  unsigned int submit = r->tail - *r->sq_tail;
+  __atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+  if (submit == 0 && wait == 0) return 0;
+
+  int ret;
+  do {
+    ret = (int)syscall(__NR_io_uring_enter, r->fd, submit, wait,
+                       wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  } while (ret == -1 && errno == EINTR);
+  return ret == -1 ? errno : 0;
+}
+
+// Copy out the completion at the head
+// and move the head past it.
+int uring_reap(uring_t *r, unsigned long long *tag, int *res) {
+  unsigned int head = *r->cq_head;
+  if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) return EAGAIN;
+  struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+  *tag = cqe->user_data;
+  *res = cqe->res;
+  __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+  return 0;
+}
@@ -0,0 +1,169 @@
+/**
+ * Minimal io_uring wrapper, set up with
+ * the raw system calls so cpy does not
+ * need liburing. A ring is owned by one
+ * thread: it queues operations,
+ * submits them with io_uring_enter and
+ * reaps their completions. Rings can
+ * carry a table of direct descriptors,
+ * so an openat can hand its file to the
+ * operations linked after it without
+ * the file ever getting a descriptor.
+ *
+ * linux/io_uring.h is only included by
+ * uring.c, as the linux/fs.h it pulls in
+ * has a BLOCK_SIZE of its own.
+ *
+ * @author Matt Stetter
+ * @file uring.h
+ */
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifndef URING_H_
+#define URING_H_
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct statx;
+
+// How an operation is linked
+// to the one queued after it
+#define URING_LINK 0x1		// Run the next one only if this one succeeds
+#define URING_HARDLINK 0x2	// Run the next one once this one completes
+
+// A ring and its mappings
+typedef struct uring {
+  int fd;			// Ring descriptor, -1 if not set up
+  unsigned int entries;		// Number of submission entries
+  unsigned int *sq_head;	// Submission entries the kernel consumed
+  unsigned int *sq_tail;	// Submission entries handed to the kernel
+  unsigned int *sq_mask;	// Mask of the submission ring
+  unsigned int *sq_array;	// Indirection from the ring to sqes
+  struct io_uring_sqe *sqes;	// Submission entries
+  unsigned int *cq_head;	// Completions consumed
+  unsigned int *cq_tail;	// Completions posted by the kernel
+  unsigned int *cq_mask;	// Mask of the completion ring
+  struct io_uring_cqe *cqes;	// Completions
+  unsigned int tail;		// Local tail, ahead of sq_tail until submitted
+  void *sq_map;			// Mapping of the submission ring
+  size_t sq_len;		// Length of sq_map
+  void *cq_map;			// Mapping of the completion ring
+  size_t cq_len;		// Length of cq_map
+  size_t sqes_len;		// Length of the sqes mapping
+} uring_t;
+
+/**
+ * Set up a ring.
+ *
+ * @param r ring to set up
+ * @param entries number of submission entries
+ * @param files number of direct descriptor slots, 0 for none
+ * @return 0 if successful, errno otherwise (ENOSYS or EPERM without io_uring)
+ */
+int uring_init(uring_t *r, unsigned int entries, unsigned int files);
+
+/**
+ * Unmap and close a ring.
+ *
+ * @param r the ring
+ */
+void uring_destroy(uring_t *r);
+
+/**
+ * Queue an openat of a file into a
+ * slot of the ring's file table.
+ *
+ * @param r the ring
+ * @param path file to open, kept valid until it completes
+ * @param flags open flags, without O_CLOEXEC
+ * @param mode mode of a created file
+ * @param slot slot of the file table to open into
+ * @param tag value returned with the completion
+ * @param link URING_LINK or URING_HARDLINK to link it to the next, 0 for none
+ * @return 0 if successful, EBUSY if the ring is full
+ */
+int uring_openat(uring_t *r, const char *path, int flags, mode_t mode, unsigned int slot,
+                 unsigned long long tag, int link);
+
+/**
+ * Queue a write to a file of the
+ * ring's file table.
+ *
+ * @param r the ring
+ * @param slot slot of the file table to write to
+ * @param buf data to write, kept valid until it completes
+ * @param len number of bytes to write
+ * @param off offset in the file
+ * @param tag value returned with the completion
+ * @param link URING_LINK or URING_HARDLINK to link it to the next, 0 for none
+ * @return 0 if successful, EBUSY if the ring is full
+ */
+int uring_write(uring_t *r, unsigned int slot, const void *buf, size_t len, off_t off,
+                unsigned long long tag, int link);
+
+/**
+ * Queue a close of a file of the
+ * ring's file table.
+ *
+ * @param r the ring
+ * @param slot slot of the file table to close
+ * @param tag value returned with the completion
+ * @param link URING_LINK or URING_HARDLINK to link it to the next, 0 for none
+ * @return 0 if successful, EBUSY if the ring is full
+ */
+int uring_close(uring_t *r, unsigned int slot, unsigned long long tag, int link);
+
+/**
+ * Queue a read from a file of the
+ * ring's file table.
+ *
+ * @param r the ring
+ * @param slot slot of the file table to read from
+ * @param buf buffer to read into, kept valid until it completes
+ * @param len number of bytes to read
+ * @param off offset in the file
+ * @param tag value returned with the completion
+ * @param link URING_LINK or URING_HARDLINK to link it to the next, 0 for none
+ * @return 0 if successful, EBUSY if the ring is full
+ */
+int uring_read(uring_t *r, unsigned int slot, void *buf, size_t len, off_t off,
+               unsigned long long tag, int link);
+
+/**
+ * Queue a statx of a path.
+ *
+ * @param r the ring
+ * @param path file to look up, kept valid until it completes
+ * @param mask STATX_* fields wanted
+ * @param stx struct to fill in, kept valid until it completes
+ * @param tag value returned with the completion
+ * @return 0 if successful, EBUSY if the ring is full
+ */
+int uring_statx(uring_t *r, const char *path, unsigned int mask, struct statx *stx,
+                unsigned long long tag);
+
+/**
+ * Submit the queued entries and wait
+ * for completions, all in one
+ * io_uring_enter.
+ *
+ * @param r the ring
+ * @param wait number of completions to wait for
+ * @return 0 if successful, errno otherwise
+ */
+int uring_submit(uring_t *r, unsigned int wait);
+
+/**
+ * Take the oldest completion
+ * without waiting.
+ *
+ * @param r the ring
+ * @param tag returned tag of the operation
+ * @param res returned result, -errno if it failed
+ * @return 0 if successful, EAGAIN if there is no completion
+ */
+int uring_reap(uring_t *r, unsigned long long *tag, int *res);
+
+#endif